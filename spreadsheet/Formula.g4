@@ -9,7 +9,11 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | expr (EQ | NE | LT | LE | GT | GE) expr  # Comparison
+    | FUNCTION '(' (expr (',' expr)*)? ')'  # Call
+    | CELL ':' CELL  # Range
     | CELL  # Cell
+    | REF  # Ref
     | NUMBER  # Literal
     ;
 
@@ -26,5 +30,23 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
+EQ: '=' ;
+NE: '<>' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
+// a cell of another workbook sheet is prefixed with the sheet name:
+// Sheet2!A1, 'Sales 2024'!B3 (a quote inside a quoted name is doubled)
+CELL: (SHEET '!')? [A-Z]+[0-9]+ ;
+fragment SHEET
+    : [A-Za-z_] [A-Za-z0-9_]*
+    | '\'' (~'\'' | '\'\'')+ '\''
+    ;
+// a reference to a deleted cell or range prints as #REF! and reads back
+// as the same invalid reference
+REF: '#REF!' ;
+// a name without digits is a function: IF(A1>0,B1,C1); A1 is still a cell
+// because the longer match wins
+FUNCTION: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
@@ -1,485 +1,1630 @@
-﻿#include "FormulaAST.h"
-
-#include "FormulaBaseListener.h"
-#include "FormulaLexer.h"
-#include "FormulaParser.h"
-
-#include <cassert>
-#include <cmath>
-#include <memory>
-#include <optional>
-#include <sstream>
-
-namespace ASTImpl {
-
-    enum ExprPrecedence {
-        EP_ADD,
-        EP_SUB,
-        EP_MUL,
-        EP_DIV,
-        EP_UNARY,
-        EP_ATOM,
-        EP_END,
-    };
-
-    // a bit is set when the parentheses are needed
-    enum PrecedenceRule {
-        PR_NONE = 0b00,                // never needed
-        PR_LEFT = 0b01,                // needed for a left child
-        PR_RIGHT = 0b10,               // needed for a right child
-        PR_BOTH = PR_LEFT | PR_RIGHT,  // needed for both children
-    };
-
-    // PRECEDENCE_RULES[parent][child] determines if parentheses need
-    // to be inserted between a parent and a child of specific precedences;
-    // for some nodes rules are different for left and right children:
-    // (X c Y) p Z  vs  X p (Y c Z)
-    //
-    // The interesting cases are the ones where removing the parens would change the AST.
-    // It may happen when our precedence rules for parentheses are different from
-    // the grammatic precedence of operations.
-    //
-    // Case analysis:
-    // A + (B + C) - always okay (nothing of lower grammatic precedence could have been written to the
-    // right)
-    //    (e.g. if we had A + (B + C) / D, it wouldn't parse in a way
-    //    that woudld have given us A + (B + C) as a subexpression to deal with)
-    // A + (B - C) - always okay (nothing of lower grammatic precedence could have been written to the
-    // right) A - (B + C) - never okay A - (B - C) - never okay A * (B * C) - always okay (the parent
-    // has the highest grammatic precedence) A * (B / C) - always okay (the parent has the highest
-    // grammatic precedence) A / (B * C) - never okay A / (B / C) - never okay
-    // -(A + B) - never okay
-    // -(A - B) - never okay
-    // -(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
-    // -(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
-    // +(A + B) - **sometimes okay** (e.g. parens in +(A + B) / C are **not** optional)
-    //     (currently in the table we're always putting in the parentheses)
-    // +(A - B) - **sometimes okay** (same)
-    //     (currently in the table we're always putting in the parentheses)
-    // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
-    // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
-    constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-        /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    };
-
-    class Expr {
-    public:
-        virtual ~Expr() = default;
-        virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(const SheetInterface& sheet) const = 0;
-
-        // higher is tighter
-        virtual ExprPrecedence GetPrecedence() const = 0;
-
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-            bool right_child = false) const {
-            auto precedence = GetPrecedence();
-            auto mask = right_child ? PR_RIGHT : PR_LEFT;
-            bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-            if (parens_needed) {
-                out << '(';
-            }
-
-            DoPrintFormula(out, precedence);
-
-            if (parens_needed) {
-                out << ')';
-            }
-        }
-    };
-
-    namespace {
-        class BinaryOpExpr final : public Expr {
-        public:
-            enum Type : char {
-                Add = '+',
-                Subtract = '-',
-                Multiply = '*',
-                Divide = '/',
-            };
-
-        public:
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-                : type_(type)
-                , lhs_(std::move(lhs))
-                , rhs_(std::move(rhs)) {
-            }
-
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
-                out << ' ';
-                rhs_->Print(out);
-                out << ')';
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
-                out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-            }
-
-            ExprPrecedence GetPrecedence() const override {
-                switch (type_) {
-                case Add:
-                    return EP_ADD;
-                case Subtract:
-                    return EP_SUB;
-                case Multiply:
-                    return EP_MUL;
-                case Divide:
-                    return EP_DIV;
-                default:
-                    // have to do this because VC++ has a buggy warning
-                    assert(false);
-                    return static_cast<ExprPrecedence>(INT_MAX);
-                }
-            }
-
-            double Evaluate(const SheetInterface& sheet) const override {
-                auto left = lhs_.get()->Evaluate(sheet);
-                auto right = rhs_.get()->Evaluate(sheet);
-                double result = 0.0;
-                switch (type_) {
-                case Type::Add:
-                    result = left + right;
-                    break;
-                case Type::Subtract:
-                    result = left - right;
-                    break;
-                case Type::Multiply:
-                    result = left * right;
-                    break;
-                case Type::Divide:
-                    result = left / right;
-                    break;
-                default:
-                    break;
-                }
-                if (!std::isfinite(result)) {
-                    throw FormulaError(FormulaError::Category::Arithmetic); 
-                }
-                return result;
-            }
-
-
-        private:
-            Type type_;
-            std::unique_ptr<Expr> lhs_;
-            std::unique_ptr<Expr> rhs_;
-        };
-
-        class UnaryOpExpr final : public Expr {
-        public:
-            enum Type : char {
-                UnaryPlus = '+',
-                UnaryMinus = '-',
-            };
-
-        public:
-            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-                : type_(type)
-                , operand_(std::move(operand)) {
-            }
-
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
-                out << ')';
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
-            }
-
-            ExprPrecedence GetPrecedence() const override {
-                return EP_UNARY;
-            }
-
-            double Evaluate(const SheetInterface& sheet) const override {
-                auto result = operand_.get()->Evaluate(sheet);
-                switch (type_) {
-                case Type::UnaryMinus:
-                    result = -result;
-                    break;
-                case Type::UnaryPlus:
-                    break;
-                default:
-                    assert(false);
-                }
-                if (!std::isfinite(result)) {
-                    throw FormulaError(FormulaError::Category::Value);
-                }
-                return result;
-            }
-
-        private:
-            Type type_;
-            std::unique_ptr<Expr> operand_;
-        };
-
-        class CellExpr final : public Expr {
-        public:
-            explicit CellExpr(const Position* cell)
-                : cell_(cell) {
-            }
-
-            void Print(std::ostream& out) const override {
-                if (!cell_->IsValid()) {
-                    out << FormulaError::Category::Ref;
-                }
-                else {
-                    out << cell_->ToString();
-                }
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                Print(out);
-            }
-
-            ExprPrecedence GetPrecedence() const override {
-                return EP_ATOM;
-            }
-
-            double Evaluate(const SheetInterface& sheet) const override {
-                // Получаем значение ячейки через интерфейс таблицы
-                const CellInterface* cell = sheet.GetCell(*cell_);
-                if (!cell) {
-                    return 0;  // Пустая или несуществующая ячейка интерпретируется как 0
-                }
-
-                std::variant<std::string, double, FormulaError> value = cell->GetValue();
-
-                // Если значение — это число, возвращаем его
-                if (std::holds_alternative<double>(value)) {
-                    return std::get<double>(value);
-                }
-
-                // Если значение — это строка, пробуем преобразовать её в число
-                if (std::holds_alternative<std::string>(value)) {
-                    const std::string& text = std::get<std::string>(value);
-                    char* end;
-                    double number = strtod(text.c_str(), &end);
-
-                    // Если преобразование прошло успешно (весь текст — число), возвращаем его
-                    if (*end == '\0') {
-                        return number;
-                    }
-                    else {
-                        throw FormulaError(FormulaError::Category::Value);  // Ошибка преобразования строки в число
-                    }
-                }
-
-                // Если значение — это ошибка формулы, выбрасываем исключение
-                if (std::holds_alternative<FormulaError>(value)) {
-                    throw std::runtime_error("Formula error in cell");
-                }
-
-                // Если тип значения неизвестен, выбрасываем исключение
-                throw std::runtime_error("Invalid value in cell");
-            }
-
-        private:
-            const Position* cell_;
-        };
-
-        class NumberExpr final : public Expr {
-        public:
-            explicit NumberExpr(double value)
-                : value_(value) {
-            }
-
-            void Print(std::ostream& out) const override {
-                out << value_;
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                out << value_;
-            }
-
-            ExprPrecedence GetPrecedence() const override {
-                return EP_ATOM;
-            }
-
-            double Evaluate(const SheetInterface& sheet) const override {
-                return value_;
-            }
-
-        private:
-            double value_;
-        };
-
-        class ParseASTListener final : public FormulaBaseListener {
-        public:
-            std::unique_ptr<Expr> MoveRoot() {
-                assert(args_.size() == 1);
-                auto root = std::move(args_.front());
-                args_.clear();
-
-                return root;
-            }
-
-            std::forward_list<Position> MoveCells() {
-                return std::move(cells_);
-            }
-
-        public:
-            void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-                assert(args_.size() >= 1);
-
-                auto operand = std::move(args_.back());
-
-                UnaryOpExpr::Type type;
-                if (ctx->SUB()) {
-                    type = UnaryOpExpr::UnaryMinus;
-                }
-                else {
-                    assert(ctx->ADD() != nullptr);
-                    type = UnaryOpExpr::UnaryPlus;
-                }
-
-                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-                args_.back() = std::move(node);
-            }
-
-            void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-                double value = 0;
-                auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-                std::istringstream in(valueStr);
-                in >> value;
-                if (!in) {
-                    throw ParsingError("Invalid number: " + valueStr);
-                }
-
-                auto node = std::make_unique<NumberExpr>(value);
-                args_.push_back(std::move(node));
-            }
-
-            void exitCell(FormulaParser::CellContext* ctx) override {
-                auto value_str = ctx->CELL()->getSymbol()->getText();
-                auto value = Position::FromString(value_str);
-                if (!value.IsValid()) {
-                    throw FormulaException("Invalid position: " + value_str);
-                }
-
-                cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
-                args_.push_back(std::move(node));
-            }
-
-            void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-                assert(args_.size() >= 2);
-
-                auto rhs = std::move(args_.back());
-                args_.pop_back();
-
-                auto lhs = std::move(args_.back());
-
-                BinaryOpExpr::Type type;
-                if (ctx->ADD()) {
-                    type = BinaryOpExpr::Add;
-                }
-                else if (ctx->SUB()) {
-                    type = BinaryOpExpr::Subtract;
-                }
-                else if (ctx->MUL()) {
-                    type = BinaryOpExpr::Multiply;
-                }
-                else {
-                    assert(ctx->DIV() != nullptr);
-                    type = BinaryOpExpr::Divide;
-                }
-
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-                args_.back() = std::move(node);
-            }
-
-            void visitErrorNode(antlr4::tree::ErrorNode* node) override {
-                throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
-            }
-
-        private:
-            std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
-        };
-
-        class BailErrorListener : public antlr4::BaseErrorListener {
-        public:
-            void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
-                size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
-                std::exception_ptr /* e */
-            ) override {
-                throw ParsingError("Error when lexing: " + msg);
-            }
-        };
-
-    }  // namespace
-}  // namespace ASTImpl
-
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
-
-    ANTLRInputStream input(in);
-
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
-
-    CommonTokenStream tokens(&lexer);
-
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
-
-    tree::ParseTree* tree;
-    try {
-        tree = parser.main();
-    }
-    catch (...) {
-        throw FormulaException("tree::ParseTree* tree = parser.main() ""Invalid position: ");
-    }
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
-
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
-}
-
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
-}
-
-void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
-    }
-}
-
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
-}
-
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
-}
-
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
-}
-
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
-}
-
-FormulaAST::~FormulaAST() = default;
+﻿#include "FormulaAST.h"
+
+#include "FormulaBaseListener.h"
+#include "FormulaLexer.h"
+#include "FormulaParser.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cmath>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+
+namespace ASTImpl {
+
+    enum ExprPrecedence {
+        EP_COMPARE,
+        EP_ADD,
+        EP_SUB,
+        EP_MUL,
+        EP_DIV,
+        EP_UNARY,
+        EP_ATOM,
+        EP_END,
+    };
+
+    // a bit is set when the parentheses are needed
+    enum PrecedenceRule {
+        PR_NONE = 0b00,                // never needed
+        PR_LEFT = 0b01,                // needed for a left child
+        PR_RIGHT = 0b10,               // needed for a right child
+        PR_BOTH = PR_LEFT | PR_RIGHT,  // needed for both children
+    };
+
+    // PRECEDENCE_RULES[parent][child] determines if parentheses need
+    // to be inserted between a parent and a child of specific precedences;
+    // for some nodes rules are different for left and right children:
+    // (X c Y) p Z  vs  X p (Y c Z)
+    //
+    // The interesting cases are the ones where removing the parens would change the AST.
+    // It may happen when our precedence rules for parentheses are different from
+    // the grammatic precedence of operations.
+    //
+    // Case analysis:
+    // A + (B + C) - always okay (nothing of lower grammatic precedence could have been written to the
+    // right)
+    //    (e.g. if we had A + (B + C) / D, it wouldn't parse in a way
+    //    that woudld have given us A + (B + C) as a subexpression to deal with)
+    // A + (B - C) - always okay (nothing of lower grammatic precedence could have been written to the
+    // right) A - (B + C) - never okay A - (B - C) - never okay A * (B * C) - always okay (the parent
+    // has the highest grammatic precedence) A * (B / C) - always okay (the parent has the highest
+    // grammatic precedence) A / (B * C) - never okay A / (B / C) - never okay
+    // -(A + B) - never okay
+    // -(A - B) - never okay
+    // -(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
+    // -(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+    // +(A + B) - **sometimes okay** (e.g. parens in +(A + B) / C are **not** optional)
+    //     (currently in the table we're always putting in the parentheses)
+    // +(A - B) - **sometimes okay** (same)
+    //     (currently in the table we're always putting in the parentheses)
+    // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
+    // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+    // Comparisons have the lowest grammatic precedence and are left-associative:
+    // A = B < C is (A = B) < C, so only a right comparison child needs parens,
+    // and a comparison under any arithmetic operation always does: (A < B) * C.
+    // Function arguments are delimited by commas and never need parens.
+    constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
+        /* EP_COMPARE */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    };
+
+    // maps cells of the original AST to the cells of its copy
+    struct CellMap {
+        std::unordered_map<const Position*, const Position*> cells;
+        std::unordered_map<const ExternalReference*, const ExternalReference*> external_cells;
+        std::unordered_map<const CellRange*, const CellRange*> ranges;
+    };
+
+    class Expr {
+    public:
+        virtual ~Expr() = default;
+        virtual std::unique_ptr<Expr> Clone(const CellMap& cells) const = 0;
+        virtual void Print(std::ostream& out) const = 0;
+        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
+        virtual double Evaluate(const SheetInterface& sheet) const = 0;
+
+        // Returns an equivalent expression for evaluation or nullptr when
+        // there is nothing to simplify. Cells of the result point to the
+        // same positions as the cells of this expression (cells is the
+        // identity map), so shifting references updates both.
+        virtual std::unique_ptr<Expr> Simplify(const CellMap& cells) const {
+            return nullptr;
+        }
+
+        // the value if the expression is a constant
+        virtual std::optional<double> GetConstant() const {
+            return std::nullopt;
+        }
+
+        // true if Evaluate either returns a finite number or throws
+        virtual bool IsAlwaysFinite() const {
+            return false;
+        }
+
+        // true if some operands are evaluated only under a condition,
+        // e.g. the branches of IF
+        virtual bool IsConditional() const {
+            return false;
+        }
+
+        // appends the expression to program in evaluation order
+        virtual bool Compile(FormulaProgram& program) const {
+            return false;
+        }
+
+        // the range if the expression is a range, which is only valid as
+        // an argument of a lookup function
+        virtual const CellRange* AsRange() const {
+            return nullptr;
+        }
+
+        // the position if the expression is a cell of this sheet
+        virtual const Position* AsCell() const {
+            return nullptr;
+        }
+
+        // higher is tighter
+        virtual ExprPrecedence GetPrecedence() const = 0;
+
+        // approximate heap size of the node and its subexpressions
+        virtual size_t GetAllocatedBytes() const = 0;
+
+        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+            bool right_child = false) const {
+            auto precedence = GetPrecedence();
+            auto mask = right_child ? PR_RIGHT : PR_LEFT;
+            bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+            if (parens_needed) {
+                out << '(';
+            }
+
+            DoPrintFormula(out, precedence);
+
+            if (parens_needed) {
+                out << ')';
+            }
+        }
+    };
+
+    double GetCellNumber(const SheetInterface& sheet, Position pos) {
+        // Получаем значение ячейки через интерфейс таблицы
+        const CellInterface* cell = sheet.GetCell(pos);
+        if (!cell) {
+            return 0;  // Пустая или несуществующая ячейка интерпретируется как 0
+        }
+
+        // Текст читается без копирования в строку
+        CellInterface::ValueView value = cell->GetValueView();
+
+        // Если значение — это число, возвращаем его
+        if (std::holds_alternative<double>(value)) {
+            return std::get<double>(value);
+        }
+
+        // Если значение — это строка, пробуем преобразовать её в число
+        if (std::holds_alternative<std::string_view>(value)) {
+            // Если весь текст — число, возвращаем его
+            if (std::optional<double> number = ParseNumber(std::get<std::string_view>(value))) {
+                return *number;
+            }
+            else {
+                throw FormulaError(FormulaError::Category::Value);  // Ошибка преобразования строки в число
+            }
+        }
+
+        // Если значение — это ошибка формулы, она становится результатом и этой формулы
+        if (std::holds_alternative<FormulaError>(value)) {
+            throw std::get<FormulaError>(value);
+        }
+
+        // Если тип значения неизвестен, выбрасываем исключение
+        throw std::runtime_error("Invalid value in cell");
+    }
+
+    namespace {
+        // the simplified expression or a copy of the original one
+        std::unique_ptr<Expr> TakeSimplified(std::unique_ptr<Expr> simplified, const Expr& original,
+            const CellMap& cells) {
+            return simplified ? std::move(simplified) : original.Clone(cells);
+        }
+
+        // x / c == x * (1 / c) exactly when c is a power of two
+        bool HasExactReciprocal(double value) {
+            int exponent = 0;
+            return std::fabs(std::frexp(value, &exponent)) == 0.5 && std::isnormal(1 / value);
+        }
+
+        class BinaryOpExpr final : public Expr {
+        public:
+            enum Type : char {
+                Add = '+',
+                Subtract = '-',
+                Multiply = '*',
+                Divide = '/',
+            };
+
+        public:
+            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+                : type_(type)
+                , lhs_(std::move(lhs))
+                , rhs_(std::move(rhs)) {
+            }
+
+            std::unique_ptr<Expr> Clone(const CellMap& cells) const override {
+                return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(cells), rhs_->Clone(cells));
+            }
+
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this) + lhs_->GetAllocatedBytes() + rhs_->GetAllocatedBytes();
+            }
+
+            void Print(std::ostream& out) const override {
+                out << '(' << static_cast<char>(type_) << ' ';
+                lhs_->Print(out);
+                out << ' ';
+                rhs_->Print(out);
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+                lhs_->PrintFormula(out, precedence);
+                out << static_cast<char>(type_);
+                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                switch (type_) {
+                case Add:
+                    return EP_ADD;
+                case Subtract:
+                    return EP_SUB;
+                case Multiply:
+                    return EP_MUL;
+                case Divide:
+                    return EP_DIV;
+                default:
+                    // have to do this because VC++ has a buggy warning
+                    assert(false);
+                    return static_cast<ExprPrecedence>(INT_MAX);
+                }
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                auto left = lhs_.get()->Evaluate(sheet);
+                auto right = rhs_.get()->Evaluate(sheet);
+                double result = Apply(left, right);
+                if (!std::isfinite(result)) {
+                    throw FormulaError(FormulaError::Category::Arithmetic); 
+                }
+                return result;
+            }
+
+            std::unique_ptr<Expr> Simplify(const CellMap& cells) const override;
+
+            bool IsAlwaysFinite() const override {
+                return true;
+            }
+
+            bool IsConditional() const override {
+                return lhs_->IsConditional() || rhs_->IsConditional();
+            }
+
+            bool Compile(FormulaProgram& program) const override {
+                if (!lhs_->Compile(program) || !rhs_->Compile(program)) {
+                    return false;
+                }
+                switch (type_) {
+                case Add:
+                    program.push_back({ FormulaInstruction::Type::Add });
+                    break;
+                case Subtract:
+                    program.push_back({ FormulaInstruction::Type::Subtract });
+                    break;
+                case Multiply:
+                    program.push_back({ FormulaInstruction::Type::Multiply });
+                    break;
+                case Divide:
+                    program.push_back({ FormulaInstruction::Type::Divide });
+                    break;
+                }
+                return true;
+            }
+
+
+        private:
+            double Apply(double left, double right) const {
+                switch (type_) {
+                case Type::Add:
+                    return left + right;
+                case Type::Subtract:
+                    return left - right;
+                case Type::Multiply:
+                    return left * right;
+                case Type::Divide:
+                    return left / right;
+                default:
+                    return 0.0;
+                }
+            }
+
+            Type type_;
+            std::unique_ptr<Expr> lhs_;
+            std::unique_ptr<Expr> rhs_;
+        };
+
+        class UnaryOpExpr final : public Expr {
+        public:
+            enum Type : char {
+                UnaryPlus = '+',
+                UnaryMinus = '-',
+            };
+
+        public:
+            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+                : type_(type)
+                , operand_(std::move(operand)) {
+            }
+
+            std::unique_ptr<Expr> Clone(const CellMap& cells) const override {
+                return std::make_unique<UnaryOpExpr>(type_, operand_->Clone(cells));
+            }
+
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this) + operand_->GetAllocatedBytes();
+            }
+
+            void Print(std::ostream& out) const override {
+                out << '(' << static_cast<char>(type_) << ' ';
+                operand_->Print(out);
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+                out << static_cast<char>(type_);
+                operand_->PrintFormula(out, precedence);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_UNARY;
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                auto result = operand_.get()->Evaluate(sheet);
+                switch (type_) {
+                case Type::UnaryMinus:
+                    result = -result;
+                    break;
+                case Type::UnaryPlus:
+                    break;
+                default:
+                    assert(false);
+                }
+                if (!std::isfinite(result)) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                return result;
+            }
+
+            std::unique_ptr<Expr> Simplify(const CellMap& cells) const override;
+
+            bool IsAlwaysFinite() const override {
+                return true;
+            }
+
+            bool IsConditional() const override {
+                return operand_->IsConditional();
+            }
+
+            bool Compile(FormulaProgram& program) const override {
+                if (!operand_->Compile(program)) {
+                    return false;
+                }
+                program.push_back({ type_ == UnaryMinus ? FormulaInstruction::Type::Negate
+                    : FormulaInstruction::Type::CheckFinite });
+                return true;
+            }
+
+        private:
+            Type type_;
+            std::unique_ptr<Expr> operand_;
+        };
+
+        class CellExpr final : public Expr {
+        public:
+            explicit CellExpr(const Position* cell)
+                : cell_(cell) {
+            }
+
+            std::unique_ptr<Expr> Clone(const CellMap& cells) const override {
+                return std::make_unique<CellExpr>(cells.cells.at(cell_));
+            }
+
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this);
+            }
+
+            void Print(std::ostream& out) const override {
+                if (!cell_->IsValid()) {
+                    out << FormulaError::Category::Ref;
+                }
+                else {
+                    out << cell_->ToString();
+                }
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                Print(out);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                // ячейка, на которую ссылалась формула, удалена
+                if (!cell_->IsValid()) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+
+                return GetCellNumber(sheet, *cell_);
+            }
+
+            bool Compile(FormulaProgram& program) const override {
+                if (!cell_->IsValid()) {
+                    return false;
+                }
+                program.push_back({ FormulaInstruction::Type::Cell, 0, *cell_ });
+                return true;
+            }
+
+            const Position* AsCell() const override {
+                return cell_;
+            }
+
+        private:
+            const Position* cell_;
+        };
+
+        // A1:B10, an argument of a lookup function. A range whose cells were
+        // all deleted prints and evaluates as #REF!.
+        class RangeExpr final : public Expr {
+        public:
+            explicit RangeExpr(const CellRange* range)
+                : range_(range) {
+            }
+
+            std::unique_ptr<Expr> Clone(const CellMap& cells) const override {
+                return std::make_unique<RangeExpr>(cells.ranges.at(range_));
+            }
+
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this);
+            }
+
+            void Print(std::ostream& out) const override {
+                if (!range_->first.IsValid()) {
+                    out << FormulaError::Category::Ref;
+                }
+                else {
+                    out << range_->first.ToString() << ':' << range_->last.ToString();
+                }
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                Print(out);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const SheetInterface& /* sheet */) const override {
+                // the parser keeps ranges out of arithmetic
+                throw FormulaError(FormulaError::Category::Value);
+            }
+
+            const CellRange* AsRange() const override {
+                return range_;
+            }
+
+        private:
+            const CellRange* range_;
+        };
+
+        // names that are not plain identifiers are quoted, quotes are doubled
+        void PrintSheetName(std::ostream& out, const std::string& name) {
+            bool plain = !name.empty() && !std::isdigit(static_cast<unsigned char>(name.front()));
+            for (char ch : name) {
+                plain = plain && (std::isalnum(static_cast<unsigned char>(ch)) || ch == '_');
+            }
+            if (plain) {
+                out << name;
+                return;
+            }
+            out << '\'';
+            for (char ch : name) {
+                out << ch;
+                if (ch == '\'') {
+                    out << ch;
+                }
+            }
+            out << '\'';
+        }
+
+        class ExternalCellExpr final : public Expr {
+        public:
+            explicit ExternalCellExpr(const ExternalReference* cell)
+                : cell_(cell) {
+            }
+
+            std::unique_ptr<Expr> Clone(const CellMap& cells) const override {
+                return std::make_unique<ExternalCellExpr>(cells.external_cells.at(cell_));
+            }
+
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this);
+            }
+
+            void Print(std::ostream& out) const override {
+                if (!cell_->pos.IsValid()) {
+                    out << FormulaError::Category::Ref;
+                }
+                else {
+                    PrintSheetName(out, cell_->sheet);
+                    out << '!' << cell_->pos.ToString();
+                }
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                Print(out);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                // the sheet is not loaded or was removed, or the cell was deleted
+                const SheetInterface* other = sheet.FindSheet(cell_->sheet);
+                if (!other || !cell_->pos.IsValid()) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                return GetCellNumber(*other, cell_->pos);
+            }
+
+        private:
+            const ExternalReference* cell_;
+        };
+
+        class NumberExpr final : public Expr {
+        public:
+            explicit NumberExpr(double value)
+                : value_(value) {
+            }
+
+            std::unique_ptr<Expr> Clone(const CellMap& cells) const override {
+                return std::make_unique<NumberExpr>(value_);
+            }
+
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this);
+            }
+
+            void Print(std::ostream& out) const override {
+                out << value_;
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                out << value_;
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                return value_;
+            }
+
+            std::optional<double> GetConstant() const override {
+                return value_;
+            }
+
+            bool IsAlwaysFinite() const override {
+                return std::isfinite(value_);
+            }
+
+            bool Compile(FormulaProgram& program) const override {
+                program.push_back({ FormulaInstruction::Type::Number, value_ });
+                return true;
+            }
+
+        private:
+            double value_;
+        };
+
+        // A constant subexpression whose evaluation always fails, e.g. 1/0.
+        // Exists only in simplified expressions and is never printed to
+        // the user.
+        class ErrorExpr final : public Expr {
+        public:
+            explicit ErrorExpr(FormulaError::Category category)
+                : category_(category) {
+            }
+
+            std::unique_ptr<Expr> Clone(const CellMap& cells) const override {
+                return std::make_unique<ErrorExpr>(category_);
+            }
+
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this);
+            }
+
+            void Print(std::ostream& out) const override {
+                out << category_;
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                Print(out);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                throw FormulaError(category_);
+            }
+
+            bool IsAlwaysFinite() const override {
+                return true;
+            }
+
+        private:
+            FormulaError::Category category_;
+        };
+
+        // Comparisons give 1 when true and 0 when false, like the logical
+        // values of IF, AND and OR.
+        class ComparisonExpr final : public Expr {
+        public:
+            enum Type : char {
+                Equal,
+                NotEqual,
+                Less,
+                LessOrEqual,
+                Greater,
+                GreaterOrEqual,
+            };
+
+        public:
+            explicit ComparisonExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+                : type_(type)
+                , lhs_(std::move(lhs))
+                , rhs_(std::move(rhs)) {
+            }
+
+            std::unique_ptr<Expr> Clone(const CellMap& cells) const override {
+                return std::make_unique<ComparisonExpr>(type_, lhs_->Clone(cells), rhs_->Clone(cells));
+            }
+
+            size_t GetAllocatedBytes() const override {
+                return sizeof(*this) + lhs_->GetAllocatedBytes() + rhs_->GetAllocatedBytes();
+            }
+
+            void Print(std::ostream& out) const override {
+                out << '(' << GetSymbol() << ' ';
+                lhs_->Print(out);
+                out << ' ';
+                rhs_->Print(out);
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+                lhs_->PrintFormula(out, precedence);
+                out << GetSymbol();
+                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_COMPARE;
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                auto left = lhs_->Evaluate(sheet);
+                auto right = rhs_->Evaluate(sheet);
+                return Apply(left, right);
+            }
+
+            std::unique_ptr<Expr> Simplify(const CellMap& cells) const override {
+                auto lhs = lhs_->Simplify(cells);
+                auto rhs = rhs_->Simplify(cells);
+                auto left_value = (lhs ? *lhs : *lhs_).GetConstant();
+                auto right_value = (rhs ? *rhs : *rhs_).GetConstant();
+                if (left_value && right_value) {
+                    return std::make_unique<NumberExpr>(Apply(*left_value, *right_value));
+                }
+                if (!lhs && !rhs) {
+                    return nullptr;
+                }
+                return std::make_unique<ComparisonExpr>(type_, TakeSimplified(std::move(lhs), *lhs_, cells),
+                    TakeSimplified(std::move(rhs), *rhs_, cells));
+            }
+
+            bool IsAlwaysFinite() const override {
+                return true;
+            }
+
+            bool IsConditional() const override {
+                return lhs_->IsConditional() || rhs_->IsConditional();
+            }
+
+        private:
+            const char* GetSymbol() const {
+                switch (type_) {
+                case Equal:
+                    return "=";
+                case NotEqual:
+                    return "<>";
+                case Less:
+                    return "<";
+                case LessOrEqual:
+                    return "<=";
+                case Greater:
+                    return ">";
+                default:
+                    return ">=";
+                }
+            }
+
+            double Apply(double left, double right) const {
+                switch (type_) {
+                case Equal:
+                    return left == right;
+                case NotEqual:
+                    return left != right;
+                case Less:
+                    return left < right;
+                case LessOrEqual:
+                    return left <= right;
+                case Greater:
+                    return left > right;
+                default:
+                    return left >= right;
+                }
+            }
+
+            Type type_;
+            std::unique_ptr<Expr> lhs_;
+            std::unique_ptr<Expr> rhs_;
+        };
+
+        // IF(condition, value_if_true[, value_if_false]), AND(...), OR(...).
+        // Operands are evaluated left to right and only while the result is
+        // unknown: IF evaluates one branch, AND stops at the first zero and
+        // OR at the first non-zero. Cells of the skipped operands are not
+        // read, so their formulas are not evaluated either. A missing else
+        // branch gives 0.
+        class CallExpr final : public Expr {
+        public:
+            enum Function : char {
+                If,
+                And,
+                Or,
+            };
+
+            // nullopt for an unknown name
+            static std::optional<Function> FindFunction(const std::string& name) {
+                if (name == "IF") {
+                    return If;
+                }
+                if (name == "AND") {
+                    return And;
+                }
+                if (name == "OR") {
+                    return Or;
+                }
+                return std::nullopt;
+            }
+
+        public:
+            // the argument count must be valid for the function, see ParseASTListener
+            explicit CallExpr(Function function, std::vector<std::unique_ptr<Expr>> args)
+                : function_(function)
+                , args_(std::move(args)) {
+            }
+
+            std::unique_ptr<Expr> Clone(const CellMap& cells) const override {
+                std::vector<std::unique_ptr<Expr>> args;
+                args.reserve(args_.size());
+                for (const auto& arg : args_) {
+                    args.push_back(arg->Clone(cells));
+                }
+                return std::make_unique<CallExpr>(function_, std::move(args));
+            }
+
+            size_t GetAllocatedBytes() const override {
+                size_t bytes = sizeof(*this) + args_.capacity() * sizeof(args_.front());
+                for (const auto& arg : args_) {
+                    bytes += arg->GetAllocatedBytes();
+                }
+                return bytes;
+            }
+
+            void Print(std::ostream& out) const override {
+                out << '(' << GetName();
+                for (const auto& arg : args_) {
+                    out << ' ';
+                    arg->Print(out);
+                }
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+                out << GetName() << '(';
+                bool first = true;
+                for (const auto& arg : args_) {
+                    if (!first) {
+                        out << ',';
+                    }
+                    first = false;
+                    arg->PrintFormula(out, EP_ATOM);
+                }
+                out << ')';
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                switch (function_) {
+                case If:
+                    if (args_[0]->Evaluate(sheet) != 0) {
+                        return args_[1]->Evaluate(sheet);
+                    }
+                    return args_.size() > 2 ? args_[2]->Evaluate(sheet) : 0.0;
+                case And:
+                    for (const auto& arg : args_) {
+                        if (arg->Evaluate(sheet) == 0) {
+                            return 0.0;
+                        }
+                    }
+                    return 1.0;
+                default:
+                    for (const auto& arg : args_) {
+                        if (arg->Evaluate(sheet) != 0) {
+                            return 1.0;
+                        }
+                    }
+                    return 0.0;
+                }
+            }
+
+            std::unique_ptr<Expr> Simplify(const CellMap& cells) const override;
+
+            bool IsAlwaysFinite() const override {
+                if (function_ != If) {
+                    return true;
+                }
+                return args_[1]->IsAlwaysFinite() && (args_.size() < 3 || args_[2]->IsAlwaysFinite());
+            }
+
+            bool IsConditional() const override {
+                return true;
+            }
+
+        private:
+            const char* GetName() const {
+                switch (function_) {
+                case If:
+                    return "IF";
+                case And:
+                    return "AND";
+                default:
+                    return "OR";
+                }
+            }
+
+            Function function_;
+            std::vector<std::unique_ptr<Expr>> args_;
+        };
+
+        // VLOOKUP(value, table, column[, sorted]), MATCH(value, column[, type]),
+        // XLOOKUP(value, lookup_column, result_column[, if_not_found[, mode]]).
+        // The search itself is up to the sheet (SheetInterface::FindInColumn),
+        // which may keep an index of the searched column. A cell given as the
+        // value is looked up by its text too, any other value is a number.
+        // Approximate modes find the closest value whatever the order of the
+        // column, so sorted data gives the usual spreadsheet result. A missing
+        // value is #N/A, XLOOKUP evaluates if_not_found only then.
+        class LookupExpr final : public Expr {
+        public:
+            enum Function : char {
+                VLookup,
+                Match,
+                XLookup,
+            };
+
+            // nullopt for an unknown name
+            static std::optional<Function> FindFunction(const std::string& name) {
+                if (name == "VLOOKUP") {
+                    return VLookup;
+                }
+                if (name == "MATCH") {
+                    return Match;
+                }
+                if (name == "XLOOKUP") {
+                    return XLookup;
+                }
+                return std::nullopt;
+            }
+
+            static bool IsValidArgumentCount(Function function, size_t count) {
+                switch (function) {
+                case VLookup:
+                    return count == 3 || count == 4;
+                case Match:
+                    return count == 2 || count == 3;
+                default:
+                    return count >= 3 && count <= 5;
+                }
+            }
+
+            // ranges are allowed and required exactly in these positions
+            static bool IsRangeArgument(Function function, size_t index) {
+                return index == 1 || (function == XLookup && index == 2);
+            }
+
+        public:
+            // the arguments must be valid for the function, see ParseASTListener
+            explicit LookupExpr(Function function, std::vector<std::unique_ptr<Expr>> args)
+                : function_(function)
+                , args_(std::move(args)) {
+            }
+
+            std::unique_ptr<Expr> Clone(const CellMap& cells) const override {
+                std::vector<std::unique_ptr<Expr>> args;
+                args.reserve(args_.size());
+                for (const auto& arg : args_) {
+                    args.push_back(arg->Clone(cells));
+                }
+                return std::make_unique<LookupExpr>(function_, std::move(args));
+            }
+
+            size_t GetAllocatedBytes() const override {
+                size_t bytes = sizeof(*this) + args_.capacity() * sizeof(args_.front());
+                for (const auto& arg : args_) {
+                    bytes += arg->GetAllocatedBytes();
+                }
+                return bytes;
+            }
+
+            void Print(std::ostream& out) const override {
+                out << '(' << GetName();
+                for (const auto& arg : args_) {
+                    out << ' ';
+                    arg->Print(out);
+                }
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+                out << GetName() << '(';
+                bool first = true;
+                for (const auto& arg : args_) {
+                    if (!first) {
+                        out << ',';
+                    }
+                    first = false;
+                    arg->PrintFormula(out, EP_ATOM);
+                }
+                out << ')';
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                LookupValue value = GetLookupValue(sheet);
+                switch (function_) {
+                case VLookup: {
+                    const CellRange& table = GetRange(1);
+                    double column = args_[2]->Evaluate(sheet);
+                    if (column < 1) {
+                        throw FormulaError(FormulaError::Category::Value);
+                    }
+                    if (column > table.last.col - table.first.col + 1) {
+                        throw FormulaError(FormulaError::Category::Ref);
+                    }
+                    bool sorted = args_.size() < 4 || args_[3]->Evaluate(sheet) != 0;
+                    int row = Find(sheet, { table.first, { table.last.row, table.first.col } }, value,
+                        sorted ? LookupMode::LessOrEqual : LookupMode::Exact);
+                    return GetCellNumber(sheet, { table.first.row + row, table.first.col + static_cast<int>(column) - 1 });
+                }
+                case Match: {
+                    // MATCH type: 1 exact or next smaller, 0 exact, -1 exact or next larger
+                    double type = args_.size() < 3 ? 1 : args_[2]->Evaluate(sheet);
+                    LookupMode mode = type > 0 ? LookupMode::LessOrEqual
+                        : (type < 0 ? LookupMode::GreaterOrEqual : LookupMode::Exact);
+                    return Find(sheet, GetColumn(1), value, mode) + 1;
+                }
+                default: {
+                    const CellRange& lookup = GetColumn(1);
+                    const CellRange& result = GetColumn(2);
+                    if (lookup.last.row - lookup.first.row != result.last.row - result.first.row) {
+                        throw FormulaError(FormulaError::Category::Value);
+                    }
+                    double mode = args_.size() < 5 ? 0 : args_[4]->Evaluate(sheet);
+                    std::optional<int> row = sheet.FindInColumn(lookup, value, GetMode(mode));
+                    if (!row) {
+                        if (args_.size() < 4) {
+                            throw FormulaError(FormulaError::Category::NotAvailable);
+                        }
+                        return args_[3]->Evaluate(sheet);
+                    }
+                    return GetCellNumber(sheet, { result.first.row + *row, result.first.col });
+                }
+                }
+            }
+
+            bool IsConditional() const override {
+                return std::any_of(args_.begin(), args_.end(), [](const auto& arg) { return arg->IsConditional(); });
+            }
+
+        private:
+            const char* GetName() const {
+                switch (function_) {
+                case VLookup:
+                    return "VLOOKUP";
+                case Match:
+                    return "MATCH";
+                default:
+                    return "XLOOKUP";
+                }
+            }
+
+            // the value is read as is from a cell, otherwise evaluated
+            LookupValue GetLookupValue(const SheetInterface& sheet) const {
+                const Position* pos = args_[0]->AsCell();
+                if (!pos) {
+                    return args_[0]->Evaluate(sheet);
+                }
+                if (!pos->IsValid()) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                const CellInterface* cell = sheet.GetCell(*pos);
+                if (!cell) {
+                    return 0.0;
+                }
+                CellInterface::ValueView view = cell->GetValueView();
+                if (const auto* error = std::get_if<FormulaError>(&view)) {
+                    throw *error;
+                }
+                // an empty text is 0 like an empty cell
+                std::optional<LookupValue> value = ToLookupValue(view);
+                return value ? *value : LookupValue(0.0);
+            }
+
+            const CellRange& GetRange(size_t index) const {
+                const CellRange& range = *args_[index]->AsRange();
+                if (!range.first.IsValid()) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                return range;
+            }
+
+            // MATCH and XLOOKUP search a single column
+            const CellRange& GetColumn(size_t index) const {
+                const CellRange& range = GetRange(index);
+                if (range.first.col != range.last.col) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                return range;
+            }
+
+            // XLOOKUP match mode: 0 exact, -1 exact or next smaller,
+            // 1 exact or next larger
+            static LookupMode GetMode(double mode) {
+                if (mode == 0) {
+                    return LookupMode::Exact;
+                }
+                return mode < 0 ? LookupMode::LessOrEqual : LookupMode::GreaterOrEqual;
+            }
+
+            static int Find(const SheetInterface& sheet, CellRange column, const LookupValue& value, LookupMode mode) {
+                std::optional<int> row = sheet.FindInColumn(column, value, mode);
+                if (!row) {
+                    throw FormulaError(FormulaError::Category::NotAvailable);
+                }
+                return *row;
+            }
+
+            Function function_;
+            std::vector<std::unique_ptr<Expr>> args_;
+        };
+
+        std::unique_ptr<Expr> BinaryOpExpr::Simplify(const CellMap& cells) const {
+            auto lhs = lhs_->Simplify(cells);
+            auto rhs = rhs_->Simplify(cells);
+            const Expr& left = lhs ? *lhs : *lhs_;
+            const Expr& right = rhs ? *rhs : *rhs_;
+            auto left_value = left.GetConstant();
+            auto right_value = right.GetConstant();
+
+            if (left_value && right_value) {
+                double result = Apply(*left_value, *right_value);
+                if (!std::isfinite(result)) {
+                    return std::make_unique<ErrorExpr>(FormulaError::Category::Arithmetic);
+                }
+                return std::make_unique<NumberExpr>(result);
+            }
+
+            // Identities hold bit for bit, -0 included, but drop the finiteness
+            // check of the operation, so they apply only to operands that are
+            // checked by themselves. A cell may hold "inf" and stays as is.
+            bool right_is_one = right_value && *right_value == 1;
+            if (((type_ == Multiply || type_ == Divide) && right_is_one)
+                || (type_ == Subtract && right_value && *right_value == 0 && !std::signbit(*right_value))) {
+                if (left.IsAlwaysFinite()) {
+                    return TakeSimplified(std::move(lhs), *lhs_, cells);
+                }
+            }
+            if (type_ == Multiply && left_value && *left_value == 1 && right.IsAlwaysFinite()) {
+                return TakeSimplified(std::move(rhs), *rhs_, cells);
+            }
+            if (type_ == Divide && right_value && !right_is_one && HasExactReciprocal(*right_value)) {
+                return std::make_unique<BinaryOpExpr>(Multiply, TakeSimplified(std::move(lhs), *lhs_, cells),
+                    std::make_unique<NumberExpr>(1 / *right_value));
+            }
+
+            if (!lhs && !rhs) {
+                return nullptr;
+            }
+            return std::make_unique<BinaryOpExpr>(type_, TakeSimplified(std::move(lhs), *lhs_, cells),
+                TakeSimplified(std::move(rhs), *rhs_, cells));
+        }
+
+        std::unique_ptr<Expr> UnaryOpExpr::Simplify(const CellMap& cells) const {
+            auto operand = operand_->Simplify(cells);
+            const Expr& value = operand ? *operand : *operand_;
+            if (auto constant = value.GetConstant()) {
+                return std::make_unique<NumberExpr>(type_ == UnaryMinus ? -*constant : *constant);
+            }
+            // unary plus only checks that the operand is finite
+            if (type_ == UnaryPlus && value.IsAlwaysFinite()) {
+                return TakeSimplified(std::move(operand), *operand_, cells);
+            }
+            if (!operand) {
+                return nullptr;
+            }
+            return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+        }
+
+        std::unique_ptr<Expr> CallExpr::Simplify(const CellMap& cells) const {
+            std::vector<std::unique_ptr<Expr>> simplified;
+            simplified.reserve(args_.size());
+            bool changed = false;
+            for (const auto& arg : args_) {
+                simplified.push_back(arg->Simplify(cells));
+                changed = changed || simplified.back();
+            }
+            auto value = [&](size_t index) -> const Expr& {
+                return simplified[index] ? *simplified[index] : *args_[index];
+            };
+
+            // a constant condition selects the branch once and for all
+            if (function_ == If) {
+                if (auto condition = value(0).GetConstant()) {
+                    size_t branch = *condition != 0 ? 1 : 2;
+                    if (branch >= args_.size()) {
+                        return std::make_unique<NumberExpr>(0.0);
+                    }
+                    return TakeSimplified(std::move(simplified[branch]), *args_[branch], cells);
+                }
+            }
+            // leading constants of AND and OR either decide the result or can be
+            // dropped, the first non-constant operand stops the folding
+            else {
+                size_t first = 0;
+                for (; first < args_.size(); ++first) {
+                    auto constant = value(first).GetConstant();
+                    if (!constant) {
+                        break;
+                    }
+                    if ((*constant != 0) == (function_ == Or)) {
+                        return std::make_unique<NumberExpr>(function_ == Or ? 1.0 : 0.0);
+                    }
+                }
+                if (first == args_.size()) {
+                    return std::make_unique<NumberExpr>(function_ == Or ? 0.0 : 1.0);
+                }
+                changed = changed || first > 0;
+                if (changed) {
+                    std::vector<std::unique_ptr<Expr>> args;
+                    for (size_t i = first; i < args_.size(); ++i) {
+                        args.push_back(TakeSimplified(std::move(simplified[i]), *args_[i], cells));
+                    }
+                    return std::make_unique<CallExpr>(function_, std::move(args));
+                }
+            }
+
+            if (!changed) {
+                return nullptr;
+            }
+            std::vector<std::unique_ptr<Expr>> args;
+            for (size_t i = 0; i < args_.size(); ++i) {
+                args.push_back(TakeSimplified(std::move(simplified[i]), *args_[i], cells));
+            }
+            return std::make_unique<CallExpr>(function_, std::move(args));
+        }
+
+        class ParseASTListener final : public FormulaBaseListener {
+        public:
+            std::unique_ptr<Expr> MoveRoot() {
+                assert(args_.size() == 1);
+                auto root = std::move(args_.front());
+                args_.clear();
+
+                return root;
+            }
+
+            std::forward_list<Position> MoveCells() {
+                return std::move(cells_);
+            }
+
+            std::forward_list<ExternalReference> MoveExternalCells() {
+                return std::move(external_cells_);
+            }
+
+            std::forward_list<CellRange> MoveRanges() {
+                return std::move(ranges_);
+            }
+
+        public:
+            void exitMain(FormulaParser::MainContext* /* ctx */) override {
+                assert(args_.size() == 1);
+                CheckValue(*args_.back());
+            }
+
+            void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
+                assert(args_.size() >= 1);
+
+                auto operand = std::move(args_.back());
+                CheckValue(*operand);
+
+                UnaryOpExpr::Type type;
+                if (ctx->SUB()) {
+                    type = UnaryOpExpr::UnaryMinus;
+                }
+                else {
+                    assert(ctx->ADD() != nullptr);
+                    type = UnaryOpExpr::UnaryPlus;
+                }
+
+                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+                args_.back() = std::move(node);
+            }
+
+            void exitLiteral(FormulaParser::LiteralContext* ctx) override {
+                double value = 0;
+                auto valueStr = ctx->NUMBER()->getSymbol()->getText();
+                std::istringstream in(valueStr);
+                in >> value;
+                if (!in) {
+                    throw ParsingError("Invalid number: " + valueStr);
+                }
+
+                auto node = std::make_unique<NumberExpr>(value);
+                args_.push_back(std::move(node));
+            }
+
+            void exitCell(FormulaParser::CellContext* ctx) override {
+                auto text = ctx->CELL()->getSymbol()->getText();
+                // a quoted sheet name may contain '!', the cell address may not
+                auto separator = text.rfind('!');
+                auto value_str = separator == std::string::npos ? text : text.substr(separator + 1);
+                auto value = Position::FromString(value_str);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + value_str);
+                }
+
+                if (separator == std::string::npos) {
+                    cells_.push_front(value);
+                    args_.push_back(std::make_unique<CellExpr>(&cells_.front()));
+                    return;
+                }
+
+                std::string sheet = text.substr(0, separator);
+                if (!sheet.empty() && sheet.front() == '\'') {
+                    // 'Sales ''24' -> Sales '24
+                    std::string unquoted;
+                    for (size_t i = 1; i + 1 < sheet.size(); ++i) {
+                        unquoted += sheet[i];
+                        if (sheet[i] == '\'') {
+                            ++i;
+                        }
+                    }
+                    sheet = std::move(unquoted);
+                }
+                external_cells_.push_front({ std::move(sheet), value });
+                args_.push_back(std::make_unique<ExternalCellExpr>(&external_cells_.front()));
+            }
+
+            // #REF! is read as a deleted cell; in place of a range argument of
+            // a lookup function exitCall turns it into a deleted range
+            void exitRef(FormulaParser::RefContext* /* ctx */) override {
+                cells_.push_front(Position::NONE);
+                args_.push_back(std::make_unique<CellExpr>(&cells_.front()));
+            }
+
+            void exitRange(FormulaParser::RangeContext* ctx) override {
+                Position corners[2];
+                for (size_t i = 0; i < 2; ++i) {
+                    auto text = ctx->CELL(i)->getSymbol()->getText();
+                    if (text.find('!') != std::string::npos) {
+                        throw ParsingError("Ranges of other sheets are not supported: " + text);
+                    }
+                    corners[i] = Position::FromString(text);
+                    if (!corners[i].IsValid()) {
+                        throw FormulaException("Invalid position: " + text);
+                    }
+                }
+                // B10:A1 is the same range as A1:B10
+                ranges_.push_front({
+                    { std::min(corners[0].row, corners[1].row), std::min(corners[0].col, corners[1].col) },
+                    { std::max(corners[0].row, corners[1].row), std::max(corners[0].col, corners[1].col) } });
+                args_.push_back(std::make_unique<RangeExpr>(&ranges_.front()));
+            }
+
+            void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+                assert(args_.size() >= 2);
+
+                auto rhs = std::move(args_.back());
+                args_.pop_back();
+
+                auto lhs = std::move(args_.back());
+                CheckValue(*lhs);
+                CheckValue(*rhs);
+
+                BinaryOpExpr::Type type;
+                if (ctx->ADD()) {
+                    type = BinaryOpExpr::Add;
+                }
+                else if (ctx->SUB()) {
+                    type = BinaryOpExpr::Subtract;
+                }
+                else if (ctx->MUL()) {
+                    type = BinaryOpExpr::Multiply;
+                }
+                else {
+                    assert(ctx->DIV() != nullptr);
+                    type = BinaryOpExpr::Divide;
+                }
+
+                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+                args_.back() = std::move(node);
+            }
+
+            void exitComparison(FormulaParser::ComparisonContext* ctx) override {
+                assert(args_.size() >= 2);
+
+                auto rhs = std::move(args_.back());
+                args_.pop_back();
+
+                auto lhs = std::move(args_.back());
+                CheckValue(*lhs);
+                CheckValue(*rhs);
+
+                ComparisonExpr::Type type;
+                if (ctx->EQ()) {
+                    type = ComparisonExpr::Equal;
+                }
+                else if (ctx->NE()) {
+                    type = ComparisonExpr::NotEqual;
+                }
+                else if (ctx->LT()) {
+                    type = ComparisonExpr::Less;
+                }
+                else if (ctx->LE()) {
+                    type = ComparisonExpr::LessOrEqual;
+                }
+                else if (ctx->GT()) {
+                    type = ComparisonExpr::Greater;
+                }
+                else {
+                    assert(ctx->GE() != nullptr);
+                    type = ComparisonExpr::GreaterOrEqual;
+                }
+
+                auto node = std::make_unique<ComparisonExpr>(type, std::move(lhs), std::move(rhs));
+                args_.back() = std::move(node);
+            }
+
+            void exitCall(FormulaParser::CallContext* ctx) override {
+                auto name = ctx->FUNCTION()->getSymbol()->getText();
+                auto function = CallExpr::FindFunction(name);
+                auto lookup = function ? std::nullopt : LookupExpr::FindFunction(name);
+                if (!function && !lookup) {
+                    throw ParsingError("Unknown function: " + name);
+                }
+
+                size_t count = ctx->expr().size();
+                bool valid = function
+                    ? (*function == CallExpr::If ? count == 2 || count == 3 : count >= 1)
+                    : LookupExpr::IsValidArgumentCount(*lookup, count);
+                if (!valid) {
+                    throw ParsingError("Invalid number of arguments: " + name);
+                }
+
+                assert(args_.size() >= count);
+                std::vector<std::unique_ptr<Expr>> args;
+                for (auto it = args_.end() - count; it != args_.end(); ++it) {
+                    args.push_back(std::move(*it));
+                }
+                args_.resize(args_.size() - count);
+
+                for (size_t i = 0; i < count; ++i) {
+                    if (lookup && LookupExpr::IsRangeArgument(*lookup, i)) {
+                        if (const Position* cell = args[i]->AsCell(); cell && !cell->IsValid()) {
+                            cells_.remove_if([cell](const Position& pos) {
+                                return &pos == cell;
+                            });
+                            ranges_.push_front({ Position::NONE, Position::NONE });
+                            args[i] = std::make_unique<RangeExpr>(&ranges_.front());
+                        }
+                        if (!args[i]->AsRange()) {
+                            throw ParsingError("Range expected: argument " + std::to_string(i + 1) + " of " + name);
+                        }
+                    }
+                    else {
+                        CheckValue(*args[i]);
+                    }
+                }
+
+                if (function) {
+                    args_.push_back(std::make_unique<CallExpr>(*function, std::move(args)));
+                }
+                else {
+                    args_.push_back(std::make_unique<LookupExpr>(*lookup, std::move(args)));
+                }
+            }
+
+            void visitErrorNode(antlr4::tree::ErrorNode* node) override {
+                throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+            }
+
+        private:
+            // a range is only an argument of a lookup function, never a value
+            static void CheckValue(const Expr& expr) {
+                if (expr.AsRange()) {
+                    throw ParsingError("A range is not a value");
+                }
+            }
+
+            std::vector<std::unique_ptr<Expr>> args_;
+            std::forward_list<Position> cells_;
+            std::forward_list<ExternalReference> external_cells_;
+            std::forward_list<CellRange> ranges_;
+        };
+
+        class BailErrorListener : public antlr4::BaseErrorListener {
+        public:
+            void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
+                size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
+                std::exception_ptr /* e */
+            ) override {
+                throw ParsingError("Error when lexing: " + msg);
+            }
+        };
+
+    }  // namespace
+}  // namespace ASTImpl
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    using namespace antlr4;
+
+    ANTLRInputStream input(in);
+
+    FormulaLexer lexer(&input);
+    ASTImpl::BailErrorListener error_listener;
+    lexer.removeErrorListeners();
+    lexer.addErrorListener(&error_listener);
+
+    CommonTokenStream tokens(&lexer);
+
+    FormulaParser parser(&tokens);
+    auto error_handler = std::make_shared<BailErrorStrategy>();
+    parser.setErrorHandler(error_handler);
+    parser.removeErrorListeners();
+
+    tree::ParseTree* tree;
+    try {
+        tree = parser.main();
+    }
+    catch (...) {
+        throw FormulaException("tree::ParseTree* tree = parser.main() ""Invalid position: ");
+    }
+    ASTImpl::ParseASTListener listener;
+    try {
+        tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+    }
+    catch (const ParsingError& e) {
+        throw FormulaException(e.what());
+    }
+
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveExternalCells(), listener.MoveRanges());
+}
+
+FormulaAST ParseFormulaAST(const std::string& in_str) {
+    std::istringstream in(in_str);
+    return ParseFormulaAST(in);
+}
+
+void FormulaAST::PrintCells(std::ostream& out) const {
+    for (auto cell : cells_) {
+        out << cell.ToString() << ' ';
+    }
+}
+
+void FormulaAST::Print(std::ostream& out) const {
+    root_expr_->Print(out);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+}
+
+double FormulaAST::Execute(const SheetInterface& sheet) const {
+    return (simplified_expr_ ? simplified_expr_ : root_expr_)->Evaluate(sheet);
+}
+
+bool FormulaAST::IsSimplified() const {
+    return simplified_expr_ != nullptr;
+}
+
+void FormulaAST::PrintSimplified(std::ostream& out) const {
+    (simplified_expr_ ? simplified_expr_ : root_expr_)->Print(out);
+}
+
+bool FormulaAST::Compile(FormulaProgram& program) const {
+    return (simplified_expr_ ? simplified_expr_ : root_expr_)->Compile(program);
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+    std::forward_list<ExternalReference> external_cells, std::forward_list<CellRange> ranges)
+    : root_expr_(std::move(root_expr))
+    , cells_(std::move(cells))
+    , external_cells_(std::move(external_cells))
+    , ranges_(std::move(ranges)) {
+    cells_.sort();  // to avoid sorting in GetReferencedCells
+    external_cells_.sort();
+
+    ASTImpl::CellMap identity;
+    for (const Position& cell : cells_) {
+        identity.cells[&cell] = &cell;
+    }
+    for (const ExternalReference& cell : external_cells_) {
+        identity.external_cells[&cell] = &cell;
+    }
+    for (const CellRange& range : ranges_) {
+        identity.ranges[&range] = &range;
+    }
+    simplified_expr_ = root_expr_->Simplify(identity);
+}
+
+FormulaAST::FormulaAST(const FormulaAST& other)
+    : cells_(other.cells_)
+    , external_cells_(other.external_cells_)
+    , ranges_(other.ranges_) {
+    ASTImpl::CellMap cells;
+    auto it = cells_.begin();
+    for (const Position& cell : other.cells_) {
+        cells.cells[&cell] = &*it++;
+    }
+    auto external_it = external_cells_.begin();
+    for (const ExternalReference& cell : other.external_cells_) {
+        cells.external_cells[&cell] = &*external_it++;
+    }
+    auto range_it = ranges_.begin();
+    for (const CellRange& range : other.ranges_) {
+        cells.ranges[&range] = &*range_it++;
+    }
+    root_expr_ = other.root_expr_->Clone(cells);
+    if (other.simplified_expr_) {
+        simplified_expr_ = other.simplified_expr_->Clone(cells);
+    }
+}
+
+FormulaAST::~FormulaAST() = default;
+
+bool FormulaAST::IsConditional() const {
+    return (simplified_expr_ ? simplified_expr_ : root_expr_)->IsConditional();
+}
+
+size_t FormulaAST::GetAllocatedBytes() const {
+    size_t bytes = root_expr_->GetAllocatedBytes();
+    if (simplified_expr_) {
+        bytes += simplified_expr_->GetAllocatedBytes();
+    }
+    // a list node holds the next pointer besides the value
+    for (const Position& cell : cells_) {
+        bytes += sizeof(void*) + sizeof(cell);
+    }
+    for (const ExternalReference& cell : external_cells_) {
+        bytes += sizeof(void*) + sizeof(cell) + cell.sheet.capacity();
+    }
+    for (const CellRange& range : ranges_) {
+        bytes += sizeof(void*) + sizeof(range);
+    }
+    return bytes;
+}
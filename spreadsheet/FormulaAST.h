@@ -1,49 +1,96 @@
-﻿#pragma once
-
-#include "FormulaLexer.h"
-#include "common.h"
-
-#include <forward_list>
-#include <functional>
-#include <stdexcept>
-
-namespace ASTImpl {
-    class Expr;
-}
-
-class ParsingError : public std::runtime_error {
-    using std::runtime_error::runtime_error;
-};
-
-class FormulaAST {
-public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
-    ~FormulaAST();
-
-    double Execute(const SheetInterface& sheet) const;
-    void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
-
-    std::forward_list<Position>& GetCells() {
-        return cells_;
-    }
-
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
-    }
-
-private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-
-    // physically stores cells so that they can be
-    // efficiently traversed without going through
-    // the whole AST
-    std::forward_list<Position> cells_;
-};
-
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+﻿#pragma once
+
+#include "FormulaLexer.h"
+#include "common.h"
+#include "formula.h"
+
+#include <forward_list>
+#include <functional>
+#include <stdexcept>
+
+namespace ASTImpl {
+    class Expr;
+
+    // numeric value of a cell used as an operand, throws FormulaError
+    double GetCellNumber(const SheetInterface& sheet, Position pos);
+}
+
+class ParsingError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+class FormulaAST {
+public:
+    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
+        std::forward_list<Position> cells,
+        std::forward_list<ExternalReference> external_cells = {},
+        std::forward_list<CellRange> ranges = {});
+    // deep copy, cell expressions point into the copied cell list
+    FormulaAST(const FormulaAST& other);
+    FormulaAST(FormulaAST&&) = default;
+    FormulaAST& operator=(FormulaAST&&) = default;
+    ~FormulaAST();
+
+    double Execute(const SheetInterface& sheet) const;
+    void PrintCells(std::ostream& out) const;
+    void Print(std::ostream& out) const;
+    void PrintFormula(std::ostream& out) const;
+
+    // Constant subexpressions are folded at construction and the result is
+    // evaluated instead of the parsed tree. Printing always uses the parsed
+    // tree, so the formula text stays the way the user wrote it.
+    bool IsSimplified() const;
+    void PrintSimplified(std::ostream& out) const;
+
+    // Appends the evaluated tree to program in postfix order. Returns false
+    // if some node has no instruction, the program is unusable then.
+    bool Compile(FormulaProgram& program) const;
+
+    // true if some cells are read only under a condition, e.g. in the
+    // branches of IF
+    bool IsConditional() const;
+
+    // approximate heap size of the parsed and simplified trees and cell lists
+    size_t GetAllocatedBytes() const;
+
+    std::forward_list<Position>& GetCells() {
+        return cells_;
+    }
+
+    const std::forward_list<Position>& GetCells() const {
+        return cells_;
+    }
+
+    // references to cells of other workbook sheets
+    std::forward_list<ExternalReference>& GetExternalCells() {
+        return external_cells_;
+    }
+
+    const std::forward_list<ExternalReference>& GetExternalCells() const {
+        return external_cells_;
+    }
+
+    // ranges of this sheet used by lookup functions, in no particular order
+    std::forward_list<CellRange>& GetRanges() {
+        return ranges_;
+    }
+
+    const std::forward_list<CellRange>& GetRanges() const {
+        return ranges_;
+    }
+
+private:
+    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // nullptr when the parsed tree has nothing to simplify
+    std::unique_ptr<ASTImpl::Expr> simplified_expr_;
+
+    // physically stores cells so that they can be
+    // efficiently traversed without going through
+    // the whole AST
+    std::forward_list<Position> cells_;
+    std::forward_list<ExternalReference> external_cells_;
+    std::forward_list<CellRange> ranges_;
+};
+
+FormulaAST ParseFormulaAST(std::istream& in);
+FormulaAST ParseFormulaAST(const std::string& in_str);
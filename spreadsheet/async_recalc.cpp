@@ -0,0 +1,155 @@
+﻿#include "async_recalc.h"
+
+#include "cell.h"
+
+#include <stdexcept>
+
+class AsyncRecalculator::ForegroundLock {
+public:
+    explicit ForegroundLock(AsyncRecalculator& owner)
+        : owner_(owner) {
+        // пока счётчик не ноль, фоновый поток не берёт новых формул
+        ++owner_.waiting_foreground_;
+        lock_ = std::unique_lock(owner_.mutex_);
+        --owner_.waiting_foreground_;
+    }
+
+    ForegroundLock(const ForegroundLock&) = delete;
+    ForegroundLock& operator=(const ForegroundLock&) = delete;
+
+    ~ForegroundLock() {
+        lock_.unlock();
+        owner_.work_.notify_one();
+    }
+
+private:
+    AsyncRecalculator& owner_;
+    std::unique_lock<std::mutex> lock_;
+};
+
+AsyncRecalculator::AsyncRecalculator(Sheet& sheet)
+    : sheet_(sheet) {
+    // имя есть только у листов книги
+    if (!sheet_.GetName().empty()) {
+        throw std::invalid_argument("Background recalculation of a workbook sheet");
+    }
+    // наблюдатель вызывается из SetCell и прочих изменений, то есть под mutex_
+    sheet_.SetInvalidationListener([this](Position pos) {
+        Enqueue(pos);
+    });
+    EnqueueUncalculated();
+    worker_ = std::thread([this] {
+        Run();
+    });
+}
+
+AsyncRecalculator::~AsyncRecalculator() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    work_.notify_one();
+    worker_.join();
+    sheet_.SetInvalidationListener(nullptr);
+}
+
+void AsyncRecalculator::SetCell(Position pos, std::string text) {
+    ForegroundLock lock(*this);
+    sheet_.SetCell(pos, std::move(text));
+}
+
+void AsyncRecalculator::ClearCell(Position pos) {
+    ForegroundLock lock(*this);
+    sheet_.ClearCell(pos);
+}
+
+CellInterface::Value AsyncRecalculator::GetValue(Position pos) {
+    ForegroundLock lock(*this);
+    const CellInterface* cell = sheet_.GetCell(pos);
+    return cell ? cell->GetValue() : CellInterface::Value{};
+}
+
+std::string AsyncRecalculator::GetText(Position pos) {
+    ForegroundLock lock(*this);
+    const CellInterface* cell = sheet_.GetCell(pos);
+    return cell ? cell->GetText() : std::string{};
+}
+
+void AsyncRecalculator::Read(const std::function<void(const Sheet&)>& read) {
+    ForegroundLock lock(*this);
+    read(sheet_);
+}
+
+void AsyncRecalculator::Modify(const std::function<void(Sheet&)>& change) {
+    ForegroundLock lock(*this);
+    // очередь строится заново и тогда, когда изменение бросило исключение
+    try {
+        change(sheet_);
+    }
+    catch (...) {
+        EnqueueUncalculated();
+        throw;
+    }
+    EnqueueUncalculated();
+}
+
+void AsyncRecalculator::Wait() {
+    std::unique_lock lock(mutex_);
+    idle_.wait(lock, [this] {
+        return queue_.empty();
+    });
+}
+
+bool AsyncRecalculator::WaitFor(std::chrono::milliseconds timeout) {
+    std::unique_lock lock(mutex_);
+    return idle_.wait_for(lock, timeout, [this] {
+        return queue_.empty();
+    });
+}
+
+AsyncRecalculator::Progress AsyncRecalculator::GetProgress() const {
+    std::lock_guard lock(mutex_);
+    return { queue_.size(), computed_ };
+}
+
+void AsyncRecalculator::Run() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        work_.wait(lock, [this] {
+            return stop_ || (!queue_.empty() && waiting_foreground_ == 0);
+        });
+        if (stop_) {
+            return;
+        }
+        Position pos = queue_.front();
+        queue_.pop_front();
+        queued_.erase(pos);
+
+        // формула могла быть вычислена по запросу или удалена
+        auto* cell = static_cast<Cell*>(sheet_.GetCell(pos));
+        if (cell && cell->IsFormula() && !cell->IsCacheValid()) {
+            cell->GetValue();
+            ++computed_;
+        }
+        if (queue_.empty()) {
+            idle_.notify_all();
+        }
+    }
+}
+
+void AsyncRecalculator::Enqueue(Position pos) {
+    if (queued_.insert(pos).second) {
+        queue_.push_back(pos);
+    }
+}
+
+void AsyncRecalculator::EnqueueUncalculated() {
+    queue_.clear();
+    queued_.clear();
+    for (Position pos : sheet_.GetUncalculatedFormulas()) {
+        Enqueue(pos);
+    }
+    if (queue_.empty()) {
+        idle_.notify_all();
+    }
+}
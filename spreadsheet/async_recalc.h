@@ -0,0 +1,75 @@
+﻿#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+// Фоновый пересчёт листа. Изменения только сбрасывают кэши и сразу
+// возвращают управление, а формулы со сброшенным кэшем вычисляет фоновый
+// поток. Чтение не ждёт фоновой очереди: невычисленная ячейка вычисляется
+// вместе со своими зависимостями в вызывающем потоке, а фоновый поток
+// уступает ему лист после текущей формулы. Пока объект существует, лист
+// читается и меняется только через него.
+class AsyncRecalculator {
+public:
+    struct Progress {
+        size_t pending = 0;     // ячеек в очереди фонового пересчёта
+        uint64_t computed = 0;  // формул, вычисленных фоновым потоком
+    };
+
+    // Лист книги не поддерживается: фоновый поток читал бы другие листы без
+    // синхронизации. Для него бросается std::invalid_argument.
+    explicit AsyncRecalculator(Sheet& sheet);
+    ~AsyncRecalculator();
+
+    AsyncRecalculator(const AsyncRecalculator&) = delete;
+    AsyncRecalculator& operator=(const AsyncRecalculator&) = delete;
+
+    void SetCell(Position pos, std::string text);
+    void ClearCell(Position pos);
+    // значение ячейки, у пустой ячейки - пустая строка
+    CellInterface::Value GetValue(Position pos);
+    std::string GetText(Position pos);
+
+    // Чтение листа целиком, например печать
+    void Read(const std::function<void(const Sheet&)>& read);
+    // Прочие изменения: вставка и удаление строк, отмена, пакеты. Позиции
+    // в очереди после них могут устареть, поэтому очередь строится заново.
+    void Modify(const std::function<void(Sheet&)>& change);
+
+    // ждёт, пока фоновый поток вычислит все формулы
+    void Wait();
+    // false, если за timeout пересчёт не закончился
+    bool WaitFor(std::chrono::milliseconds timeout);
+    Progress GetProgress() const;
+
+private:
+    // захват листа вызывающим потоком с приоритетом перед фоновым
+    class ForegroundLock;
+
+    void Run();
+    // вызываются под mutex_
+    void Enqueue(Position pos);
+    void EnqueueUncalculated();
+
+    Sheet& sheet_;
+    mutable std::mutex mutex_;
+    std::condition_variable work_;  // очередь или приоритет изменились
+    std::condition_variable idle_;  // очередь опустела
+    std::atomic<int> waiting_foreground_ = 0;
+    bool stop_ = false;
+    std::deque<Position> queue_;
+    std::unordered_set<Position> queued_;
+    uint64_t computed_ = 0;
+    std::thread worker_;  // запускается после инициализации остальных полей
+};
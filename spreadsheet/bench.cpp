@@ -0,0 +1,1048 @@
+﻿#include "async_recalc.h"
+#include "bench_runner_p.h"
+#include "columnar_snapshot.h"
+#include "common.h"
+#include "concurrent_writer.h"
+#include "edit_log.h"
+#include "formula.h"
+#include "sheet.h"
+#include "snapshot.h"
+#include "workbook.h"
+
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+    // Размеры подобраны так, чтобы один повтор занимал миллисекунды
+    constexpr int SET_CELL_COUNT = 10000;
+    constexpr int SET_FORMULA_COUNT = 2000;
+    constexpr int PARSE_COUNT = 2000;
+    constexpr int CHAIN_LENGTH = Position::MAX_ROWS;
+    constexpr int FAN_OUT = 10000;
+    constexpr int FILL_DOWN_ROWS = 10000;
+    constexpr int VIEWPORT_ROWS = 100;
+    constexpr int VIEWPORT_COLS = 50;
+    constexpr int CATEGORICAL_ROWS = 16000;
+    constexpr int BRANCH_ROWS = 5000;
+    constexpr int BRANCH_DEPTH = 8;
+    constexpr int LOOKUP_ROWS = 2000;
+    constexpr int IMPORT_ROWS = 2000;
+    constexpr int WRITER_ROWS = 4096;
+    constexpr int LOGGED_EDITS = 1000;
+    constexpr int SNAPSHOT_ROWS = 5000;
+    constexpr int CLEAR_SIDE = 50;
+    constexpr int DENSE_SIDE = 100;
+    constexpr int SPARSE_CELLS = 200;
+    constexpr int SPARSE_SIDE = 2000;
+    constexpr int SNAPSHOT_SIDE = 320;
+    constexpr int WORKBOOK_SHEETS = 8;
+
+    Position Pos(int row, int col) {
+        return Position{ row, col };
+    }
+
+    void FillDenseSheet(Sheet& sheet, int side) {
+        for (int row = 0; row < side; ++row) {
+            for (int col = 0; col < side; ++col) {
+                if (col % 2 == 0) {
+                    sheet.SetCell(Pos(row, col), std::to_string(row * side + col));
+                }
+                else {
+                    sheet.SetCell(Pos(row, col), "=" + Pos(row, col - 1).ToString() + "*2");
+                }
+            }
+        }
+    }
+
+    std::unique_ptr<Sheet> MakeDenseSheet(int side) {
+        auto sheet = std::make_unique<Sheet>();
+        FillDenseSheet(*sheet, side);
+        return sheet;
+    }
+
+    // Независимые плотные листы S0..S7 и лист Total, который ссылается на
+    // первый столбец каждого из них
+    std::unique_ptr<Workbook> MakeWorkbook() {
+        auto book = std::make_unique<Workbook>();
+        Sheet& total = book->AddSheet("Total");
+        for (int i = 0; i < WORKBOOK_SHEETS; ++i) {
+            std::string name = "S" + std::to_string(i);
+            FillDenseSheet(book->AddSheet(name), DENSE_SIDE);
+            for (int row = 0; row < DENSE_SIDE; ++row) {
+                total.SetCell(Pos(row, i), "=" + name + "!" + Pos(row, 1).ToString() + "+1");
+            }
+        }
+        return book;
+    }
+
+    // Редко заполненный лист: ячейки разбросаны по большому прямоугольнику
+    std::unique_ptr<Sheet> MakeSparseSheet() {
+        auto sheet = std::make_unique<Sheet>();
+        unsigned seed = 12345;
+        for (int i = 0; i < SPARSE_CELLS; ++i) {
+            seed = seed * 1103515245 + 12345;
+            int row = (seed >> 8) % SPARSE_SIDE;
+            seed = seed * 1103515245 + 12345;
+            int col = (seed >> 8) % 100;
+            sheet->SetCell(Pos(row, col), std::to_string(i));
+        }
+        return sheet;
+    }
+
+    // Цепочка A1 = 1, A2 = A1 + 1, ..., первое чтение последней ячейки
+    // пересчитывает её целиком
+    std::unique_ptr<Sheet> MakeChainSheet(int length) {
+        auto sheet = std::make_unique<Sheet>();
+        sheet->SetCell(Pos(0, 0), "1");
+        for (int row = 1; row < length; ++row) {
+            sheet->SetCell(Pos(row, 0), "=" + Pos(row - 1, 0).ToString() + "+1");
+        }
+        return sheet;
+    }
+
+    // Одна ячейка A1, от которой зависят все ячейки столбца B
+    std::unique_ptr<Sheet> MakeFanOutSheet(int width) {
+        auto sheet = std::make_unique<Sheet>();
+        sheet->SetCell(Pos(0, 0), "1");
+        for (int row = 0; row < width; ++row) {
+            sheet->SetCell(Pos(row, 1), "=A1*" + std::to_string(row));
+        }
+        return sheet;
+    }
+
+    // Столбцы чисел A, B, C и заполненная вниз формула D = A * B + C
+    std::unique_ptr<Sheet> MakeFillDownSheet(int rows) {
+        auto sheet = std::make_unique<Sheet>();
+        for (int row = 0; row < rows; ++row) {
+            std::string r = std::to_string(row + 1);
+            sheet->SetCell(Pos(row, 0), std::to_string(row));
+            sheet->SetCell(Pos(row, 1), "1.5");
+            sheet->SetCell(Pos(row, 2), std::to_string(row % 7));
+            sheet->SetCell(Pos(row, 3), "=A" + r + "*B" + r + "+C" + r);
+        }
+        return sheet;
+    }
+
+    void BenchSetCell(BenchRunner& runner) {
+        auto empty_sheet = [] { return std::make_unique<Sheet>(); };
+
+        runner.Run("set_cell_text", SET_CELL_COUNT, empty_sheet, [](auto& sheet) {
+            for (int i = 0; i < SET_CELL_COUNT; ++i) {
+                sheet->SetCell(Pos(i / 100, i % 100), "label");
+            }
+        });
+        runner.Run("set_cell_number", SET_CELL_COUNT, empty_sheet, [](auto& sheet) {
+            for (int i = 0; i < SET_CELL_COUNT; ++i) {
+                sheet->SetCell(Pos(i / 100, i % 100), std::to_string(i));
+            }
+        });
+        runner.Run("set_cell_formula", SET_FORMULA_COUNT, empty_sheet, [](auto& sheet) {
+            for (int i = 0; i < SET_FORMULA_COUNT; ++i) {
+                sheet->SetCell(Pos(i / 100, i % 100 + 100), "=A1*2+B2/3-(C3+4)");
+            }
+        });
+    }
+
+    void BenchParse(BenchRunner& runner) {
+        auto texts = [] {
+            std::vector<std::string> result;
+            for (int i = 0; i < PARSE_COUNT; ++i) {
+                result.push_back("(A" + std::to_string(i % 1000 + 1) + "+" + std::to_string(i)
+                    + ")*B" + std::to_string(i % 700 + 1) + "/2.5-C1");
+            }
+            return result;
+        };
+        runner.Run("parse_formula", PARSE_COUNT, texts, [](auto& texts) {
+            for (auto& text : texts) {
+                auto formula = ParseFormula(text);
+                DoNotOptimize(formula);
+            }
+        });
+    }
+
+    void BenchRecalc(BenchRunner& runner) {
+        runner.Run("recalc_deep_chain", CHAIN_LENGTH, [] { return MakeChainSheet(CHAIN_LENGTH); },
+            [](auto& sheet) {
+                auto value = sheet->GetCell(Pos(CHAIN_LENGTH - 1, 0))->GetValue();
+                DoNotOptimize(value);
+            });
+        runner.Run("recalc_wide_fan_out", FAN_OUT, [] { return MakeFanOutSheet(FAN_OUT); },
+            [](auto& sheet) {
+                for (int row = 0; row < FAN_OUT; ++row) {
+                    auto value = sheet->GetCell(Pos(row, 1))->GetValue();
+                    DoNotOptimize(value);
+                }
+            });
+        // константные подвыражения сворачиваются при разборе формулы
+        runner.Run("recalc_constant_subexpressions", FAN_OUT, [] {
+                auto sheet = std::make_unique<Sheet>();
+                sheet->SetCell(Pos(0, 0), "1");
+                for (int row = 0; row < FAN_OUT; ++row) {
+                    sheet->SetCell(Pos(row, 1), "=(2+3)*1000*60*60*A1/4+(1-0.5)*" + std::to_string(row));
+                }
+                return sheet;
+            },
+            [](auto& sheet) {
+                for (int row = 0; row < FAN_OUT; ++row) {
+                    auto value = sheet->GetCell(Pos(row, 1))->GetValue();
+                    DoNotOptimize(value);
+                }
+            });
+        // Пересчёт столбца формул после правки всех входных значений, пакетом
+        // и по одной формуле. Первый пересчёт при создании листа компилирует
+        // программы формул, в замер он не входит.
+        for (bool batched : { true, false }) {
+            runner.Run(batched ? "recalc_fill_down_batched" : "recalc_fill_down_per_cell", FILL_DOWN_ROWS,
+                [batched] {
+                    auto sheet = MakeFillDownSheet(FILL_DOWN_ROWS);
+                    sheet->SetBatchEvaluation(batched);
+                    sheet->Recalculate();
+                    for (int row = 0; row < FILL_DOWN_ROWS; ++row) {
+                        sheet->SetCell(Pos(row, 0), std::to_string(row + 1));
+                    }
+                    return sheet;
+                },
+                [](auto& sheet) {
+                    sheet->Recalculate();
+                });
+        }
+    }
+
+    void BenchClearCell(BenchRunner& runner) {
+        runner.Run("clear_cell_range", CLEAR_SIDE * CLEAR_SIDE, [] { return MakeDenseSheet(CLEAR_SIDE); },
+            [](auto& sheet) {
+                for (int row = 0; row < CLEAR_SIDE; ++row) {
+                    for (int col = 0; col < CLEAR_SIDE; ++col) {
+                        sheet->ClearCell(Pos(row, col));
+                    }
+                }
+            });
+    }
+
+    void BenchPrint(BenchRunner& runner) {
+        runner.Run("printable_size_dense", 1, [] { return MakeDenseSheet(DENSE_SIDE); },
+            [](auto& sheet) {
+                auto size = sheet->GetPrintableSize();
+                DoNotOptimize(size);
+            });
+        runner.Run("printable_size_sparse", 1, MakeSparseSheet, [](auto& sheet) {
+            auto size = sheet->GetPrintableSize();
+            DoNotOptimize(size);
+        });
+        runner.Run("print_values_dense", DENSE_SIDE * DENSE_SIDE, [] { return MakeDenseSheet(DENSE_SIDE); },
+            [](auto& sheet) {
+                std::ostringstream out;
+                sheet->PrintValues(out);
+                DoNotOptimize(out);
+            });
+        runner.Run("print_values_sparse", SPARSE_CELLS, MakeSparseSheet, [](auto& sheet) {
+            std::ostringstream out;
+            sheet->PrintValues(out);
+            DoNotOptimize(out);
+        });
+    }
+
+    // Глубина отмены против памяти журнала: depth правок, затем отмена всех
+    void BenchUndo(BenchRunner& runner) {
+        for (int depth : { 1000, 10000, 100000 }) {
+            auto make_edited_sheet = [depth] {
+                auto sheet = std::make_unique<Sheet>();
+                sheet->SetUndoMemoryLimit(size_t{ 1 } << 30);
+                for (int i = 0; i < depth; ++i) {
+                    Position pos = Pos(i % 100, (i / 100) % 100);
+                    if (i % 4 == 3) {
+                        sheet->SetCell(pos, "=A1+" + std::to_string(i));
+                    }
+                    else {
+                        sheet->SetCell(pos, "value " + std::to_string(i));
+                    }
+                }
+                return sheet;
+            };
+
+            auto sample = make_edited_sheet();
+            const UndoJournal* journal = sample->GetUndoJournal();
+            auto& result = runner.Run("undo_depth_" + std::to_string(depth), depth, make_edited_sheet,
+                [depth](auto& sheet) {
+                    for (int i = 0; i < depth; ++i) {
+                        sheet->Undo();
+                    }
+                });
+            result.counters["journal_bytes"] = static_cast<double>(journal->GetMemoryUsage());
+            result.counters["bytes_per_edit"] = static_cast<double>(journal->GetMemoryUsage()) / depth;
+        }
+    }
+
+    // Стоимость снимка: полный первый снимок и снимки после edits изменений
+    void BenchSnapshot(BenchRunner& runner) {
+        runner.Run("snapshot_full", SNAPSHOT_SIDE * SNAPSHOT_SIDE, [] { return MakeDenseSheet(SNAPSHOT_SIDE); },
+            [](auto& sheet) {
+                auto snapshot = sheet->Snapshot();
+                DoNotOptimize(snapshot);
+            });
+
+        for (int edits : { 1, 100, 10000 }) {
+            struct State {
+                std::unique_ptr<Sheet> sheet;
+                std::shared_ptr<const SheetSnapshot> base;
+                std::shared_ptr<const SheetSnapshot> snapshot;
+            };
+            auto make_edited_sheet = [edits] {
+                State state{ MakeDenseSheet(SNAPSHOT_SIDE), nullptr, nullptr };
+                state.base = state.sheet->Snapshot();
+                // изменения разбросаны по таблице
+                for (int i = 0; i < edits; ++i) {
+                    int index = static_cast<int>((i * 7919LL) % (SNAPSHOT_SIDE * SNAPSHOT_SIDE));
+                    int col = index % SNAPSHOT_SIDE / 2 * 2;
+                    state.sheet->SetCell(Pos(index / SNAPSHOT_SIDE, col), std::to_string(i));
+                }
+                return state;
+            };
+
+            auto& result = runner.Run("snapshot_after_" + std::to_string(edits) + "_edits", edits, make_edited_sheet,
+                [](State& state) {
+                    state.snapshot = state.sheet->Snapshot();
+                });
+            if (!result.samples_ns.empty()) {
+                State sample = make_edited_sheet();
+                auto snapshot = sample.sheet->Snapshot();
+                result.counters["tiles"] = static_cast<double>(snapshot->GetTiles().size());
+                result.counters["shared_tiles"] = static_cast<double>(snapshot->CountSharedTiles(*sample.base));
+            }
+        }
+    }
+
+    // Вставка и удаление строк против пересоздания таблицы через SetCell
+    void BenchStructureEdit(BenchRunner& runner) {
+        constexpr int cells = DENSE_SIDE * DENSE_SIDE;
+        auto make_sheet = [] { return MakeDenseSheet(DENSE_SIDE); };
+        runner.Run("insert_rows_top", cells, make_sheet, [](auto& sheet) {
+            sheet->InsertRows(0);
+        });
+        runner.Run("insert_rows_middle", cells / 2, make_sheet, [](auto& sheet) {
+            sheet->InsertRows(DENSE_SIDE / 2);
+        });
+        runner.Run("delete_rows_top", cells, make_sheet, [](auto& sheet) {
+            sheet->DeleteRows(0);
+        });
+        runner.Run("insert_cols_left", cells, make_sheet, [](auto& sheet) {
+            sheet->InsertCols(0);
+        });
+        // то же, что insert_rows_top, но заново через SetCell с разбором формул
+        runner.Run("insert_rows_top_by_set_cell", cells, make_sheet, [](auto& sheet) {
+            auto shifted = std::make_unique<Sheet>();
+            for (int row = 0; row < DENSE_SIDE; ++row) {
+                for (int col = 0; col < DENSE_SIDE; ++col) {
+                    if (col % 2 == 0) {
+                        shifted->SetCell(Pos(row + 1, col), sheet->GetCell(Pos(row, col))->GetText());
+                    }
+                    else {
+                        shifted->SetCell(Pos(row + 1, col), "=" + Pos(row + 1, col - 1).ToString() + "*2");
+                    }
+                }
+            }
+            sheet = std::move(shifted);
+        });
+    }
+
+    void BenchWorkbook(BenchRunner& runner) {
+        constexpr int formulas = WORKBOOK_SHEETS * DENSE_SIDE * (DENSE_SIDE / 2 + 1);
+        for (size_t threads : { 1, 4 }) {
+            runner.Run("workbook_recalc_" + std::to_string(threads) + "_threads", formulas, MakeWorkbook,
+                [threads](auto& book) {
+                    book->Recalculate(threads);
+                });
+        }
+        // изменение сбрасывает кэши только своего листа и листа Total
+        runner.Run("workbook_edit_and_recalc", DENSE_SIDE, [] {
+                auto book = MakeWorkbook();
+                book->Recalculate();
+                return book;
+            },
+            [](auto& book) {
+                Sheet* sheet = book->GetSheet("S0");
+                for (int row = 0; row < DENSE_SIDE; ++row) {
+                    sheet->SetCell(Pos(row, 0), std::to_string(row));
+                    book->GetSheet("Total")->GetCell(Pos(row, 0))->GetValue();
+                }
+            });
+    }
+
+    // Лист в 10 экранов высотой: длинный текст, числа и формулы по столбцам,
+    // все значения уже вычислены
+    std::unique_ptr<Sheet> MakeViewportSheet() {
+        auto sheet = std::make_unique<Sheet>();
+        for (int row = 0; row < VIEWPORT_ROWS * 10; ++row) {
+            for (int col = 0; col < VIEWPORT_COLS; ++col) {
+                switch (col % 3) {
+                case 0:
+                    sheet->SetCell(Pos(row, col), "Item description number " + std::to_string(row));
+                    break;
+                case 1:
+                    sheet->SetCell(Pos(row, col), std::to_string(row * col));
+                    break;
+                default:
+                    sheet->SetCell(Pos(row, col), "=" + Pos(row, col - 1).ToString() + "*2");
+                }
+            }
+        }
+        sheet->Recalculate();
+        return sheet;
+    }
+
+    // Чтение видимого окна VIEWPORT_ROWS x VIEWPORT_COLS несколько раз
+    // подряд, как при перерисовке экрана
+    void BenchViewport(BenchRunner& runner) {
+        constexpr int frames = 10;
+        constexpr int cells = VIEWPORT_ROWS * VIEWPORT_COLS;
+        const CellRange window{ Pos(VIEWPORT_ROWS, 0), Pos(2 * VIEWPORT_ROWS - 1, VIEWPORT_COLS - 1) };
+        runner.Run("viewport_get_cell", cells * frames, MakeViewportSheet, [&window](auto& sheet) {
+            for (int frame = 0; frame < frames; ++frame) {
+                for (int row = window.first.row; row <= window.last.row; ++row) {
+                    for (int col = window.first.col; col <= window.last.col; ++col) {
+                        if (const CellInterface* cell = sheet->GetCell(Pos(row, col))) {
+                            auto value = cell->GetValue();
+                            DoNotOptimize(value);
+                        }
+                    }
+                }
+            }
+        });
+        // буфер переиспользуется между кадрами
+        runner.Run("viewport_read_range", cells * frames, MakeViewportSheet, [&window](auto& sheet) {
+            RangeValues buffer;
+            for (int frame = 0; frame < frames; ++frame) {
+                sheet->ReadRange(window, buffer);
+                DoNotOptimize(buffer);
+            }
+        });
+    }
+
+    // Текст длиннее буфера короткой строки: GetValue копирует его в кучу
+    std::unique_ptr<Sheet> MakeLongTextSheet() {
+        auto sheet = std::make_unique<Sheet>();
+        for (int row = 0; row < DENSE_SIDE; ++row) {
+            for (int col = 0; col < DENSE_SIDE; ++col) {
+                sheet->SetCell(Pos(row, col), "'text of cell " + Pos(row, col).ToString() + " long enough to allocate");
+            }
+        }
+        return sheet;
+    }
+
+    void BenchValueView(BenchRunner& runner) {
+        constexpr int cells = DENSE_SIDE * DENSE_SIDE;
+        runner.Run("read_text_get_value", cells, MakeLongTextSheet, [](auto& sheet) {
+            for (int row = 0; row < DENSE_SIDE; ++row) {
+                for (int col = 0; col < DENSE_SIDE; ++col) {
+                    auto value = sheet->GetCell(Pos(row, col))->GetValue();
+                    DoNotOptimize(value);
+                }
+            }
+        });
+        runner.Run("read_text_get_value_view", cells, MakeLongTextSheet, [](auto& sheet) {
+            for (int row = 0; row < DENSE_SIDE; ++row) {
+                for (int col = 0; col < DENSE_SIDE; ++col) {
+                    auto value = sheet->GetCell(Pos(row, col))->GetValueView();
+                    DoNotOptimize(value);
+                }
+            }
+        });
+        runner.Run("print_values_long_text", cells, MakeLongTextSheet, [](auto& sheet) {
+            std::ostringstream out;
+            sheet->PrintValues(out);
+            DoNotOptimize(out);
+        });
+    }
+
+    // Пересчёт столбца формул без лимита памяти под формулы и с лимитом в
+    // четверть их объёма: вытесненные формулы компилируются заново
+    void BenchFormulaMemoryLimit(BenchRunner& runner) {
+        size_t full = MakeFillDownSheet(FILL_DOWN_ROWS)->GetCompiledFormulaBytes();
+        for (auto [name, limit] : { std::pair{ "none", std::numeric_limits<size_t>::max() },
+                 std::pair{ "quarter", full / 4 } }) {
+            auto make_sheet = [limit = limit] {
+                auto sheet = MakeFillDownSheet(FILL_DOWN_ROWS);
+                sheet->SetFormulaMemoryLimit(limit);
+                sheet->Recalculate();
+                for (int row = 0; row < FILL_DOWN_ROWS; ++row) {
+                    sheet->SetCell(Pos(row, 0), std::to_string(row + 1));
+                }
+                return sheet;
+            };
+            auto& result = runner.Run(std::string("recalc_formula_limit_") + name, FILL_DOWN_ROWS, make_sheet,
+                [](auto& sheet) {
+                    sheet->Recalculate();
+                });
+            auto sample = make_sheet();
+            sample->Recalculate();
+            SheetMemoryUsage usage = sample->GetMemoryUsage();
+            result.counters["formula_bytes"] = static_cast<double>(usage.formulas);
+            result.counters["total_bytes"] = static_cast<double>(usage.GetTotal());
+        }
+
+        // правки при лимите, когда все AST держит снимок и вытеснять нечего
+        runner.Run("edit_formula_limit_pinned", FILL_DOWN_ROWS,
+            [full] {
+                auto sheet = MakeFillDownSheet(FILL_DOWN_ROWS);
+                sheet->Snapshot();
+                sheet->SetFormulaMemoryLimit(full / 4);
+                return sheet;
+            },
+            [](auto& sheet) {
+                for (int row = 0; row < FILL_DOWN_ROWS; ++row) {
+                    sheet->SetCell(Pos(row, 0), std::to_string(row + 2));
+                }
+            });
+    }
+
+    // Таблица заказов с повторяющимися значениями: регион, товар, статус и
+    // валюта, как в выгрузке из учётной системы
+    void FillCategoricalSheet(Sheet& sheet) {
+        static const char* const regions[] = { "North America", "South America", "Western Europe",
+            "Eastern Europe", "Middle East and North Africa", "Sub-Saharan Africa", "South Asia",
+            "East Asia and Pacific", "Central Asia", "Oceania", "Caribbean", "Nordic countries" };
+        static const char* const statuses[] = { "Active", "Inactive", "Pending" };
+        static const char* const currencies[] = { "USD", "EUR", "GBP", "JPY", "CNY" };
+        unsigned seed = 12345;
+        for (int row = 0; row < CATEGORICAL_ROWS; ++row) {
+            seed = seed * 1103515245 + 12345;
+            sheet.SetCell(Pos(row, 0), regions[(seed >> 8) % 12]);
+            sheet.SetCell(Pos(row, 1), "Product line " + std::to_string((seed >> 12) % 300) + " - office supplies");
+            sheet.SetCell(Pos(row, 2), statuses[(seed >> 16) % 3]);
+            sheet.SetCell(Pos(row, 3), currencies[(seed >> 20) % 5]);
+        }
+    }
+
+    // Память под тексты с пулом и оценка для строки в каждой ячейке
+    void BenchStringPool(BenchRunner& runner) {
+        constexpr int cells = CATEGORICAL_ROWS * 4;
+        auto& result = runner.Run("set_cell_categorical", cells, [] { return std::make_unique<Sheet>(); },
+            [](auto& sheet) {
+                FillCategoricalSheet(*sheet);
+            });
+
+        Sheet sample;
+        FillCategoricalSheet(sample);
+        const StringPool& pool = sample.GetStringPool();
+        size_t unpooled_bytes = 0;
+        for (int row = 0; row < CATEGORICAL_ROWS; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                size_t length = sample.GetCell(Pos(row, col))->GetText().size();
+                unpooled_bytes += sizeof(std::string) + (length > std::string().capacity() ? length + 1 : 0);
+            }
+        }
+        size_t pooled_bytes = pool.GetAllocatedBytes() + cells * sizeof(StringPool::Handle);
+        result.counters["distinct_texts"] = static_cast<double>(pool.GetSize());
+        result.counters["pooled_text_bytes"] = static_cast<double>(pooled_bytes);
+        result.counters["unpooled_text_bytes"] = static_cast<double>(unpooled_bytes);
+    }
+
+    // Как узнать, что изменилось после правки: подпиской на изменения или
+    // печатью всех значений с последующим сравнением текста
+    void BenchChangeNotifications(BenchRunner& runner) {
+        auto make_sheet = [] {
+            auto sheet = MakeDenseSheet(DENSE_SIDE);
+            std::ostringstream out;
+            sheet->PrintValues(out);
+            return sheet;
+        };
+        runner.Run("edit_notify_subscription", DENSE_SIDE, make_sheet, [](auto& sheet) {
+            size_t changed = 0;
+            auto id = sheet->Subscribe({ Pos(0, 0), Pos(DENSE_SIDE - 1, DENSE_SIDE - 1) },
+                [&changed](const Sheet::Changes& changes) {
+                    changed += changes.cells.size();
+                });
+            for (int row = 0; row < DENSE_SIDE; ++row) {
+                sheet->SetCell(Pos(row, 0), "-1");
+            }
+            sheet->Unsubscribe(id);
+            DoNotOptimize(changed);
+        });
+        runner.Run("edit_notify_print_diff", DENSE_SIDE, make_sheet, [](auto& sheet) {
+            std::ostringstream before;
+            sheet->PrintValues(before);
+            size_t changed = 0;
+            for (int row = 0; row < DENSE_SIDE; ++row) {
+                sheet->SetCell(Pos(row, 0), "-1");
+                std::ostringstream after;
+                sheet->PrintValues(after);
+                changed += after.str() != before.str();
+                before = std::move(after);
+            }
+            DoNotOptimize(changed);
+        });
+    }
+
+    // Лист с фоновым пересчётом; пересчётчик разрушается раньше листа
+    struct AsyncSheet {
+        std::unique_ptr<Sheet> sheet;
+        std::unique_ptr<AsyncRecalculator> recalc;
+    };
+
+    // Задержка правки A1, от которой зависят width формул, до получения
+    // значения видимой ячейки B1: синхронно все формулы пересчитываются до
+    // ответа, асинхронно - только B1, остальные досчитываются в фоне
+    void BenchAsyncRecalc(BenchRunner& runner) {
+        for (int width : { FAN_OUT / 10, FAN_OUT }) {
+            runner.Run("edit_latency_sync_" + std::to_string(width), 1, [width] {
+                    auto sheet = MakeFanOutSheet(width);
+                    sheet->Recalculate();
+                    return sheet;
+                },
+                [](auto& sheet) {
+                    sheet->SetCell(Pos(0, 0), "2");
+                    sheet->Recalculate();
+                    auto value = sheet->GetCell(Pos(0, 1))->GetValue();
+                    DoNotOptimize(value);
+                });
+            runner.Run("edit_latency_async_" + std::to_string(width), 1, [width] {
+                    AsyncSheet state{ MakeFanOutSheet(width), nullptr };
+                    state.recalc = std::make_unique<AsyncRecalculator>(*state.sheet);
+                    state.recalc->Wait();
+                    return state;
+                },
+                [](auto& state) {
+                    state.recalc->SetCell(Pos(0, 0), "2");
+                    auto value = state.recalc->GetValue(Pos(0, 1));
+                    DoNotOptimize(value);
+                });
+        }
+    }
+
+    // Модель с ветвлением: в каждой строке дешёвая ветвь (столбец C) и
+    // дорогая цепочка из BRANCH_DEPTH формул, итог выбирается признаком из
+    // столбца B, и лишь каждая десятая строка берёт дорогую ветвь. Выбор
+    // записан либо через IF, либо арифметикой, вычисляющей обе ветви.
+    std::unique_ptr<Sheet> MakeBranchSheet(bool use_if) {
+        auto sheet = std::make_unique<Sheet>();
+        for (int row = 0; row < BRANCH_ROWS; ++row) {
+            std::string suffix = std::to_string(row + 1);
+            sheet->SetCell(Pos(row, 0), std::to_string(row % 97));
+            sheet->SetCell(Pos(row, 1), row % 10 == 0 ? "1" : "0");
+            sheet->SetCell(Pos(row, 2), "=A" + suffix + "*2");
+            std::string prev = "A" + suffix;
+            for (int col = 3; col < 3 + BRANCH_DEPTH; ++col) {
+                sheet->SetCell(Pos(row, col), "=" + prev + "*" + prev + "/(" + prev + "+1)+1");
+                prev = Pos(row, col).ToString();
+            }
+            std::string cheap = "C" + suffix;
+            std::string flag = "B" + suffix;
+            sheet->SetCell(Pos(row, 3 + BRANCH_DEPTH), use_if
+                ? "=IF(" + flag + ">0," + prev + "," + cheap + ")"
+                : "=" + flag + "*" + prev + "+(1-" + flag + ")*" + cheap);
+        }
+        return sheet;
+    }
+
+    void BenchBranchSelection(BenchRunner& runner) {
+        auto read_results = [](Sheet& sheet) {
+            double sum = 0;
+            for (int row = 0; row < BRANCH_ROWS; ++row) {
+                sum += std::get<double>(sheet.GetCell(Pos(row, 3 + BRANCH_DEPTH))->GetValue());
+            }
+            DoNotOptimize(sum);
+        };
+        for (auto [name, use_if] : { std::pair{ "if", true }, std::pair{ "arithmetic", false } }) {
+            auto& result = runner.Run(std::string("read_branch_") + name, BRANCH_ROWS,
+                [use_if = use_if] { return MakeBranchSheet(use_if); },
+                [&read_results](auto& sheet) {
+                    read_results(*sheet);
+                });
+            auto sample = MakeBranchSheet(use_if);
+            sample->EnableStats(true);
+            read_results(*sample);
+            result.counters["evaluations"] = static_cast<double>(sample->GetStats().evaluations);
+        }
+    }
+
+    // таблица поиска A1:B{LOOKUP_ROWS} с ключами вразброс и столько же формул
+    // VLOOKUP по ней, каждая ищет ключ из своей строки столбца C
+    std::unique_ptr<Sheet> MakeLookupSheet() {
+        auto sheet = std::make_unique<Sheet>();
+        const std::string table = "A1:B" + std::to_string(LOOKUP_ROWS);
+        for (int row = 0; row < LOOKUP_ROWS; ++row) {
+            sheet->SetCell(Pos(row, 0), std::to_string((row * 7919LL) % LOOKUP_ROWS));
+            sheet->SetCell(Pos(row, 1), std::to_string(row));
+            sheet->SetCell(Pos(row, 2), std::to_string((row * 31LL) % LOOKUP_ROWS));
+            sheet->SetCell(Pos(row, 3), "=VLOOKUP(C" + std::to_string(row + 1) + "," + table + ",2,0)");
+        }
+        return sheet;
+    }
+
+    void BenchLookup(BenchRunner& runner) {
+        auto read_results = [](const SheetInterface& sheet) {
+            double sum = 0;
+            for (int row = 0; row < LOOKUP_ROWS; ++row) {
+                sum += std::get<double>(sheet.GetCell(Pos(row, 3))->GetValue());
+            }
+            DoNotOptimize(sum);
+        };
+
+        // лист ищет по индексу столбца: построение O(M log M), поиск O(log M)
+        auto& indexed = runner.Run("lookup_indexed", LOOKUP_ROWS, MakeLookupSheet,
+            [&read_results](auto& sheet) {
+                read_results(*sheet);
+            });
+        if (!indexed.samples_ns.empty()) {
+            auto sample = MakeLookupSheet();
+            read_results(*sample);
+            indexed.counters["index_bytes"] = static_cast<double>(sample->GetMemoryUsage().lookup_indexes);
+        }
+
+        // читатель снимка просматривает столбец целиком: O(M) на поиск
+        runner.Run("lookup_scan", LOOKUP_ROWS, [] { return MakeLookupSheet()->Snapshot(); },
+            [&read_results](auto& snapshot) {
+                SnapshotReader reader(snapshot);
+                read_results(reader);
+            });
+
+        // после записи ключа (того же самого, чтобы все формулы нашли свои
+        // значения) индекс переиндексирует одну строку, а все формулы поиска
+        // вычисляются заново
+        runner.Run("lookup_after_key_change", LOOKUP_ROWS,
+            [&read_results] {
+                auto sheet = MakeLookupSheet();
+                read_results(*sheet);
+                return sheet;
+            },
+            [&read_results](auto& sheet) {
+                sheet->SetCell(Pos(LOOKUP_ROWS / 2, 0), sheet->GetCell(Pos(LOOKUP_ROWS / 2, 0))->GetText());
+                read_results(*sheet);
+            });
+
+        // у каждой формулы своё окно из пяти строк столбца A: запись ключа
+        // сбрасывает формулы только тех окон, в которые он попал
+        runner.Run("lookup_window_edits", LOOKUP_ROWS,
+            [] {
+                auto sheet = std::make_unique<Sheet>();
+                for (int row = 0; row < LOOKUP_ROWS; ++row) {
+                    const std::string r = std::to_string(row + 1);
+                    sheet->SetCell(Pos(row, 0), std::to_string(row));
+                    sheet->SetCell(Pos(row, 1), "=MATCH(" + r + ",A" + r + ":A" + std::to_string(row + 5) + ",0)");
+                }
+                sheet->Recalculate();
+                return sheet;
+            },
+            [](auto& sheet) {
+                for (int row = 0; row < LOOKUP_ROWS; ++row) {
+                    sheet->SetCell(Pos(row, 0), std::to_string(row + 1));
+                }
+            });
+    }
+
+    std::vector<std::string> MakeImportTexts() {
+        std::vector<std::string> texts;
+        for (int row = 0; row < IMPORT_ROWS; ++row) {
+            std::string r = std::to_string(row + 1);
+            texts.push_back("=(A" + r + "*1.2+B" + r + ")/(1+C" + r + ")-D1");
+        }
+        return texts;
+    }
+
+    // Повторный импорт тех же формул и правка, отклонённая из-за цикла: с
+    // кэшем разобранных формул тексты не проходят разбор заново, в том числе
+    // прежняя формула, которую лист восстанавливает после ошибки
+    void BenchFormulaCache(BenchRunner& runner) {
+        const std::vector<std::string> texts = MakeImportTexts();
+        for (auto [name, capacity] : { std::pair{ "cached", FormulaCache::DEFAULT_CAPACITY }, std::pair{ "uncached", size_t{ 0 } } }) {
+            auto make_sheet = [&texts, capacity = capacity] {
+                auto sheet = std::make_unique<Sheet>();
+                sheet->SetFormulaCacheCapacity(capacity);
+                for (int row = 0; row < IMPORT_ROWS; ++row) {
+                    sheet->SetCell(Pos(row, 4), texts[row]);
+                }
+                return sheet;
+            };
+            auto& reimport = runner.Run(std::string("reimport_formulas_") + name, IMPORT_ROWS, make_sheet,
+                [&texts](auto& sheet) {
+                    for (int row = 0; row < IMPORT_ROWS; ++row) {
+                        sheet->SetCell(Pos(row, 4), texts[row]);
+                    }
+                });
+            if (!reimport.samples_ns.empty()) {
+                auto sample = make_sheet();
+                for (int row = 0; row < IMPORT_ROWS; ++row) {
+                    sample->SetCell(Pos(row, 4), texts[row]);
+                }
+                const FormulaCache::Stats& stats = sample->GetFormulaCache().GetStats();
+                reimport.counters["hit_rate"] = static_cast<double>(stats.hits) / (stats.hits + stats.misses);
+                reimport.counters["cache_bytes"] = static_cast<double>(sample->GetMemoryUsage().formula_cache);
+            }
+
+            runner.Run(std::string("rejected_edit_") + name, IMPORT_ROWS, make_sheet,
+                [](auto& sheet) {
+                    for (int row = 0; row < IMPORT_ROWS; ++row) {
+                        try {
+                            sheet->SetCell(Pos(row, 4), "=E" + std::to_string(row + 1) + "+1");
+                        }
+                        catch (const CircularDependencyException&) {
+                        }
+                    }
+                });
+        }
+    }
+
+    // Каждый поток пишет числа и формулы с разным текстом в свои строки:
+    // через ConcurrentSheetWriter, который разбирает формулы вне блокировки
+    // и применяет очередь изменений одним захватом листа, и через общий
+    // mutex вокруг Sheet::SetCell
+    void BenchConcurrentWriters(BenchRunner& runner) {
+        struct Writers {
+            Sheet sheet;
+            ConcurrentSheetWriter writer{ sheet };
+            std::mutex mutex;
+        };
+        for (int threads : { 1, 2, 4, 8 }) {
+            const int rows = WRITER_ROWS / threads;
+            auto write = [threads, rows](Writers& writers, bool queued) {
+                std::vector<std::thread> workers;
+                for (int i = 0; i < threads; ++i) {
+                    workers.emplace_back([&writers, queued, first = i * rows, rows] {
+                        for (int row = first; row < first + rows; ++row) {
+                            std::string number = std::to_string(row);
+                            std::string formula = "=A" + std::to_string(row + 1) + "*2+" + number;
+                            if (queued) {
+                                writers.writer.SetCell(Pos(row, 0), std::move(number));
+                                writers.writer.SetCell(Pos(row, 1), std::move(formula));
+                            }
+                            else {
+                                std::lock_guard lock(writers.mutex);
+                                writers.sheet.SetCell(Pos(row, 0), std::move(number));
+                                writers.sheet.SetCell(Pos(row, 1), std::move(formula));
+                            }
+                        }
+                    });
+                }
+                for (auto& worker : workers) {
+                    worker.join();
+                }
+            };
+            auto make_writers = [] {
+                return std::make_unique<Writers>();
+            };
+            const std::string suffix = "_" + std::to_string(threads) + "_threads";
+            auto& queued = runner.Run("concurrent_writers" + suffix, 2 * rows * threads, make_writers,
+                [&write](auto& writers) {
+                    write(*writers, true);
+                });
+            if (!queued.samples_ns.empty()) {
+                auto sample = make_writers();
+                write(*sample, true);
+                ConcurrentSheetWriter::Stats stats = sample->writer.GetStats();
+                queued.counters["edits_per_round"] = static_cast<double>(stats.edits) / stats.rounds;
+            }
+            runner.Run("global_mutex_writers" + suffix, 2 * rows * threads, make_writers,
+                [&write](auto& writers) {
+                    write(*writers, false);
+                });
+        }
+    }
+
+    // Изменения в секунду с журналом при каждой политике синхронизации:
+    // один писатель вызывает Commit после каждого изменения, а четыре
+    // писателя через ConcurrentSheetWriter показывают общий fsync политики
+    // Group. Файл журнала создаётся во временном каталоге (TMPDIR).
+    void BenchEditLog(BenchRunner& runner) {
+        using Policy = EditLog::SyncPolicy;
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_bench_edit.log").string();
+        struct Logged {
+            Sheet sheet;
+            std::shared_ptr<EditLog> log;
+        };
+        auto make_logged = [&path](Policy policy) {
+            return [&path, policy] {
+                std::filesystem::remove(path);
+                auto logged = std::make_unique<Logged>();
+                logged->log = std::make_shared<EditLog>(path, EditLog::Options{ policy, std::chrono::milliseconds(10) });
+                logged->sheet.SetEditLog(logged->log);
+                return logged;
+            };
+        };
+        const std::pair<const char*, Policy> policies[] = {
+            { "always", Policy::Always },
+            { "group", Policy::Group },
+            { "interval", Policy::Interval },
+            { "none", Policy::None },
+        };
+        auto write_one = [](Logged& logged) {
+            for (int row = 0; row < LOGGED_EDITS; ++row) {
+                logged.sheet.SetCell(Pos(row, 0), std::to_string(row));
+                logged.log->Commit();
+            }
+        };
+        for (auto [name, policy] : policies) {
+            auto& result = runner.Run(std::string("edit_log_") + name, LOGGED_EDITS, make_logged(policy),
+                [&write_one](auto& logged) {
+                    write_one(*logged);
+                });
+            if (!result.samples_ns.empty()) {
+                auto sample = make_logged(policy)();
+                write_one(*sample);
+                result.counters["syncs_per_edit"] = static_cast<double>(sample->log->GetStats().syncs) / LOGGED_EDITS;
+            }
+        }
+
+        constexpr int WRITERS = 4;
+        for (auto [name, policy] : { policies[0], policies[1] }) {
+            auto write = [](Logged& logged) {
+                ConcurrentSheetWriter writer(logged.sheet);
+                std::vector<std::thread> threads;
+                for (int i = 0; i < WRITERS; ++i) {
+                    threads.emplace_back([&writer, i] {
+                        for (int row = i; row < LOGGED_EDITS; row += WRITERS) {
+                            writer.SetCell(Pos(row, 0), std::to_string(row));
+                        }
+                    });
+                }
+                for (auto& thread : threads) {
+                    thread.join();
+                }
+            };
+            auto& result = runner.Run(std::string("edit_log_") + name + "_4_writers", LOGGED_EDITS, make_logged(policy),
+                [&write](auto& logged) {
+                    write(*logged);
+                });
+            if (!result.samples_ns.empty()) {
+                auto sample = make_logged(policy)();
+                write(*sample);
+                result.counters["syncs_per_edit"] = static_cast<double>(sample->log->GetStats().syncs) / LOGGED_EDITS;
+            }
+        }
+        std::filesystem::remove(path);
+    }
+
+    // Таблица продаж: номер, цена с копейками, категория, количество,
+    // сумма строки и нарастающий итог, заполненные вниз
+    void BenchColumnarSnapshot(BenchRunner& runner) {
+        static const char* const categories[] = { "groceries", "electronics", "clothing", "books", "garden" };
+        Sheet sheet;
+        for (int row = 0; row < SNAPSHOT_ROWS; ++row) {
+            const std::string name = std::to_string(row + 1);
+            char price[32];
+            auto result = std::to_chars(price, price + sizeof(price), (row * 7919 % 100000) / 100.0);
+            sheet.SetCell(Pos(row, 0), std::to_string(100000 + row));
+            sheet.SetCell(Pos(row, 1), std::string(price, result.ptr));
+            sheet.SetCell(Pos(row, 2), categories[row * 31 % 5]);
+            sheet.SetCell(Pos(row, 3), std::to_string(1 + row * 13 % 20));
+            sheet.SetCell(Pos(row, 4), "=B" + name + "*D" + name);
+            sheet.SetCell(Pos(row, 5), row == 0 ? "=E1" : "=F" + std::to_string(row) + "+E" + name);
+        }
+        auto snapshot = sheet.Snapshot();
+        const std::string data = EncodeColumnarSnapshot(*snapshot);
+        const int64_t cells = SNAPSHOT_ROWS * 6;
+
+        // размер прежней контрольной точки: позиция и str32 на ячейку
+        size_t plain_size = 0;
+        for (const auto& [key, tile] : snapshot->GetTiles()) {
+            const Position origin{ static_cast<int>(key / SheetSnapshot::TILES_PER_ROW) * SheetSnapshot::TILE_SIZE,
+                static_cast<int>(key % SheetSnapshot::TILES_PER_ROW) * SheetSnapshot::TILE_SIZE };
+            for (int row = 0; row < SheetSnapshot::TILE_SIZE; ++row) {
+                for (int col = 0; col < SheetSnapshot::TILE_SIZE; ++col) {
+                    if (const SheetSnapshot::Entry* entry = tile->Find({ origin.row + row, origin.col + col })) {
+                        plain_size += 2 * sizeof(uint16_t) + sizeof(uint32_t) + entry->text.size();
+                    }
+                }
+            }
+        }
+
+        auto& encode = runner.Run("columnar_encode", cells,
+            [] {
+                return 0;
+            },
+            [&snapshot](int) {
+                auto data = EncodeColumnarSnapshot(*snapshot);
+                DoNotOptimize(data);
+            });
+        if (!encode.samples_ns.empty()) {
+            encode.counters["compression_ratio"] = static_cast<double>(plain_size) / data.size();
+            encode.counters["bytes_per_cell"] = static_cast<double>(data.size()) / cells;
+        }
+        for (unsigned threads : { 1u, 4u }) {
+            runner.Run("columnar_decode_" + std::to_string(threads) + "_threads", cells,
+                [] {
+                    return 0;
+                },
+                [&data, threads](int) {
+                    auto columns = ColumnarSnapshot(data).DecodeAll(threads);
+                    DoNotOptimize(columns);
+                });
+        }
+        runner.Run("columnar_load", cells,
+            [] {
+                return std::make_unique<Sheet>();
+            },
+            [&data](auto& restored) {
+                ColumnarSnapshot(data).Load(*restored);
+            });
+    }
+
+}  // namespace
+
+// Использование: spreadsheet_bench [--warmup N] [--repetitions N] [--filter NAME] [--out FILE]
+int main(int argc, char* argv[]) {
+    int warmup = 2;
+    int repetitions = 10;
+    std::string filter;
+    std::string out_path;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string_view arg = argv[i];
+        if (arg == "--warmup") {
+            warmup = std::atoi(argv[i + 1]);
+        }
+        else if (arg == "--repetitions") {
+            repetitions = std::atoi(argv[i + 1]);
+        }
+        else if (arg == "--filter") {
+            filter = argv[i + 1];
+        }
+        else if (arg == "--out") {
+            out_path = argv[i + 1];
+        }
+        else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    BenchRunner runner(warmup, repetitions, filter);
+    BenchSetCell(runner);
+    BenchParse(runner);
+    BenchRecalc(runner);
+    BenchClearCell(runner);
+    BenchPrint(runner);
+    BenchUndo(runner);
+    BenchSnapshot(runner);
+    BenchStructureEdit(runner);
+    BenchWorkbook(runner);
+    BenchAsyncRecalc(runner);
+    BenchChangeNotifications(runner);
+    BenchViewport(runner);
+    BenchValueView(runner);
+    BenchStringPool(runner);
+    BenchFormulaMemoryLimit(runner);
+    BenchBranchSelection(runner);
+    BenchLookup(runner);
+    BenchFormulaCache(runner);
+    BenchConcurrentWriters(runner);
+    BenchEditLog(runner);
+    BenchColumnarSnapshot(runner);
+
+    if (out_path.empty()) {
+        runner.PrintJson(std::cout);
+    }
+    else {
+        std::ofstream out(out_path);
+        runner.PrintJson(out);
+    }
+}
@@ -0,0 +1,136 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Результат одного бенчмарка: времена всех замеренных повторов и
+// дополнительные счётчики (память, коэффициенты и т.п.)
+struct BenchResult {
+    std::string name;
+    std::int64_t items = 0;                 // операций за один повтор
+    std::vector<std::int64_t> samples_ns;   // время каждого повтора
+    std::map<std::string, double> counters;
+
+    std::int64_t Percentile(double p) const {
+        if (samples_ns.empty()) {
+            return 0;
+        }
+        std::vector<std::int64_t> sorted = samples_ns;
+        std::sort(sorted.begin(), sorted.end());
+        // nearest-rank
+        size_t rank = static_cast<size_t>(p / 100.0 * sorted.size() + 0.999999);
+        rank = std::clamp<size_t>(rank, 1, sorted.size());
+        return sorted[rank - 1];
+    }
+
+    double Mean() const {
+        if (samples_ns.empty()) {
+            return 0;
+        }
+        double sum = 0;
+        for (auto sample : samples_ns) {
+            sum += static_cast<double>(sample);
+        }
+        return sum / samples_ns.size();
+    }
+};
+
+// Прогоняет бенчмарки с прогревом и повторами и печатает результаты в JSON.
+// Каждый повтор состоит из неизмеряемой подготовки setup() и измеряемого
+// тела body(state), поэтому тело всегда работает на свежем состоянии.
+class BenchRunner {
+public:
+    BenchRunner(int warmup, int repetitions, std::string filter = {})
+        : warmup_(warmup)
+        , repetitions_(repetitions)
+        , filter_(std::move(filter)) {
+    }
+
+    template <class Setup, class Body>
+    BenchResult& Run(std::string name, std::int64_t items, Setup setup, Body body) {
+        if (!filter_.empty() && name.find(filter_) == std::string::npos) {
+            return skipped_;
+        }
+        results_.push_back({ std::move(name), items, {}, {} });
+        BenchResult& result = results_.back();
+
+        for (int i = 0; i < warmup_ + repetitions_; ++i) {
+            auto state = setup();
+            auto start = std::chrono::steady_clock::now();
+            body(state);
+            auto finish = std::chrono::steady_clock::now();
+            if (i >= warmup_) {
+                result.samples_ns.push_back(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count());
+            }
+        }
+        std::cerr << result.name << " p50 " << result.Percentile(50) / 1000 << " us" << std::endl;
+        return result;
+    }
+
+    void PrintJson(std::ostream& out) const {
+        out << "{\n";
+        out << "  \"warmup\": " << warmup_ << ",\n";
+        out << "  \"repetitions\": " << repetitions_ << ",\n";
+        out << "  \"benchmarks\": [";
+        bool first = true;
+        for (const auto& result : results_) {
+            out << (first ? "\n" : ",\n");
+            first = false;
+            double mean = result.Mean();
+            out << "    {\"name\": \"" << result.name << "\""
+                << ", \"items\": " << result.items
+                << ", \"mean_ns\": " << std::fixed << std::setprecision(0) << mean
+                << ", \"min_ns\": " << result.Percentile(0)
+                << ", \"p50_ns\": " << result.Percentile(50)
+                << ", \"p90_ns\": " << result.Percentile(90)
+                << ", \"p99_ns\": " << result.Percentile(99)
+                << ", \"max_ns\": " << result.Percentile(100)
+                << ", \"items_per_sec\": " << (mean > 0 ? result.items * 1e9 / mean : 0.0);
+            out << std::defaultfloat << std::setprecision(6);
+            if (!result.counters.empty()) {
+                out << ", \"counters\": {";
+                bool first_counter = true;
+                for (const auto& [key, value] : result.counters) {
+                    out << (first_counter ? "" : ", ") << "\"" << key << "\": ";
+                    // в JSON нет бесконечности и NaN, например у отношения к нулю
+                    if (std::isfinite(value)) {
+                        out << value;
+                    }
+                    else {
+                        out << "null";
+                    }
+                    first_counter = false;
+                }
+                out << "}";
+            }
+            out << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    int warmup_;
+    int repetitions_;
+    std::string filter_;
+    std::deque<BenchResult> results_; // ссылки на результаты не инвалидируются
+    BenchResult skipped_;
+};
+
+inline const void* volatile bench_sink = nullptr;
+
+// Не даёт компилятору выбросить вычисление, результат которого не используется
+template <class T>
+void DoNotOptimize(const T& value) {
+    bench_sink = &value;
+}
@@ -1,206 +1,885 @@
-﻿#include "cell.h"
-
-#include <cassert>
-#include <iostream>
-#include <string>
-#include <optional>
-#include <algorithm>
-
-class Cell::Impl {
-public:
-    virtual CellInterface::Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
-    virtual ~Impl() = default;
-};
-
-class Cell::EmptyImpl : public Impl {
-public:
-    CellInterface::Value GetValue() const override {
-        return "";
-    }
-
-    std::string GetText() const override {
-        return "";
-    }
-};
-
-class Cell::TextImpl : public Impl {
-public:
-    explicit TextImpl(std::string text) : text_(std::move(text)) {}
-
-    CellInterface::Value GetValue() const override {
-        if (!text_.empty() && text_.front() == ESCAPE_SIGN) {
-            return text_.substr(1);
-        }
-        return text_;
-    }
-
-    std::string GetText() const override {
-        return text_;
-    }
-
-private:
-    std::string text_;
-};
-
-class Cell::FormulaImpl : public Impl {
-public:
-    explicit FormulaImpl(std::string expression, const SheetInterface& sheet)
-        : sheet_(sheet) {
-        if (expression.empty() || expression[0] != FORMULA_SIGN) {
-            throw FormulaException("Invalid formula");
-        }
-        // Парсинг формулы через функцию ParseFormula
-        formula_ = ParseFormula(expression.substr(1));
-    }
-
-    CellInterface::Value GetValue() const override {
-        if (!cache_) {
-            // Вычисляем значение формулы через Evaluate, передавая ссылку на таблицу
-            cache_ = formula_->Evaluate(sheet_);
-        }
-
-        // Возвращаем кэшированное значение
-        if (std::holds_alternative<double>(*cache_)) {
-            return std::get<double>(*cache_);
-        }
-        else {
-            return std::get<FormulaError>(*cache_);
-        }
-    }
-
-    std::string GetText() const override {
-        return FORMULA_SIGN + formula_->GetExpression();
-    }
-
-    // сброс кэша при изменениях
-    void InvalidateCache() {
-        cache_.reset();
-    }
-
-    std::vector<Position> GetReferencedCells() const {
-        return formula_->GetReferencedCells();
-    }
-
-private:
-    std::unique_ptr<FormulaInterface> formula_;
-    const SheetInterface& sheet_; // ссылка на таблицу
-    mutable std::optional<std::variant<double, FormulaError>> cache_; // кеш результата вычислений
-};
-
-Cell::~Cell() = default;
-
-Cell::Cell(SheetInterface& sheet)
-    : impl_(std::make_unique<EmptyImpl>())
-    , sheet_(sheet)
-{}
-
-void Cell::Set(std::string text) {
-    if (text.empty()) {
-        impl_ = std::make_unique<EmptyImpl>();
-    }
-    else if (!text.empty() && text.front() == FORMULA_SIGN) {
-        impl_ = std::make_unique<FormulaImpl>(std::move(text), sheet_);
-
-        auto new_references = GetReferencedCells();
-        std::unordered_set<Position> visited;
-        std::unordered_set<Position> in_stack;
-
-        for (const auto& ref : new_references) {
-            if (HasCircularDependency(ref, visited, in_stack)) {
-                throw CircularDependencyException("Circular dependency detected in cell.");
-            }
-        }
-
-        UpdateReferences(new_references);
-    }
-    else {
-        impl_ = std::make_unique<TextImpl>(std::move(text));
-    }
-}
-
-void Cell::Clear() {
-    Set("");
-}
-
-CellInterface::Value Cell::GetValue() const {
-    return impl_->GetValue();
-}
-
-std::string Cell::GetText() const {
-    return impl_->GetText();
-}
-
-std::vector<Position> Cell::GetReferencedCells() const {
-    if (auto formula_impl = dynamic_cast<const FormulaImpl*>(impl_.get())) {
-        return formula_impl->GetReferencedCells();
-    }
-    return {};
-}
-
-// методы будут работать с зависимостями
-void Cell::InvalidateCache() {
-    if (!cache_) {
-        return;
-    }
-    cache_.reset();
-    for (const Position& pos : dependent_cells_) {
-        Cell* dependent = dynamic_cast<Cell*>(sheet_.GetCell(pos));
-        if (dependent) {
-            dependent->InvalidateCache();
-        }
-    }
-}
-
-bool Cell::IsCacheValid() const {
-    return cache_.has_value();
-}
-
-void Cell::UpdateReferences(const std::vector<Position>& new_references) {
-    referenced_cells_ = new_references;
-}
-
-void Cell::AddDependentCell(Position pos) {
-    dependent_cells_.push_back(pos);
-}
-
-void Cell::RemoveDependentCell(Position pos) {
-    for (Position dep_pos : dependent_cells_) {
-        Cell* cell = dynamic_cast<Cell*>(sheet_.GetCell(dep_pos));
-        if (!dep_pos.IsValid() || !cell)
-            continue;
-
-        // Ищем позицию в referenced_cells_
-        auto it = std::find(cell->referenced_cells_.begin(), cell->referenced_cells_.end(), pos);
-        if (it != cell->referenced_cells_.end()) {
-            cell->referenced_cells_.erase(it);  // Удаляем элемент по итератору
-        }
-    }
-}
-
-bool Cell::HasCircularDependency(Position pos, std::unordered_set<Position>& visited, std::unordered_set<Position>& in_stack) const {
-    if (in_stack.count(pos)) {
-        return true;  // Обнаружен цикл
-    }
-
-    if (visited.count(pos)) {
-        return false;  // Ячейка уже проверена
-    }
-
-    visited.insert(pos);
-    in_stack.insert(pos);
-
-    const CellInterface* cell = sheet_.GetCell(pos);
-    if (cell) {
-        for (const auto& ref_pos : cell->GetReferencedCells()) {
-            if (ref_pos.IsValid()) {
-                if (HasCircularDependency(ref_pos, visited, in_stack)) {
-                    return true;
-                }
-            }
-        }
-    }
-
-    in_stack.erase(pos);
-    return false;
+﻿#include "cell.h"
+#include "sheet.h"
+
+#include <cassert>
+#include <iostream>
+#include <string>
+#include <optional>
+#include <algorithm>
+#include <chrono>
+
+namespace {
+    // Глубина рекурсии вычислений в текущем потоке. Дальше этой глубины
+    // формулы вычисляются итеративно, см. Cell::EvaluatePrecedents.
+    constexpr int MAX_RECURSIVE_EVAL_DEPTH = 128;
+    thread_local int eval_depth = 0;
+
+    class EvalDepthGuard {
+    public:
+        EvalDepthGuard() {
+            ++eval_depth;
+        }
+        ~EvalDepthGuard() {
+            --eval_depth;
+        }
+    };
+
+    // Пробное вычисление условной формулы, см. Cell::EvaluatePrecedents:
+    // невычисленные формулы не вычисляются, а дают 0, и первая из них
+    // запоминается в missing_precedent
+    thread_local bool probing = false;
+    thread_local const Cell* missing_precedent = nullptr;
+
+    // Включает пробный режим или, с enabled = false, выключает его на время
+    // точного чтения внутри пробы. Прежний режим восстанавливается.
+    class ProbeGuard {
+    public:
+        explicit ProbeGuard(bool enabled = true)
+            : previous_probing_(probing)
+            , previous_missing_(missing_precedent) {
+            probing = enabled;
+            missing_precedent = nullptr;
+        }
+        ~ProbeGuard() {
+            probing = previous_probing_;
+            missing_precedent = previous_missing_;
+        }
+
+    private:
+        bool previous_probing_;
+        const Cell* previous_missing_;
+    };
+
+    const std::vector<Position> NO_REFERENCES;
+    const std::vector<ExternalReference> NO_EXTERNAL_REFERENCES;
+    const std::vector<CellRange> NO_RANGES;
+
+    // память строки вне самого объекта, короткие строки хранятся внутри
+    size_t GetHeapBytes(const std::string& text) {
+        return text.capacity() > std::string().capacity() ? text.capacity() + 1 : 0;
+    }
+}  // namespace
+
+class Cell::Impl {
+public:
+    virtual CellInterface::ValueView GetValueView() const = 0;
+    virtual std::string_view GetText() const = 0;
+    virtual const std::vector<Position>& GetReferencedCells() const {
+        return NO_REFERENCES;
+    }
+    virtual const std::vector<ExternalReference>& GetExternalReferences() const {
+        return NO_EXTERNAL_REFERENCES;
+    }
+    virtual const std::vector<CellRange>& GetReferencedRanges() const {
+        return NO_RANGES;
+    }
+    // сбрасывает кэш, возвращает true, если было что сбрасывать
+    virtual bool InvalidateCache() {
+        return false;
+    }
+    virtual bool IsCacheValid() const {
+        return false;
+    }
+    virtual void SetCachedValue(FormulaInterface::Value value) {
+    }
+    // у текста и пустой ячейки значение всегда известно
+    virtual std::optional<CellInterface::Value> GetCachedValue() const {
+        return ToValue(GetValueView());
+    }
+    // у пустой ячейки out остаётся пустым
+    virtual void ReadValue(RangeValues::Value& out) const {
+    }
+    virtual std::shared_ptr<const FormulaInterface> GetSharedFormula() const {
+        return nullptr;
+    }
+    virtual std::shared_ptr<const FormulaInterface> GetCompiledFormula() const {
+        return nullptr;
+    }
+    virtual FormulaInterface::HandlingResult HandleStructureChange(const StructureHandler& handle) {
+        return FormulaInterface::HandlingResult::NothingChanged;
+    }
+    // приблизительный объём памяти, занятый реализацией
+    virtual size_t GetAllocatedBytes() const = 0;
+    virtual void AddMemoryUsage(SheetMemoryUsage& usage) const {
+        usage.cells += GetAllocatedBytes();
+    }
+    // false, если у реализации нет AST, которое можно вытеснить
+    virtual bool EvictFormula() const {
+        return false;
+    }
+    // true, если часть ссылок читается только при выполнении условия
+    virtual bool IsConditional() const {
+        return false;
+    }
+    // Вычисляет формулу без рекурсии. Если ей нужна невычисленная формула,
+    // значение не запоминается и возвращается ячейка этой формулы.
+    virtual const Cell* TryEvaluate() const {
+        return nullptr;
+    }
+    virtual ~Impl() = default;
+};
+
+class Cell::EmptyImpl : public Impl {
+public:
+    CellInterface::ValueView GetValueView() const override {
+        return std::string_view{};
+    }
+
+    std::string_view GetText() const override {
+        return {};
+    }
+
+    size_t GetAllocatedBytes() const override {
+        return sizeof(EmptyImpl);
+    }
+};
+
+class Cell::TextImpl : public Impl {
+public:
+    explicit TextImpl(StringPool::Handle text) : text_(std::move(text)) {}
+
+    CellInterface::ValueView GetValueView() const override {
+        std::string_view text = text_.GetText();
+        if (!text.empty() && text.front() == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        return text;
+    }
+
+    std::string_view GetText() const override {
+        return text_.GetText();
+    }
+
+    void ReadValue(RangeValues::Value& out) const override {
+        out.kind = RangeValues::Kind::Text;
+        out.text = std::get<std::string_view>(GetValueView());
+    }
+
+    size_t GetAllocatedBytes() const override {
+        // сам текст учитывается в пуле листа
+        return sizeof(TextImpl);
+    }
+
+private:
+    StringPool::Handle text_;
+};
+
+class Cell::FormulaImpl : public Impl {
+public:
+    FormulaImpl(std::string expression, const Cell& cell, std::shared_ptr<FormulaInterface> parsed_formula)
+        : cell_(cell)
+        , sheet_(cell.sheet_) {
+        if (expression.empty() || expression[0] != FORMULA_SIGN) {
+            throw FormulaException("Invalid formula");
+        }
+        if (parsed_formula) {
+            // формулу, разобранную вне листа, следующий Get с тем же текстом возьмёт из кэша
+            sheet_.formula_cache_.Put(expression.substr(1), parsed_formula);
+            formula_ = std::move(parsed_formula);
+        }
+        else {
+            if (sheet_.IsLazyFormulaCompilation()) {
+                // в ленивом режиме достаточно ссылок из быстрого сканирования,
+                // AST будет построено при первом обращении к значению
+                if (auto references = ScanFormulaReferences(std::string_view(expression).substr(1))) {
+                    referenced_cells_ = std::move(*references);
+                    source_ = std::move(expression);
+                    ++sheet_.uncompiled_formulas_;
+                    return;
+                }
+            }
+            // Парсинг формулы через функцию ParseFormula
+            formula_ = Compile(expression.substr(1));
+        }
+        OnCompiled();
+        referenced_cells_ = formula_->GetReferencedCells();
+        external_cells_ = formula_->GetExternalReferences();
+        referenced_ranges_ = formula_->GetReferencedRanges();
+    }
+
+    ~FormulaImpl() override {
+        if (!formula_) {
+            --sheet_.uncompiled_formulas_;
+        }
+        else {
+            sheet_.compiled_formula_bytes_ -= compiled_bytes_;
+            sheet_.compiled_formulas_.erase(use_position_);
+        }
+    }
+
+    CellInterface::ValueView GetValueView() const override {
+        SheetStats* stats = sheet_.ActiveStats();
+        if (!cache_) {
+            if (probing) {
+                if (!missing_precedent) {
+                    missing_precedent = &cell_;
+                }
+                return 0.0;
+            }
+            // глубокие цепочки досчитываются итеративно, чтобы не переполнить стек;
+            // условная формула при этом вычисляется сама
+            if (eval_depth >= MAX_RECURSIVE_EVAL_DEPTH) {
+                cell_.EvaluatePrecedents();
+            }
+            if (!cache_) {
+                EvalDepthGuard depth;
+                RecalcProfiler::Scope profile(sheet_.profiler_.get(), cell_.pos_);
+                // Вычисляем значение формулы через Evaluate, передавая ссылку на таблицу
+                cache_ = GetFormula().Evaluate(sheet_);
+                if (stats) {
+                    ++stats->evaluations;
+                }
+            }
+        }
+        else if (stats) {
+            ++stats->cache_hits;
+        }
+
+        // Возвращаем кэшированное значение
+        if (std::holds_alternative<double>(*cache_)) {
+            return std::get<double>(*cache_);
+        }
+        else {
+            return std::get<FormulaError>(*cache_);
+        }
+    }
+
+    std::string_view GetText() const override {
+        // отложенная формула не компилируется ради текста
+        return formula_ ? formula_->GetTextView() : source_;
+    }
+
+    // сброс кэша при изменениях
+    bool InvalidateCache() override {
+        if (!cache_) {
+            return false;
+        }
+        cache_.reset();
+        return true;
+    }
+
+    bool IsCacheValid() const override {
+        return cache_.has_value();
+    }
+
+    void SetCachedValue(FormulaInterface::Value value) override {
+        cache_ = std::move(value);
+    }
+
+    std::optional<CellInterface::Value> GetCachedValue() const override {
+        if (!cache_) {
+            return std::nullopt;
+        }
+        return std::visit([](const auto& value) { return CellInterface::Value(value); }, *cache_);
+    }
+
+    void ReadValue(RangeValues::Value& out) const override {
+        if (!cache_) {
+            GetValueView();
+        }
+        else if (SheetStats* stats = sheet_.ActiveStats()) {
+            ++stats->cache_hits;
+        }
+        if (const double* number = std::get_if<double>(&*cache_)) {
+            out.kind = RangeValues::Kind::Number;
+            out.number = *number;
+        }
+        else {
+            out.kind = RangeValues::Kind::Error;
+            out.error = std::get<FormulaError>(*cache_).GetCategory();
+        }
+    }
+
+    const std::vector<Position>& GetReferencedCells() const override {
+        return referenced_cells_;
+    }
+
+    // быстрое сканирование не пропускает ссылки на другие листы, поэтому
+    // у отложенной формулы их нет
+    const std::vector<ExternalReference>& GetExternalReferences() const override {
+        return external_cells_;
+    }
+
+    // области есть только у полностью разобранных формул
+    const std::vector<CellRange>& GetReferencedRanges() const override {
+        return referenced_ranges_;
+    }
+
+    std::shared_ptr<const FormulaInterface> GetSharedFormula() const override {
+        GetFormula();
+        return formula_;
+    }
+
+    std::shared_ptr<const FormulaInterface> GetCompiledFormula() const override {
+        return formula_;
+    }
+
+    FormulaInterface::HandlingResult HandleStructureChange(const StructureHandler& handle) override {
+        GetFormula();
+        // формула, попавшая в снимок или кэш формул, не должна меняться:
+        // снимки неизменяемы, а кэш отдаёт её другим ячейкам
+        if (formula_.use_count() > 1) {
+            formula_ = formula_->Clone();
+        }
+        auto result = handle(*formula_);
+        if (result != FormulaInterface::HandlingResult::NothingChanged) {
+            referenced_cells_ = formula_->GetReferencedCells();
+            external_cells_ = formula_->GetExternalReferences();
+            referenced_ranges_ = formula_->GetReferencedRanges();
+        }
+        if (result == FormulaInterface::HandlingResult::ReferencesChanged) {
+            cache_.reset();
+        }
+        return result;
+    }
+
+    size_t GetAllocatedBytes() const override {
+        return sizeof(FormulaImpl) + source_.capacity()
+            + referenced_cells_.capacity() * sizeof(Position)
+            + external_cells_.capacity() * sizeof(ExternalReference)
+            + referenced_ranges_.capacity() * sizeof(CellRange);
+    }
+
+    void AddMemoryUsage(SheetMemoryUsage& usage) const override {
+        usage.cells += sizeof(FormulaImpl) - sizeof(cache_);
+        usage.cached_values += sizeof(cache_);
+        usage.formulas += GetHeapBytes(source_);
+        if (formula_) {
+            usage.formulas += formula_->GetAllocatedBytes();
+        }
+        usage.dependencies += referenced_cells_.capacity() * sizeof(Position)
+            + external_cells_.capacity() * sizeof(ExternalReference)
+            + referenced_ranges_.capacity() * sizeof(CellRange);
+    }
+
+    bool IsConditional() const override {
+        return conditional_;
+    }
+
+    const Cell* TryEvaluate() const override {
+        RecalcProfiler::Scope profile(sheet_.profiler_.get(), cell_.pos_);
+        ProbeGuard probe;
+        FormulaInterface::Value value = GetFormula().Evaluate(sheet_);
+        if (missing_precedent) {
+            return missing_precedent;
+        }
+        cache_ = std::move(value);
+        if (SheetStats* stats = sheet_.ActiveStats()) {
+            ++stats->evaluations;
+        }
+        return nullptr;
+    }
+
+    bool EvictFormula() const override {
+        if (!formula_) {
+            return false;
+        }
+        // формулу снимка или другой ячейки освободит только её владелец,
+        // а запись кэша уходит вместе с AST ячейки
+        FormulaCache& cache = sheet_.formula_cache_;
+        const bool cached = cache.Contains(formula_.get());
+        if (formula_.use_count() > (cached ? 2 : 1)) {
+            return false;
+        }
+        // канонический текст нужен для повторной компиляции
+        source_ = formula_->GetTextView();
+        sheet_.compiled_formula_bytes_ -= compiled_bytes_;
+        sheet_.compiled_formulas_.erase(use_position_);
+        compiled_bytes_ = 0;
+        if (cached) {
+            cache.Erase(formula_.get());
+        }
+        formula_.reset();
+        ++sheet_.uncompiled_formulas_;
+        if (SheetStats* stats = sheet_.ActiveStats()) {
+            ++stats->formulas_evicted;
+        }
+        return true;
+    }
+
+private:
+    // формула с уже встречавшимся текстом берётся из кэша листа без разбора
+    std::shared_ptr<FormulaInterface> Compile(std::string expression) const {
+        FormulaCache& cache = sheet_.formula_cache_;
+        SheetStats* stats = sheet_.ActiveStats();
+        if (!stats) {
+            return cache.Get(std::move(expression));
+        }
+        const uint64_t misses = cache.GetStats().misses;
+        auto start = std::chrono::steady_clock::now();
+        auto record_time = [&] {
+            stats->parse_time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        };
+        try {
+            auto formula = cache.Get(std::move(expression));
+            if (cache.GetStats().misses != misses) {
+                record_time();
+                ++stats->formulas_parsed;
+            }
+            return formula;
+        }
+        catch (...) {
+            record_time();
+            throw;
+        }
+    }
+
+    // учитывает новое AST в объёме скомпилированных формул листа
+    void OnCompiled() const {
+        compiled_bytes_ = formula_->GetAllocatedBytes();
+        sheet_.compiled_formula_bytes_ += compiled_bytes_;
+        conditional_ = formula_->IsConditional();
+        sheet_.compiled_formulas_.push_front(&cell_);
+        use_position_ = sheet_.compiled_formulas_.begin();
+    }
+
+    // компилирует формулу, если она была отложена или вытеснена
+    const FormulaInterface& GetFormula() const {
+        if (!formula_) {
+            // у вытесненной формулы здесь канонический текст
+            formula_ = Compile(source_.substr(1));
+            OnCompiled();
+            --sheet_.uncompiled_formulas_;
+            source_.clear();
+            source_.shrink_to_fit();
+        }
+        else if (use_position_ != sheet_.compiled_formulas_.begin()) {
+            sheet_.compiled_formulas_.splice(sheet_.compiled_formulas_.begin(), sheet_.compiled_formulas_, use_position_);
+        }
+        return *formula_;
+    }
+
+    mutable std::shared_ptr<FormulaInterface> formula_; // разделяется со снимками и кэшем формул
+    // текст формулы, пока нет AST: исходный до компиляции, канонический после вытеснения
+    mutable std::string source_;
+    std::vector<Position> referenced_cells_;
+    std::vector<ExternalReference> external_cells_;
+    std::vector<CellRange> referenced_ranges_;
+    const Cell& cell_; // ячейка, которой принадлежит формула
+    Sheet& sheet_; // ссылка на таблицу
+    mutable std::optional<std::variant<double, FormulaError>> cache_; // кеш результата вычислений
+    mutable std::list<const Cell*>::iterator use_position_; // место в очереди вытеснения листа, пока есть AST
+    mutable size_t compiled_bytes_ = 0; // объём AST, учтённый в листе
+    mutable bool conditional_ = false; // отложенная формула условий не содержит
+};
+
+Cell::~Cell() = default;
+
+Cell::Cell(Sheet& sheet, Position pos)
+    : impl_(std::make_unique<EmptyImpl>())
+    , sheet_(sheet)
+    , pos_(pos)
+{}
+
+void Cell::Set(std::string text, std::shared_ptr<FormulaInterface> parsed_formula) {
+    if (text.empty()) {
+        impl_ = std::make_unique<EmptyImpl>();
+    }
+    else if (!text.empty() && text.front() == FORMULA_SIGN) {
+        impl_ = std::make_unique<FormulaImpl>(std::move(text), *this, std::move(parsed_formula));
+
+        const auto& new_references = impl_->GetReferencedCells();
+        if (HasCircularDependency(new_references, impl_->GetExternalReferences(), impl_->GetReferencedRanges())) {
+            throw CircularDependencyException("Circular dependency detected in cell.");
+        }
+
+        UpdateReferences(new_references);
+    }
+    else {
+        impl_ = std::make_unique<TextImpl>(sheet_.string_pool_.Intern(std::move(text)));
+    }
+
+    if (SheetStats* stats = sheet_.ActiveStats()) {
+        stats->bytes_allocated += impl_->GetAllocatedBytes();
+    }
+}
+
+void Cell::Clear() {
+    Set("");
+}
+
+CellInterface::Value Cell::GetValue() const {
+    return ToValue(impl_->GetValueView());
+}
+
+CellInterface::ValueView Cell::GetValueView() const {
+    return impl_->GetValueView();
+}
+
+CellInterface::ValueView Cell::GetResolvedValueView() const {
+    ProbeGuard exact(false);
+    return impl_->GetValueView();
+}
+
+std::string Cell::GetText() const {
+    return std::string(impl_->GetText());
+}
+
+std::string_view Cell::GetTextView() const {
+    return impl_->GetText();
+}
+
+std::vector<Position> Cell::GetReferencedCells() const {
+    return impl_->GetReferencedCells();
+}
+
+const std::vector<ExternalReference>& Cell::GetExternalReferences() const {
+    return impl_->GetExternalReferences();
+}
+
+const std::vector<CellRange>& Cell::GetReferencedRanges() const {
+    return impl_->GetReferencedRanges();
+}
+
+bool Cell::IsFormula() const {
+    return dynamic_cast<const FormulaImpl*>(impl_.get()) != nullptr;
+}
+
+std::shared_ptr<const FormulaInterface> Cell::GetSharedFormula() const {
+    return impl_->GetSharedFormula();
+}
+
+std::shared_ptr<const FormulaInterface> Cell::GetCompiledFormula() const {
+    return impl_->GetCompiledFormula();
+}
+
+// методы будут работать с зависимостями
+void Cell::InvalidateCache() {
+    // сама ячейка изменилась, поэтому зависимые сбрасываются безусловно;
+    // обход идёт по явному стеку, глубина графа ограничена только памятью
+    impl_->InvalidateCache();
+    sheet_.NotifyInvalidated(pos_);
+    size_t fanout = 0;
+    std::vector<ExternalDependent> stack;
+    auto push_dependents = [&stack](const Cell& cell) {
+        for (Position pos : cell.dependent_cells_) {
+            stack.push_back({ &cell.sheet_, pos });
+        }
+        // зависимые с других листов хранятся в книге, а не в ячейке
+        if (const auto* dependents = cell.sheet_.FindExternalDependents(cell.pos_)) {
+            stack.insert(stack.end(), dependents->begin(), dependents->end());
+        }
+        // как и формулы, ищущие по областям, в которые попала ячейка
+        cell.sheet_.ForEachRangeDependents(cell.pos_, [&stack, &cell](const std::vector<Position>& cells) {
+            for (Position pos : cells) {
+                stack.push_back({ &cell.sheet_, pos });
+            }
+        });
+    };
+    push_dependents(*this);
+    while (!stack.empty()) {
+        Cell* dependent = stack.back().sheet->FindCell(stack.back().pos);
+        stack.pop_back();
+        // если кэша уже нет, зависимые ячейки тоже не могут хранить значение:
+        // при их вычислении кэш этой ячейки был бы заполнен
+        if (!dependent || !dependent->impl_->IsCacheValid()) {
+            continue;
+        }
+        dependent->sheet_.RecordValueChange(dependent->pos_, *dependent);
+        dependent->impl_->InvalidateCache();
+        ++fanout;
+        dependent->sheet_.NotifyInvalidated(dependent->pos_);
+        push_dependents(*dependent);
+    }
+
+    if (SheetStats* stats = sheet_.ActiveStats()) {
+        ++stats->invalidations;
+        stats->invalidated_cells += fanout;
+        stats->max_invalidation_fanout = std::max<uint64_t>(stats->max_invalidation_fanout, fanout);
+    }
+}
+
+void Cell::EvaluatePrecedents() const {
+    // обход в глубину с явным стеком: каждая формула вычисляется после всех
+    // формул, на которые она ссылается, поэтому их значения уже в кэше и
+    // вычисление не уходит в рекурсию. Сама ячейка не вычисляется.
+    // Номер ссылки сначала пробегает ссылки на свой лист, затем на другие.
+    // Условной формуле нужны не все ссылки, поэтому она вычисляется пробно:
+    // в стек попадает только та формула, без которой проба не удалась, и
+    // после её вычисления проба повторяется. Формулы невыбранных ветвей IF
+    // так и остаются невычисленными; сама условная ячейка вычисляется тоже.
+    // Формулы областей, по которым ищет формула, вычисляются раньше неё,
+    // чтобы построение индекса поиска не уходило в рекурсию.
+    struct Frame {
+        const Cell* cell;
+        size_t next_ref;
+        bool ranges_pushed;
+    };
+    std::vector<Frame> stack{ { this, 0, false } };
+    std::vector<CellRange> expanded_ranges;
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        // ячейка могла попасть в стек дважды
+        if (frame.cell != this && frame.cell->IsCacheValid()) {
+            stack.pop_back();
+            continue;
+        }
+        if (frame.cell->impl_->IsConditional()) {
+            if (const Cell* missing = frame.cell->impl_->TryEvaluate()) {
+                stack.push_back({ missing, 0, false });
+            }
+            else {
+                stack.pop_back();
+            }
+            continue;
+        }
+        if (!frame.ranges_pushed) {
+            frame.ranges_pushed = true;
+            const Cell* owner = frame.cell;
+            for (const CellRange& range : owner->impl_->GetReferencedRanges()) {
+                if (std::find(expanded_ranges.begin(), expanded_ranges.end(), range) != expanded_ranges.end()) {
+                    continue;
+                }
+                expanded_ranges.push_back(range);
+                owner->sheet_.ForEachCellInRange(range, [&stack](Position, const Cell& ref) {
+                    if (!ref.IsCacheValid() && ref.IsFormula()) {
+                        stack.push_back({ &ref, 0, false });
+                    }
+                });
+            }
+            continue;
+        }
+        const auto& references = frame.cell->impl_->GetReferencedCells();
+        const auto& external_references = frame.cell->impl_->GetExternalReferences();
+        if (frame.next_ref < references.size() + external_references.size()) {
+            size_t index = frame.next_ref++;
+            const Cell* ref = index < references.size()
+                ? frame.cell->sheet_.FindCell(references[index])
+                : frame.cell->sheet_.FindExternalCell(external_references[index - references.size()]);
+            // формулы без ссылок вычисляются без рекурсии, их можно пропустить
+            if (ref && !ref->IsCacheValid()
+                && (!ref->impl_->GetReferencedCells().empty() || !ref->impl_->GetExternalReferences().empty()
+                    || !ref->impl_->GetReferencedRanges().empty())) {
+                stack.push_back({ ref, 0, false });
+            }
+            continue;
+        }
+        const Cell* cell = frame.cell;
+        stack.pop_back();
+        if (cell != this) {
+            cell->impl_->GetValueView();
+        }
+    }
+}
+
+bool Cell::IsCacheValid() const {
+    return impl_->IsCacheValid();
+}
+
+void Cell::SetCachedValue(FormulaInterface::Value value) {
+    impl_->SetCachedValue(std::move(value));
+}
+
+std::optional<CellInterface::Value> Cell::GetCachedValue() const {
+    return impl_->GetCachedValue();
+}
+
+void Cell::ReadValue(RangeValues::Value& out) const {
+    impl_->ReadValue(out);
+}
+
+bool Cell::HasDependentCells() const {
+    return !dependent_cells_.empty();
+}
+
+const std::vector<Position>& Cell::GetDependentCells() const {
+    return dependent_cells_;
+}
+
+void Cell::AddMemoryUsage(SheetMemoryUsage& usage) const {
+    usage.cells += sizeof(Cell);
+    usage.dependencies += (referenced_cells_.capacity() + dependent_cells_.capacity()) * sizeof(Position);
+    impl_->AddMemoryUsage(usage);
+}
+
+bool Cell::EvictFormula() const {
+    return impl_->EvictFormula();
+}
+
+void Cell::UpdateReferences(const std::vector<Position>& new_references) {
+    referenced_cells_ = new_references;
+}
+
+void Cell::AddDependentCell(Position pos) {
+    dependent_cells_.push_back(pos);
+}
+
+void Cell::RemoveDependentCell(Position pos) {
+    auto it = std::find(dependent_cells_.begin(), dependent_cells_.end(), pos);
+    if (it != dependent_cells_.end()) {
+        dependent_cells_.erase(it);
+    }
+}
+
+FormulaInterface::HandlingResult Cell::HandleStructureChange(const StructureHandler& handle) {
+    auto result = impl_->HandleStructureChange(handle);
+    if (result != FormulaInterface::HandlingResult::NothingChanged) {
+        referenced_cells_ = impl_->GetReferencedCells();
+    }
+    return result;
+}
+
+void Cell::RemapDependentCells(const std::function<Position(Position)>& remap) {
+    auto out = dependent_cells_.begin();
+    for (Position pos : dependent_cells_) {
+        Position moved = remap(pos);
+        if (moved.IsValid()) {
+            *out++ = moved;
+        }
+    }
+    dependent_cells_.erase(out, dependent_cells_.end());
+}
+
+void Cell::Relocate(Position pos) {
+    pos_ = pos;
+}
+
+bool Cell::HasCircularDependency(const std::vector<Position>& references,
+    const std::vector<ExternalReference>& external_references, const std::vector<CellRange>& ranges) const {
+    auto is_referenced = [&references, &ranges](Position pos) {
+        return std::binary_search(references.begin(), references.end(), pos)
+            || std::any_of(ranges.begin(), ranges.end(), [pos](const CellRange& range) { return range.Contains(pos); });
+    };
+    // ссылка на саму себя
+    if (is_referenced(pos_)) {
+        return true;
+    }
+    // цикл через другие листы возможен, только если в этот лист ведут ссылки
+    // из книги или их добавляет сама формула
+    if (!external_references.empty() || sheet_.HasExternalDependents()) {
+        return HasCrossSheetCycle(references, external_references, ranges);
+    }
+    // граф до изменения ацикличен, поэтому цикл может пройти только через эту
+    // ячейку, а значит, только если от неё кто-то зависит
+    if ((dependent_cells_.empty() && !sheet_.HasRangeDependents(pos_)) || (references.empty() && ranges.empty())) {
+        return false;
+    }
+
+    SheetStats* stats = sheet_.ActiveStats();
+    // Области не раскрываются в ячейки: достаточно обойти всё, что зависит от
+    // ячейки, включая формулы, ищущие по областям, и проверить, не ссылается
+    // ли на что-то из этого новая формула
+    if (!ranges.empty() || !sheet_.range_dependents_.empty()) {
+        std::vector<Position> stack(dependent_cells_.begin(), dependent_cells_.end());
+        std::unordered_set<Position> visited;
+        auto push_range_dependents = [this, &stack](Position pos) {
+            sheet_.ForEachRangeDependents(pos, [&stack](const std::vector<Position>& cells) {
+                stack.insert(stack.end(), cells.begin(), cells.end());
+            });
+        };
+        push_range_dependents(pos_);
+        while (!stack.empty()) {
+            Position pos = stack.back();
+            stack.pop_back();
+            if (!visited.insert(pos).second) {
+                continue;
+            }
+            if (stats) {
+                ++stats->cycle_check_nodes;
+            }
+            if (is_referenced(pos)) {
+                return true;  // Обнаружен цикл
+            }
+            if (const Cell* cell = sheet_.FindCell(pos)) {
+                stack.insert(stack.end(), cell->dependent_cells_.begin(), cell->dependent_cells_.end());
+            }
+            push_range_dependents(pos);
+        }
+        return false;
+    }
+
+    // Цикл есть, если ячейка достижима из новых ссылок. Ищем одновременно от
+    // ссылок по ссылкам и от ячейки по зависимым, по шагу с каждой стороны.
+    // Исчерпание любого из поисков доказывает отсутствие цикла, так что
+    // стоимость проверки определяется меньшей из двух областей.
+    std::vector<Position> forward(references.begin(), references.end());
+    std::vector<Position> backward(dependent_cells_.begin(), dependent_cells_.end());
+    std::unordered_set<Position> forward_visited;
+    std::unordered_set<Position> backward_visited;
+
+    while (!forward.empty() && !backward.empty()) {
+        Position pos = forward.back();
+        forward.pop_back();
+        if (forward_visited.insert(pos).second) {
+            if (stats) {
+                ++stats->cycle_check_nodes;
+            }
+            if (pos == pos_) {
+                return true;  // Обнаружен цикл
+            }
+            if (const Cell* cell = sheet_.FindCell(pos)) {
+                const auto& refs = cell->impl_->GetReferencedCells();
+                forward.insert(forward.end(), refs.begin(), refs.end());
+            }
+        }
+
+        pos = backward.back();
+        backward.pop_back();
+        if (backward_visited.insert(pos).second) {
+            if (stats) {
+                ++stats->cycle_check_nodes;
+            }
+            if (std::binary_search(references.begin(), references.end(), pos)) {
+                return true;  // Обнаружен цикл
+            }
+            if (const Cell* cell = sheet_.FindCell(pos)) {
+                backward.insert(backward.end(), cell->dependent_cells_.begin(), cell->dependent_cells_.end());
+            }
+        }
+    }
+    return false;
+}
+
+bool Cell::HasCrossSheetCycle(const std::vector<Position>& references,
+    const std::vector<ExternalReference>& external_references, const std::vector<CellRange>& ranges) const {
+    // Межлистовые зависимые хранятся по позициям, а не в ячейках, поэтому
+    // ищем только в одну сторону: обходим всё, что достижимо по ссылкам
+    // формулы на этом и других листах. Области раскрываются в существующие
+    // ячейки, каждая область листа - один раз.
+    SheetStats* stats = sheet_.ActiveStats();
+    std::vector<ExternalDependent> stack;
+    std::vector<std::pair<const Sheet*, CellRange>> expanded_ranges;
+    auto push_references = [&stack, &expanded_ranges](Sheet& sheet, const std::vector<Position>& refs,
+        const std::vector<ExternalReference>& external_refs, const std::vector<CellRange>& ranges) {
+        for (Position pos : refs) {
+            stack.push_back({ &sheet, pos });
+        }
+        for (const ExternalReference& ref : external_refs) {
+            if (Sheet* other = sheet.FindExternalSheet(ref.sheet)) {
+                stack.push_back({ other, ref.pos });
+            }
+        }
+        for (const CellRange& range : ranges) {
+            auto expanded = std::make_pair(static_cast<const Sheet*>(&sheet), range);
+            if (std::find(expanded_ranges.begin(), expanded_ranges.end(), expanded) != expanded_ranges.end()) {
+                continue;
+            }
+            expanded_ranges.push_back(expanded);
+            sheet.ForEachCellInRange(range, [&stack, &sheet](Position pos, const Cell&) {
+                stack.push_back({ &sheet, pos });
+            });
+        }
+    };
+    push_references(sheet_, references, external_references, ranges);
+
+    std::unordered_map<const Sheet*, std::unordered_set<Position>> visited;
+    while (!stack.empty()) {
+        auto [sheet, pos] = stack.back();
+        stack.pop_back();
+        if (!visited[sheet].insert(pos).second) {
+            continue;
+        }
+        if (stats) {
+            ++stats->cycle_check_nodes;
+        }
+        if (sheet == &sheet_ && pos == pos_) {
+            return true;  // Обнаружен цикл
+        }
+        if (const Cell* cell = sheet->FindCell(pos)) {
+            push_references(*sheet, cell->impl_->GetReferencedCells(), cell->impl_->GetExternalReferences(),
+                cell->impl_->GetReferencedRanges());
+        }
+    }
+    return false;
 }
\ No newline at end of file
@@ -1,49 +1,95 @@
-﻿#pragma once
-
-#include "common.h"
-#include "formula.h"
-#include <utility>
-#include <unordered_set>
-#include <optional>  
-
-
-class Sheet;
-
-class Cell : public CellInterface {
-public:
-    explicit Cell(SheetInterface& sheet);
-    ~Cell();
-
-    void Set(std::string text);
-    void Clear();
-
-    Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-
-    void InvalidateCache();
-    bool IsCacheValid() const;
-
-    // методы будут работать с зависимостями
-    void UpdateReferences(const std::vector<Position>& new_references);
-    void AddDependentCell(Position pos);
-    void RemoveDependentCell(Position pos);
-
-private:
-    class Impl;
-    class EmptyImpl;
-    class TextImpl;
-    class FormulaImpl;
-    std::unique_ptr<Impl> impl_;
-
-    // ссылка на лист для доступа к другим ячейкам
-    SheetInterface& sheet_;
-
-    // значение кэша
-    std::optional<Value> cache_;
-
-    std::vector<Position> referenced_cells_;   // // ячейки на которые ссылается эта ячейка
-    std::vector<Position> dependent_cells_;    // ячейки которые зависят от этой ячейки
-
-    bool HasCircularDependency(Position pos, std::unordered_set<Position>& visited, std::unordered_set<Position>& in_stack) const;
+﻿#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include <functional>
+#include <utility>
+#include <unordered_set>
+#include <optional>  
+
+
+class Sheet;
+struct SheetMemoryUsage;
+
+class Cell : public CellInterface {
+public:
+    Cell(Sheet& sheet, Position pos);
+    ~Cell();
+
+    // parsed_formula - уже разобранное выражение формулы text
+    void Set(std::string text, std::shared_ptr<FormulaInterface> parsed_formula = nullptr);
+    void Clear();
+
+    Value GetValue() const override;
+    ValueView GetValueView() const override;
+    // То же значение, но формула вычисляется и во время пробного вычисления
+    // условной формулы: индексу поиска нужно настоящее значение
+    ValueView GetResolvedValueView() const;
+    std::string GetText() const override;
+    // текст ячейки без копирования, валиден до следующего изменения ячейки
+    std::string_view GetTextView() const;
+    std::vector<Position> GetReferencedCells() const override;
+    // ячейки других листов, на которые ссылается формула
+    const std::vector<ExternalReference>& GetExternalReferences() const;
+    // области, по которым ищут функции поиска формулы
+    const std::vector<CellRange>& GetReferencedRanges() const;
+    bool IsFormula() const;
+    // скомпилированная формула ячейки, nullptr у ячеек без формулы
+    std::shared_ptr<const FormulaInterface> GetSharedFormula() const;
+    // то же без компиляции: nullptr и у отложенной или вытесненной формулы
+    std::shared_ptr<const FormulaInterface> GetCompiledFormula() const;
+
+    // сбрасывает кэш ячейки и всех ячеек, которые от неё зависят, в том
+    // числе на других листах книги
+    void InvalidateCache();
+    bool IsCacheValid() const;
+    // запоминает значение формулы, вычисленное вне ячейки (пакетное вычисление)
+    void SetCachedValue(FormulaInterface::Value value);
+    // значение без вычисления формулы, пусто у формулы со сброшенным кэшем
+    std::optional<Value> GetCachedValue() const;
+    // значение без копирования текста, формула при необходимости вычисляется
+    void ReadValue(RangeValues::Value& out) const;
+    bool HasDependentCells() const;
+    const std::vector<Position>& GetDependentCells() const;
+
+    // добавляет память ячейки к usage по составляющим
+    void AddMemoryUsage(SheetMemoryUsage& usage) const;
+    // Вытеснение AST формулы по лимиту памяти листа: значение и текст ячейки
+    // сохраняются. false, если AST нет или его разделяет снимок либо другая
+    // ячейка.
+    bool EvictFormula() const;
+
+    // методы будут работать с зависимостями
+    void UpdateReferences(const std::vector<Position>& new_references);
+    void AddDependentCell(Position pos);
+    void RemoveDependentCell(Position pos);
+
+    // Вставка и удаление строк и столбцов. handle сдвигает ссылки формулы,
+    // remap переводит старую позицию в новую или в Position::NONE для удалённых.
+    using StructureHandler = std::function<FormulaInterface::HandlingResult(FormulaInterface&)>;
+    FormulaInterface::HandlingResult HandleStructureChange(const StructureHandler& handle);
+    void RemapDependentCells(const std::function<Position(Position)>& remap);
+    void Relocate(Position pos);
+
+private:
+    class Impl;
+    class EmptyImpl;
+    class TextImpl;
+    class FormulaImpl;
+    std::unique_ptr<Impl> impl_;
+
+    // ссылка на лист для доступа к другим ячейкам
+    Sheet& sheet_;
+    Position pos_;
+
+    std::vector<Position> referenced_cells_;   // // ячейки на которые ссылается эта ячейка
+    std::vector<Position> dependent_cells_;    // ячейки которые зависят от этой ячейки
+
+    // вычисляет невычисленные формулы, от которых зависит значение ячейки
+    void EvaluatePrecedents() const;
+    bool HasCircularDependency(const std::vector<Position>& references,
+        const std::vector<ExternalReference>& external_references, const std::vector<CellRange>& ranges) const;
+    // проверка цикла, проходящего через другие листы книги
+    bool HasCrossSheetCycle(const std::vector<Position>& references,
+        const std::vector<ExternalReference>& external_references, const std::vector<CellRange>& ranges) const;
 };
\ No newline at end of file
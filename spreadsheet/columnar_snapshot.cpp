@@ -0,0 +1,616 @@
+﻿#include "columnar_snapshot.h"
+
+#include "protocol.h"
+#include "sheet.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+    constexpr std::string_view MAGIC = "SHEETCOL";
+    constexpr uint32_t FORMAT_VERSION = 1;
+
+    // виды ячеек внутри блока
+    enum class CellKind : uint8_t {
+        Integer,
+        Double,
+        Text,
+        Formula,
+    };
+    constexpr uint8_t KIND_COUNT = 4;
+
+    // целые до 18 цифр: разность двух таких чисел помещается в int64_t
+    constexpr size_t MAX_INTEGER_DIGITS = 18;
+
+    [[noreturn]] void ThrowCorrupted(const std::string& what) {
+        throw ColumnarSnapshotException("Corrupted columnar snapshot: " + what);
+    }
+
+    uint64_t ZigZag(int64_t value) {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    int64_t UnZigZag(uint64_t value) {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    // Целое в канонической записи: без ведущих нулей, знака плюс и "-0",
+    // иначе текст ячейки не восстановился бы из числа
+    bool ParseInteger(std::string_view text, int64_t& value) {
+        const bool negative = !text.empty() && text.front() == '-';
+        const std::string_view digits = text.substr(negative ? 1 : 0);
+        if (digits.empty() || digits.size() > MAX_INTEGER_DIGITS || (digits.front() == '0' && (digits.size() > 1 || negative))) {
+            return false;
+        }
+        value = 0;
+        for (char c : digits) {
+            if (c < '0' || c > '9') {
+                return false;
+            }
+            value = value * 10 + (c - '0');
+        }
+        if (negative) {
+            value = -value;
+        }
+        return true;
+    }
+
+    // Конечное число, текст которого совпадает с кратчайшей записью double
+    bool ParseDouble(std::string_view text, double& value) {
+        char buffer[32];
+        if (text.empty() || text.size() > sizeof(buffer)) {
+            return false;
+        }
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (error != std::errc{} || end != text.data() + text.size() || !std::isfinite(value)) {
+            return false;
+        }
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        return result.ec == std::errc{} && std::string_view(buffer, result.ptr - buffer) == text;
+    }
+
+    std::string FormatDouble(double value) {
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        return std::string(buffer, result.ptr - buffer);
+    }
+
+    // XOR с предыдущим числом: байт заголовка (старшие нулевые байты << 4 |
+    // младшие нулевые байты) и значащие байты между ними
+    void PutXorDouble(ProtocolWriter& writer, double value, uint64_t& previous) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        const uint64_t x = bits ^ previous;
+        previous = bits;
+        int leading = 0;
+        while (leading < 8 && static_cast<uint8_t>(x >> (8 * (7 - leading))) == 0) {
+            ++leading;
+        }
+        int trailing = 0;
+        while (trailing < 8 - leading && static_cast<uint8_t>(x >> (8 * trailing)) == 0) {
+            ++trailing;
+        }
+        writer.PutU8(static_cast<uint8_t>(leading << 4 | trailing));
+        for (int i = trailing; i < 8 - leading; ++i) {
+            writer.PutU8(static_cast<uint8_t>(x >> (8 * i)));
+        }
+    }
+
+    double GetXorDouble(ProtocolReader& reader, uint64_t& previous) {
+        const uint8_t header = reader.GetU8();
+        const int leading = header >> 4;
+        const int trailing = header & 0x0F;
+        if (leading + trailing > 8) {
+            ThrowCorrupted("invalid number header");
+        }
+        uint64_t x = 0;
+        for (int i = trailing; i < 8 - leading; ++i) {
+            x |= static_cast<uint64_t>(reader.GetU8()) << (8 * i);
+        }
+        previous ^= x;
+        double value;
+        std::memcpy(&value, &previous, sizeof(value));
+        return value;
+    }
+
+    bool IsWordChar(char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    }
+
+    bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    // Тело формулы: LEB128 число ссылок, для каждой - текст перед ней
+    // (строка с длиной LEB128) и смещение строки и столбца от ячейки (zigzag),
+    // затем текст после последней ссылки. Ссылкой считается имя ячейки вне
+    // кавычек, не являющееся частью другого слова, имени функции или листа.
+    std::string MakeFormulaBody(std::string_view text, Position pos) {
+        struct Reference {
+            size_t begin;
+            size_t end;
+            Position target;
+        };
+        std::vector<Reference> references;
+        size_t i = 0;
+        while (i < text.size()) {
+            const char c = text[i];
+            if (c == '"' || c == '\'') {
+                size_t close = text.find(c, i + 1);
+                i = close == std::string_view::npos ? text.size() : close + 1;
+                continue;
+            }
+            if (!IsUpper(c) || (i > 0 && IsWordChar(text[i - 1]))) {
+                ++i;
+                continue;
+            }
+            const size_t begin = i;
+            while (i < text.size() && IsUpper(text[i])) {
+                ++i;
+            }
+            const size_t digits = i;
+            while (i < text.size() && IsDigit(text[i])) {
+                ++i;
+            }
+            if (i == digits || (i < text.size() && (IsWordChar(text[i]) || text[i] == '(' || text[i] == '!'))) {
+                continue;
+            }
+            const std::string_view name = text.substr(begin, i - begin);
+            const Position target = Position::FromString(name);
+            if (target.IsValid() && target.ToString() == name) {
+                references.push_back({ begin, i, target });
+            }
+        }
+
+        std::string body;
+        ProtocolWriter writer(body);
+        writer.PutVarU64(references.size());
+        size_t end = 0;
+        for (const Reference& reference : references) {
+            writer.PutVarString(text.substr(end, reference.begin - end));
+            writer.PutVarU64(ZigZag(reference.target.row - pos.row));
+            writer.PutVarU64(ZigZag(reference.target.col - pos.col));
+            end = reference.end;
+        }
+        writer.PutVarString(text.substr(end));
+        return body;
+    }
+
+    // тело формулы, разобранное один раз на блок
+    struct FormulaBody {
+        std::vector<std::string_view> pieces;          // на одну больше, чем ссылок
+        std::vector<std::pair<int64_t, int64_t>> offsets;
+    };
+
+    FormulaBody ParseFormulaBody(std::string_view data) {
+        ProtocolReader reader(data);
+        FormulaBody body;
+        const uint64_t count = reader.GetVarU64();
+        if (count > data.size()) {
+            ThrowCorrupted("invalid formula");
+        }
+        for (uint64_t i = 0; i < count; ++i) {
+            body.pieces.push_back(reader.GetVarString());
+            const int64_t rows = UnZigZag(reader.GetVarU64());
+            const int64_t cols = UnZigZag(reader.GetVarU64());
+            if (rows <= -Position::MAX_ROWS || rows >= Position::MAX_ROWS || cols <= -Position::MAX_COLS || cols >= Position::MAX_COLS) {
+                ThrowCorrupted("formula reference out of range");
+            }
+            body.offsets.emplace_back(rows, cols);
+        }
+        body.pieces.push_back(reader.GetVarString());
+        reader.ExpectEnd();
+        return body;
+    }
+
+    std::string ExpandFormula(const FormulaBody& body, Position pos) {
+        std::string text(body.pieces.front());
+        for (size_t i = 0; i < body.offsets.size(); ++i) {
+            const int64_t row = pos.row + body.offsets[i].first;
+            const int64_t col = pos.col + body.offsets[i].second;
+            if (row < 0 || row >= Position::MAX_ROWS || col < 0 || col >= Position::MAX_COLS) {
+                ThrowCorrupted("formula reference out of range");
+            }
+            text += Position{ static_cast<int>(row), static_cast<int>(col) }.ToString();
+            text += body.pieces[i + 1];
+        }
+        return text;
+    }
+
+    // Блок столбца: шесть разделов, каждый - строка с длиной LEB128:
+    // отрезки строк (число, затем пропуск от конца предыдущего и длина),
+    // серии видов (число, затем вид u8 и длина), целые, числа с XOR,
+    // текст (размер словаря, словарь, номера в словаре) и формулы (число
+    // тел, тела, номера тел)
+    std::string EncodeColumn(int col, std::vector<std::pair<int, const std::string*>>& cells) {
+        std::sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        });
+
+        std::vector<std::pair<int, uint64_t>> row_runs;
+        std::vector<std::pair<CellKind, uint64_t>> kind_runs;
+        std::string integers, doubles, text_indexes, formula_indexes;
+        ProtocolWriter integer_writer(integers);
+        ProtocolWriter double_writer(doubles);
+        ProtocolWriter text_index_writer(text_indexes);
+        ProtocolWriter formula_index_writer(formula_indexes);
+        int64_t previous_integer = 0;
+        uint64_t previous_double = 0;
+        std::unordered_map<std::string_view, uint64_t> dictionary;
+        std::vector<std::string_view> dictionary_order;
+        std::unordered_map<std::string, uint64_t> bodies;
+        std::vector<const std::string*> body_order;
+
+        for (const auto& [row, text] : cells) {
+            if (!row_runs.empty() && row_runs.back().first + static_cast<int64_t>(row_runs.back().second) == row) {
+                ++row_runs.back().second;
+            }
+            else {
+                row_runs.emplace_back(row, 1);
+            }
+
+            CellKind kind;
+            int64_t integer;
+            double number;
+            if (text->size() > 1 && text->front() == FORMULA_SIGN) {
+                kind = CellKind::Formula;
+                auto [it, inserted] = bodies.try_emplace(MakeFormulaBody(*text, { row, col }), bodies.size());
+                if (inserted) {
+                    body_order.push_back(&it->first);
+                }
+                formula_index_writer.PutVarU64(it->second);
+            }
+            else if (ParseInteger(*text, integer)) {
+                kind = CellKind::Integer;
+                integer_writer.PutVarU64(ZigZag(integer - previous_integer));
+                previous_integer = integer;
+            }
+            else if (ParseDouble(*text, number)) {
+                kind = CellKind::Double;
+                PutXorDouble(double_writer, number, previous_double);
+            }
+            else {
+                kind = CellKind::Text;
+                auto [it, inserted] = dictionary.try_emplace(*text, dictionary.size());
+                if (inserted) {
+                    dictionary_order.push_back(*text);
+                }
+                text_index_writer.PutVarU64(it->second);
+            }
+
+            if (!kind_runs.empty() && kind_runs.back().first == kind) {
+                ++kind_runs.back().second;
+            }
+            else {
+                kind_runs.emplace_back(kind, 1);
+            }
+        }
+
+        std::string rows;
+        ProtocolWriter row_writer(rows);
+        row_writer.PutVarU64(row_runs.size());
+        int64_t end = 0;
+        for (const auto& [first, length] : row_runs) {
+            row_writer.PutVarU64(first - end);
+            row_writer.PutVarU64(length);
+            end = first + static_cast<int64_t>(length);
+        }
+
+        std::string kinds;
+        ProtocolWriter kind_writer(kinds);
+        kind_writer.PutVarU64(kind_runs.size());
+        for (const auto& [kind, length] : kind_runs) {
+            kind_writer.PutU8(static_cast<uint8_t>(kind));
+            kind_writer.PutVarU64(length);
+        }
+
+        std::string texts;
+        ProtocolWriter text_writer(texts);
+        text_writer.PutVarU64(dictionary_order.size());
+        for (std::string_view entry : dictionary_order) {
+            text_writer.PutVarString(entry);
+        }
+        texts += text_indexes;
+
+        std::string formulas;
+        ProtocolWriter formula_writer(formulas);
+        formula_writer.PutVarU64(body_order.size());
+        for (const std::string* body : body_order) {
+            formula_writer.PutVarString(*body);
+        }
+        formulas += formula_indexes;
+
+        std::string block;
+        ProtocolWriter writer(block);
+        for (const std::string* section : { &rows, &kinds, &integers, &doubles, &texts, &formulas }) {
+            writer.PutVarString(*section);
+        }
+        return block;
+    }
+
+    std::vector<ColumnarSnapshot::Cell> DecodeBlock(std::string_view block, int col, size_t count) {
+        ProtocolReader reader(block);
+        ProtocolReader rows(reader.GetVarString());
+        ProtocolReader kinds(reader.GetVarString());
+        ProtocolReader integers(reader.GetVarString());
+        ProtocolReader doubles(reader.GetVarString());
+        ProtocolReader texts(reader.GetVarString());
+        ProtocolReader formulas(reader.GetVarString());
+        reader.ExpectEnd();
+
+        // размеры таблиц проверяются по длине блока до выделения памяти
+        const uint64_t dictionary_size = texts.GetVarU64();
+        if (dictionary_size > block.size()) {
+            ThrowCorrupted("invalid dictionary");
+        }
+        std::vector<std::string_view> dictionary;
+        dictionary.reserve(dictionary_size);
+        for (uint64_t i = 0; i < dictionary_size; ++i) {
+            dictionary.push_back(texts.GetVarString());
+        }
+        const uint64_t body_count = formulas.GetVarU64();
+        if (body_count > block.size()) {
+            ThrowCorrupted("invalid formula table");
+        }
+        std::vector<FormulaBody> bodies;
+        bodies.reserve(body_count);
+        for (uint64_t i = 0; i < body_count; ++i) {
+            bodies.push_back(ParseFormulaBody(formulas.GetVarString()));
+        }
+
+        uint64_t row_runs = rows.GetVarU64();
+        uint64_t kind_runs = kinds.GetVarU64();
+        uint64_t row_left = 0;
+        uint64_t kind_left = 0;
+        int64_t row = 0;
+        CellKind kind = CellKind::Text;
+        int64_t previous_integer = 0;
+        uint64_t previous_double = 0;
+
+        std::vector<ColumnarSnapshot::Cell> cells;
+        cells.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            if (row_left == 0) {
+                if (row_runs-- == 0) {
+                    ThrowCorrupted("row runs are too short");
+                }
+                const uint64_t gap = rows.GetVarU64();
+                row_left = rows.GetVarU64();
+                if (gap > Position::MAX_ROWS || row_left == 0 || row_left > Position::MAX_ROWS) {
+                    ThrowCorrupted("invalid row run");
+                }
+                row += static_cast<int64_t>(gap);
+            }
+            if (row >= Position::MAX_ROWS) {
+                ThrowCorrupted("row out of range");
+            }
+            if (kind_left == 0) {
+                if (kind_runs-- == 0) {
+                    ThrowCorrupted("kind runs are too short");
+                }
+                const uint8_t value = kinds.GetU8();
+                kind_left = kinds.GetVarU64();
+                if (value >= KIND_COUNT || kind_left == 0) {
+                    ThrowCorrupted("invalid kind run");
+                }
+                kind = static_cast<CellKind>(value);
+            }
+
+            const Position pos{ static_cast<int>(row), col };
+            std::string text;
+            switch (kind) {
+            case CellKind::Integer:
+                // повреждённые разности переполняются без неопределённого поведения
+                previous_integer = static_cast<int64_t>(static_cast<uint64_t>(previous_integer)
+                    + static_cast<uint64_t>(UnZigZag(integers.GetVarU64())));
+                text = std::to_string(previous_integer);
+                break;
+            case CellKind::Double:
+                text = FormatDouble(GetXorDouble(doubles, previous_double));
+                break;
+            case CellKind::Text: {
+                const uint64_t index = texts.GetVarU64();
+                if (index >= dictionary.size()) {
+                    ThrowCorrupted("text index out of range");
+                }
+                text = dictionary[index];
+                break;
+            }
+            case CellKind::Formula: {
+                const uint64_t index = formulas.GetVarU64();
+                if (index >= bodies.size()) {
+                    ThrowCorrupted("formula index out of range");
+                }
+                text = ExpandFormula(bodies[index], pos);
+                break;
+            }
+            }
+            cells.push_back({ pos, std::move(text) });
+            ++row;
+            --row_left;
+            --kind_left;
+        }
+        if (row_runs != 0 || row_left != 0 || kind_runs != 0 || kind_left != 0) {
+            ThrowCorrupted("cell count mismatch");
+        }
+        for (const ProtocolReader* section : { &rows, &kinds, &integers, &doubles, &texts, &formulas }) {
+            section->ExpectEnd();
+        }
+        return cells;
+    }
+}  // namespace
+
+std::string EncodeColumnarSnapshot(const SheetSnapshot& snapshot) {
+    std::map<int, std::vector<std::pair<int, const std::string*>>> columns;
+    for (const auto& [key, tile] : snapshot.GetTiles()) {
+        const Position origin{ static_cast<int>(key / SheetSnapshot::TILES_PER_ROW) * SheetSnapshot::TILE_SIZE,
+            static_cast<int>(key % SheetSnapshot::TILES_PER_ROW) * SheetSnapshot::TILE_SIZE };
+        for (int row = 0; row < SheetSnapshot::TILE_SIZE; ++row) {
+            for (int col = 0; col < SheetSnapshot::TILE_SIZE; ++col) {
+                const Position pos{ origin.row + row, origin.col + col };
+                if (const SheetSnapshot::Entry* entry = tile->Find(pos)) {
+                    columns[pos.col].emplace_back(pos.row, &entry->text);
+                }
+            }
+        }
+    }
+
+    std::string directory;
+    std::string blocks;
+    ProtocolWriter directory_writer(directory);
+    directory_writer.PutVarU64(columns.size());
+    for (auto& [col, cells] : columns) {
+        const std::string block = EncodeColumn(col, cells);
+        directory_writer.PutVarU64(col);
+        directory_writer.PutVarU64(cells.size());
+        directory_writer.PutVarU64(block.size());
+        directory_writer.PutU32(Crc32(block));
+        blocks += block;
+    }
+
+    std::string data(MAGIC);
+    ProtocolWriter writer(data);
+    writer.PutU32(FORMAT_VERSION);
+    data += directory;
+    data += blocks;
+    return data;
+}
+
+ColumnarSnapshot::ColumnarSnapshot(std::string_view data)
+    : data_(data) {
+    if (data.substr(0, MAGIC.size()) != MAGIC) {
+        throw ColumnarSnapshotException("Not a columnar snapshot");
+    }
+    try {
+        ProtocolReader reader(data.substr(MAGIC.size()));
+        if (reader.GetU32() != FORMAT_VERSION) {
+            throw ColumnarSnapshotException("Unsupported columnar snapshot version");
+        }
+        const uint64_t count = reader.GetVarU64();
+        if (count > static_cast<uint64_t>(Position::MAX_COLS)) {
+            ThrowCorrupted("too many columns");
+        }
+        columns_.reserve(count);
+        size_t offset = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            Column column;
+            const uint64_t col = reader.GetVarU64();
+            if (col >= static_cast<uint64_t>(Position::MAX_COLS) || (!columns_.empty() && static_cast<int>(col) <= columns_.back().col)) {
+                ThrowCorrupted("invalid column");
+            }
+            column.col = static_cast<int>(col);
+            const uint64_t cells = reader.GetVarU64();
+            const uint64_t size = reader.GetVarU64();
+            if (cells == 0 || cells > static_cast<uint64_t>(Position::MAX_ROWS) || size > data.size()) {
+                ThrowCorrupted("invalid column block");
+            }
+            column.cells = static_cast<size_t>(cells);
+            column.size = static_cast<size_t>(size);
+            column.crc = reader.GetU32();
+            column.offset = offset;
+            offset += column.size;
+            columns_.push_back(column);
+        }
+        // блоки начинаются сразу за каталогом
+        const size_t directory_end = data.size() - reader.GetRest().size();
+        if (reader.GetRest().size() != offset) {
+            ThrowCorrupted("block sizes do not match the data");
+        }
+        for (Column& column : columns_) {
+            column.offset += directory_end;
+        }
+    }
+    catch (const ProtocolException& e) {
+        ThrowCorrupted(e.what());
+    }
+}
+
+const std::vector<ColumnarSnapshot::Column>& ColumnarSnapshot::GetColumns() const {
+    return columns_;
+}
+
+std::vector<ColumnarSnapshot::Cell> ColumnarSnapshot::DecodeColumn(size_t index) const {
+    const Column& column = columns_.at(index);
+    const std::string_view block = data_.substr(column.offset, column.size);
+    if (Crc32(block) != column.crc) {
+        ThrowCorrupted("checksum mismatch in column " + std::to_string(column.col));
+    }
+    try {
+        return DecodeBlock(block, column.col, column.cells);
+    }
+    catch (const ProtocolException& e) {
+        ThrowCorrupted(e.what());
+    }
+}
+
+std::vector<std::vector<ColumnarSnapshot::Cell>> ColumnarSnapshot::DecodeAll(unsigned threads) const {
+    std::vector<std::vector<Cell>> result(columns_.size());
+    std::atomic<size_t> next = 0;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto work = [&] {
+        for (size_t index; (index = next++) < columns_.size();) {
+            try {
+                result[index] = DecodeColumn(index);
+            }
+            catch (...) {
+                std::lock_guard lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                // остальные блоки уже не нужны
+                next = columns_.size();
+            }
+        }
+    };
+
+    threads = static_cast<unsigned>(std::min<size_t>(std::max(threads, 1u), columns_.size()));
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; ++i) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return result;
+}
+
+void ColumnarSnapshot::Load(Sheet& sheet, unsigned threads) const {
+    std::vector<std::vector<Cell>> columns = DecodeAll(threads);
+    std::vector<Position> loaded;
+    try {
+        for (std::vector<Cell>& column : columns) {
+            for (Cell& cell : column) {
+                sheet.SetCell(cell.pos, std::move(cell.text));
+                loaded.push_back(cell.pos);
+            }
+        }
+    }
+    catch (...) {
+        // лист не остаётся загруженным наполовину
+        for (auto it = loaded.rbegin(); it != loaded.rend(); ++it) {
+            sheet.ClearCell(*it);
+        }
+        throw;
+    }
+}
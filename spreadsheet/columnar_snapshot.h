@@ -0,0 +1,80 @@
+﻿#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Sheet;
+class SheetSnapshot;
+
+// Исключение для данных, которые не являются столбцовым снимком или
+// повреждены
+class ColumnarSnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Сжатый столбцовый формат снимка листа для хранения на диске. Тексты
+// ячеек хранятся по столбцам, каждый столбец - отдельным блоком со своей
+// контрольной суммой, который декодируется независимо от остальных: можно
+// загрузить часть столбцов или декодировать блоки в нескольких потоках.
+//
+// Внутри блока ячейки разделены по видам, и каждый вид сжимается по-своему:
+// - целые числа - разностью с предыдущим целым столбца (zigzag, LEB128);
+// - прочие числа, текст которых совпадает с кратчайшей записью double, -
+//   XOR с предыдущим числом, от которого хранятся только ненулевые байты;
+// - остальной текст - словарём блока;
+// - формулы - ссылкой на общее тело формулы, в котором ссылки на ячейки
+//   записаны смещениями от самой ячейки, поэтому формулы, заполненные вниз
+//   по столбцу, хранят одно тело.
+// Номера строк хранятся отрезками подряд идущих строк, виды ячеек - длинами
+// серий. Текст каждой ячейки восстанавливается байт в байт.
+//
+// Формат: "SHEETCOL", u32 версия, каталог - LEB128 число блоков и для
+// каждого LEB128 столбец, число ячеек, длина блока и u32 CRC-32 блока;
+// затем блоки подряд в порядке каталога.
+std::string EncodeColumnarSnapshot(const SheetSnapshot& snapshot);
+
+// Чтение столбцового снимка. Конструктор разбирает только каталог, блоки
+// декодируются по запросу; методы чтения можно вызывать из разных потоков
+// одновременно. Данные должны жить дольше объекта.
+class ColumnarSnapshot {
+public:
+    struct Cell {
+        Position pos;
+        std::string text;
+    };
+
+    struct Column {
+        int col = 0;
+        size_t cells = 0;
+        size_t offset = 0;  // начало блока в данных
+        size_t size = 0;
+        uint32_t crc = 0;
+    };
+
+    // Бросает ColumnarSnapshotException, если каталог не разбирается или
+    // блоки выходят за пределы данных
+    explicit ColumnarSnapshot(std::string_view data);
+
+    // блоки по возрастанию столбцов
+    const std::vector<Column>& GetColumns() const;
+    // Ячейки блока по возрастанию строк. Бросает ColumnarSnapshotException
+    // для повреждённого блока.
+    std::vector<Cell> DecodeColumn(size_t index) const;
+    // все блоки, декодированные в threads потоках
+    std::vector<std::vector<Cell>> DecodeAll(unsigned threads = 1) const;
+    // Записывает ячейки снимка в лист: блоки декодируются в threads
+    // потоках, а ячейки устанавливаются в вызывающем. Повреждённый блок
+    // обнаруживается до изменения листа; если лист отклоняет ячейку, уже
+    // записанные ячейки очищаются и исключение бросается дальше.
+    void Load(Sheet& sheet, unsigned threads = 1) const;
+
+private:
+    std::string_view data_;
+    std::vector<Column> columns_;
+};
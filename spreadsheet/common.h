@@ -1,175 +1,274 @@
-﻿#pragma once
-
-#include <iosfwd>
-#include <memory>
-#include <stdexcept>
-#include <string>
-#include <string_view>
-#include <variant>
-#include <vector>
-
-// Позиция ячейки. Индексация с нуля.
-struct Position {
-    int row = 0;
-    int col = 0;
-
-    bool operator==(Position rhs) const;
-    bool operator<(Position rhs) const;
-
-    bool IsValid() const;
-    std::string ToString() const;
-
-    static Position FromString(std::string_view str);
-
-    static const int MAX_ROWS = 16384;
-    static const int MAX_COLS = 16384;
-    static const Position NONE;
-};
-
-namespace std {
-    template <>
-    struct hash<Position> {
-        std::size_t operator()(const Position& p) const noexcept {
-            return std::hash<int>()(p.col) ^ (std::hash<int>()(p.row) << 1);
-        }
-    };
-}
-
-struct Size {
-    int rows = 0;
-    int cols = 0;
-
-    bool operator==(Size rhs) const;
-};
-
-// Описывает ошибки, которые могут возникнуть при вычислении формулы.
-class FormulaError {
-public:
-    enum class Category {
-        Ref,    // ссылка на ячейку с некорректной позицией
-        Value,  // ячейка не может быть трактована как число
-        Arithmetic,  // некорректная арифметическая операция
-    };
-
-    FormulaError(Category category)
-        : category_(category)
-    {}
-
-    Category GetCategory() const {
-        return category_;
-    }
-
-    bool operator==(FormulaError rhs) const {
-        return category_ == rhs.GetCategory();
-    }
-
-    std::string_view ToString() const {
-        switch (category_) {
-            case Category::Ref:
-                return "REF";       // Некорректная ссылка на ячейку
-            case Category::Value:
-                return "VALUE";     // Ячейка не может быть трактована как число
-            case Category::Arithmetic:
-                return "DIV/0";     // Некорректная арифметическая операция
-            default:
-                return "UNKNOWN";   // На случай непредвиденной ситуации
-        }
-    }
-
-private:
-    Category category_;
-};
-
-std::ostream& operator<<(std::ostream& output, FormulaError fe);
-
-// Исключение, выбрасываемое при попытке передать в метод некорректную позицию
-class InvalidPositionException : public std::out_of_range {
-public:
-    using std::out_of_range::out_of_range;
-};
-
-// Исключение, выбрасываемое при попытке задать синтаксически некорректную
-// формулу
-class FormulaException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-// Исключение, выбрасываемое при попытке задать формулу, которая приводит к
-// циклической зависимости между ячейками
-class CircularDependencyException : public std::runtime_error {
-public:
-    using std::runtime_error::runtime_error;
-};
-
-class CellInterface {
-public:
-    // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
-    // формулы
-    using Value = std::variant<std::string, double, FormulaError>;
-
-    virtual ~CellInterface() = default;
-
-    // Возвращает видимое значение ячейки.
-    // В случае текстовой ячейки это её текст (без экранирующих символов). В
-    // случае формулы - числовое значение формулы или сообщение об ошибке.
-    virtual Value GetValue() const = 0;
-    // Возвращает внутренний текст ячейки, как если бы мы начали её
-    // редактирование. В случае текстовой ячейки это её текст (возможно,
-    // содержащий экранирующие символы). В случае формулы - её выражение.
-    virtual std::string GetText() const = 0;
-
-    // Возвращает список ячеек, которые непосредственно задействованы в данной
-    // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек. В случае текстовой ячейки список пуст.
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-};
-
-inline constexpr char FORMULA_SIGN = '=';
-inline constexpr char ESCAPE_SIGN = '\'';
-
-// Интерфейс таблицы
-class SheetInterface {
-public:
-    virtual ~SheetInterface() = default;
-
-    // Задаёт содержимое ячейки. Если текст начинается со знака "=", то он
-    // интерпретируется как формула. Если задаётся синтаксически некорректная
-    // формула, то бросается исключение FormulaException и значение ячейки не
-    // изменяется. Если задаётся формула, которая приводит к циклической
-    // зависимости (в частности, если формула использует текущую ячейку), то
-    // бросается исключение CircularDependencyException и значение ячейки не
-    // изменяется.
-    // Уточнения по записи формулы:
-    // * Если текст содержит только символ "=" и больше ничего, то он не считается
-    // формулой
-    // * Если текст начинается с символа "'" (апостроф), то при выводе значения
-    // ячейки методом GetValue() он опускается. Можно использовать, если нужно
-    // начать текст со знака "=", но чтобы он не интерпретировался как формула.
-    virtual void SetCell(Position pos, std::string text) = 0;
-
-    // Возвращает значение ячейки.
-    // Если ячейка пуста, может вернуть nullptr.
-    virtual const CellInterface* GetCell(Position pos) const = 0;
-    virtual CellInterface* GetCell(Position pos) = 0;
-
-    // Очищает ячейку.
-    // Последующий вызов GetCell() для этой ячейки вернёт либо nullptr, либо
-    // объект с пустым текстом.
-    virtual void ClearCell(Position pos) = 0;
-
-    // Вычисляет размер области, которая участвует в печати.
-    // Определяется как ограничивающий прямоугольник всех ячеек с непустым
-    // текстом.
-    virtual Size GetPrintableSize() const = 0;
-
-    // Выводит всю таблицу в переданный поток. Столбцы разделяются знаком
-    // табуляции. После каждой строки выводится символ перевода строки. Для
-    // преобразования ячеек в строку используются методы GetValue() или GetText()
-    // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
-    virtual void PrintValues(std::ostream& output) const = 0;
-    virtual void PrintTexts(std::ostream& output) const = 0;
-};
-
-// Создаёт готовую к работе пустую таблицу.
+﻿#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+// Позиция ячейки. Индексация с нуля.
+struct Position {
+    int row = 0;
+    int col = 0;
+
+    bool operator==(Position rhs) const;
+    bool operator<(Position rhs) const;
+
+    bool IsValid() const;
+    std::string ToString() const;
+
+    static Position FromString(std::string_view str);
+
+    static const int MAX_ROWS = 16384;
+    static const int MAX_COLS = 16384;
+    static const Position NONE;
+};
+
+namespace std {
+    template <>
+    struct hash<Position> {
+        std::size_t operator()(const Position& p) const noexcept {
+            return std::hash<int>()(p.row * Position::MAX_COLS + p.col);
+        }
+    };
+}
+
+// Ссылка на ячейку другого листа книги, например Sheet2!A1
+struct ExternalReference {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const ExternalReference& rhs) const;
+    bool operator<(const ExternalReference& rhs) const;
+};
+
+struct Size {
+    int rows = 0;
+    int cols = 0;
+
+    bool operator==(Size rhs) const;
+};
+
+// Прямоугольная область ячеек от first до last включительно
+struct CellRange {
+    Position first;
+    Position last;
+
+    bool Contains(Position pos) const;
+    bool operator==(const CellRange& rhs) const;
+};
+
+// Описывает ошибки, которые могут возникнуть при вычислении формулы.
+class FormulaError {
+public:
+    enum class Category {
+        Ref,    // ссылка на ячейку с некорректной позицией
+        Value,  // ячейка не может быть трактована как число
+        Arithmetic,  // некорректная арифметическая операция
+        NotAvailable,  // функция поиска не нашла значение
+    };
+
+    FormulaError(Category category)
+        : category_(category)
+    {}
+
+    Category GetCategory() const {
+        return category_;
+    }
+
+    bool operator==(FormulaError rhs) const {
+        return category_ == rhs.GetCategory();
+    }
+
+    std::string_view ToString() const {
+        switch (category_) {
+            case Category::Ref:
+                return "REF";       // Некорректная ссылка на ячейку
+            case Category::Value:
+                return "VALUE";     // Ячейка не может быть трактована как число
+            case Category::Arithmetic:
+                return "DIV/0";     // Некорректная арифметическая операция
+            case Category::NotAvailable:
+                return "N/A";       // Значение не найдено
+            default:
+                return "UNKNOWN";   // На случай непредвиденной ситуации
+        }
+    }
+
+private:
+    Category category_;
+};
+
+std::ostream& operator<<(std::ostream& output, FormulaError fe);
+
+// Значения прямоугольной области, заполняются Sheet::ReadRange построчно.
+// Буфер принадлежит вызывающему и переиспользуется между чтениями: чтение
+// области не большего размера не выделяет память, если значения формул
+// уже вычислены.
+struct RangeValues {
+    enum class Kind : uint8_t {
+        Empty,
+        Text,
+        Number,
+        Error,
+    };
+
+    struct Value {
+        Kind kind = Kind::Empty;
+        FormulaError::Category error = FormulaError::Category::Ref;  // для Error
+        double number = 0;                                           // для Number
+        std::string_view text;  // для Text, действителен до изменения ячейки
+    };
+
+    int rows = 0;
+    int cols = 0;
+    std::vector<Value> values;
+
+    const Value& At(int row, int col) const {
+        return values[static_cast<size_t>(row) * cols + col];
+    }
+};
+
+// Исключение, выбрасываемое при попытке передать в метод некорректную позицию
+class InvalidPositionException : public std::out_of_range {
+public:
+    using std::out_of_range::out_of_range;
+};
+
+// Исключение, выбрасываемое при попытке задать синтаксически некорректную
+// формулу
+class FormulaException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Исключение, выбрасываемое при попытке задать формулу, которая приводит к
+// циклической зависимости между ячейками
+class CircularDependencyException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Исключение, выбрасываемое, если после вставки строк или столбцов ячейки
+// вышли бы за пределы таблицы
+class TableTooBigException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class CellInterface {
+public:
+    // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
+    // формулы
+    using Value = std::variant<std::string, double, FormulaError>;
+    // То же значение без копирования текста: string_view указывает на текст,
+    // которым владеет ячейка, и действителен до изменения ячейки
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+
+    virtual ~CellInterface() = default;
+
+    // Возвращает видимое значение ячейки.
+    // В случае текстовой ячейки это её текст (без экранирующих символов). В
+    // случае формулы - числовое значение формулы или сообщение об ошибке.
+    virtual Value GetValue() const = 0;
+    // То же, что GetValue(), но без выделения памяти под текст
+    virtual ValueView GetValueView() const = 0;
+    // Возвращает внутренний текст ячейки, как если бы мы начали её
+    // редактирование. В случае текстовой ячейки это её текст (возможно,
+    // содержащий экранирующие символы). В случае формулы - её выражение.
+    virtual std::string GetText() const = 0;
+
+    // Возвращает список ячеек, которые непосредственно задействованы в данной
+    // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
+    // ячеек. В случае текстовой ячейки список пуст.
+    virtual std::vector<Position> GetReferencedCells() const = 0;
+};
+
+// Копирует значение из представления
+CellInterface::Value ToValue(const CellInterface::ValueView& view);
+
+// Читает число, записанное текстом целиком, так же, как его читают формулы.
+// Пустой текст даёт 0.
+std::optional<double> ParseNumber(std::string_view text);
+
+// Значение, которое ищут функции поиска (VLOOKUP, MATCH, XLOOKUP)
+using LookupValue = std::variant<double, std::string_view>;
+
+enum class LookupMode {
+    Exact,           // равное значение
+    LessOrEqual,     // равное или ближайшее меньшее
+    GreaterOrEqual,  // равное или ближайшее большее
+};
+
+// Значение ячейки для поиска: текст, похожий на число, считается числом,
+// пустая ячейка и ошибка не участвуют в поиске
+std::optional<LookupValue> ToLookupValue(const CellInterface::ValueView& view);
+
+// Порядок значений при поиске: числа меньше текста, текст сравнивается без
+// учёта регистра латинских букв
+int CompareLookupValues(const LookupValue& lhs, const LookupValue& rhs);
+
+inline constexpr char FORMULA_SIGN = '=';
+inline constexpr char ESCAPE_SIGN = '\'';
+
+// Интерфейс таблицы
+class SheetInterface {
+public:
+    virtual ~SheetInterface() = default;
+
+    // Задаёт содержимое ячейки. Если текст начинается со знака "=", то он
+    // интерпретируется как формула. Если задаётся синтаксически некорректная
+    // формула, то бросается исключение FormulaException и значение ячейки не
+    // изменяется. Если задаётся формула, которая приводит к циклической
+    // зависимости (в частности, если формула использует текущую ячейку), то
+    // бросается исключение CircularDependencyException и значение ячейки не
+    // изменяется.
+    // Уточнения по записи формулы:
+    // * Если текст содержит только символ "=" и больше ничего, то он не считается
+    // формулой
+    // * Если текст начинается с символа "'" (апостроф), то при выводе значения
+    // ячейки методом GetValue() он опускается. Можно использовать, если нужно
+    // начать текст со знака "=", но чтобы он не интерпретировался как формула.
+    virtual void SetCell(Position pos, std::string text) = 0;
+
+    // Возвращает значение ячейки.
+    // Если ячейка пуста, может вернуть nullptr.
+    virtual const CellInterface* GetCell(Position pos) const = 0;
+    virtual CellInterface* GetCell(Position pos) = 0;
+
+    // Очищает ячейку.
+    // Последующий вызов GetCell() для этой ячейки вернёт либо nullptr, либо
+    // объект с пустым текстом.
+    virtual void ClearCell(Position pos) = 0;
+
+    // Вычисляет размер области, которая участвует в печати.
+    // Определяется как ограничивающий прямоугольник всех ячеек с непустым
+    // текстом.
+    virtual Size GetPrintableSize() const = 0;
+
+    // Выводит всю таблицу в переданный поток. Столбцы разделяются знаком
+    // табуляции. После каждой строки выводится символ перевода строки. Для
+    // преобразования ячеек в строку используются методы GetValue() или GetText()
+    // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
+    virtual void PrintValues(std::ostream& output) const = 0;
+    virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает лист той же книги для ссылок вида Sheet2!A1 или nullptr,
+    // если такого листа нет. Таблица вне книги других листов не видит.
+    virtual const SheetInterface* FindSheet(std::string_view name) const {
+        return nullptr;
+    }
+
+    // Ищет значение в столбце column (first.col == last.col) и возвращает
+    // номер найденной строки относительно начала столбца. При равных значениях
+    // Exact и GreaterOrEqual находят первую такую строку, LessOrEqual -
+    // последнюю. Реализация по умолчанию просматривает столбец целиком.
+    virtual std::optional<int> FindInColumn(CellRange column, const LookupValue& value, LookupMode mode) const;
+};
+
+// Создаёт готовую к работе пустую таблицу.
 std::unique_ptr<SheetInterface> CreateSheet();
\ No newline at end of file
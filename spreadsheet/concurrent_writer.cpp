@@ -0,0 +1,133 @@
+﻿#include "concurrent_writer.h"
+
+#include <stdexcept>
+#include <utility>
+
+ConcurrentSheetWriter::ConcurrentSheetWriter(Sheet& sheet)
+    : sheet_(sheet) {
+    // имя есть только у листов книги
+    if (!sheet_.GetName().empty()) {
+        throw std::invalid_argument("Concurrent writing to a workbook sheet");
+    }
+    UpdateParseMode();
+}
+
+void ConcurrentSheetWriter::SetCell(Position pos, std::string text) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    Edit edit;
+    edit.pos = pos;
+    // некорректная формула не изменила бы лист, поэтому ошибка разбора
+    // бросается сразу, без очереди
+    if (!text.empty() && text.front() == FORMULA_SIGN && parse_in_writer_) {
+        edit.formula = ParseFormula(text.substr(1));
+    }
+    edit.text = std::move(text);
+    Submit(edit);
+}
+
+void ConcurrentSheetWriter::ClearCell(Position pos) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    Edit edit;
+    edit.pos = pos;
+    edit.clear = true;
+    Submit(edit);
+}
+
+CellInterface::Value ConcurrentSheetWriter::GetValue(Position pos) {
+    std::lock_guard lock(sheet_mutex_);
+    const CellInterface* cell = sheet_.GetCell(pos);
+    return cell ? cell->GetValue() : CellInterface::Value{};
+}
+
+std::string ConcurrentSheetWriter::GetText(Position pos) {
+    std::lock_guard lock(sheet_mutex_);
+    const CellInterface* cell = sheet_.GetCell(pos);
+    return cell ? cell->GetText() : std::string{};
+}
+
+void ConcurrentSheetWriter::Read(const std::function<void(const Sheet&)>& read) {
+    std::lock_guard lock(sheet_mutex_);
+    read(sheet_);
+}
+
+void ConcurrentSheetWriter::Modify(const std::function<void(Sheet&)>& change) {
+    std::lock_guard lock(sheet_mutex_);
+    ApplyPending();
+    // режимы листа перечитываются и тогда, когда change бросило исключение
+    try {
+        change(sheet_);
+    }
+    catch (...) {
+        UpdateParseMode();
+        throw;
+    }
+    UpdateParseMode();
+}
+
+ConcurrentSheetWriter::Stats ConcurrentSheetWriter::GetStats() const {
+    std::lock_guard lock(sheet_mutex_);
+    return stats_;
+}
+
+void ConcurrentSheetWriter::UpdateParseMode() {
+    parse_in_writer_ = !sheet_.IsLazyFormulaCompilation();
+}
+
+void ConcurrentSheetWriter::Submit(Edit& edit) {
+    {
+        std::lock_guard lock(queue_mutex_);
+        pending_.push_back(&edit);
+    }
+    std::unique_lock lock(sheet_mutex_);
+    // пока писатель ждал лист, его изменение мог применить другой поток
+    if (!edit.done) {
+        ApplyPending();
+    }
+    // копия указателя держит журнал, даже если его отключат до Commit
+    std::shared_ptr<EditLog> log = sheet_.GetEditLog();
+    lock.unlock();
+    if (edit.error) {
+        std::rethrow_exception(edit.error);
+    }
+    // журнал синхронизируется вне блокировки листа, чтобы писатели делили fsync
+    if (log) {
+        log->Commit();
+    }
+}
+
+void ConcurrentSheetWriter::ApplyPending() {
+    std::vector<Edit*> edits;
+    {
+        std::lock_guard lock(queue_mutex_);
+        edits.swap(pending_);
+    }
+    // изменение, поставленное после обмена, применит его писатель: он
+    // захватит лист позже и не найдёт изменение применённым
+    if (edits.empty()) {
+        return;
+    }
+    for (Edit* edit : edits) {
+        Apply(*edit);
+    }
+    ++stats_.rounds;
+}
+
+void ConcurrentSheetWriter::Apply(Edit& edit) {
+    try {
+        if (edit.clear) {
+            sheet_.ClearCell(edit.pos);
+        }
+        else {
+            sheet_.SetCell(edit.pos, std::move(edit.text), std::move(edit.formula));
+        }
+    }
+    catch (...) {
+        edit.error = std::current_exception();
+    }
+    edit.done = true;
+    ++stats_.edits;
+}
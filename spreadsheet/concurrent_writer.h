@@ -0,0 +1,87 @@
+﻿#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Запись в лист из нескольких потоков. Параллельно выполняется только
+// разбор формулы, самая дорогая часть SetCell: он идёт в вызывающем потоке
+// до любых блокировок. Таблица ячеек, граф зависимостей и кэши листа общие,
+// поэтому изменения применяются по одному через общую очередь с
+// объединением: писатель ставит изменение в очередь под коротким mutex,
+// а захвативший лист поток применяет всю очередь, и остальные писатели,
+// дождавшись листа, находят свои изменения уже применёнными. Так лист
+// захватывается один раз на группу изменений, а не на каждое. Проверка
+// циклов видит изменения по одному, так что из двух встречных формул,
+// замыкающих цикл, принимается только одна. Пока объект существует, лист
+// читается и меняется только через него; подписчики листа вызываются в
+// потоке, применившем изменение.
+class ConcurrentSheetWriter {
+public:
+    struct Stats {
+        uint64_t edits = 0;   // применённых изменений, включая отклонённые листом
+        uint64_t rounds = 0;  // захватов листа, применивших хотя бы одно изменение
+    };
+
+    // Лист книги не поддерживается: изменение ячейки меняет граф зависимостей
+    // других листов, для него бросается std::invalid_argument.
+    explicit ConcurrentSheetWriter(Sheet& sheet);
+
+    ConcurrentSheetWriter(const ConcurrentSheetWriter&) = delete;
+    ConcurrentSheetWriter& operator=(const ConcurrentSheetWriter&) = delete;
+
+    // Можно вызывать из любых потоков. Возвращают управление после
+    // применения изменения и бросают те же исключения, что и методы Sheet.
+    // Если у листа есть журнал (Sheet::SetEditLog), затем вызывается его
+    // Commit вне блокировки листа: при политике Group одновременные
+    // писатели делят один fsync. Писатель держит журнал до конца Commit,
+    // поэтому отключать его через Modify можно в любой момент.
+    void SetCell(Position pos, std::string text);
+    void ClearCell(Position pos);
+
+    // значение ячейки, у пустой ячейки - пустая строка
+    CellInterface::Value GetValue(Position pos);
+    std::string GetText(Position pos);
+
+    // Чтение листа целиком, например печать
+    void Read(const std::function<void(const Sheet&)>& read);
+    // Прочие изменения: вставка и удаление строк, отмена, пакеты, режимы
+    // листа и ёмкость кэша формул. Изменения, поставленные раньше,
+    // применяются до change.
+    void Modify(const std::function<void(Sheet&)>& change);
+
+    Stats GetStats() const;
+
+private:
+    // изменение живёт в стеке писателя, пока он ждёт применения
+    struct Edit {
+        Position pos;
+        std::string text;
+        bool clear = false;
+        std::shared_ptr<FormulaInterface> formula;  // разобранная заранее формула
+        std::exception_ptr error;
+        bool done = false;  // меняется под sheet_mutex_
+    };
+
+    void Submit(Edit& edit);
+    // вызываются под sheet_mutex_, очередь захватывается после листа
+    void UpdateParseMode();
+    void ApplyPending();
+    void Apply(Edit& edit);
+
+    Sheet& sheet_;
+    std::mutex queue_mutex_;
+    std::vector<Edit*> pending_;  // в порядке постановки
+    mutable std::mutex sheet_mutex_;
+    // в режиме ленивой компиляции лист сам откладывает разбор формул
+    std::atomic<bool> parse_in_writer_ = false;
+    Stats stats_;
+};
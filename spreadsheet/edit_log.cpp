@@ -0,0 +1,627 @@
+﻿#include "edit_log.h"
+
+#include "columnar_snapshot.h"
+#include "protocol.h"
+#include "sheet.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    constexpr std::string_view LOG_MAGIC = "SHEETLOG";
+    constexpr std::string_view CHECKPOINT_MAGIC = "SHEETCKP";
+    constexpr uint32_t FORMAT_VERSION = 1;
+    // версия 2 хранит ячейки в столбцовом формате
+    constexpr uint32_t CHECKPOINT_VERSION = 2;
+    constexpr size_t LOG_HEADER_SIZE = 8 + sizeof(uint32_t) + sizeof(uint64_t);
+    // длина записи и контрольная сумма
+    constexpr size_t RECORD_PREFIX_SIZE = 2 * sizeof(uint32_t);
+    // LSN и число операций
+    constexpr size_t RECORD_MIN_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+
+    void PutU32At(std::string& out, size_t offset, uint32_t value) {
+        for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+            out[offset + i] = static_cast<char>(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    [[noreturn]] void ThrowSystemError(const std::string& what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    // Файловые операции без буферизации библиотеки, чтобы fsync видел все
+    // записанные данные
+
+    int OpenFile(const std::string& path, bool truncate) {
+#ifdef _WIN32
+        int fd = ::_open(path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY | (truncate ? _O_TRUNC : 0), _S_IREAD | _S_IWRITE);
+#else
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+#endif
+        if (fd < 0) {
+            ThrowSystemError("open " + path);
+        }
+        return fd;
+    }
+
+    void CloseFile(int fd) {
+#ifdef _WIN32
+        ::_close(fd);
+#else
+        ::close(fd);
+#endif
+    }
+
+    void WriteAll(int fd, std::string_view data) {
+        while (!data.empty()) {
+#ifdef _WIN32
+            int written = ::_write(fd, data.data(), static_cast<unsigned>(std::min<size_t>(data.size(), 1u << 30)));
+#else
+            ssize_t written = ::write(fd, data.data(), data.size());
+#endif
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written < 0) {
+                ThrowSystemError("write");
+            }
+            data.remove_prefix(static_cast<size_t>(written));
+        }
+    }
+
+    void SyncFile(int fd) {
+#ifdef _WIN32
+        if (::_commit(fd) != 0) {
+#else
+        if (::fsync(fd) != 0) {
+#endif
+            ThrowSystemError("fsync");
+        }
+    }
+
+    // обрезает файл и ставит позицию записи в его конец
+    void TruncateFile(int fd, uint64_t size) {
+#ifdef _WIN32
+        if (::_chsize_s(fd, static_cast<long long>(size)) != 0 || ::_lseeki64(fd, 0, SEEK_END) < 0) {
+#else
+        if (::ftruncate(fd, static_cast<off_t>(size)) != 0 || ::lseek(fd, 0, SEEK_END) < 0) {
+#endif
+            ThrowSystemError("truncate");
+        }
+    }
+
+    // Переименование в каталоге становится устойчивым после fsync каталога.
+    // В Windows каталог так не синхронизируется, там достаточно переименования.
+    void SyncDirectory(const std::filesystem::path& path) {
+#ifndef _WIN32
+        std::filesystem::path directory = path.parent_path();
+        int fd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            ThrowSystemError("open " + directory.string());
+        }
+        int result = ::fsync(fd);
+        ::close(fd);
+        if (result != 0) {
+            ThrowSystemError("fsync " + directory.string());
+        }
+#endif
+    }
+
+    // содержимое файла или std::nullopt, если файла нет
+    std::optional<std::string> ReadFile(const std::string& path) {
+        std::ifstream input(path, std::ios::binary);
+        if (!input) {
+            if (!std::filesystem::exists(path)) {
+                return std::nullopt;
+            }
+            ThrowSystemError("open " + path);
+        }
+        std::string data(std::istreambuf_iterator<char>(input), {});
+        if (input.bad()) {
+            ThrowSystemError("read " + path);
+        }
+        return data;
+    }
+
+    std::string MakeLogHeader(uint64_t first_lsn) {
+        std::string header(LOG_MAGIC);
+        ProtocolWriter writer(header);
+        writer.PutU32(FORMAT_VERSION);
+        writer.PutU64(first_lsn);
+        return header;
+    }
+
+    void PutOperation(ProtocolWriter& writer, const EditLogOperation& operation) {
+        writer.PutU8(static_cast<uint8_t>(operation.kind));
+        switch (operation.kind) {
+            case EditLogOperation::Kind::Set:
+                writer.PutPosition(operation.pos);
+                writer.PutString32(operation.text);
+                break;
+            case EditLogOperation::Kind::Clear:
+                writer.PutPosition(operation.pos);
+                break;
+            default:
+                writer.PutU32(static_cast<uint32_t>(operation.index));
+                writer.PutU32(static_cast<uint32_t>(operation.count));
+                break;
+        }
+    }
+
+    EditLogOperation GetOperation(ProtocolReader& reader) {
+        EditLogOperation operation;
+        operation.kind = static_cast<EditLogOperation::Kind>(reader.GetU8());
+        switch (operation.kind) {
+            case EditLogOperation::Kind::Set:
+                operation.pos = reader.GetPosition();
+                operation.text = std::string(reader.GetString32());
+                break;
+            case EditLogOperation::Kind::Clear:
+                operation.pos = reader.GetPosition();
+                break;
+            case EditLogOperation::Kind::InsertRows:
+            case EditLogOperation::Kind::InsertCols:
+            case EditLogOperation::Kind::DeleteRows:
+            case EditLogOperation::Kind::DeleteCols:
+                operation.index = static_cast<int>(reader.GetU32());
+                operation.count = static_cast<int>(reader.GetU32());
+                break;
+            default:
+                throw ProtocolException("Unknown operation");
+        }
+        return operation;
+    }
+
+    void ApplyOperation(Sheet& sheet, const EditLogOperation& operation) {
+        switch (operation.kind) {
+            case EditLogOperation::Kind::Set:
+                sheet.SetCell(operation.pos, operation.text);
+                break;
+            case EditLogOperation::Kind::Clear:
+                sheet.ClearCell(operation.pos);
+                break;
+            case EditLogOperation::Kind::InsertRows:
+                sheet.InsertRows(operation.index, operation.count);
+                break;
+            case EditLogOperation::Kind::InsertCols:
+                sheet.InsertCols(operation.index, operation.count);
+                break;
+            case EditLogOperation::Kind::DeleteRows:
+                sheet.DeleteRows(operation.index, operation.count);
+                break;
+            case EditLogOperation::Kind::DeleteCols:
+                sheet.DeleteCols(operation.index, operation.count);
+                break;
+        }
+    }
+
+    struct LogRecord {
+        uint64_t lsn = 0;
+        std::vector<EditLogOperation> operations;
+    };
+
+    struct ParsedLog {
+        uint64_t first_lsn = 1;
+        std::vector<LogRecord> records;
+        size_t valid_size = 0;   // заголовок и целые записи; 0, если нет и заголовка
+        bool torn_tail = false;  // после целых записей остались данные
+    };
+
+    // Записи журнала до первой оборванной, повреждённой или идущей не по
+    // порядку. Бросает EditLogException, если файл не является журналом.
+    ParsedLog ParseLog(std::string_view data) {
+        ParsedLog log;
+        // заголовок мог не записаться целиком только у нового журнала
+        if (data.size() < LOG_HEADER_SIZE) {
+            log.torn_tail = !data.empty();
+            return log;
+        }
+        if (data.substr(0, LOG_MAGIC.size()) != LOG_MAGIC) {
+            throw EditLogException("Not an edit log");
+        }
+        ProtocolReader header(data.substr(LOG_MAGIC.size(), LOG_HEADER_SIZE - LOG_MAGIC.size()));
+        if (header.GetU32() != FORMAT_VERSION) {
+            throw EditLogException("Unsupported edit log version");
+        }
+        log.first_lsn = header.GetU64();
+        log.valid_size = LOG_HEADER_SIZE;
+
+        uint64_t expected_lsn = log.first_lsn;
+        std::string_view rest = data.substr(LOG_HEADER_SIZE);
+        while (rest.size() >= RECORD_PREFIX_SIZE) {
+            ProtocolReader prefix(rest.substr(0, RECORD_PREFIX_SIZE));
+            const uint32_t size = prefix.GetU32();
+            const uint32_t crc = prefix.GetU32();
+            if (size < RECORD_MIN_SIZE + sizeof(uint32_t) || size - sizeof(uint32_t) > rest.size() - RECORD_PREFIX_SIZE) {
+                break;
+            }
+            std::string_view body = rest.substr(RECORD_PREFIX_SIZE, size - sizeof(uint32_t));
+            if (Crc32(body) != crc) {
+                break;
+            }
+            LogRecord record;
+            try {
+                ProtocolReader reader(body);
+                record.lsn = reader.GetU64();
+                uint32_t count = reader.GetU32();
+                for (uint32_t i = 0; i < count; ++i) {
+                    record.operations.push_back(GetOperation(reader));
+                }
+                reader.ExpectEnd();
+            }
+            catch (const ProtocolException&) {
+                break;
+            }
+            if (record.lsn != expected_lsn) {
+                break;
+            }
+            ++expected_lsn;
+            log.records.push_back(std::move(record));
+            rest.remove_prefix(RECORD_PREFIX_SIZE + body.size());
+            log.valid_size += RECORD_PREFIX_SIZE + body.size();
+        }
+        log.torn_tail = log.valid_size != data.size();
+        return log;
+    }
+
+    // Контрольная точка: "SHEETCKP", u32 версия, u64 LSN, столбцовый снимок
+    // листа (columnar_snapshot.h), u32 CRC-32 всего после сигнатуры
+    void WriteCheckpoint(const std::string& path, const SheetSnapshot& snapshot, uint64_t lsn) {
+        std::string data(CHECKPOINT_MAGIC);
+        ProtocolWriter writer(data);
+        writer.PutU32(CHECKPOINT_VERSION);
+        writer.PutU64(lsn);
+        data += EncodeColumnarSnapshot(snapshot);
+        writer.PutU32(Crc32(std::string_view(data).substr(CHECKPOINT_MAGIC.size())));
+
+        // прежняя контрольная точка заменяется только целиком записанной новой
+        const std::string temp_path = path + ".tmp";
+        int fd = OpenFile(temp_path, true);
+        try {
+            WriteAll(fd, data);
+            SyncFile(fd);
+        }
+        catch (...) {
+            CloseFile(fd);
+            throw;
+        }
+        CloseFile(fd);
+        std::filesystem::rename(temp_path, path);
+        SyncDirectory(path);
+    }
+
+    // LSN контрольной точки или std::nullopt, если файла нет
+    std::optional<uint64_t> ReadCheckpoint(const std::string& path, Sheet& sheet) {
+        std::optional<std::string> data = ReadFile(path);
+        if (!data) {
+            return std::nullopt;
+        }
+        std::string_view view = *data;
+        if (view.substr(0, CHECKPOINT_MAGIC.size()) != CHECKPOINT_MAGIC || view.size() < CHECKPOINT_MAGIC.size() + sizeof(uint32_t)) {
+            throw EditLogException("Not a sheet checkpoint");
+        }
+        std::string_view body = view.substr(CHECKPOINT_MAGIC.size(), view.size() - CHECKPOINT_MAGIC.size() - sizeof(uint32_t));
+        if (Crc32(body) != ProtocolReader(view.substr(view.size() - sizeof(uint32_t))).GetU32()) {
+            throw EditLogException("Checkpoint checksum mismatch");
+        }
+        try {
+            ProtocolReader reader(body);
+            if (reader.GetU32() != CHECKPOINT_VERSION) {
+                throw EditLogException("Unsupported checkpoint version");
+            }
+            uint64_t lsn = reader.GetU64();
+            ColumnarSnapshot(reader.GetRest()).Load(sheet);
+            return lsn;
+        }
+        catch (const ProtocolException& e) {
+            throw EditLogException(std::string("Corrupted checkpoint: ") + e.what());
+        }
+        catch (const ColumnarSnapshotException& e) {
+            throw EditLogException(std::string("Corrupted checkpoint: ") + e.what());
+        }
+        catch (const FormulaException& e) {
+            throw EditLogException(std::string("Checkpoint cell cannot be restored: ") + e.what());
+        }
+        catch (const CircularDependencyException& e) {
+            throw EditLogException(std::string("Checkpoint cell cannot be restored: ") + e.what());
+        }
+    }
+}  // namespace
+
+EditLog::EditLog(std::string path)
+    : EditLog(std::move(path), Options{}) {
+}
+
+EditLog::EditLog(std::string path, Options options)
+    : path_(std::move(path))
+    , options_(options) {
+    std::optional<std::string> data = ReadFile(path_);
+    ParsedLog log = ParseLog(data ? std::string_view(*data) : std::string_view{});
+    last_lsn_ = log.records.empty() ? log.first_lsn - 1 : log.records.back().lsn;
+    written_lsn_ = last_lsn_;
+    durable_lsn_ = last_lsn_;
+
+    fd_ = OpenFile(path_, false);
+    try {
+        // оборванный хвост отрезается, новые записи идут сразу за целыми
+        TruncateFile(fd_, log.valid_size);
+        if (log.valid_size == 0) {
+            WriteAll(fd_, MakeLogHeader(log.first_lsn));
+        }
+        if (log.valid_size == 0 || log.torn_tail) {
+            SyncFile(fd_);
+        }
+    }
+    catch (...) {
+        CloseFile(fd_);
+        throw;
+    }
+    if (options_.policy == SyncPolicy::Interval) {
+        sync_thread_ = std::thread([this] {
+            RunSyncThread();
+        });
+    }
+}
+
+EditLog::~EditLog() {
+    if (sync_thread_.joinable()) {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        stop_sync_.notify_one();
+        sync_thread_.join();
+    }
+    try {
+        Sync();
+    }
+    catch (...) {
+        // ошибка записи уже сообщена или сообщить её некому
+    }
+    CloseFile(fd_);
+}
+
+uint64_t EditLog::Append(const std::vector<EditLogOperation>& operations) {
+    std::lock_guard lock(mutex_);
+    const size_t start = buffer_.size();
+    ProtocolWriter writer(buffer_);
+    writer.PutU32(0);
+    writer.PutU32(0);
+    writer.PutU64(++last_lsn_);
+    writer.PutU32(static_cast<uint32_t>(operations.size()));
+    for (const EditLogOperation& operation : operations) {
+        PutOperation(writer, operation);
+    }
+    const size_t body = start + RECORD_PREFIX_SIZE;
+    PutU32At(buffer_, start, static_cast<uint32_t>(buffer_.size() - start - sizeof(uint32_t)));
+    PutU32At(buffer_, start + sizeof(uint32_t), Crc32(std::string_view(buffer_).substr(body)));
+    ++stats_.records;
+    return last_lsn_;
+}
+
+void EditLog::Commit() {
+    Lock lock(mutex_);
+    ThrowSyncError();
+    const uint64_t target = last_lsn_;
+    switch (options_.policy) {
+        case SyncPolicy::Always:
+            AcquireFile(lock);
+            Flush(lock, true);
+            ReleaseFile();
+            break;
+        case SyncPolicy::Group:
+            // пока один поток пишет и синхронизирует, остальные копят записи
+            // для следующего fsync
+            while (durable_lsn_ < target && !sync_error_) {
+                if (file_busy_) {
+                    file_released_.wait(lock);
+                    continue;
+                }
+                file_busy_ = true;
+                Flush(lock, true);
+                ReleaseFile();
+            }
+            break;
+        case SyncPolicy::Interval:
+            break;
+        case SyncPolicy::None:
+            if (written_lsn_ < target) {
+                AcquireFile(lock);
+                if (written_lsn_ < target) {
+                    Flush(lock, false);
+                }
+                ReleaseFile();
+            }
+            break;
+    }
+    ThrowSyncError();
+}
+
+void EditLog::Sync() {
+    Lock lock(mutex_);
+    ThrowSyncError();
+    AcquireFile(lock);
+    Flush(lock, true);
+    ReleaseFile();
+    ThrowSyncError();
+}
+
+void EditLog::Checkpoint(Sheet& sheet, const std::string& checkpoint_path) {
+    Lock lock(mutex_);
+    ThrowSyncError();
+    AcquireFile(lock);
+    // записи буфера учтены контрольной точкой, в старый журнал их писать незачем
+    buffer_.clear();
+    const uint64_t lsn = last_lsn_;
+    std::shared_ptr<const SheetSnapshot> snapshot;
+    lock.unlock();
+    try {
+        snapshot = sheet.Snapshot();
+        WriteCheckpoint(checkpoint_path, *snapshot, lsn);
+        // журнал начинается заново со следующего LSN
+        TruncateFile(fd_, 0);
+        WriteAll(fd_, MakeLogHeader(lsn + 1));
+        SyncFile(fd_);
+    }
+    catch (...) {
+        lock.lock();
+        sync_error_ = std::current_exception();
+        ReleaseFile();
+        throw;
+    }
+    lock.lock();
+    written_lsn_ = std::max(written_lsn_, lsn);
+    durable_lsn_ = std::max(durable_lsn_, lsn);
+    ++stats_.syncs;
+    ReleaseFile();
+}
+
+EditLog::RecoveryInfo EditLog::Recover(Sheet& sheet, const std::string& log_path, const std::string& checkpoint_path) {
+    RecoveryInfo info;
+    if (std::optional<uint64_t> lsn = ReadCheckpoint(checkpoint_path, sheet)) {
+        info.checkpoint_lsn = *lsn;
+    }
+    info.last_lsn = info.checkpoint_lsn;
+
+    std::optional<std::string> data = ReadFile(log_path);
+    if (!data) {
+        return info;
+    }
+    ParsedLog log = ParseLog(*data);
+    info.torn_tail = log.torn_tail;
+    if (log.first_lsn > info.checkpoint_lsn + 1) {
+        throw EditLogException("Edit log does not continue the checkpoint");
+    }
+    for (const LogRecord& record : log.records) {
+        // записи до контрольной точки остаются, если сбой случился до очистки журнала
+        if (record.lsn <= info.checkpoint_lsn) {
+            continue;
+        }
+        if (record.operations.size() == 1) {
+            ApplyOperation(sheet, record.operations.front());
+        }
+        else {
+            sheet.BeginBatch();
+            try {
+                for (const EditLogOperation& operation : record.operations) {
+                    ApplyOperation(sheet, operation);
+                }
+            }
+            catch (...) {
+                sheet.EndBatch();
+                throw;
+            }
+            sheet.EndBatch();
+        }
+        ++info.replayed;
+        info.last_lsn = record.lsn;
+    }
+    return info;
+}
+
+EditLog::SyncPolicy EditLog::GetPolicy() const {
+    return options_.policy;
+}
+
+uint64_t EditLog::GetLastLsn() const {
+    std::lock_guard lock(mutex_);
+    return last_lsn_;
+}
+
+uint64_t EditLog::GetDurableLsn() const {
+    std::lock_guard lock(mutex_);
+    return durable_lsn_;
+}
+
+EditLog::Stats EditLog::GetStats() const {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+void EditLog::Flush(Lock& lock, bool sync) {
+    if (sync_error_) {
+        return;
+    }
+    writing_.swap(buffer_);
+    const uint64_t lsn = last_lsn_;
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+        WriteAll(fd_, writing_);
+        if (sync) {
+            SyncFile(fd_);
+        }
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+    lock.lock();
+    if (error) {
+        // часть записей могла попасть в файл: дописывать за ними нельзя
+        sync_error_ = error;
+        return;
+    }
+    if (!writing_.empty()) {
+        stats_.bytes += writing_.size();
+        ++stats_.writes;
+    }
+    writing_.clear();
+    written_lsn_ = lsn;
+    if (sync) {
+        durable_lsn_ = lsn;
+        ++stats_.syncs;
+    }
+}
+
+void EditLog::AcquireFile(Lock& lock) {
+    file_released_.wait(lock, [this] {
+        return !file_busy_;
+    });
+    file_busy_ = true;
+}
+
+void EditLog::ReleaseFile() {
+    file_busy_ = false;
+    file_released_.notify_all();
+}
+
+void EditLog::RunSyncThread() {
+    Lock lock(mutex_);
+    while (true) {
+        stop_sync_.wait_for(lock, options_.sync_interval, [this] {
+            return stop_;
+        });
+        if (stop_) {
+            return;
+        }
+        if (sync_error_ || durable_lsn_ == last_lsn_) {
+            continue;
+        }
+        AcquireFile(lock);
+        Flush(lock, true);
+        ReleaseFile();
+    }
+}
+
+void EditLog::ThrowSyncError() {
+    if (sync_error_) {
+        std::rethrow_exception(sync_error_);
+    }
+}
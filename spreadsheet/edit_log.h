@@ -0,0 +1,155 @@
+﻿#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Sheet;
+
+// Исключение для файла журнала или контрольной точки, который не удаётся
+// разобрать. Ошибки ввода-вывода бросаются как std::system_error.
+class EditLogException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Изменение листа в журнале
+struct EditLogOperation {
+    enum class Kind : uint8_t {
+        Set = 1,
+        Clear,
+        InsertRows,
+        InsertCols,
+        DeleteRows,
+        DeleteCols,
+    };
+
+    Kind kind = Kind::Set;
+    Position pos;      // Set и Clear
+    std::string text;  // Set
+    int index = 0;     // первая строка или столбец вставки и удаления
+    int count = 0;
+};
+
+// Журнал изменений листа для восстановления после сбоя (write-ahead log).
+// Лист с журналом (Sheet::SetEditLog) дописывает каждую успешную операцию
+// одной записью: изменение ячейки, вставку или удаление строк и столбцов,
+// пакет BeginBatch/EndBatch или отмену. Запись получает возрастающий номер
+// LSN и защищена контрольной суммой CRC-32, поэтому запись, оборванная
+// сбоем, при чтении отбрасывается вместе со всем, что за ней.
+//
+// Append только добавляет запись в буфер, в файл её переносит Commit
+// согласно политике синхронизации. Commit вызывается после изменения листа
+// вне блокировки листа: тогда при политике Group потоки, ждущие Commit
+// одновременно, делят один fsync. Журнал потокобезопасен.
+//
+// Формат файла: заголовок - 8 байт "SHEETLOG", u32 версия, u64 LSN первой
+// записи; запись - u32 длина, u32 CRC-32 остатка, u64 LSN, u32 число
+// операций, операции. Числа в порядке little-endian, строки и позиции
+// кодируются как в протоколе сервера (protocol.h).
+class EditLog {
+public:
+    enum class SyncPolicy {
+        Always,    // каждый Commit записывает буфер и ждёт собственного fsync
+        Group,     // Commit ждёт fsync; записи, накопившиеся за время чужого fsync, синхронизирует следующий общий fsync
+        Interval,  // fsync делает фоновый поток раз в sync_interval, Commit не ждёт; при сбое теряется последний интервал
+        None,      // Commit передаёт данные ОС без fsync: они переживают падение процесса, но не системы
+    };
+
+    struct Options {
+        SyncPolicy policy = SyncPolicy::Group;
+        std::chrono::milliseconds sync_interval{ 10 };
+    };
+
+    struct Stats {
+        uint64_t records = 0;  // записей, добавленных Append
+        uint64_t bytes = 0;    // байт, записанных в файл
+        uint64_t writes = 0;   // записей буфера в файл
+        uint64_t syncs = 0;    // вызовов fsync
+    };
+
+    // Результат восстановления листа
+    struct RecoveryInfo {
+        uint64_t checkpoint_lsn = 0;  // LSN последней записи, учтённой контрольной точкой
+        uint64_t replayed = 0;        // записей журнала, применённых после неё
+        uint64_t last_lsn = 0;        // LSN последней применённой записи
+        bool torn_tail = false;       // в конце журнала есть оборванная или повреждённая запись
+    };
+
+    // Открывает журнал или создаёт пустой. Оборванный хвост существующего
+    // журнала отрезается, новые записи продолжают его нумерацию.
+    explicit EditLog(std::string path);
+    EditLog(std::string path, Options options);
+    // записывает и синхронизирует оставшиеся записи
+    ~EditLog();
+
+    EditLog(const EditLog&) = delete;
+    EditLog& operator=(const EditLog&) = delete;
+
+    // Добавляет операции одной записью и возвращает её LSN. Не обращается
+    // к файлу и не бросает исключений, кроме нехватки памяти.
+    uint64_t Append(const std::vector<EditLogOperation>& operations);
+    // Делает записи, добавленные до вызова, устойчивыми согласно политике.
+    // Ошибка записи фонового потока бросается из следующего Commit.
+    void Commit();
+    // Записывает и синхронизирует все добавленные записи при любой политике
+    void Sync();
+
+    // Записывает содержимое листа в файл контрольной точки и очищает журнал:
+    // следующая запись получит следующий LSN. Файл заменяется атомарно,
+    // поэтому сбой во время записи оставляет прежнюю контрольную точку и
+    // журнал. Вызывается там же, где меняется лист, чтобы лист не менялся
+    // во время вызова.
+    void Checkpoint(Sheet& sheet, const std::string& checkpoint_path);
+
+    // Восстанавливает пустой лист: загружает контрольную точку, если файл
+    // есть, и применяет записи журнала после неё до первой повреждённой.
+    // Контрольная точка загружается целиком или никак: если она повреждена
+    // или лист отклоняет её ячейку, бросается EditLogException и лист
+    // остаётся пустым. Журнал к листу в это время подключать не нужно.
+    static RecoveryInfo Recover(Sheet& sheet, const std::string& log_path, const std::string& checkpoint_path);
+
+    SyncPolicy GetPolicy() const;
+    uint64_t GetLastLsn() const;
+    // LSN последней записи, синхронизированной fsync
+    uint64_t GetDurableLsn() const;
+    Stats GetStats() const;
+
+private:
+    using Lock = std::unique_lock<std::mutex>;
+
+    // Переносит буфер в файл; файл в это время занят вызывающим потоком
+    // (file_busy_), а mutex_ отпускается на время ввода-вывода
+    void Flush(Lock& lock, bool sync);
+    // ждёт освобождения файла и занимает его
+    void AcquireFile(Lock& lock);
+    void ReleaseFile();
+    void RunSyncThread();
+    void ThrowSyncError();
+
+    const std::string path_;
+    const Options options_;
+    int fd_ = -1;
+
+    mutable std::mutex mutex_;
+    std::condition_variable file_released_;
+    std::condition_variable stop_sync_;
+    std::string buffer_;   // записи, ещё не переданные в файл
+    std::string writing_;  // буфер, который записывается сейчас
+    uint64_t last_lsn_ = 0;
+    uint64_t written_lsn_ = 0;
+    uint64_t durable_lsn_ = 0;
+    bool file_busy_ = false;
+    bool stop_ = false;
+    std::exception_ptr sync_error_;
+    Stats stats_;
+    std::thread sync_thread_;  // только при политике Interval
+};
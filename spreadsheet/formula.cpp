@@ -1,66 +1,399 @@
-﻿#include "formula.h"
-
-#include "FormulaAST.h"
-
-#include <algorithm>
-#include <cassert>
-#include <cctype>
-#include <sstream>
-
-using namespace std::literals;
-
-std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#ARITHM!";
-}
-
-namespace {
-    class Formula : public FormulaInterface {
-    public: 
-
-        Formula(std::string expression)
-            try
-            : ast_(ParseFormulaAST(std::move(expression)))
-        {}
-        catch (const FormulaException& e) {
-            throw FormulaException("Error parsing formula");
-        }
-
-        Value Evaluate(const SheetInterface& sheet) const override {
-            /*Должен вычислять значение формулы и возвращать число, если формулу удалось вычислить. 
-            Если не удалось, должен возвращать ошибку вычисления FormulaError. 
-            Для этого в файле common.h объявлен метод вывода ошибки в поток, а в файле formula.cpp он реализован.*/
-            try {
-                return ast_.Execute(sheet);
-            } 
-            catch (const FormulaError& e) {
-                return e;
-            }
-        }
-
-        std::string GetExpression() const override { 
-            std::ostringstream oss;
-            ast_.PrintFormula(oss);
-            return oss.str();
-        } 
-         
-        std::vector<Position> GetReferencedCells() const {
-            auto positions = ast_.GetCells();
-            std::unordered_set<Position> unique_positions;
-
-            for (const auto& pos : positions) {
-                unique_positions.insert(pos);  
-            }
-
-            return std::vector<Position>(unique_positions.begin(), unique_positions.end());
-        }
-
-
-
-    private:
-        FormulaAST ast_;
-    };
-}  // namespace
-
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
-}
\ No newline at end of file
+﻿#include "formula.h"
+
+#include "FormulaAST.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <iterator>
+#include <optional>
+#include <sstream>
+
+using namespace std::literals;
+
+std::ostream& operator<<(std::ostream& output, FormulaError fe) {
+    switch (fe.GetCategory()) {
+        case FormulaError::Category::Ref:
+            return output << "#REF!";
+        case FormulaError::Category::Value:
+            return output << "#VALUE!";
+        case FormulaError::Category::NotAvailable:
+            return output << "#N/A";
+        default:
+            return output << "#ARITHM!";
+    }
+}
+
+namespace {
+    class Formula : public FormulaInterface {
+    public: 
+
+        Formula(std::string expression)
+            try
+            : ast_(ParseFormulaAST(std::move(expression)))
+        {}
+        catch (const FormulaException& e) {
+            throw FormulaException("Error parsing formula");
+        }
+
+        Value Evaluate(const SheetInterface& sheet) const override {
+            /*Должен вычислять значение формулы и возвращать число, если формулу удалось вычислить. 
+            Если не удалось, должен возвращать ошибку вычисления FormulaError. 
+            Для этого в файле common.h объявлен метод вывода ошибки в поток, а в файле formula.cpp он реализован.*/
+            try {
+                return ast_.Execute(sheet);
+            } 
+            catch (const FormulaError& e) {
+                return e;
+            }
+        }
+
+        std::string GetExpression() const override { 
+            return std::string(GetExpressionView());
+        } 
+
+        std::string_view GetExpressionView() const override {
+            return GetTextView().substr(1);
+        }
+
+        std::string_view GetTextView() const override {
+            if (!expression_) {
+                std::ostringstream oss;
+                oss << FORMULA_SIGN;
+                ast_.PrintFormula(oss);
+                expression_ = oss.str();
+            }
+            return *expression_;
+        }
+         
+        std::vector<Position> GetReferencedCells() const {
+            // ячейки в AST уже отсортированы, остаётся убрать повторы;
+            // удалённые ссылки невалидны и при сортировке оказываются в начале
+            const auto& positions = ast_.GetCells();
+            auto first_valid = std::find_if(positions.begin(), positions.end(),
+                [](Position pos) { return pos.IsValid(); });
+            std::vector<Position> cells(first_valid, positions.end());
+            cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+            return cells;
+        }
+
+        std::vector<ExternalReference> GetExternalReferences() const override {
+            std::vector<ExternalReference> cells;
+            for (const auto& cell : ast_.GetExternalCells()) {
+                if (cell.pos.IsValid()) {
+                    cells.push_back(cell);
+                }
+            }
+            cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+            return cells;
+        }
+
+        std::vector<CellRange> GetReferencedRanges() const override {
+            std::vector<CellRange> ranges;
+            for (const CellRange& range : ast_.GetRanges()) {
+                if (range.first.IsValid() && std::find(ranges.begin(), ranges.end(), range) == ranges.end()) {
+                    ranges.push_back(range);
+                }
+            }
+            return ranges;
+        }
+
+        HandlingResult HandleInsertedRows(int before, int count, std::string_view sheet) override {
+            return RewriteReferences(sheet, [before, count](Position pos) {
+                if (pos.row >= before) {
+                    pos.row += count;
+                }
+                return pos;
+            });
+        }
+
+        HandlingResult HandleInsertedCols(int before, int count, std::string_view sheet) override {
+            return RewriteReferences(sheet, [before, count](Position pos) {
+                if (pos.col >= before) {
+                    pos.col += count;
+                }
+                return pos;
+            });
+        }
+
+        HandlingResult HandleDeletedRows(int first, int count, std::string_view sheet) override {
+            return RewriteReferences(sheet, [first, count](Position pos) {
+                if (pos.row >= first + count) {
+                    pos.row -= count;
+                }
+                else if (pos.row >= first) {
+                    pos = Position::NONE;
+                }
+                return pos;
+            });
+        }
+
+        HandlingResult HandleDeletedCols(int first, int count, std::string_view sheet) override {
+            return RewriteReferences(sheet, [first, count](Position pos) {
+                if (pos.col >= first + count) {
+                    pos.col -= count;
+                }
+                else if (pos.col >= first) {
+                    pos = Position::NONE;
+                }
+                return pos;
+            });
+        }
+
+        std::unique_ptr<FormulaInterface> Clone() const override {
+            return std::make_unique<Formula>(*this);
+        }
+
+        const FormulaProgram* GetProgram() const override {
+            if (!program_) {
+                // пустая программа означает, что формулу выразить нельзя
+                program_.emplace();
+                // операндов столько же, сколько ссылок, и почти столько же операций
+                const auto& cells = ast_.GetCells();
+                program_->reserve(2 * std::distance(cells.begin(), cells.end()) + 1);
+                if (!ast_.Compile(*program_)) {
+                    program_->clear();
+                }
+            }
+            return program_->empty() ? nullptr : &*program_;
+        }
+
+        bool IsConditional() const override {
+            return ast_.IsConditional();
+        }
+
+        size_t GetAllocatedBytes() const override {
+            size_t bytes = sizeof(*this) + ast_.GetAllocatedBytes();
+            if (expression_) {
+                bytes += expression_->capacity();
+            }
+            if (program_) {
+                bytes += program_->capacity() * sizeof(FormulaInstruction);
+            }
+            return bytes;
+        }
+
+    private:
+        // Переписывает позиции ячеек прямо в AST: узлы выражения указывают на
+        // элементы списка ячеек, поэтому текст формулы не разбирается заново
+        template <typename Remap>
+        HandlingResult RewriteReferences(std::string_view sheet, Remap remap) {
+            bool renamed = false;
+            bool deleted = false;
+            auto rewrite = [&](Position& pos) {
+                if (!pos.IsValid()) {
+                    return;
+                }
+                Position moved = remap(pos);
+                if (moved == pos) {
+                    return;
+                }
+                (moved.IsValid() ? renamed : deleted) = true;
+                pos = moved;
+            };
+            if (sheet.empty()) {
+                for (Position& pos : ast_.GetCells()) {
+                    rewrite(pos);
+                }
+                for (CellRange& range : ast_.GetRanges()) {
+                    if (!range.first.IsValid()) {
+                        continue;
+                    }
+                    CellRange moved = RemapRange(range, remap);
+                    if (moved == range) {
+                        continue;
+                    }
+                    // вставка или удаление внутри области меняет номера её строк
+                    bool resized = !moved.first.IsValid()
+                        || moved.last.row - moved.first.row != range.last.row - range.first.row
+                        || moved.last.col - moved.first.col != range.last.col - range.first.col;
+                    (resized ? deleted : renamed) = true;
+                    range = moved;
+                }
+            }
+            else {
+                for (ExternalReference& cell : ast_.GetExternalCells()) {
+                    if (cell.sheet == sheet) {
+                        rewrite(cell.pos);
+                    }
+                }
+            }
+            if (!renamed && !deleted) {
+                return HandlingResult::NothingChanged;
+            }
+            // sort переставляет узлы списка, указатели на позиции остаются верными
+            ast_.GetCells().sort();
+            ast_.GetExternalCells().sort();
+            expression_.reset();
+            program_.reset();
+            return deleted ? HandlingResult::ReferencesChanged : HandlingResult::ReferencesRenamedOnly;
+        }
+
+        // Угол области, попавший в удалённые строки или столбцы, сдвигается
+        // внутрь области до первой уцелевшей позиции. remap меняет только
+        // строки или только столбцы, поэтому шаги по обоим направлениям
+        // находят уцелевшую позицию, если она есть.
+        template <typename Remap>
+        static CellRange RemapRange(const CellRange& range, Remap remap) {
+            auto remap_corner = [&remap](Position corner, Position toward) {
+                int row_step = toward.row < corner.row ? -1 : 1;
+                int col_step = toward.col < corner.col ? -1 : 1;
+                for (int row = corner.row; row != toward.row + row_step; row += row_step) {
+                    Position moved = remap(Position{ row, corner.col });
+                    if (moved.IsValid()) {
+                        return moved;
+                    }
+                }
+                for (int col = corner.col; col != toward.col + col_step; col += col_step) {
+                    Position moved = remap(Position{ corner.row, col });
+                    if (moved.IsValid()) {
+                        return moved;
+                    }
+                }
+                return Position::NONE;
+            };
+            CellRange moved{ remap_corner(range.first, range.last), remap_corner(range.last, range.first) };
+            if (!moved.first.IsValid() || !moved.last.IsValid()) {
+                return { Position::NONE, Position::NONE };
+            }
+            return moved;
+        }
+
+        FormulaAST ast_;
+        mutable std::optional<std::string> expression_; // каноническое выражение со знаком "="
+        mutable std::optional<FormulaProgram> program_; // позиции ячеек абсолютные
+    };
+}  // namespace
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+    return std::make_unique<Formula>(std::move(expression));
+}
+
+namespace {
+    bool IsFormulaSpace(char ch) {
+        return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+    }
+
+    bool IsDigit(char ch) {
+        return ch >= '0' && ch <= '9';
+    }
+
+    bool IsUpper(char ch) {
+        return ch >= 'A' && ch <= 'Z';
+    }
+
+    // Пропускает последовательность цифр, возвращает их количество
+    size_t SkipDigits(std::string_view expression, size_t& i) {
+        size_t start = i;
+        while (i < expression.size() && IsDigit(expression[i])) {
+            ++i;
+        }
+        return i - start;
+    }
+
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    bool SkipNumber(std::string_view expression, size_t& i) {
+        size_t int_digits = SkipDigits(expression, i);
+        if (i < expression.size() && expression[i] == '.') {
+            ++i;
+            if (SkipDigits(expression, i) == 0) {
+                return false;
+            }
+        }
+        else if (int_digits == 0) {
+            return false;
+        }
+        if (i < expression.size() && (expression[i] == 'e' || expression[i] == 'E')) {
+            ++i;
+            if (i < expression.size() && (expression[i] == '+' || expression[i] == '-')) {
+                ++i;
+            }
+            if (SkipDigits(expression, i) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+}  // namespace
+
+std::optional<std::vector<Position>> ScanFormulaReferences(std::string_view expression) {
+    std::vector<Position> references;
+    // грамматика формулы сводится к чередованию операндов и бинарных операций,
+    // поэтому достаточно автомата из двух состояний и счётчика скобок
+    bool expect_operand = true;
+    int depth = 0;
+    size_t i = 0;
+
+    while (i < expression.size()) {
+        char ch = expression[i];
+        if (IsFormulaSpace(ch)) {
+            ++i;
+            continue;
+        }
+
+        if (expect_operand) {
+            if (ch == '+' || ch == '-') {
+                ++i;
+            }
+            else if (ch == '(') {
+                ++depth;
+                ++i;
+            }
+            else if (IsDigit(ch) || ch == '.') {
+                size_t start = i;
+                if (!SkipNumber(expression, i)) {
+                    return std::nullopt;
+                }
+                // выход за пределы double парсер считает ошибкой
+                std::string number(expression.substr(start, i - start));
+                errno = 0;
+                std::strtod(number.c_str(), nullptr);
+                if (errno == ERANGE) {
+                    return std::nullopt;
+                }
+                expect_operand = false;
+            }
+            else if (IsUpper(ch)) {
+                size_t start = i;
+                while (i < expression.size() && IsUpper(expression[i])) {
+                    ++i;
+                }
+                if (SkipDigits(expression, i) == 0) {
+                    return std::nullopt;
+                }
+                Position pos = Position::FromString(expression.substr(start, i - start));
+                if (!pos.IsValid()) {
+                    return std::nullopt;
+                }
+                references.push_back(pos);
+                expect_operand = false;
+            }
+            else {
+                return std::nullopt;
+            }
+        }
+        else {
+            if (ch == '+' || ch == '-' || ch == '*' || ch == '/') {
+                expect_operand = true;
+                ++i;
+            }
+            else if (ch == ')' && depth > 0) {
+                --depth;
+                ++i;
+            }
+            else {
+                return std::nullopt;
+            }
+        }
+    }
+
+    if (expect_operand || depth != 0) {
+        return std::nullopt;
+    }
+
+    std::sort(references.begin(), references.end());
+    references.erase(std::unique(references.begin(), references.end()), references.end());
+    return references;
+}
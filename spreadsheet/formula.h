@@ -1,41 +1,130 @@
-﻿#pragma once
-
-#include "common.h"
-
-#include <memory>
-#include <vector>
-
-// Формула, позволяющая вычислять и обновлять арифметическое выражение.
-// Поддерживаемые возможности:
-// * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
-// * Значения ячеек в качестве переменных: A1+B2*C3
-// Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
-// текст, но он представляет число, тогда его нужно трактовать как число. Пустая
-// ячейка или ячейка с пустым текстом трактуется как число ноль.
-class FormulaInterface {
-public:
-    using Value = std::variant<double, FormulaError>;
-
-    virtual ~FormulaInterface() = default;
-
-    // Обратите внимание, что в метод Evaluate() ссылка на таблицу передаётся 
-    // в качестве аргумента.
-    // Возвращает вычисленное значение формулы для переданного листа либо ошибку.
-    // Если вычисление какой-то из указанных в формуле ячеек приводит к ошибке, то
-    // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
-    // любая.
-    virtual Value Evaluate(const SheetInterface& sheet) const = 0;
-
-    // Возвращает выражение, которое описывает формулу.
-    // Не содержит пробелов и лишних скобок.
-    virtual std::string GetExpression() const = 0;
-
-    // Возвращает список ячеек, которые непосредственно задействованы в вычислении
-    // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-};
-
-// Парсит переданное выражение и возвращает объект формулы.
-// Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+﻿#pragma once
+
+#include "common.h"
+
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// Инструкция формулы в обратной польской записи. Программа формулы
+// выполняется в том же порядке, что и обычное вычисление, и используется
+// для пакетного вычисления одинаковых формул, см. FormulaBatch.
+struct FormulaInstruction {
+    enum class Type : char {
+        Number,       // положить число
+        Cell,         // положить числовое значение ячейки
+        Add,          // бинарные операции, #ARITHM! при бесконечном результате
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,       // унарный минус, #VALUE! при бесконечном результате
+        CheckFinite,  // унарный плюс, #VALUE! при бесконечном значении
+    };
+
+    Type type = Type::Number;
+    double number = 0;                // для Number
+    Position cell = Position::NONE;   // для Cell
+};
+
+using FormulaProgram = std::vector<FormulaInstruction>;
+
+// Формула, позволяющая вычислять и обновлять арифметическое выражение.
+// Поддерживаемые возможности:
+// * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
+// * Значения ячеек в качестве переменных: A1+B2*C3
+// * Ячейки других листов книги: Sheet2!A1, 'Итоги за май'!B3
+// * Сравнения и логические функции: A1>=0, IF(A1>0,B1,C1), AND(A1,B1), OR(A1,B1).
+//   Истина - это 1, ложь - 0. Функции вычисляют только те аргументы, от
+//   которых зависит результат.
+// * Функции поиска по областям своего листа: VLOOKUP(A1,B1:D100,3,0),
+//   MATCH(A1,B1:B100,0), XLOOKUP(A1,B1:B100,C1:C100,-1). Ненайденное значение
+//   даёт #N/A. Результат - число из найденной ячейки.
+// Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
+// текст, но он представляет число, тогда его нужно трактовать как число. Пустая
+// ячейка или ячейка с пустым текстом трактуется как число ноль.
+class FormulaInterface {
+public:
+    using Value = std::variant<double, FormulaError>;
+
+    virtual ~FormulaInterface() = default;
+
+    // Обратите внимание, что в метод Evaluate() ссылка на таблицу передаётся 
+    // в качестве аргумента.
+    // Возвращает вычисленное значение формулы для переданного листа либо ошибку.
+    // Если вычисление какой-то из указанных в формуле ячеек приводит к ошибке, то
+    // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
+    // любая.
+    virtual Value Evaluate(const SheetInterface& sheet) const = 0;
+
+    // Возвращает выражение, которое описывает формулу.
+    // Не содержит пробелов и лишних скобок.
+    virtual std::string GetExpression() const = 0;
+
+    // То же выражение без копирования. Строится один раз при первом обращении
+    // и хранится вместе с формулой, поэтому остаётся валидным, пока жива формула.
+    virtual std::string_view GetExpressionView() const = 0;
+    // Выражение со знаком "=", как в тексте ячейки. Хранится в той же строке,
+    // что и GetExpressionView.
+    virtual std::string_view GetTextView() const = 0;
+
+    // Возвращает список ячеек, которые непосредственно задействованы в вычислении
+    // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
+    // ячеек.
+    virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Ячейки других листов книги, на которые ссылается формула, без
+    // повторов и в порядке возрастания
+    virtual std::vector<ExternalReference> GetExternalReferences() const = 0;
+
+    // Области своего листа, по которым ищут функции поиска, без повторов.
+    // Ячейки областей не входят в GetReferencedCells().
+    virtual std::vector<CellRange> GetReferencedRanges() const = 0;
+
+    enum class HandlingResult {
+        NothingChanged,         // ссылки не изменились
+        ReferencesRenamedOnly,  // ссылки сдвинулись, значение формулы прежнее
+        ReferencesChanged       // часть ссылок удалена, формулу нужно пересчитать
+    };
+
+    // Сдвигают ссылки формулы при вставке и удалении строк и столбцов без
+    // повторного разбора текста. Ссылки на удалённые ячейки становятся
+    // ошибкой #REF!, а сами ячейки пропадают из GetReferencedCells(). Текст
+    // #REF! разбирается обратно в такую же ссылку, поэтому текст формулы
+    // с удалёнными ссылками можно установить в ячейку заново.
+    // Область сжимается до уцелевших строк и столбцов и становится #REF!,
+    // только если удалена целиком.
+    // С пустым sheet сдвигаются ссылки на свой лист, иначе - на лист sheet.
+    virtual HandlingResult HandleInsertedRows(int before, int count = 1, std::string_view sheet = {}) = 0;
+    virtual HandlingResult HandleInsertedCols(int before, int count = 1, std::string_view sheet = {}) = 0;
+    virtual HandlingResult HandleDeletedRows(int first, int count = 1, std::string_view sheet = {}) = 0;
+    virtual HandlingResult HandleDeletedCols(int first, int count = 1, std::string_view sheet = {}) = 0;
+
+    // Независимая копия формулы, которую можно менять, не затрагивая исходную
+    virtual std::unique_ptr<FormulaInterface> Clone() const = 0;
+
+    // Программа вычисления формулы или nullptr, если формулу нельзя выразить
+    // программой (например, она ссылается на другие листы). Строится при
+    // первом обращении и живёт до изменения ссылок формулы.
+    virtual const FormulaProgram* GetProgram() const = 0;
+
+    // Истина, если часть ячеек формула читает только при выполнении условия,
+    // например в ветвях IF. Такая формула может вычислиться, не обращаясь
+    // ко всем ячейкам из GetReferencedCells().
+    virtual bool IsConditional() const = 0;
+
+    // Приблизительный объём памяти формулы в байтах: AST, выражение и
+    // программа, если они уже построены
+    virtual size_t GetAllocatedBytes() const = 0;
+};
+
+// Парсит переданное выражение и возвращает объект формулы.
+// Бросает FormulaException в случае, если формула синтаксически некорректна.
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Быстро проверяет выражение формулы без построения AST и возвращает
+// отсортированный список ячеек, на которые оно ссылается. Если выражение
+// содержит что-то, кроме чисел, ссылок, скобок и арифметических операций, или
+// синтаксически некорректно, возвращает std::nullopt - такую формулу нужно
+// разбирать полноценно через ParseFormula.
+std::optional<std::vector<Position>> ScanFormulaReferences(std::string_view expression);
\ No newline at end of file
@@ -0,0 +1,153 @@
+﻿#include "formula_batch.h"
+
+#include "FormulaAST.h"
+
+#include <cmath>
+#include <cstdint>
+
+namespace {
+    // 0 - ошибки нет, иначе категория ошибки + 1
+    using ErrorMask = std::vector<uint8_t>;
+
+    uint8_t ToErrorCode(FormulaError::Category category) {
+        return static_cast<uint8_t>(category) + 1;
+    }
+
+    // отмечает строки с бесконечным значением, если в них ещё нет ошибки
+    void MarkNonFinite(const std::vector<double>& values, ErrorMask& errors, FormulaError::Category category) {
+        uint8_t code = ToErrorCode(category);
+        for (size_t i = 0; i < values.size(); ++i) {
+            errors[i] = errors[i] ? errors[i] : (std::isfinite(values[i]) ? 0 : code);
+        }
+    }
+
+    // Операция над массивами. Тип операции выбирается вне цикла, поэтому
+    // каждый цикл векторизуется отдельно.
+    void ApplyBinary(FormulaInstruction::Type type, std::vector<double>& lhs, const std::vector<double>& rhs) {
+        double* left = lhs.data();
+        const double* right = rhs.data();
+        const size_t size = lhs.size();
+        switch (type) {
+        case FormulaInstruction::Type::Add:
+            for (size_t i = 0; i < size; ++i) {
+                left[i] += right[i];
+            }
+            break;
+        case FormulaInstruction::Type::Subtract:
+            for (size_t i = 0; i < size; ++i) {
+                left[i] -= right[i];
+            }
+            break;
+        case FormulaInstruction::Type::Multiply:
+            for (size_t i = 0; i < size; ++i) {
+                left[i] *= right[i];
+            }
+            break;
+        case FormulaInstruction::Type::Divide:
+            for (size_t i = 0; i < size; ++i) {
+                left[i] /= right[i];
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}  // namespace
+
+FormulaBatch::FormulaBatch(Position first, const FormulaProgram& program)
+    : first_(first)
+    , program_(program) {
+}
+
+bool FormulaBatch::Matches(Position pos, const FormulaProgram& program) const {
+    if (pos.col != first_.col || program.size() != program_.size()) {
+        return false;
+    }
+    int shift = pos.row - first_.row;
+    for (size_t i = 0; i < program.size(); ++i) {
+        const auto& lhs = program_[i];
+        const auto& rhs = program[i];
+        if (lhs.type != rhs.type) {
+            return false;
+        }
+        if (lhs.type == FormulaInstruction::Type::Number && !(lhs.number == rhs.number)) {
+            return false;
+        }
+        if (lhs.type == FormulaInstruction::Type::Cell
+            && !(Position{ lhs.cell.row + shift, lhs.cell.col } == rhs.cell)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FormulaBatch::ReferencesOwnRows(int rows) const {
+    for (const auto& instruction : program_) {
+        if (instruction.type == FormulaInstruction::Type::Cell && instruction.cell.col == first_.col
+            && std::abs(instruction.cell.row - first_.row) < rows) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<FormulaInterface::Value> FormulaBatch::Evaluate(const SheetInterface& sheet, int rows) const {
+    const size_t size = rows;
+    ErrorMask errors(size, 0);
+    std::vector<std::vector<double>> stack;
+    for (const auto& instruction : program_) {
+        switch (instruction.type) {
+        case FormulaInstruction::Type::Number:
+            stack.emplace_back(size, instruction.number);
+            break;
+        case FormulaInstruction::Type::Cell: {
+            // значения собираются так же, как при вычислении одной формулы;
+            // формулы, на которые ссылается пакет, вычисляются здесь
+            auto& values = stack.emplace_back(size);
+            for (size_t i = 0; i < size; ++i) {
+                try {
+                    values[i] = ASTImpl::GetCellNumber(sheet, { instruction.cell.row + static_cast<int>(i), instruction.cell.col });
+                }
+                catch (const FormulaError& error) {
+                    values[i] = 0;
+                    if (!errors[i]) {
+                        errors[i] = ToErrorCode(error.GetCategory());
+                    }
+                }
+            }
+            break;
+        }
+        case FormulaInstruction::Type::Add:
+        case FormulaInstruction::Type::Subtract:
+        case FormulaInstruction::Type::Multiply:
+        case FormulaInstruction::Type::Divide: {
+            std::vector<double> rhs = std::move(stack.back());
+            stack.pop_back();
+            ApplyBinary(instruction.type, stack.back(), rhs);
+            MarkNonFinite(stack.back(), errors, FormulaError::Category::Arithmetic);
+            break;
+        }
+        case FormulaInstruction::Type::Negate:
+            for (double& value : stack.back()) {
+                value = -value;
+            }
+            MarkNonFinite(stack.back(), errors, FormulaError::Category::Value);
+            break;
+        case FormulaInstruction::Type::CheckFinite:
+            MarkNonFinite(stack.back(), errors, FormulaError::Category::Value);
+            break;
+        }
+    }
+
+    std::vector<FormulaInterface::Value> result;
+    result.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        if (errors[i]) {
+            result.push_back(FormulaError(static_cast<FormulaError::Category>(errors[i] - 1)));
+        }
+        else {
+            result.push_back(stack.back()[i]);
+        }
+    }
+    return result;
+}
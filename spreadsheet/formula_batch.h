@@ -0,0 +1,36 @@
+﻿#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <vector>
+
+// Пакетное вычисление формул одной формы, заполненных вниз по столбцу:
+// =A1*B1+C1, =A2*B2+C2, ... Значения каждой ссылки собираются по всем
+// строкам в непрерывный массив, после чего каждая операция выполняется одним
+// циклом по массивам, который компилятор векторизует. Ошибки ведутся маской
+// по строкам: в строке остаётся первая ошибка в порядке выполнения программы,
+// то есть та же, что дало бы вычисление формулы по отдельности.
+class FormulaBatch {
+public:
+    // пакеты короче обходятся дороже вычисления по одной формуле
+    static constexpr int MIN_ROWS = 8;
+
+    // first - позиция первой формулы пакета, program - её программа
+    FormulaBatch(Position first, const FormulaProgram& program);
+
+    // Формула в позиции pos того же столбца имеет ту же форму: ссылки
+    // сдвинуты на столько же строк, на сколько сама формула
+    bool Matches(Position pos, const FormulaProgram& program) const;
+
+    // Формулы из rows строк пакета ссылаются на ячейки самого пакета, и их
+    // нужно вычислять по очереди
+    bool ReferencesOwnRows(int rows) const;
+
+    // Значения формул первых rows строк пакета
+    std::vector<FormulaInterface::Value> Evaluate(const SheetInterface& sheet, int rows) const;
+
+private:
+    Position first_;
+    const FormulaProgram& program_;
+};
@@ -0,0 +1,139 @@
+﻿#include "formula_cache.h"
+
+#include <iterator>
+#include <utility>
+
+FormulaCache::FormulaCache(size_t capacity)
+    : capacity_(capacity) {
+}
+
+std::shared_ptr<FormulaInterface> FormulaCache::Get(std::string expression) {
+    auto it = index_.find(expression);
+    if (it != index_.end()) {
+        ++stats_.hits;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return it->second->formula;
+    }
+    ++stats_.misses;
+    std::shared_ptr<FormulaInterface> formula = ParseFormula(expression);
+    Insert(std::move(expression), formula);
+    return formula;
+}
+
+void FormulaCache::Put(std::string expression, std::shared_ptr<FormulaInterface> formula) {
+    auto it = index_.find(expression);
+    if (it != index_.end()) {
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return;
+    }
+    Insert(std::move(expression), std::move(formula));
+}
+
+void FormulaCache::Insert(std::string expression, std::shared_ptr<FormulaInterface> formula) {
+    if (capacity_ == 0) {
+        return;
+    }
+    const size_t bytes = formula->GetAllocatedBytes();
+    entries_.push_front({ std::move(formula), std::move(expression), {}, bytes });
+    Entry& entry = entries_.front();
+    index_.emplace(entry.expression, entries_.begin());
+    by_formula_.emplace(entry.formula.get(), entries_.begin());
+    formula_bytes_ += bytes;
+    // канонический текст мог остаться у другой записи, тогда она и отвечает на него
+    std::string_view canonical = entry.formula->GetExpressionView();
+    if (canonical != entry.expression && !index_.count(canonical)) {
+        entry.canonical = std::string(canonical);
+        index_.emplace(entry.canonical, entries_.begin());
+    }
+    Shrink();
+}
+
+void FormulaCache::SetCapacity(size_t capacity) {
+    capacity_ = capacity;
+    Shrink();
+}
+
+size_t FormulaCache::GetCapacity() const {
+    return capacity_;
+}
+
+size_t FormulaCache::GetSize() const {
+    return entries_.size();
+}
+
+void FormulaCache::Clear() {
+    index_.clear();
+    by_formula_.clear();
+    entries_.clear();
+    formula_bytes_ = 0;
+}
+
+bool FormulaCache::Contains(const FormulaInterface* formula) const {
+    return by_formula_.count(formula) > 0;
+}
+
+void FormulaCache::Erase(const FormulaInterface* formula) {
+    auto it = by_formula_.find(formula);
+    if (it != by_formula_.end()) {
+        Evict(it->second);
+    }
+}
+
+size_t FormulaCache::ReleaseUnshared(size_t bytes) {
+    size_t released = 0;
+    auto it = entries_.end();
+    while (it != entries_.begin() && released < bytes) {
+        auto entry = std::prev(it);
+        if (entry->formula.use_count() == 1) {
+            released += entry->bytes;
+            Evict(entry);
+        }
+        else {
+            it = entry;
+        }
+    }
+    return released;
+}
+
+size_t FormulaCache::GetFormulaBytes() const {
+    return formula_bytes_;
+}
+
+const FormulaCache::Stats& FormulaCache::GetStats() const {
+    return stats_;
+}
+
+void FormulaCache::ResetStats() {
+    stats_ = Stats{};
+}
+
+size_t FormulaCache::GetAllocatedBytes() const {
+    // узел списка хранит запись и два указателя, узел индекса - пару и указатель
+    size_t bytes = index_.bucket_count() * sizeof(void*)
+        + index_.size() * (sizeof(decltype(index_)::value_type) + sizeof(void*))
+        + by_formula_.bucket_count() * sizeof(void*)
+        + by_formula_.size() * (sizeof(decltype(by_formula_)::value_type) + sizeof(void*));
+    for (const Entry& entry : entries_) {
+        bytes += sizeof(Entry) + 2 * sizeof(void*) + entry.expression.capacity() + entry.canonical.capacity();
+        if (entry.formula.use_count() == 1) {
+            bytes += entry.formula->GetAllocatedBytes();
+        }
+    }
+    return bytes;
+}
+
+void FormulaCache::Evict(Entries::iterator it) {
+    index_.erase(it->expression);
+    if (!it->canonical.empty()) {
+        index_.erase(it->canonical);
+    }
+    by_formula_.erase(it->formula.get());
+    formula_bytes_ -= it->bytes;
+    entries_.erase(it);
+}
+
+void FormulaCache::Shrink() {
+    while (entries_.size() > capacity_) {
+        Evict(std::prev(entries_.end()));
+    }
+}
@@ -0,0 +1,90 @@
+﻿#pragma once
+
+#include "formula.h"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Кэш разобранных формул по тексту выражения (без знака "="). Формулы с
+// одинаковым текстом разбираются один раз и разделяют одно AST, поэтому
+// менять формулу из кэша можно только после Clone(), если у неё есть другие
+// владельцы. Формула находится и по исходному тексту, и по каноническому
+// (GetExpression), так что восстановление прежнего текста ячейки разбора не
+// требует. При превышении ёмкости забываются давно не запрошенные формулы.
+// Объём AST в кэше входит в лимит памяти формул листа: лист забывает
+// формулы, которые держит только кэш, и вместе с вытесненной из ячейки
+// формулой убирает её запись.
+// Кэш не потокобезопасен: обращения к нему происходят только при изменении
+// и вычислении листа.
+class FormulaCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;    // формул, взятых из кэша
+        uint64_t misses = 0;  // выражений, разобранных заново, включая некорректные
+    };
+
+    static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+    explicit FormulaCache(size_t capacity = DEFAULT_CAPACITY);
+
+    FormulaCache(const FormulaCache&) = delete;
+    FormulaCache& operator=(const FormulaCache&) = delete;
+
+    // Формула из кэша или результат ParseFormula, который запоминается.
+    // Некорректные выражения не запоминаются: FormulaException бросается
+    // при каждом запросе.
+    std::shared_ptr<FormulaInterface> Get(std::string expression);
+    // Запоминает формулу, разобранную вне кэша (например в другом потоке),
+    // чтобы следующий Get с тем же текстом её не разбирал. Если текст уже
+    // есть в кэше, остаётся прежняя формула. В статистике не учитывается.
+    void Put(std::string expression, std::shared_ptr<FormulaInterface> formula);
+
+    // нулевая ёмкость отключает кэш
+    void SetCapacity(size_t capacity);
+    size_t GetCapacity() const;
+    // число формул в кэше
+    size_t GetSize() const;
+    void Clear();
+
+    // true, если формула - запись кэша
+    bool Contains(const FormulaInterface* formula) const;
+    // забывает запись формулы, если она есть
+    void Erase(const FormulaInterface* formula);
+    // Забывает давно не запрошенные формулы, которых нет ни у ячеек, ни у
+    // снимков, пока не освободит bytes байт AST. Возвращает освобождённый объём.
+    size_t ReleaseUnshared(size_t bytes);
+    // объём AST формул кэша по оценке на момент добавления
+    size_t GetFormulaBytes() const;
+
+    const Stats& GetStats() const;
+    void ResetStats();
+
+    // Приблизительный объём записей кэша и формул, которые держит только
+    // кэш; формулы, разделяемые с ячейками, учитываются у ячеек
+    size_t GetAllocatedBytes() const;
+
+private:
+    struct Entry {
+        std::shared_ptr<FormulaInterface> formula;
+        std::string expression;
+        std::string canonical; // пусто, если совпадает с expression или уже занято
+        size_t bytes = 0;      // объём AST
+    };
+    using Entries = std::list<Entry>; // недавно запрошенные в начале
+
+    void Insert(std::string expression, std::shared_ptr<FormulaInterface> formula);
+    void Evict(Entries::iterator it);
+    void Shrink();
+
+    size_t capacity_;
+    Entries entries_;
+    // ключи указывают на тексты записей
+    std::unordered_map<std::string_view, Entries::iterator> index_;
+    std::unordered_map<const FormulaInterface*, Entries::iterator> by_formula_;
+    size_t formula_bytes_ = 0;
+    Stats stats_;
+};
@@ -0,0 +1,155 @@
+﻿#include "journal.h"
+
+#include <stdexcept>
+
+UndoJournal::UndoJournal(size_t memory_limit)
+    : memory_limit_(memory_limit) {
+}
+
+void UndoJournal::SetMemoryLimit(size_t bytes) {
+    memory_limit_ = bytes;
+    EnforceMemoryLimit();
+}
+
+size_t UndoJournal::GetMemoryLimit() const {
+    return memory_limit_;
+}
+
+size_t UndoJournal::GetMemoryUsage() const {
+    return memory_usage_;
+}
+
+void UndoJournal::Record(Position pos, std::string old_text, std::string new_text) {
+    if (replaying_) {
+        return;
+    }
+    CellDelta delta{ pos, std::move(old_text), std::move(new_text) };
+    if (batch_depth_ > 0) {
+        batch_.bytes += GetDeltaBytes(delta);
+        batch_.deltas.push_back(std::move(delta));
+        return;
+    }
+    Transaction transaction;
+    transaction.bytes = GetDeltaBytes(delta);
+    transaction.deltas.push_back(std::move(delta));
+    Commit(std::move(transaction));
+}
+
+void UndoJournal::BeginBatch() {
+    ++batch_depth_;
+}
+
+void UndoJournal::EndBatch() {
+    if (batch_depth_ == 0) {
+        throw std::logic_error("EndBatch without BeginBatch");
+    }
+    if (--batch_depth_ == 0 && !batch_.deltas.empty()) {
+        Commit(std::move(batch_));
+        batch_ = Transaction{};
+    }
+}
+
+bool UndoJournal::InBatch() const {
+    return batch_depth_ > 0;
+}
+
+bool UndoJournal::CanUndo() const {
+    return !undo_.empty();
+}
+
+bool UndoJournal::CanRedo() const {
+    return !redo_.empty();
+}
+
+size_t UndoJournal::GetUndoDepth() const {
+    return undo_.size();
+}
+
+size_t UndoJournal::GetRedoDepth() const {
+    return redo_.size();
+}
+
+void UndoJournal::Undo(const ApplyFunc& apply) {
+    if (batch_depth_ > 0) {
+        throw std::logic_error("Undo inside a batch");
+    }
+    if (undo_.empty()) {
+        return;
+    }
+    Transaction transaction = std::move(undo_.back());
+    undo_.pop_back();
+
+    replaying_ = true;
+    try {
+        for (auto it = transaction.deltas.rbegin(); it != transaction.deltas.rend(); ++it) {
+            apply(it->pos, it->old_text);
+        }
+    }
+    catch (...) {
+        replaying_ = false;
+        memory_usage_ -= transaction.bytes;
+        throw;
+    }
+    replaying_ = false;
+    redo_.push_back(std::move(transaction));
+}
+
+void UndoJournal::Redo(const ApplyFunc& apply) {
+    if (batch_depth_ > 0) {
+        throw std::logic_error("Redo inside a batch");
+    }
+    if (redo_.empty()) {
+        return;
+    }
+    Transaction transaction = std::move(redo_.back());
+    redo_.pop_back();
+
+    replaying_ = true;
+    try {
+        for (const auto& delta : transaction.deltas) {
+            apply(delta.pos, delta.new_text);
+        }
+    }
+    catch (...) {
+        replaying_ = false;
+        memory_usage_ -= transaction.bytes;
+        throw;
+    }
+    replaying_ = false;
+    undo_.push_back(std::move(transaction));
+}
+
+void UndoJournal::Clear() {
+    undo_.clear();
+    redo_.clear();
+    batch_ = Transaction{};
+    memory_usage_ = 0;
+}
+
+size_t UndoJournal::GetDeltaBytes(const CellDelta& delta) {
+    return sizeof(CellDelta) + delta.old_text.capacity() + delta.new_text.capacity();
+}
+
+void UndoJournal::Commit(Transaction transaction) {
+    // новое изменение делает недоступными отменённые операции
+    for (const auto& undone : redo_) {
+        memory_usage_ -= undone.bytes;
+    }
+    redo_.clear();
+
+    memory_usage_ += transaction.bytes;
+    undo_.push_back(std::move(transaction));
+    EnforceMemoryLimit();
+}
+
+void UndoJournal::EnforceMemoryLimit() {
+    // сначала забываются самые давние изменения, затем самые дальние повторы
+    while (memory_usage_ > memory_limit_ && !undo_.empty()) {
+        memory_usage_ -= undo_.front().bytes;
+        undo_.pop_front();
+    }
+    while (memory_usage_ > memory_limit_ && !redo_.empty()) {
+        memory_usage_ -= redo_.front().bytes;
+        redo_.pop_front();
+    }
+}
@@ -0,0 +1,68 @@
+﻿#pragma once
+
+#include "common.h"
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Журнал отмены изменений. Для каждого изменения хранится только разница -
+// позиция, старый и новый текст ячейки, - поэтому отмена и повтор стоят
+// столько же, сколько сами изменения, и не зависят от размера таблицы.
+// Изменения между BeginBatch и EndBatch отменяются одной операцией.
+class UndoJournal {
+public:
+    struct CellDelta {
+        Position pos;
+        std::string old_text;
+        std::string new_text;
+    };
+
+    // Устанавливает текст ячейки, пустой текст означает очистку
+    using ApplyFunc = std::function<void(Position, const std::string&)>;
+
+    // При превышении memory_limit (в байтах) забываются самые старые операции
+    explicit UndoJournal(size_t memory_limit);
+
+    void SetMemoryLimit(size_t bytes);
+    size_t GetMemoryLimit() const;
+    size_t GetMemoryUsage() const;
+
+    void Record(Position pos, std::string old_text, std::string new_text);
+
+    void BeginBatch();
+    void EndBatch();
+    bool InBatch() const;
+
+    bool CanUndo() const;
+    bool CanRedo() const;
+    size_t GetUndoDepth() const;
+    size_t GetRedoDepth() const;
+
+    // Применяет старые тексты последней операции в обратном порядке и
+    // переносит её в стек повтора. Изменения, сделанные через apply, в
+    // журнал не попадают.
+    void Undo(const ApplyFunc& apply);
+    void Redo(const ApplyFunc& apply);
+
+    void Clear();
+
+private:
+    struct Transaction {
+        std::vector<CellDelta> deltas;
+        size_t bytes = 0;
+    };
+
+    static size_t GetDeltaBytes(const CellDelta& delta);
+    void Commit(Transaction transaction);
+    void EnforceMemoryLimit();
+
+    size_t memory_limit_;
+    size_t memory_usage_ = 0;
+    int batch_depth_ = 0;
+    bool replaying_ = false;
+    Transaction batch_;
+    std::deque<Transaction> undo_;  // последняя операция в конце
+    std::deque<Transaction> redo_;  // следующая для повтора операция в конце
+};
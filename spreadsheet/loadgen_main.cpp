@@ -0,0 +1,315 @@
+﻿#include "protocol.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    constexpr int RANGE_ROWS = 10;
+
+    struct Options {
+        std::string socket_path;
+        std::string sheet = "Sheet1";
+        int connections = 4;
+        int pipeline = 16;
+        int requests = 100000;  // на соединение
+        int rows = 1000;
+        int writes = 20;        // процент записей
+        int ranges = 5;         // процент чтений области
+    };
+
+    struct Result {
+        std::vector<uint64_t> latencies_ns;
+        uint64_t errors = 0;
+    };
+
+    // Блокирующее соединение с сервером
+    class Client {
+    public:
+        explicit Client(const std::string& path) {
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path)) {
+                throw std::invalid_argument("Invalid socket path");
+            }
+            std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+            fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd_ < 0) {
+                throw std::system_error(errno, std::generic_category(), "socket");
+            }
+            if (::connect(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+                int error = errno;
+                ::close(fd_);
+                throw std::system_error(error, std::generic_category(), "connect");
+            }
+        }
+
+        Client(const Client&) = delete;
+        Client& operator=(const Client&) = delete;
+
+        ~Client() {
+            ::close(fd_);
+        }
+
+        void Write(std::string_view data) {
+            while (!data.empty()) {
+                ssize_t written = ::write(fd_, data.data(), data.size());
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (written <= 0) {
+                    throw std::system_error(errno, std::generic_category(), "write");
+                }
+                data.remove_prefix(static_cast<size_t>(written));
+            }
+        }
+
+        // Следующий кадр ответа, действителен до следующего вызова
+        ProtocolFrame ReadFrame() {
+            buffer_.erase(0, std::exchange(frame_end_, 0));
+            while (true) {
+                size_t size = 0;
+                if (auto frame = ParseFrame(buffer_, size)) {
+                    frame_end_ = size;
+                    return *frame;
+                }
+                size_t old_size = buffer_.size();
+                buffer_.resize(old_size + (64 << 10));
+                ssize_t received = ::read(fd_, buffer_.data() + old_size, buffer_.size() - old_size);
+                buffer_.resize(old_size + std::max<ssize_t>(received, 0));
+                if (received < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (received <= 0) {
+                    throw std::runtime_error("Connection closed by server");
+                }
+            }
+        }
+
+        // истина, если следующий кадр уже принят целиком
+        bool HasBufferedFrame() const {
+            size_t size = 0;
+            return ParseFrame(std::string_view(buffer_).substr(frame_end_), size).has_value();
+        }
+
+    private:
+        int fd_ = -1;
+        std::string buffer_;
+        size_t frame_end_ = 0;
+    };
+
+    std::string MakeRowNumber(int row) {
+        return std::to_string(row + 1);
+    }
+
+    // столбец A - числа, столбец B - формулы по ним
+    void Populate(const Options& options) {
+        Client client(options.socket_path);
+        std::string out;
+        ProtocolWriter writer(out);
+        writer.BeginFrame(1, static_cast<uint8_t>(ProtocolCommand::Batch));
+        writer.PutString16(options.sheet);
+        writer.PutU32(static_cast<uint32_t>(options.rows) * 2);
+        for (int row = 0; row < options.rows; ++row) {
+            writer.PutPosition({ row, 0 });
+            writer.PutString32(std::to_string(row));
+            writer.PutPosition({ row, 1 });
+            writer.PutString32("=A" + MakeRowNumber(row) + "*2+1");
+        }
+        writer.EndFrame();
+        client.Write(out);
+        ProtocolFrame frame = client.ReadFrame();
+        if (frame.code != static_cast<uint8_t>(ProtocolStatus::Ok)) {
+            throw std::runtime_error("Failed to populate sheet " + options.sheet);
+        }
+    }
+
+    void AppendRequest(ProtocolWriter& writer, uint32_t id, const Options& options, std::mt19937& random) {
+        const int row = static_cast<int>(random() % options.rows);
+        const int roll = static_cast<int>(random() % 100);
+        if (roll < options.writes) {
+            writer.BeginFrame(id, static_cast<uint8_t>(ProtocolCommand::Set));
+            writer.PutString16(options.sheet);
+            writer.PutPosition({ row, 0 });
+            writer.PutString32(std::to_string(random() % 1000));
+        }
+        else if (roll < options.writes + options.ranges) {
+            writer.BeginFrame(id, static_cast<uint8_t>(ProtocolCommand::ReadRange));
+            writer.PutString16(options.sheet);
+            writer.PutPosition({ row, 0 });
+            writer.PutPosition({ std::min(row + RANGE_ROWS, options.rows) - 1, 1 });
+        }
+        else {
+            writer.BeginFrame(id, static_cast<uint8_t>(ProtocolCommand::Get));
+            writer.PutString16(options.sheet);
+            writer.PutPosition({ row, 1 });
+        }
+        writer.EndFrame();
+    }
+
+    // Держит в полёте options.pipeline запросов: новые запросы отправляются
+    // одной записью, когда разобраны все принятые ответы
+    Result RunConnection(const Options& options, unsigned seed) {
+        Client client(options.socket_path);
+        std::mt19937 random(seed);
+        Result result;
+        result.latencies_ns.reserve(options.requests);
+
+        std::deque<Clock::time_point> in_flight;
+        std::string out;
+        uint32_t next_id = 1;
+        int sent = 0;
+        auto send_more = [&] {
+            out.clear();
+            ProtocolWriter writer(out);
+            Clock::time_point now = Clock::now();
+            while (static_cast<int>(in_flight.size()) < options.pipeline && sent < options.requests) {
+                AppendRequest(writer, next_id++, options, random);
+                in_flight.push_back(now);
+                ++sent;
+            }
+            if (!out.empty()) {
+                client.Write(out);
+            }
+        };
+
+        send_more();
+        while (result.latencies_ns.size() < static_cast<size_t>(options.requests)) {
+            ProtocolFrame frame = client.ReadFrame();
+            if (frame.code == static_cast<uint8_t>(ProtocolStatus::Event)) {
+                continue;
+            }
+            result.latencies_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - in_flight.front()).count());
+            in_flight.pop_front();
+            if (frame.code != static_cast<uint8_t>(ProtocolStatus::Ok)) {
+                ++result.errors;
+            }
+            if (!client.HasBufferedFrame()) {
+                send_more();
+            }
+        }
+        return result;
+    }
+
+    double Percentile(const std::vector<uint64_t>& sorted, double percent) {
+        if (sorted.empty()) {
+            return 0;
+        }
+        size_t index = static_cast<size_t>(percent / 100 * (sorted.size() - 1) + 0.5);
+        return static_cast<double>(sorted[index]);
+    }
+}  // namespace
+
+// Использование: spreadsheet_loadgen --socket PATH [--sheet NAME] [--connections N]
+//     [--pipeline N] [--requests N] [--rows N] [--writes PERCENT] [--ranges PERCENT]
+// Заполняет столбцы A и B листа, затем каждое соединение отправляет
+// --requests запросов: записи чисел в A, чтения областей A:B и чтения
+// формул из B. Пропускная способность и задержки выводятся в JSON.
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string_view arg = argv[i];
+        if (arg == "--socket") {
+            options.socket_path = argv[i + 1];
+        }
+        else if (arg == "--sheet") {
+            options.sheet = argv[i + 1];
+        }
+        else if (arg == "--connections") {
+            options.connections = std::max(std::atoi(argv[i + 1]), 1);
+        }
+        else if (arg == "--pipeline") {
+            options.pipeline = std::max(std::atoi(argv[i + 1]), 1);
+        }
+        else if (arg == "--requests") {
+            options.requests = std::max(std::atoi(argv[i + 1]), 1);
+        }
+        else if (arg == "--rows") {
+            options.rows = std::max(std::atoi(argv[i + 1]), 1);
+        }
+        else if (arg == "--writes") {
+            options.writes = std::atoi(argv[i + 1]);
+        }
+        else if (arg == "--ranges") {
+            options.ranges = std::atoi(argv[i + 1]);
+        }
+    }
+    if (options.socket_path.empty()) {
+        std::cerr << "Usage: spreadsheet_loadgen --socket PATH [--sheet NAME] [--connections N] [--pipeline N]"
+            " [--requests N] [--rows N] [--writes PERCENT] [--ranges PERCENT]" << std::endl;
+        return 1;
+    }
+
+    try {
+        Populate(options);
+
+        std::vector<Result> results(options.connections);
+        std::vector<std::exception_ptr> errors(options.connections);
+        std::vector<std::thread> threads;
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < options.connections; ++i) {
+            threads.emplace_back([&, i] {
+                try {
+                    results[i] = RunConnection(options, static_cast<unsigned>(i + 1));
+                }
+                catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        for (const auto& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        std::vector<uint64_t> latencies;
+        uint64_t failed = 0;
+        for (const auto& result : results) {
+            latencies.insert(latencies.end(), result.latencies_ns.begin(), result.latencies_ns.end());
+            failed += result.errors;
+        }
+        std::sort(latencies.begin(), latencies.end());
+
+        std::cout << std::fixed << std::setprecision(1);
+        std::cout << "{\n";
+        std::cout << "  \"connections\": " << options.connections << ",\n";
+        std::cout << "  \"pipeline\": " << options.pipeline << ",\n";
+        std::cout << "  \"requests\": " << latencies.size() << ",\n";
+        std::cout << "  \"errors\": " << failed << ",\n";
+        std::cout << "  \"seconds\": " << std::setprecision(3) << seconds << std::setprecision(1) << ",\n";
+        std::cout << "  \"requests_per_sec\": " << latencies.size() / seconds << ",\n";
+        std::cout << "  \"p50_us\": " << Percentile(latencies, 50) / 1000 << ",\n";
+        std::cout << "  \"p99_us\": " << Percentile(latencies, 99) / 1000 << ",\n";
+        std::cout << "  \"max_us\": " << Percentile(latencies, 100) / 1000 << "\n";
+        std::cout << "}\n";
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
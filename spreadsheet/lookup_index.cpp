@@ -0,0 +1,137 @@
+﻿#include "lookup_index.h"
+
+#include <algorithm>
+
+LookupIndex::LookupIndex(int rows)
+    : rows_(rows) {
+}
+
+std::optional<int> LookupIndex::Find(const LookupValue& value, LookupMode mode, const RowReader& read) {
+    if (!built_) {
+        Build(read);
+    }
+    else if (!changed_rows_.empty()) {
+        Update(read);
+    }
+
+    auto less = [](const Entry& entry, const LookupValue& value) {
+        return CompareLookupValues(entry.GetValue(), value) < 0;
+    };
+    auto greater = [](const LookupValue& value, const Entry& entry) {
+        return CompareLookupValues(value, entry.GetValue()) < 0;
+    };
+    // число ищется только среди чисел, текст - среди текста
+    auto same_kind = [&value](const Entry& entry) {
+        return entry.is_text == std::holds_alternative<std::string_view>(value);
+    };
+
+    switch (mode) {
+        case LookupMode::Exact: {
+            auto it = std::lower_bound(entries_.begin(), entries_.end(), value, less);
+            if (it != entries_.end() && CompareLookupValues(it->GetValue(), value) == 0) {
+                return it->row;
+            }
+            return std::nullopt;
+        }
+        case LookupMode::GreaterOrEqual: {
+            auto it = std::lower_bound(entries_.begin(), entries_.end(), value, less);
+            if (it != entries_.end() && same_kind(*it)) {
+                return it->row;
+            }
+            return std::nullopt;
+        }
+        default: {
+            // последняя строка с наибольшим значением, не большим искомого
+            auto it = std::upper_bound(entries_.begin(), entries_.end(), value, greater);
+            if (it != entries_.begin() && same_kind(*std::prev(it))) {
+                return std::prev(it)->row;
+            }
+            return std::nullopt;
+        }
+    }
+}
+
+void LookupIndex::MarkChanged(int row) {
+    if (built_ && !changed_[row]) {
+        changed_[row] = true;
+        changed_rows_.push_back(row);
+    }
+}
+
+bool LookupIndex::IsBuilt() const {
+    return built_;
+}
+
+size_t LookupIndex::GetAllocatedBytes() const {
+    size_t bytes = sizeof(*this) + entries_.capacity() * sizeof(Entry)
+        + changed_.capacity() / 8 + changed_rows_.capacity() * sizeof(int);
+    for (const Entry& entry : entries_) {
+        // короткие строки хранятся внутри объекта
+        if (entry.text.capacity() > std::string().capacity()) {
+            bytes += entry.text.capacity() + 1;
+        }
+    }
+    return bytes;
+}
+
+LookupValue LookupIndex::Entry::GetValue() const {
+    if (is_text) {
+        return std::string_view(text);
+    }
+    return number;
+}
+
+bool LookupIndex::IsBefore(const Entry& lhs, const Entry& rhs) {
+    int order = CompareLookupValues(lhs.GetValue(), rhs.GetValue());
+    return order < 0 || (order == 0 && lhs.row < rhs.row);
+}
+
+std::optional<LookupIndex::Entry> LookupIndex::ReadEntry(int row, const RowReader& read) {
+    std::optional<LookupValue> value = read(row);
+    if (!value) {
+        return std::nullopt;
+    }
+    Entry entry;
+    entry.row = row;
+    if (const auto* text = std::get_if<std::string_view>(&*value)) {
+        entry.text = *text;
+        entry.is_text = true;
+    }
+    else {
+        entry.number = std::get<double>(*value);
+    }
+    return entry;
+}
+
+void LookupIndex::Build(const RowReader& read) {
+    entries_.clear();
+    for (int row = 0; row < rows_; ++row) {
+        if (auto entry = ReadEntry(row, read)) {
+            entries_.push_back(std::move(*entry));
+        }
+    }
+    std::sort(entries_.begin(), entries_.end(), IsBefore);
+    changed_.assign(rows_, false);
+    changed_rows_.clear();
+    built_ = true;
+}
+
+void LookupIndex::Update(const RowReader& read) {
+    // переиндексировать большую часть строк дороже, чем построить заново
+    if (changed_rows_.size() * 4 > static_cast<size_t>(rows_)) {
+        Build(read);
+        return;
+    }
+    entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+        [this](const Entry& entry) { return changed_[entry.row]; }), entries_.end());
+    size_t middle = entries_.size();
+    for (int row : changed_rows_) {
+        changed_[row] = false;
+        if (auto entry = ReadEntry(row, read)) {
+            entries_.push_back(std::move(*entry));
+        }
+    }
+    changed_rows_.clear();
+    std::sort(entries_.begin() + middle, entries_.end(), IsBefore);
+    std::inplace_merge(entries_.begin(), entries_.begin() + middle, entries_.end(), IsBefore);
+}
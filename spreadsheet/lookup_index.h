@@ -0,0 +1,53 @@
+﻿#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Индекс столбца области для функций поиска (VLOOKUP, MATCH, XLOOKUP).
+// Хранит значения строк, упорядоченные так же, как их сравнивают функции
+// поиска, поэтому и точный, и приближённый поиск стоят O(log M) вместо
+// просмотра M строк. Индекс строится при первом поиске. Изменённые строки
+// только запоминаются и переиндексируются при следующем поиске: старые
+// записи убираются одним проходом, новые вливаются в отсортированный
+// массив. Если изменилась большая часть строк, индекс строится заново.
+class LookupIndex {
+public:
+    // значение строки столбца (номер относительно начала области) или
+    // nullopt для пустой ячейки и ошибки; текст копируется сразу
+    using RowReader = std::function<std::optional<LookupValue>(int row)>;
+
+    explicit LookupIndex(int rows);
+
+    // находит строку так же, как SheetInterface::FindInColumn
+    std::optional<int> Find(const LookupValue& value, LookupMode mode, const RowReader& read);
+    void MarkChanged(int row);
+
+    bool IsBuilt() const;
+    size_t GetAllocatedBytes() const;
+
+private:
+    struct Entry {
+        double number = 0;
+        std::string text;
+        bool is_text = false;
+        int row = 0;
+
+        LookupValue GetValue() const;
+    };
+
+    static bool IsBefore(const Entry& lhs, const Entry& rhs);
+    static std::optional<Entry> ReadEntry(int row, const RowReader& read);
+    void Build(const RowReader& read);
+    void Update(const RowReader& read);
+
+    int rows_;
+    bool built_ = false;
+    std::vector<Entry> entries_;      // по значению, при равных - по строке
+    std::vector<bool> changed_;       // строки, изменённые после обновления
+    std::vector<int> changed_rows_;
+};
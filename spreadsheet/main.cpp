@@ -1,378 +1,2610 @@
-﻿#include <limits>
-
-#include "common.h"
-#include "formula.h"
-#include "test_runner_p.h"
-
-inline std::ostream& operator<<(std::ostream& output, Position pos) {
-    return output << "(" << pos.row << ", " << pos.col << ")";
-}
-
-inline Position operator"" _pos(const char* str, std::size_t) {
-    return Position::FromString(str);
-}
-
-inline std::ostream& operator<<(std::ostream& output, Size size) {
-    return output << "(" << size.rows << ", " << size.cols << ")";
-}
-
-inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
-    std::visit(
-        [&](const auto& x) {
-            output << x;
-        },
-        value);
-    return output;
-}
-
-namespace {
-
-    void TestPositionAndStringConversion() {
-        auto testSingle = [](Position pos, std::string_view str) {
-            ASSERT_EQUAL(pos.ToString(), str);
-            ASSERT_EQUAL(Position::FromString(str), pos);
-            };
-
-        for (int i = 0; i < 25; ++i) {
-            testSingle(Position{ i, i }, char('A' + i) + std::to_string(i + 1));
-        }
-
-        testSingle(Position{ 0, 0 }, "A1");
-        testSingle(Position{ 0, 1 }, "B1");
-        testSingle(Position{ 0, 25 }, "Z1");
-        testSingle(Position{ 0, 26 }, "AA1");
-        testSingle(Position{ 0, 27 }, "AB1");
-        testSingle(Position{ 0, 51 }, "AZ1");
-        testSingle(Position{ 0, 52 }, "BA1");
-        testSingle(Position{ 0, 53 }, "BB1");
-        testSingle(Position{ 0, 77 }, "BZ1");
-        testSingle(Position{ 0, 78 }, "CA1");
-        testSingle(Position{ 0, 701 }, "ZZ1");
-        testSingle(Position{ 0, 702 }, "AAA1");
-        testSingle(Position{ 136, 2 }, "C137");
-        testSingle(Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }, "XFD16384");
-    }
-
-    void TestPositionToStringInvalid() {
-        ASSERT_EQUAL((Position{ -1, -1 }).ToString(), "");
-        ASSERT_EQUAL((Position{ -10, 0 }).ToString(), "");
-        ASSERT_EQUAL((Position{ 1, -3 }).ToString(), "");
-    }
-
-    void TestStringToPositionInvalid() {
-        ASSERT(!Position::FromString("").IsValid());
-        ASSERT(!Position::FromString("A").IsValid());
-        ASSERT(!Position::FromString("1").IsValid());
-        ASSERT(!Position::FromString("e2").IsValid());
-        ASSERT(!Position::FromString("A0").IsValid());
-        ASSERT(!Position::FromString("A-1").IsValid());
-        ASSERT(!Position::FromString("A+1").IsValid());
-        ASSERT(!Position::FromString("R2D2").IsValid());
-        ASSERT(!Position::FromString("C3PO").IsValid());
-        ASSERT(!Position::FromString("XFD16385").IsValid());
-        ASSERT(!Position::FromString("XFE16384").IsValid());
-        ASSERT(!Position::FromString("A1234567890123456789").IsValid());
-        ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
-    }
-
-    void TestEmpty() {
-        auto sheet = CreateSheet();
-        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 0, 0 }));
-    }
-
-    void TestInvalidPosition() {
-        auto sheet = CreateSheet();
-        try {
-            sheet->SetCell(Position{ -1, 0 }, "");
-        }
-        catch (const InvalidPositionException&) {
-        }
-        try {
-            sheet->GetCell(Position{ 0, -2 });
-        }
-        catch (const InvalidPositionException&) {
-        }
-        try {
-            sheet->ClearCell(Position{ Position::MAX_ROWS, 0 });
-        }
-        catch (const InvalidPositionException&) {
-        }
-    }
-
-    void TestSetCellPlainText() {
-        auto sheet = CreateSheet();
-
-        auto checkCell = [&](Position pos, std::string text) {
-            sheet->SetCell(pos, text);
-            CellInterface* cell = sheet->GetCell(pos);
-            ASSERT(cell != nullptr);
-            ASSERT_EQUAL(cell->GetText(), text);
-            ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
-            };
-
-        checkCell("A1"_pos, "Hello");
-        checkCell("A1"_pos, "World");
-        checkCell("B2"_pos, "Purr");
-        checkCell("A3"_pos, "Meow");
-
-        const SheetInterface& constSheet = *sheet;
-        ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
-
-        sheet->SetCell("A3"_pos, "'=escaped");
-        CellInterface* cell = sheet->GetCell("A3"_pos);
-        ASSERT_EQUAL(cell->GetText(), "'=escaped");
-        ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
-    }
-
-    void TestClearCell() {
-        auto sheet = CreateSheet();
-
-        sheet->SetCell("C2"_pos, "Me gusta");
-        sheet->ClearCell("C2"_pos);
-        ASSERT(sheet->GetCell("C2"_pos) == nullptr);
-
-        sheet->ClearCell("A1"_pos);
-        sheet->ClearCell("J10"_pos);
-    }
-
-    void TestFormulaArithmetic() {
-        auto sheet = CreateSheet();
-        auto evaluate = [&](std::string expr) {
-            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-            };
-
-        ASSERT_EQUAL(evaluate("1"), 1);
-        ASSERT_EQUAL(evaluate("42"), 42);
-        ASSERT_EQUAL(evaluate("2 + 2"), 4);
-        ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
-        ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
-        ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
-        ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
-    }
-
-    void TestFormulaReferences() {
-        auto sheet = CreateSheet();
-        auto evaluate = [&](std::string expr) {
-            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
-            };
-
-        sheet->SetCell("A1"_pos, "1");
-        ASSERT_EQUAL(evaluate("A1"), 1);
-        sheet->SetCell("A2"_pos, "2");
-        ASSERT_EQUAL(evaluate("A1+A2"), 3);
-
-        // Тест на нули:
-        sheet->SetCell("B3"_pos, "");
-        ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
-        ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
-        ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
-    }
-
-    void TestFormulaExpressionFormatting() {
-        auto reformat = [](std::string expr) {
-            return ParseFormula(std::move(expr))->GetExpression();
-            };
-
-        ASSERT_EQUAL(reformat("  1  "), "1");
-        ASSERT_EQUAL(reformat("  -1  "), "-1");
-        ASSERT_EQUAL(reformat("2 + 2"), "2+2");
-        ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
-        ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
-        ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
-    }
-
-    void TestFormulaReferencedCells() {
-        ASSERT(ParseFormula("1")->GetReferencedCells().empty());
-
-        auto a1 = ParseFormula("A1");
-        ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{ "A1"_pos }));
-
-        auto b2c3 = ParseFormula("B2+C3");
-        ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{ "B2"_pos, "C3"_pos }));
-
-        auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
-        ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
-        ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{ "A1"_pos, "A2"_pos, "A3"_pos }));
-    }
-
-    void TestErrorValue() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("E2"_pos, "A1");
-        sheet->SetCell("E4"_pos, "=E2");
-        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-            CellInterface::Value(FormulaError::Category::Value));
-
-        sheet->SetCell("E2"_pos, "3D");
-        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
-            CellInterface::Value(FormulaError::Category::Value));
-    }
-
-    void TestErrorArithmetic() {
-        auto sheet = CreateSheet();
-
-        constexpr double max = std::numeric_limits<double>::max();
-
-        sheet->SetCell("A1"_pos, "=1/0");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-            CellInterface::Value(FormulaError::Category::Arithmetic));
-
-        sheet->SetCell("A1"_pos, "=1e+200/1e-200");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-            CellInterface::Value(FormulaError::Category::Arithmetic));
-
-        sheet->SetCell("A1"_pos, "=0/0");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-            CellInterface::Value(FormulaError::Category::Arithmetic));
-
-        {
-            std::ostringstream formula;
-            formula << '=' << max << '+' << max;
-            sheet->SetCell("A1"_pos, formula.str());
-            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                CellInterface::Value(FormulaError::Category::Arithmetic));
-        }
-
-        {
-            std::ostringstream formula;
-            formula << '=' << -max << '-' << max;
-            sheet->SetCell("A1"_pos, formula.str());
-            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                CellInterface::Value(FormulaError::Category::Arithmetic));
-        }
-
-        {
-            std::ostringstream formula;
-            formula << '=' << max << '*' << max;
-            sheet->SetCell("A1"_pos, formula.str());
-            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
-                CellInterface::Value(FormulaError::Category::Arithmetic));
-        }
-    }
-
-    void TestEmptyCellTreatedAsZero() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("A1"_pos, "=B2");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
-    }
-
-    void TestFormulaInvalidPosition() {
-        auto sheet = CreateSheet();
-        auto try_formula = [&](const std::string& formula) {
-            try {
-                sheet->SetCell("A1"_pos, formula);
-                ASSERT(false);
-            }
-            catch (const FormulaException&) {
-                // we expect this one
-            }
-            };
-
-        try_formula("=X0");
-        try_formula("=ABCD1");
-        try_formula("=A123456");
-        try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-        try_formula("=XFD16385");
-        try_formula("=XFE16384"); 
-        try_formula("=R2D2");
-    }
-
-    void TestPrint() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("A2"_pos, "meow");
-        sheet->SetCell("B2"_pos, "=35");
-
-        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2, 2 }));
-
-        std::ostringstream texts;
-        sheet->PrintTexts(texts);
-        ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
-
-        std::ostringstream values;
-        sheet->PrintValues(values);
-        ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
-    }
-
-    void TestCellReferences() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("A1"_pos, "1");
-        sheet->SetCell("A2"_pos, "=A1");
-        sheet->SetCell("B2"_pos, "=A1");
-
-        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(), std::vector{ "A1"_pos });
-        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{ "A1"_pos });
-
-        // Ссылка на пустую ячейку
-        sheet->SetCell("B2"_pos, "=B1");
-        ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
-        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{ "B1"_pos });
-
-        sheet->SetCell("A2"_pos, "");
-        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-        ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
-
-        // Ссылка на ячейку за пределами таблицы
-        sheet->SetCell("B1"_pos, "=C3");
-        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{ "C3"_pos });
-    }
-
-    void TestFormulaIncorrect() {
-        auto isIncorrect = [](std::string expression) {
-            try {
-                ParseFormula(std::move(expression));
-            }
-            catch (const FormulaException&) {
-                return true;
-            }
-            return false;
-            };
-
-        ASSERT(isIncorrect("A2B"));
-        ASSERT(isIncorrect("3X"));
-        ASSERT(isIncorrect("A0++"));
-        ASSERT(isIncorrect("((1)"));
-        ASSERT(isIncorrect("2+4-"));
-    }
-
-    void TestCellCircularReferences() {
-        auto sheet = CreateSheet();
-        sheet->SetCell("E2"_pos, "=E4");
-        sheet->SetCell("E4"_pos, "=X9");
-        sheet->SetCell("X9"_pos, "=M6");
-        sheet->SetCell("M6"_pos, "Ready");
-
-        bool caught = false;
-        try {
-            sheet->SetCell("M6"_pos, "=E2");
-        }
-        catch (const CircularDependencyException&) {
-            caught = true;
-        }
-
-        ASSERT(caught);
-        ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
-    }
-}  // namespace
-
-int main() {
-    TestRunner tr;
-    RUN_TEST(tr, TestPositionAndStringConversion);
-    RUN_TEST(tr, TestPositionToStringInvalid);
-    RUN_TEST(tr, TestStringToPositionInvalid);
-    RUN_TEST(tr, TestEmpty);
-    RUN_TEST(tr, TestInvalidPosition);
-    RUN_TEST(tr, TestSetCellPlainText);
-    RUN_TEST(tr, TestClearCell);
-    RUN_TEST(tr, TestFormulaArithmetic);
-    RUN_TEST(tr, TestFormulaReferences);
-    RUN_TEST(tr, TestFormulaExpressionFormatting);
-    RUN_TEST(tr, TestFormulaReferencedCells);
-    RUN_TEST(tr, TestErrorValue);
-    RUN_TEST(tr, TestErrorArithmetic);
-    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
-    RUN_TEST(tr, TestFormulaInvalidPosition);
-    RUN_TEST(tr, TestPrint);
-    RUN_TEST(tr, TestCellReferences);
-    RUN_TEST(tr, TestFormulaIncorrect);
-    RUN_TEST(tr, TestCellCircularReferences);
-}
+﻿#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <thread>
+
+#include "async_recalc.h"
+#include "columnar_snapshot.h"
+#include "common.h"
+#include "concurrent_writer.h"
+#include "edit_log.h"
+#include "formula.h"
+#include "protocol.h"
+#include "sheet.h"
+#include "snapshot.h"
+#include "test_runner_p.h"
+#include "workbook.h"
+
+#ifdef SPREADSHEET_SERVER_TEST
+#include "server.h"
+
+#include <chrono>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+inline std::ostream& operator<<(std::ostream& output, Position pos) {
+    return output << "(" << pos.row << ", " << pos.col << ")";
+}
+
+inline Position operator"" _pos(const char* str, std::size_t) {
+    return Position::FromString(str);
+}
+
+inline std::ostream& operator<<(std::ostream& output, Size size) {
+    return output << "(" << size.rows << ", " << size.cols << ")";
+}
+
+inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
+    std::visit(
+        [&](const auto& x) {
+            output << x;
+        },
+        value);
+    return output;
+}
+
+namespace {
+
+    void TestPositionAndStringConversion() {
+        auto testSingle = [](Position pos, std::string_view str) {
+            ASSERT_EQUAL(pos.ToString(), str);
+            ASSERT_EQUAL(Position::FromString(str), pos);
+            };
+
+        for (int i = 0; i < 25; ++i) {
+            testSingle(Position{ i, i }, char('A' + i) + std::to_string(i + 1));
+        }
+
+        testSingle(Position{ 0, 0 }, "A1");
+        testSingle(Position{ 0, 1 }, "B1");
+        testSingle(Position{ 0, 25 }, "Z1");
+        testSingle(Position{ 0, 26 }, "AA1");
+        testSingle(Position{ 0, 27 }, "AB1");
+        testSingle(Position{ 0, 51 }, "AZ1");
+        testSingle(Position{ 0, 52 }, "BA1");
+        testSingle(Position{ 0, 53 }, "BB1");
+        testSingle(Position{ 0, 77 }, "BZ1");
+        testSingle(Position{ 0, 78 }, "CA1");
+        testSingle(Position{ 0, 701 }, "ZZ1");
+        testSingle(Position{ 0, 702 }, "AAA1");
+        testSingle(Position{ 136, 2 }, "C137");
+        testSingle(Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }, "XFD16384");
+    }
+
+    void TestPositionToStringInvalid() {
+        ASSERT_EQUAL((Position{ -1, -1 }).ToString(), "");
+        ASSERT_EQUAL((Position{ -10, 0 }).ToString(), "");
+        ASSERT_EQUAL((Position{ 1, -3 }).ToString(), "");
+    }
+
+    void TestStringToPositionInvalid() {
+        ASSERT(!Position::FromString("").IsValid());
+        ASSERT(!Position::FromString("A").IsValid());
+        ASSERT(!Position::FromString("1").IsValid());
+        ASSERT(!Position::FromString("e2").IsValid());
+        ASSERT(!Position::FromString("A0").IsValid());
+        ASSERT(!Position::FromString("A-1").IsValid());
+        ASSERT(!Position::FromString("A+1").IsValid());
+        ASSERT(!Position::FromString("R2D2").IsValid());
+        ASSERT(!Position::FromString("C3PO").IsValid());
+        ASSERT(!Position::FromString("XFD16385").IsValid());
+        ASSERT(!Position::FromString("XFE16384").IsValid());
+        ASSERT(!Position::FromString("A1234567890123456789").IsValid());
+        ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
+    }
+
+    void TestEmpty() {
+        auto sheet = CreateSheet();
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 0, 0 }));
+    }
+
+    void TestInvalidPosition() {
+        auto sheet = CreateSheet();
+        try {
+            sheet->SetCell(Position{ -1, 0 }, "");
+        }
+        catch (const InvalidPositionException&) {
+        }
+        try {
+            sheet->GetCell(Position{ 0, -2 });
+        }
+        catch (const InvalidPositionException&) {
+        }
+        try {
+            sheet->ClearCell(Position{ Position::MAX_ROWS, 0 });
+        }
+        catch (const InvalidPositionException&) {
+        }
+    }
+
+    void TestSetCellPlainText() {
+        auto sheet = CreateSheet();
+
+        auto checkCell = [&](Position pos, std::string text) {
+            sheet->SetCell(pos, text);
+            CellInterface* cell = sheet->GetCell(pos);
+            ASSERT(cell != nullptr);
+            ASSERT_EQUAL(cell->GetText(), text);
+            ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text);
+            };
+
+        checkCell("A1"_pos, "Hello");
+        checkCell("A1"_pos, "World");
+        checkCell("B2"_pos, "Purr");
+        checkCell("A3"_pos, "Meow");
+
+        const SheetInterface& constSheet = *sheet;
+        ASSERT_EQUAL(constSheet.GetCell("B2"_pos)->GetText(), "Purr");
+
+        sheet->SetCell("A3"_pos, "'=escaped");
+        CellInterface* cell = sheet->GetCell("A3"_pos);
+        ASSERT_EQUAL(cell->GetText(), "'=escaped");
+        ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), "=escaped");
+    }
+
+    void TestClearCell() {
+        auto sheet = CreateSheet();
+
+        sheet->SetCell("C2"_pos, "Me gusta");
+        sheet->ClearCell("C2"_pos);
+        ASSERT(sheet->GetCell("C2"_pos) == nullptr);
+
+        sheet->ClearCell("A1"_pos);
+        sheet->ClearCell("J10"_pos);
+    }
+
+    void TestFormulaArithmetic() {
+        auto sheet = CreateSheet();
+        auto evaluate = [&](std::string expr) {
+            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+            };
+
+        ASSERT_EQUAL(evaluate("1"), 1);
+        ASSERT_EQUAL(evaluate("42"), 42);
+        ASSERT_EQUAL(evaluate("2 + 2"), 4);
+        ASSERT_EQUAL(evaluate("2 + 2*2"), 6);
+        ASSERT_EQUAL(evaluate("4/2 + 6/3"), 4);
+        ASSERT_EQUAL(evaluate("(2+3)*4 + (3-4)*5"), 15);
+        ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
+    }
+
+    void TestFormulaReferences() {
+        auto sheet = CreateSheet();
+        auto evaluate = [&](std::string expr) {
+            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+            };
+
+        sheet->SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(evaluate("A1"), 1);
+        sheet->SetCell("A2"_pos, "2");
+        ASSERT_EQUAL(evaluate("A1+A2"), 3);
+
+        // Тест на нули:
+        sheet->SetCell("B3"_pos, "");
+        ASSERT_EQUAL(evaluate("A1+B3"), 1);  // Ячейка с пустым текстом
+        ASSERT_EQUAL(evaluate("A1+B1"), 1);  // Пустая ячейка
+        ASSERT_EQUAL(evaluate("A1+E4"), 1);  // Ячейка за пределами таблицы
+    }
+
+    void TestFormulaExpressionFormatting() {
+        auto reformat = [](std::string expr) {
+            return ParseFormula(std::move(expr))->GetExpression();
+            };
+
+        ASSERT_EQUAL(reformat("  1  "), "1");
+        ASSERT_EQUAL(reformat("  -1  "), "-1");
+        ASSERT_EQUAL(reformat("2 + 2"), "2+2");
+        ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
+        ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
+        ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
+
+        // каноническое выражение строится один раз и не копируется
+        auto formula = ParseFormula("(1.5e3 + A1) * 0.25");
+        std::string_view view = formula->GetExpressionView();
+        ASSERT_EQUAL(view, "(1500+A1)*0.25");
+        ASSERT(view.data() == formula->GetExpressionView().data());
+        ASSERT_EQUAL(formula->GetExpression(), "(1500+A1)*0.25");
+    }
+
+    void TestFormulaReferencedCells() {
+        ASSERT(ParseFormula("1")->GetReferencedCells().empty());
+
+        auto a1 = ParseFormula("A1");
+        ASSERT_EQUAL(a1->GetReferencedCells(), (std::vector{ "A1"_pos }));
+
+        auto b2c3 = ParseFormula("B2+C3");
+        ASSERT_EQUAL(b2c3->GetReferencedCells(), (std::vector{ "B2"_pos, "C3"_pos }));
+
+        auto tricky = ParseFormula("A1 + A2 + A1 + A3 + A1 + A2 + A1");
+        ASSERT_EQUAL(tricky->GetExpression(), "A1+A2+A1+A3+A1+A2+A1");
+        ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{ "A1"_pos, "A2"_pos, "A3"_pos }));
+    }
+
+    void TestErrorValue() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("E2"_pos, "A1");
+        sheet->SetCell("E4"_pos, "=E2");
+        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+
+        sheet->SetCell("E2"_pos, "3D");
+        ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+    }
+
+    void TestErrorArithmetic() {
+        auto sheet = CreateSheet();
+
+        constexpr double max = std::numeric_limits<double>::max();
+
+        sheet->SetCell("A1"_pos, "=1/0");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Arithmetic));
+
+        sheet->SetCell("A1"_pos, "=1e+200/1e-200");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Arithmetic));
+
+        sheet->SetCell("A1"_pos, "=0/0");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Arithmetic));
+
+        {
+            std::ostringstream formula;
+            formula << '=' << max << '+' << max;
+            sheet->SetCell("A1"_pos, formula.str());
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                CellInterface::Value(FormulaError::Category::Arithmetic));
+        }
+
+        {
+            std::ostringstream formula;
+            formula << '=' << -max << '-' << max;
+            sheet->SetCell("A1"_pos, formula.str());
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                CellInterface::Value(FormulaError::Category::Arithmetic));
+        }
+
+        {
+            std::ostringstream formula;
+            formula << '=' << max << '*' << max;
+            sheet->SetCell("A1"_pos, formula.str());
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                CellInterface::Value(FormulaError::Category::Arithmetic));
+        }
+    }
+
+    void TestEmptyCellTreatedAsZero() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=B2");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    }
+
+    void TestFormulaInvalidPosition() {
+        auto sheet = CreateSheet();
+        auto try_formula = [&](const std::string& formula) {
+            try {
+                sheet->SetCell("A1"_pos, formula);
+                ASSERT(false);
+            }
+            catch (const FormulaException&) {
+                // we expect this one
+            }
+            };
+
+        try_formula("=X0");
+        try_formula("=ABCD1");
+        try_formula("=A123456");
+        try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
+        try_formula("=XFD16385");
+        try_formula("=XFE16384"); 
+        try_formula("=R2D2");
+    }
+
+    void TestPrint() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A2"_pos, "meow");
+        sheet->SetCell("B2"_pos, "=35");
+
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2, 2 }));
+
+        std::ostringstream texts;
+        sheet->PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), "\t\nmeow\t=35\n");
+
+        std::ostringstream values;
+        sheet->PrintValues(values);
+        ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
+    }
+
+    void TestCellReferences() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "=A1");
+        sheet->SetCell("B2"_pos, "=A1");
+
+        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetReferencedCells(), std::vector{ "A1"_pos });
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{ "A1"_pos });
+
+        // Ссылка на пустую ячейку
+        sheet->SetCell("B2"_pos, "=B1");
+        ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+        ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{ "B1"_pos });
+
+        sheet->SetCell("A2"_pos, "");
+        ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+        ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
+
+        // Ссылка на ячейку за пределами таблицы
+        sheet->SetCell("B1"_pos, "=C3");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{ "C3"_pos });
+    }
+
+    void TestFormulaIncorrect() {
+        auto isIncorrect = [](std::string expression) {
+            try {
+                ParseFormula(std::move(expression));
+            }
+            catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+            };
+
+        ASSERT(isIncorrect("A2B"));
+        ASSERT(isIncorrect("3X"));
+        ASSERT(isIncorrect("A0++"));
+        ASSERT(isIncorrect("((1)"));
+        ASSERT(isIncorrect("2+4-"));
+    }
+
+    void TestCellCircularReferences() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("E2"_pos, "=E4");
+        sheet->SetCell("E4"_pos, "=X9");
+        sheet->SetCell("X9"_pos, "=M6");
+        sheet->SetCell("M6"_pos, "Ready");
+
+        bool caught = false;
+        try {
+            sheet->SetCell("M6"_pos, "=E2");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
+    }
+
+    void TestLazyFormulaCompilation() {
+        Sheet sheet;
+        sheet.SetLazyFormulaCompilation(true);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1 + 1");
+        sheet.SetCell("A3"_pos, "=(A2)*2 + A1 + A2");
+        ASSERT_EQUAL(sheet.GetUncompiledFormulaCount(), 2u);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetReferencedCells(), (std::vector{ "A1"_pos, "A2"_pos }));
+
+        // ссылки из сканирования достаточны для проверки циклов
+        try {
+            sheet.SetCell("A1"_pos, "=A3");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+
+        // синтаксические ошибки обнаруживаются сразу
+        try {
+            sheet.SetCell("B1"_pos, "=A1+");
+            ASSERT(false);
+        }
+        catch (const FormulaException&) {
+        }
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetUncompiledFormulaCount(), 1u);
+
+        // текст, печать и снимок не компилируют формулу
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=(A2)*2 + A1 + A2");
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), "1\n=A1+1\n=(A2)*2 + A1 + A2\n");
+        SnapshotReader reader(sheet.Snapshot());
+        ASSERT_EQUAL(sheet.GetUncompiledFormulaCount(), 1u);
+        ASSERT_EQUAL(reader.GetCell("A3"_pos)->GetValue(), CellInterface::Value(7.0));
+        ASSERT_EQUAL(reader.GetCell("A3"_pos)->GetReferencedCells(), (std::vector{ "A1"_pos, "A2"_pos }));
+        ASSERT_EQUAL(sheet.GetUncompiledFormulaCount(), 1u);
+
+        // после первого вычисления текст канонический
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(7.0));
+        ASSERT_EQUAL(sheet.GetUncompiledFormulaCount(), 0u);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=A2*2+A1+A2");
+
+        sheet.SetCell("B2"_pos, "=B1*3");
+        ASSERT_EQUAL(sheet.GetUncompiledFormulaCount(), 1u);
+        sheet.ClearCell("B2"_pos);
+        ASSERT_EQUAL(sheet.GetUncompiledFormulaCount(), 0u);
+    }
+
+    void TestCacheInvalidation() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1+1");
+        sheet->SetCell("C1"_pos, "=B1*2");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+        sheet->SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        sheet->SetCell("B1"_pos, "=A1*10");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(40.0));
+
+        sheet->ClearCell("A1"_pos);
+        ASSERT(sheet->GetCell("A1"_pos) != nullptr);
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        // после смены формулы B1 больше не зависит от A1
+        sheet->SetCell("B1"_pos, "5");
+        sheet->ClearCell("A1"_pos);
+        ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+    }
+
+    void TestSheetStats() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetStats().cells_allocated, 0u);
+
+        sheet.EnableStats(true);
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2+A1");
+        sheet.SetCell("A4"_pos, "=A2*2");
+        try {
+            sheet.SetCell("A5"_pos, "=A1+");
+        }
+        catch (const FormulaException&) {
+        }
+
+        const SheetStats& stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.formulas_parsed, 3u);
+        ASSERT(stats.parse_time_ns > 0);
+        ASSERT_EQUAL(stats.cells_allocated, 4u);
+        ASSERT(stats.bytes_allocated > 0);
+        // на новые ячейки никто не ссылается, цикл через них невозможен
+        ASSERT_EQUAL(stats.cycle_check_nodes, 0u);
+
+        sheet.GetCell("A3"_pos)->GetValue();
+        sheet.GetCell("A4"_pos)->GetValue();
+        ASSERT_EQUAL(stats.evaluations, 3u);
+        ASSERT_EQUAL(stats.cache_hits, 1u);  // A2 при вычислении A4
+
+        uint64_t invalidations = stats.invalidations;
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(stats.invalidations, invalidations + 1);
+        ASSERT_EQUAL(stats.max_invalidation_fanout, 3u);
+
+        sheet.SetCell("A1"_pos, "=B1");
+        ASSERT(stats.cycle_check_nodes >= 2);
+
+        sheet.ResetStats();
+        ASSERT_EQUAL(stats.evaluations, 0u);
+        sheet.EnableStats(false);
+        sheet.GetCell("A4"_pos)->GetValue();
+        ASSERT_EQUAL(stats.evaluations, 0u);
+    }
+
+    void TestRecalcProfiler() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2*2");
+        sheet.SetCell("B1"_pos, "=A3+A2");
+
+        sheet.StartProfiling();
+        ASSERT(sheet.IsProfiling());
+        sheet.GetCell("B1"_pos)->GetValue();
+        sheet.GetCell("B1"_pos)->GetValue();
+        auto profiler = sheet.StopProfiling();
+        ASSERT(!sheet.IsProfiling());
+
+        const auto& cells = profiler->GetCellProfiles();
+        ASSERT_EQUAL(cells.size(), 3u);
+        ASSERT_EQUAL(cells.at("A2"_pos).evaluations, 1u);
+        ASSERT_EQUAL(cells.at("B1"_pos).evaluations, 1u);
+        const auto& b1 = cells.at("B1"_pos);
+        const auto& a3 = cells.at("A3"_pos);
+        ASSERT(b1.inclusive_ns >= a3.inclusive_ns);
+        ASSERT(b1.inclusive_ns >= b1.self_ns);
+        ASSERT_EQUAL(profiler->GetHottestCells(2).size(), 2u);
+
+        std::ostringstream report;
+        profiler->PrintReport(report, 10);
+        ASSERT(report.str().find("B1") != std::string::npos);
+
+        std::ostringstream trace;
+        profiler->ExportChromeTrace(trace);
+        ASSERT(trace.str().find("\"traceEvents\"") != std::string::npos);
+        ASSERT(trace.str().find("\"name\": \"A3\"") != std::string::npos);
+    }
+
+    void TestErrorPropagation() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=1/0");
+        sheet->SetCell("A2"_pos, "=A1+1");
+        sheet->SetCell("A3"_pos, "=A2*2");
+        ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Arithmetic));
+    }
+
+    void TestDeepDependencyChain() {
+        // цепочка длиной в миллион ячеек идёт змейкой по столбцам
+        constexpr int CHAIN_LENGTH = 1'000'000;
+        auto chain_pos = [](int index) {
+            return Position{ index % Position::MAX_ROWS, index / Position::MAX_ROWS };
+        };
+
+        Sheet sheet;
+        sheet.SetCell(chain_pos(0), "1");
+        for (int i = 1; i < CHAIN_LENGTH; ++i) {
+            sheet.SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+        }
+        const Position last = chain_pos(CHAIN_LENGTH - 1);
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(1'000'000.0));
+
+        // сброс кэша проходит всю цепочку
+        sheet.SetCell(chain_pos(0), "2");
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(1'000'001.0));
+
+        // проверка цикла через всю цепочку
+        try {
+            sheet.SetCell(chain_pos(0), "=" + last.ToString());
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell(chain_pos(0))->GetText(), "2");
+
+        sheet.SetCell(chain_pos(0), "=1/0");
+        ASSERT_EQUAL(sheet.GetCell(last)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Arithmetic));
+    }
+
+    void TestUndoRedo() {
+        Sheet sheet;
+        sheet.SetUndoMemoryLimit(1 << 20);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1 * 2");
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        sheet.Undo();
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+        sheet.Undo();
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        sheet.Redo();
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=A1*2");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT(sheet.CanRedo());
+
+        // пакет изменений отменяется одной операцией
+        sheet.BeginBatch();
+        sheet.SetCell("B1"_pos, "x");
+        sheet.SetCell("A1"_pos, "7");
+        sheet.ClearCell("B1"_pos);
+        sheet.SetCell("B2"_pos, "=A2+1");
+        sheet.EndBatch();
+        ASSERT(!sheet.CanRedo());
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(15.0));
+        size_t depth = sheet.GetUndoJournal()->GetUndoDepth();
+        sheet.Undo();
+        ASSERT_EQUAL(sheet.GetUndoJournal()->GetUndoDepth(), depth - 1);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+        ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+        sheet.Redo();
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(15.0));
+
+        // при уменьшении лимита забываются самые старые операции
+        size_t usage = sheet.GetUndoJournal()->GetMemoryUsage();
+        sheet.SetUndoMemoryLimit(usage - 1);
+        ASSERT(sheet.GetUndoJournal()->GetMemoryUsage() < usage);
+        ASSERT(sheet.GetUndoJournal()->GetUndoDepth() < depth);
+        ASSERT(sheet.CanUndo());
+        sheet.Undo();
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    }
+
+    void TestSheetSnapshot() {
+        Sheet sheet;
+        for (int row = 0; row < 200; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string(row));
+        }
+        sheet.SetCell("B1"_pos, "=A1+A200");
+        sheet.SetCell("B2"_pos, "=B1*2");
+        sheet.SetCell("C1"_pos, "'=text");
+
+        auto first = sheet.Snapshot();
+        ASSERT(sheet.Snapshot() == first);  // без изменений снимок тот же
+
+        sheet.SetCell("A1"_pos, "100");
+        sheet.ClearCell("C1"_pos);
+        auto second = sheet.Snapshot();
+
+        // снимки не видят последующих изменений
+        SnapshotReader old_reader(first);
+        ASSERT_EQUAL(old_reader.GetCell("B2"_pos)->GetValue(), CellInterface::Value(398.0));
+        ASSERT_EQUAL(old_reader.GetCell("C1"_pos)->GetValue(), CellInterface::Value("=text"));
+        ASSERT_EQUAL(old_reader.GetCell("B1"_pos)->GetText(), "=A1+A200");
+        ASSERT_EQUAL(old_reader.GetPrintableSize(), (Size{ 200, 3 }));
+        SnapshotReader new_reader(second);
+        ASSERT_EQUAL(new_reader.GetCell("B2"_pos)->GetValue(), CellInterface::Value(598.0));
+        ASSERT(new_reader.GetCell("C1"_pos) == nullptr);
+        ASSERT_EQUAL(new_reader.GetPrintableSize(), (Size{ 200, 2 }));
+
+        // изменения затронули только первый блок, остальные общие
+        size_t tiles = (200 + SheetSnapshot::TILE_SIZE - 1) / SheetSnapshot::TILE_SIZE;
+        ASSERT_EQUAL(first->GetTiles().size(), tiles);
+        ASSERT_EQUAL(second->CountSharedTiles(*first), tiles - 1);
+
+        try {
+            new_reader.SetCell("A1"_pos, "1");
+            ASSERT(false);
+        }
+        catch (const std::logic_error&) {
+        }
+
+        // читатель в другом потоке работает со снимком, пока таблица меняется
+        sheet.SetCell("D1"_pos, "=A1+A2+A3");
+        auto snapshot = sheet.Snapshot();
+        CellInterface::Value reader_value;
+        std::thread reader_thread([snapshot, &reader_value] {
+            for (int i = 0; i < 1000; ++i) {
+                SnapshotReader reader(snapshot);
+                reader_value = reader.GetCell("D1"_pos)->GetValue();
+            }
+        });
+        for (int i = 0; i < 1000; ++i) {
+            sheet.SetCell("A2"_pos, std::to_string(i));
+            sheet.SetCell("D1"_pos, "=A1+A2+A3+" + std::to_string(i));
+        }
+        reader_thread.join();
+        ASSERT_EQUAL(reader_value, CellInterface::Value(103.0));
+    }
+
+    void TestInsertDeleteRowsCols() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("A3"_pos, "=A1+A2");
+        sheet.SetCell("B3"_pos, "=A3*2");
+        sheet.SetCell("C1"_pos, "=A2");
+
+        sheet.InsertRows(1, 2);
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=A1+A4");
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=A5*2");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A4");
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 3 }));
+
+        // зависимости переехали вместе с ячейками
+        sheet.SetCell("A4"_pos, "10");
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(22.0));
+        try {
+            sheet.SetCell("A1"_pos, "=B5");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+
+        sheet.InsertCols(0);
+        ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetText(), "=B5*2");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=B4");
+
+        // ссылки на удалённые ячейки становятся ошибкой
+        auto snapshot = sheet.Snapshot();
+        sheet.DeleteRows(3);
+        ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetText(), "=B1+#REF!");
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=B4*2");
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=#REF!");
+        ASSERT(sheet.GetCell("D1"_pos)->GetReferencedCells().empty());
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(values.str(), "\t1\t\t#REF!\n\t\t\t\n\t\t\t\n\t#REF!\t#REF!\t\n");
+
+        // формулы снимка не изменились
+        SnapshotReader reader(snapshot);
+        ASSERT_EQUAL(reader.GetCell("B5"_pos)->GetText(), "=B1+B4");
+        ASSERT_EQUAL(reader.GetCell("C5"_pos)->GetValue(), CellInterface::Value(22.0));
+
+        // пустая ячейка, на которую ссылалась только удалённая формула, удаляется
+        sheet.SetCell("F1"_pos, "=G1");
+        sheet.DeleteCols(5);
+        ASSERT(sheet.GetCell("F1"_pos) == nullptr);
+
+        Sheet full;
+        full.SetCell({ Position::MAX_ROWS - 1, 0 }, "last");
+        try {
+            full.InsertRows(0);
+            ASSERT(false);
+        }
+        catch (const TableTooBigException&) {
+        }
+        ASSERT_EQUAL(full.GetCell({ Position::MAX_ROWS - 1, 0 })->GetText(), "last");
+
+        // огромное число вставляемых строк или столбцов не переполняет позиции
+        Sheet small;
+        small.SetCell("B6"_pos, "=A1+1");
+        for (auto insert : { &Sheet::InsertRows, &Sheet::InsertCols }) {
+            try {
+                (small.*insert)(0, std::numeric_limits<int>::max());
+                ASSERT(false);
+            }
+            catch (const TableTooBigException&) {
+            }
+        }
+        ASSERT_EQUAL(small.GetCell("B6"_pos)->GetText(), "=A1+1");
+        ASSERT_EQUAL(small.GetPrintableSize(), (Size{ 6, 2 }));
+        // пустые строки и столбцы за ячейками уходят за пределы таблицы
+        small.InsertRows(6, std::numeric_limits<int>::max());
+        small.InsertCols(2, std::numeric_limits<int>::max());
+        ASSERT_EQUAL(small.GetCell("B6"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(small.GetPrintableSize(), (Size{ 6, 2 }));
+    }
+
+    void TestWorkbook() {
+        auto is_cached = [](const CellInterface* cell) {
+            return static_cast<const Cell*>(cell)->IsCacheValid();
+        };
+        Workbook book;
+        Sheet& first = book.AddSheet("Sheet1");
+        Sheet& second = book.AddSheet("Итоги 'май'");
+        ASSERT_EQUAL(book.GetSheetNames(), (std::vector<std::string>{ "Sheet1", "Итоги 'май'" }));
+        try {
+            book.AddSheet("Sheet1");
+            ASSERT(false);
+        }
+        catch (const std::invalid_argument&) {
+        }
+
+        first.SetCell("A1"_pos, "2");
+        second.SetCell("A1"_pos, "=Sheet1!A1*10");
+        second.SetCell("B1"_pos, "='Итоги ''май'''!A1+1");
+        ASSERT_EQUAL(second.GetCell("B1"_pos)->GetText(), "='Итоги ''май'''!A1+1");
+        ASSERT_EQUAL(second.GetCell("B1"_pos)->GetValue(), CellInterface::Value(21.0));
+        ASSERT(first.GetCell("A1"_pos)->GetReferencedCells().empty());
+
+        // изменение сбрасывает кэш только зависящих листов
+        Sheet& third = book.AddSheet("Sheet3");
+        third.SetCell("A1"_pos, "=5");
+        third.GetCell("A1"_pos)->GetValue();
+        first.SetCell("A1"_pos, "3");
+        ASSERT(!is_cached(second.GetCell("B1"_pos)));
+        ASSERT(is_cached(third.GetCell("A1"_pos)));
+        ASSERT_EQUAL(second.GetCell("B1"_pos)->GetValue(), CellInterface::Value(31.0));
+
+        // ссылка на ещё не добавленный лист
+        first.SetCell("B1"_pos, "=Later!A1+1");
+        ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        Sheet& later = book.AddSheet("Later");
+        later.SetCell("A1"_pos, "41");
+        ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), CellInterface::Value(42.0));
+
+        // цикл через несколько листов
+        try {
+            later.SetCell("A1"_pos, "=Sheet1!B1");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        try {
+            first.SetCell("A1"_pos, "=Sheet1!A1");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(later.GetCell("A1"_pos)->GetText(), "41");
+
+        // вставка строк сдвигает ссылки с других листов
+        first.InsertRows(0, 2);
+        ASSERT_EQUAL(second.GetCell("A1"_pos)->GetText(), "=Sheet1!A3*10");
+        ASSERT_EQUAL(second.GetCell("A1"_pos)->GetValue(), CellInterface::Value(30.0));
+        first.SetCell("A3"_pos, "4");
+        ASSERT_EQUAL(second.GetCell("B1"_pos)->GetValue(), CellInterface::Value(41.0));
+        first.DeleteRows(2);
+        ASSERT_EQUAL(second.GetCell("A1"_pos)->GetText(), "=#REF!*10");
+        ASSERT_EQUAL(second.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+        // удаление листа
+        first.SetCell("C1"_pos, "=Later!A1");
+        ASSERT_EQUAL(first.GetCell("C1"_pos)->GetValue(), CellInterface::Value(41.0));
+        book.RemoveSheet("Later");
+        ASSERT(book.GetSheet("Later") == nullptr);
+        ASSERT_EQUAL(first.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+        // отдельная таблица других листов не видит
+        Sheet single;
+        single.SetCell("A1"_pos, "=Sheet1!A1");
+        ASSERT_EQUAL(single.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+        // параллельный пересчёт по уровням зависимостей листов
+        Workbook chain;
+        const int sheets = 8;
+        for (int i = 0; i < sheets; ++i) {
+            Sheet& sheet = chain.AddSheet("S" + std::to_string(i));
+            for (int row = 0; row < 100; ++row) {
+                std::string text = i == 0 ? std::to_string(row)
+                    : "=S" + std::to_string(i - 1) + "!A" + std::to_string(row + 1) + "+1";
+                sheet.SetCell({ row, 0 }, text);
+            }
+        }
+        chain.Recalculate(4);
+        const Sheet* last = chain.GetSheet("S" + std::to_string(sheets - 1));
+        ASSERT(is_cached(last->GetCell("A100"_pos)));
+        ASSERT_EQUAL(last->GetCell("A100"_pos)->GetValue(), CellInterface::Value(99.0 + sheets - 1));
+    }
+
+    void TestConstantFolding() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("A2"_pos, "inf");
+        sheet.SetCell("A3"_pos, "abc");
+        auto value = [&sheet](std::string text) {
+            sheet.SetCell("C1"_pos, std::move(text));
+            return sheet.GetCell("C1"_pos)->GetValue();
+        };
+        auto expression = [](std::string text) {
+            return ParseFormula(std::move(text))->GetExpression();
+        };
+
+        // выражение печатается так, как его написал пользователь
+        ASSERT_EQUAL(value("=1000*60*60*A1"), CellInterface::Value(7200000.0));
+        ASSERT_EQUAL(expression("1000*60*60*A1"), "1000*60*60*A1");
+        ASSERT_EQUAL(value("=(2+3)*B4"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(expression("(2+3)*B4"), "(2+3)*B4");
+        ASSERT_EQUAL(value("=+(1+2)*-A1"), CellInterface::Value(-6.0));
+        ASSERT_EQUAL(expression("+(1+2)*-A1"), "+(1+2)*-A1");
+        ASSERT_EQUAL(value("=A1/4+A1*1-0"), CellInterface::Value(2.5));
+        ASSERT_EQUAL(value("=A1/(1+1)"), CellInterface::Value(1.0));
+
+        // ошибки в константах сохраняют категорию и порядок вычисления
+        ASSERT_EQUAL(value("=1/0+A3"), CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(value("=A3+1/0"), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(value("=1e308*10"), CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(value("=(1-1)/0*A1"), CellInterface::Value(FormulaError::Category::Arithmetic));
+
+        // тождества не снимают проверок бесконечности у значений ячеек
+        ASSERT_EQUAL(value("=+A2"), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(value("=A2*1"), CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(value("=1*A2"), CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(value("=A2-0"), CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(value("=+(A2*1)"), CellInterface::Value(FormulaError::Category::Arithmetic));
+
+        // свёрнутые формулы сдвигаются вместе со ссылками
+        sheet.SetCell("C2"_pos, "=2*3*A1/2");
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=2*3*A2/2");
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(6.0));
+        sheet.DeleteRows(1);
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    }
+    void TestBatchEvaluation() {
+        // одинаковые листы: первый считается пакетами, второй по одной формуле
+        auto fill = [](Sheet& sheet) {
+            const int rows = 20;
+            for (int row = 0; row < rows; ++row) {
+                std::string r = std::to_string(row + 1);
+                sheet.SetCell({ row, 0 }, std::to_string(row + 1));
+                sheet.SetCell({ row, 1 }, std::to_string(row % 4));
+                sheet.SetCell({ row, 2 }, "0.5");
+                sheet.SetCell({ row, 3 }, "=A" + r + "/B" + r + "+C" + r);
+                sheet.SetCell({ row, 4 }, "=-(D" + r + "-1)*2");
+                sheet.SetCell({ row, 5 }, row == 0 ? "1" : "=F" + std::to_string(row) + "+A" + r);
+            }
+            // ошибки в ссылках: текст, ошибка формулы, деление на ноль раньше текста
+            sheet.SetCell("C6"_pos, "abc");
+            sheet.SetCell("A10"_pos, "=1/0");
+            sheet.SetCell("C13"_pos, "abc");
+            sheet.SetCell("A15"_pos, "1e308");
+            sheet.SetCell("B15"_pos, "1e-10");
+        };
+        Sheet batched;
+        Sheet single;
+        fill(batched);
+        fill(single);
+        batched.EnableStats(true);
+        single.SetBatchEvaluation(false);
+
+        batched.Recalculate();
+        single.Recalculate();
+        Size size = single.GetPrintableSize();
+        ASSERT_EQUAL(batched.GetPrintableSize(), size);
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                const auto* cell = static_cast<const Cell*>(batched.GetCell({ row, col }));
+                ASSERT(!cell->IsFormula() || cell->IsCacheValid());
+                ASSERT_EQUAL(cell->GetValue(), single.GetCell({ row, col })->GetValue());
+            }
+        }
+        ASSERT_EQUAL(batched.GetCell("D6"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(batched.GetCell("D10"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(batched.GetCell("D13"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(batched.GetCell("D15"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(batched.GetCell("E2"_pos)->GetValue(), CellInterface::Value(-3.0));
+        ASSERT_EQUAL(batched.GetCell("F20"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Arithmetic));
+        ASSERT_EQUAL(batched.GetCell("F9"_pos)->GetValue(), CellInterface::Value(45.0));
+
+        // столбец F ссылается сам на себя и считается по одной формуле,
+        // формулы A10 и F1..F20 в пакеты не попадают
+        ASSERT_EQUAL(batched.GetStats().batched_evaluations, 40u);
+
+        // после изменения пересчитываются только сброшенные формулы
+        batched.SetCell("B2"_pos, "4");
+        single.SetCell("B2"_pos, "4");
+        batched.Recalculate();
+        ASSERT_EQUAL(batched.GetCell("E2"_pos)->GetValue(), single.GetCell("E2"_pos)->GetValue());
+        ASSERT_EQUAL(batched.GetStats().batched_evaluations, 40u);
+    }
+    void TestAsyncRecalculation() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({ row, 1 }, "=A1*" + std::to_string(row + 1));
+        }
+        sheet.SetCell("C1"_pos, "=B100+1");
+
+        AsyncRecalculator recalc(sheet);
+        recalc.Wait();
+        auto progress = recalc.GetProgress();
+        ASSERT_EQUAL(progress.pending, 0u);
+        ASSERT_EQUAL(progress.computed, 101u);
+
+        // значение по запросу верно сразу, не дожидаясь фонового пересчёта
+        recalc.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(recalc.GetValue("C1"_pos), CellInterface::Value(201.0));
+        ASSERT_EQUAL(recalc.GetValue("B50"_pos), CellInterface::Value(100.0));
+        recalc.Wait();
+        progress = recalc.GetProgress();
+        ASSERT_EQUAL(progress.pending, 0u);
+        // B100, C1 и, возможно, B50 вычислены по запросу
+        ASSERT(progress.computed >= 101u + 98u && progress.computed <= 101u + 101u);
+        recalc.Read([](const Sheet& sheet) {
+            for (int row = 0; row < 100; ++row) {
+                ASSERT(static_cast<const Cell*>(sheet.GetCell({ row, 1 }))->IsCacheValid());
+                ASSERT_EQUAL(sheet.GetCell({ row, 1 })->GetValue(), CellInterface::Value(2.0 * (row + 1)));
+            }
+        });
+
+        // ошибка изменения не оставляет лист захваченным
+        try {
+            recalc.SetCell("A1"_pos, "=C1");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(recalc.GetText("A1"_pos), "2");
+        recalc.ClearCell("A1"_pos);
+        ASSERT_EQUAL(recalc.GetValue("A1"_pos), CellInterface::Value(""));
+        ASSERT(recalc.WaitFor(std::chrono::seconds(10)));
+        ASSERT_EQUAL(recalc.GetValue("C1"_pos), CellInterface::Value(1.0));
+
+        // после вставки строк очередь строится по новым позициям
+        recalc.Modify([](Sheet& sheet) {
+            sheet.SetCell("A1"_pos, "3");
+            sheet.InsertRows(0, 2);
+        });
+        recalc.Wait();
+        recalc.Read([](const Sheet& sheet) {
+            ASSERT(sheet.GetUncalculatedFormulas().empty());
+            ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(301.0));
+        });
+
+        Workbook book;
+        try {
+            AsyncRecalculator book_recalc(book.AddSheet("Sheet1"));
+            ASSERT(false);
+        }
+        catch (const std::invalid_argument&) {
+        }
+    }
+    void TestChangeSubscriptions() {
+        Sheet sheet;
+        sheet.SetUndoMemoryLimit(1 << 20);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=B1-B1");
+        sheet.SetCell("D1"_pos, "=A1");
+        for (Position pos : { "B1"_pos, "C1"_pos, "D1"_pos }) {
+            sheet.GetCell(pos)->GetValue();
+        }
+
+        std::vector<Sheet::Changes> first;
+        std::vector<Sheet::Changes> second;
+        sheet.Subscribe({ "A1"_pos, "C1"_pos }, [&first](const Sheet::Changes& changes) {
+            first.push_back(changes);
+        });
+        auto second_id = sheet.Subscribe({ "D1"_pos, "D1"_pos }, [&second](const Sheet::Changes& changes) {
+            second.push_back(changes);
+        });
+        using Cells = std::vector<Position>;
+
+        // C1 пересчитана, но значение прежнее
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(first.size(), 1u);
+        ASSERT_EQUAL(first[0].cells, (Cells{ "A1"_pos, "B1"_pos }));
+        ASSERT(!first[0].structure_changed);
+        ASSERT_EQUAL(second.size(), 1u);
+        ASSERT_EQUAL(second[0].cells, Cells{ "D1"_pos });
+
+        // тот же текст и ячейки вне областей не дают уведомлений
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("E5"_pos, "x");
+        ASSERT_EQUAL(first.size(), 1u);
+        ASSERT_EQUAL(second.size(), 1u);
+
+        // пакет сообщается одним уведомлением после EndBatch
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "3");
+        sheet.SetCell("A1"_pos, "4");
+        sheet.ClearCell("E5"_pos);
+        ASSERT_EQUAL(first.size(), 1u);
+        sheet.EndBatch();
+        ASSERT_EQUAL(first.size(), 2u);
+        ASSERT_EQUAL(first[1].cells, (Cells{ "A1"_pos, "B1"_pos }));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(8.0));
+
+        // отмена пакета - одна операция; значение вернулось к "2"
+        sheet.Undo();
+        ASSERT_EQUAL(first.size(), 3u);
+        ASSERT_EQUAL(first[2].cells, (Cells{ "A1"_pos, "B1"_pos }));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+        // неудачное изменение ничего не меняет и не сообщается
+        try {
+            sheet.SetCell("A1"_pos, "=C1");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        sheet.Unsubscribe(second_id);
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(first.size(), 4u);
+        ASSERT_EQUAL(first[3].cells, (Cells{ "A1"_pos, "B1"_pos }));
+        ASSERT_EQUAL(second.size(), 3u);
+
+        // после вставки строк подписчик перечитывает область
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(first.size(), 5u);
+        ASSERT(first[4].structure_changed);
+        ASSERT(first[4].cells.empty());
+
+        try {
+            sheet.EndBatch();
+            ASSERT(false);
+        }
+        catch (const std::logic_error&) {
+        }
+
+        // изменения на другом листе книги
+        Workbook book;
+        Sheet& source = book.AddSheet("Source");
+        Sheet& target = book.AddSheet("Target");
+        source.SetCell("A1"_pos, "1");
+        target.SetCell("A1"_pos, "=Source!A1+1");
+        target.GetCell("A1"_pos)->GetValue();
+        std::vector<Position> target_changes;
+        target.Subscribe({ "A1"_pos, "A1"_pos }, [&](const Sheet::Changes& changes) {
+            target_changes.insert(target_changes.end(), changes.cells.begin(), changes.cells.end());
+        });
+        source.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(target_changes, Cells{ "A1"_pos });
+
+        // перевёрнутая область не принимается, как и в ReadRange
+        int inverted_calls = 0;
+        for (CellRange region : { CellRange{ { 5, 5 }, { 0, 0 } }, CellRange{ "A2"_pos, "B1"_pos },
+                 CellRange{ "B1"_pos, "A2"_pos } }) {
+            try {
+                target.Subscribe(region, [&inverted_calls](const Sheet::Changes&) {
+                    ++inverted_calls;
+                });
+                ASSERT(false);
+            }
+            catch (const InvalidPositionException&) {
+            }
+        }
+        source.SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(inverted_calls, 0);
+        ASSERT_EQUAL(target_changes, (Cells{ "A1"_pos, "A1"_pos }));
+    }
+    void TestReadRange() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "a rather long piece of text");
+        sheet.SetCell("B1"_pos, "'=escaped");
+        sheet.SetCell("A2"_pos, "=C3*2");
+        sheet.SetCell("B2"_pos, "=1/0");
+        sheet.SetCell("C3"_pos, "21");
+
+        RangeValues out;
+        sheet.ReadRange({ "A1"_pos, "C3"_pos }, out);
+        ASSERT_EQUAL(out.rows, 3);
+        ASSERT_EQUAL(out.cols, 3);
+        ASSERT(out.At(0, 0).kind == RangeValues::Kind::Text);
+        ASSERT_EQUAL(out.At(0, 0).text, "a rather long piece of text");
+        ASSERT_EQUAL(out.At(0, 1).text, "=escaped");
+        ASSERT(out.At(0, 2).kind == RangeValues::Kind::Empty);
+        ASSERT(out.At(1, 0).kind == RangeValues::Kind::Number);
+        ASSERT_EQUAL(out.At(1, 0).number, 42.0);
+        ASSERT(out.At(1, 1).kind == RangeValues::Kind::Error);
+        ASSERT(out.At(1, 1).error == FormulaError::Category::Arithmetic);
+        ASSERT(out.At(2, 2).kind == RangeValues::Kind::Text);
+        ASSERT_EQUAL(out.At(2, 2).text, "21");
+
+        // значения совпадают с GetValue, в том числе в области больше листа
+        const auto* data = out.values.data();
+        for (CellRange range : { CellRange{ "B2"_pos, "C3"_pos }, CellRange{ "A1"_pos, "Z100"_pos } }) {
+            sheet.ReadRange(range, out);
+            for (int row = 0; row < out.rows; ++row) {
+                for (int col = 0; col < out.cols; ++col) {
+                    Position pos{ range.first.row + row, range.first.col + col };
+                    const auto* cell = sheet.GetCell(pos);
+                    CellInterface::Value expected = cell ? cell->GetValue() : CellInterface::Value{};
+                    const auto& value = out.At(row, col);
+                    switch (value.kind) {
+                    case RangeValues::Kind::Empty:
+                        ASSERT_EQUAL(expected, CellInterface::Value(""));
+                        break;
+                    case RangeValues::Kind::Text:
+                        ASSERT_EQUAL(expected, CellInterface::Value(std::string(value.text)));
+                        break;
+                    case RangeValues::Kind::Number:
+                        ASSERT_EQUAL(expected, CellInterface::Value(value.number));
+                        break;
+                    case RangeValues::Kind::Error:
+                        ASSERT_EQUAL(expected, CellInterface::Value(FormulaError(value.error)));
+                        break;
+                    }
+                }
+            }
+        }
+
+        // повторное чтение области того же размера не перевыделяет буфер
+        sheet.ReadRange({ "A1"_pos, "Z100"_pos }, out);
+        data = out.values.data();
+        sheet.SetCell("C3"_pos, "1");
+        sheet.ReadRange({ "B1"_pos, "AA100"_pos }, out);
+        ASSERT_EQUAL(out.values.data(), data);
+        ASSERT(out.At(1, 0).kind == RangeValues::Kind::Error);
+
+        try {
+            sheet.ReadRange({ "B2"_pos, "A1"_pos }, out);
+            ASSERT(false);
+        }
+        catch (const InvalidPositionException&) {
+        }
+    }
+
+    void TestValueView() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "a rather long piece of text");
+        sheet.SetCell("A2"_pos, "'=escaped");
+        sheet.SetCell("A3"_pos, "=A4*2");
+        sheet.SetCell("A4"_pos, "'21");
+        sheet.SetCell("A5"_pos, "=A1+1");
+
+        // текст не копируется: представление указывает на текст ячейки
+        const auto* text = static_cast<const Cell*>(sheet.GetCell("A1"_pos));
+        auto value = text->GetValueView();
+        ASSERT_EQUAL(std::get<std::string_view>(value), "a rather long piece of text");
+        ASSERT(std::get<std::string_view>(value).data() == text->GetTextView().data());
+
+        const auto* escaped = static_cast<const Cell*>(sheet.GetCell("A2"_pos));
+        value = escaped->GetValueView();
+        ASSERT_EQUAL(std::get<std::string_view>(value), "=escaped");
+        ASSERT(std::get<std::string_view>(value).data() == escaped->GetTextView().data() + 1);
+
+        // формула читает текст соседней ячейки через представление
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValueView()), 42.0);
+        ASSERT_EQUAL(std::get<FormulaError>(sheet.GetCell("A5"_pos)->GetValueView()),
+            FormulaError(FormulaError::Category::Value));
+
+        // пустая ячейка, на которую ссылается формула
+        sheet.SetCell("C1"_pos, "=B1");
+        ASSERT_EQUAL(std::get<std::string_view>(sheet.GetCell("B1"_pos)->GetValueView()), "");
+
+        // GetValue возвращает то же значение
+        for (Position pos : { "A1"_pos, "A2"_pos, "A3"_pos, "A4"_pos, "A5"_pos, "B1"_pos }) {
+            const auto* cell = sheet.GetCell(pos);
+            ASSERT_EQUAL(cell->GetValue(), ToValue(cell->GetValueView()));
+        }
+
+        // то же для снимка
+        SnapshotReader reader(sheet.Snapshot());
+        ASSERT_EQUAL(std::get<std::string_view>(reader.GetCell("A2"_pos)->GetValueView()), "=escaped");
+        ASSERT_EQUAL(std::get<double>(reader.GetCell("A3"_pos)->GetValueView()), 42.0);
+        ASSERT_EQUAL(reader.GetCell("A1"_pos)->GetValue(), sheet.GetCell("A1"_pos)->GetValue());
+    }
+    void TestStringPool() {
+        Sheet sheet;
+        const StringPool& pool = sheet.GetStringPool();
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({ row, 0 }, "Active");
+            sheet.SetCell({ row, 1 }, row % 2 ? "United States of America" : "'United States of America");
+        }
+        ASSERT_EQUAL(pool.GetSize(), 3u);
+
+        // одинаковые тексты разделяют память
+        auto text = [&sheet](Position pos) {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->GetTextView();
+        };
+        ASSERT(text("A1"_pos).data() == text("A100"_pos).data());
+        ASSERT(text("B2"_pos).data() == text("B4"_pos).data());
+        ASSERT(!(text("B1"_pos).data() == text("B2"_pos).data()));
+        ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("B1"_pos)->GetValue()), "United States of America");
+        ASSERT_EQUAL(text("B1"_pos), "'United States of America");
+
+        // запись пула удаляется с последней ссылкой
+        size_t full_bytes = pool.GetAllocatedBytes();
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({ row, 0 }, "Inactive");
+        }
+        ASSERT_EQUAL(pool.GetSize(), 3u);
+        ASSERT_EQUAL(pool.GetAllocatedBytes(), full_bytes);
+        for (int row = 0; row < 100; ++row) {
+            sheet.ClearCell({ row, 0 });
+            sheet.ClearCell({ row, 1 });
+        }
+        ASSERT_EQUAL(pool.GetSize(), 0u);
+        ASSERT(pool.GetAllocatedBytes() < full_bytes / 2);
+
+        // отмена возвращает тексты в пул
+        sheet.SetUndoMemoryLimit(1 << 20);
+        sheet.SetCell("C1"_pos, "USD");
+        sheet.SetCell("C2"_pos, "USD");
+        sheet.ClearCell("C1"_pos);
+        sheet.Undo();
+        ASSERT_EQUAL(pool.GetSize(), 1u);
+        ASSERT(text("C1"_pos).data() == text("C2"_pos).data());
+
+        // одинаковые тексты сравниваются по ссылке
+        StringPool own_pool;
+        {
+            StringPool::Handle first = own_pool.Intern("Active");
+            StringPool::Handle second = own_pool.Intern(std::string("Act") + "ive");
+            StringPool::Handle other = own_pool.Intern("active");
+            ASSERT(first == second);
+            ASSERT(first != other);
+            ASSERT(own_pool.Intern("") == StringPool::Handle{});
+            ASSERT_EQUAL(own_pool.GetSize(), 2u);
+            StringPool::Handle copy = first;
+            first = other;
+            ASSERT_EQUAL(copy.GetText(), "Active");
+            ASSERT_EQUAL(first.GetText(), "active");
+        }
+        ASSERT_EQUAL(own_pool.GetSize(), 0u);
+    }
+
+    void TestMemoryUsage() {
+        Sheet sheet;
+        SheetMemoryUsage empty = sheet.GetMemoryUsage();
+        ASSERT_EQUAL(empty.formulas, 0u);
+        ASSERT_EQUAL(empty.cached_values, 0u);
+
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({ row, 0 }, "Region with a long enough name");
+            sheet.SetCell({ row, 1 }, std::to_string(row));
+        }
+        SheetMemoryUsage texts = sheet.GetMemoryUsage();
+        ASSERT(texts.cells > empty.cells);
+        ASSERT(texts.text > empty.text);
+        ASSERT_EQUAL(texts.formulas, 0u);
+        ASSERT_EQUAL(texts.dependencies, 0u);
+
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({ row, 2 }, "=B" + std::to_string(row + 1) + "*2+1");
+        }
+        SheetMemoryUsage formulas = sheet.GetMemoryUsage();
+        ASSERT(formulas.formulas > 0);
+        ASSERT(formulas.dependencies > 0);
+        ASSERT(formulas.cached_values > 0);
+        ASSERT_EQUAL(formulas.text, texts.text);
+        ASSERT_EQUAL(formulas.GetTotal(), formulas.cells + formulas.text + formulas.formulas
+            + formulas.dependencies + formulas.cached_values + formulas.undo_journal + formulas.lookup_indexes
+            + formulas.formula_cache);
+        ASSERT(sheet.GetCompiledFormulaBytes() > 0);
+        ASSERT(sheet.GetCompiledFormulaBytes() <= formulas.formulas);
+
+        // текст формулы хранится один раз, вместе с каноническим выражением
+        const Cell* formula_cell = static_cast<const Cell*>(sheet.GetCell("C1"_pos));
+        ASSERT_EQUAL(formula_cell->GetTextView(), "=B1*2+1");
+        ASSERT(formula_cell->GetTextView().data() + 1 == formula_cell->GetSharedFormula()->GetExpressionView().data());
+        for (int row = 0; row < 100; ++row) {
+            sheet.GetCell({ row, 2 })->GetText();
+        }
+        ASSERT_EQUAL(sheet.GetMemoryUsage().formulas, formulas.formulas);
+
+        sheet.SetUndoMemoryLimit(1 << 20);
+        sheet.SetCell("D1"_pos, "x");
+        ASSERT(sheet.GetMemoryUsage().undo_journal > 0);
+
+        for (int row = 0; row < 100; ++row) {
+            sheet.ClearCell({ row, 2 });
+        }
+        ASSERT_EQUAL(sheet.GetMemoryUsage().formulas, 0u);
+        ASSERT_EQUAL(sheet.GetCompiledFormulaBytes(), 0u);
+    }
+
+    void TestFormulaMemoryLimit() {
+        Sheet sheet;
+        sheet.EnableStats(true);
+        constexpr int rows = 200;
+        for (int row = 0; row < rows; ++row) {
+            std::string r = std::to_string(row + 1);
+            sheet.SetCell({ row, 0 }, std::to_string(row));
+            sheet.SetCell({ row, 1 }, "=A" + r + "*2+(A" + r + "-1)/4");
+        }
+        sheet.Recalculate();
+        size_t full = sheet.GetCompiledFormulaBytes();
+        std::vector<CellInterface::Value> expected;
+        std::vector<std::string> texts;
+        for (int row = 0; row < rows; ++row) {
+            expected.push_back(sheet.GetCell({ row, 1 })->GetValue());
+            texts.push_back(sheet.GetCell({ row, 1 })->GetText());
+        }
+
+        // вытесняются до 3/4 лимита, первыми - давно не вычислявшиеся
+        sheet.SetFormulaMemoryLimit(full / 2);
+        ASSERT(sheet.GetCompiledFormulaBytes() <= full / 2 / 4 * 3);
+        ASSERT(sheet.GetUncompiledFormulaCount() > 0);
+        ASSERT_EQUAL(sheet.GetStats().formulas_evicted, sheet.GetUncompiledFormulaCount());
+        ASSERT(sheet.GetMemoryUsage().formulas < full);
+
+        // значения и тексты остаются без повторной компиляции
+        uint64_t parsed = sheet.GetStats().formulas_parsed;
+        for (int row = 0; row < rows; ++row) {
+            ASSERT_EQUAL(sheet.GetCell({ row, 1 })->GetValue(), expected[row]);
+            ASSERT_EQUAL(sheet.GetCell({ row, 1 })->GetText(), texts[row]);
+        }
+        ASSERT_EQUAL(sheet.GetStats().formulas_parsed, parsed);
+
+        // после изменения ссылки формула компилируется заново
+        sheet.SetFormulaMemoryLimit(0);
+        ASSERT_EQUAL(sheet.GetCompiledFormulaBytes(), 0u);
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetFormulaBytes(), 0u);
+        ASSERT_EQUAL(sheet.GetUncompiledFormulaCount(), static_cast<size_t>(rows));
+        sheet.SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 10 * 2 + 9 / 4.0);
+        ASSERT_EQUAL(sheet.GetStats().formulas_parsed, parsed + 1);
+
+        // вытесненные формулы сдвигаются вставкой строк
+        sheet.SetFormulaMemoryLimit(std::numeric_limits<size_t>::max());
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=A3*2+(A3-1)/4");
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), expected[1]);
+
+        // формулы снимка не вытесняются: их AST всё равно держит снимок
+        sheet.Snapshot();
+        sheet.SetFormulaMemoryLimit(0);
+        ASSERT_EQUAL(sheet.GetUncompiledFormulaCount(), 0u);
+        sheet.SetCell("C1"_pos, "=B2+1");
+        ASSERT_EQUAL(sheet.GetUncompiledFormulaCount(), 1u);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 10 * 2 + 9 / 4.0 + 1);
+
+        // пока снимок держит AST, правки не обходят формулы заново
+        sheet.SetFormulaMemoryLimit(sheet.GetCompiledFormulaBytes() / 2);
+        const uint64_t passes = sheet.GetStats().eviction_passes;
+        const size_t compiled = sheet.GetCompiledFormulaBytes();
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string(row * 3));
+        }
+        sheet.Recalculate();
+        ASSERT_EQUAL(sheet.GetStats().eviction_passes, passes);
+        ASSERT(sheet.GetCompiledFormulaBytes() >= compiled);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 6 * 2 + (6 - 1) / 4.0);
+
+        // новый снимок снимает отсрочку: прежний мог отпустить AST
+        sheet.Snapshot();
+        sheet.SetCell("D1"_pos, "=1");
+        ASSERT_EQUAL(sheet.GetStats().eviction_passes, passes + 1);
+        ASSERT(sheet.GetCompiledFormulaBytes() > sheet.GetFormulaMemoryLimit());
+    }
+
+    void TestConditionalFormulas() {
+        auto value = [](const Sheet& sheet, Position pos) {
+            return sheet.GetCell(pos)->GetValue();
+        };
+        auto is_cached = [](const Sheet& sheet, Position pos) {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->IsCacheValid();
+        };
+
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("B1"_pos, "=A1>=2");
+        sheet.SetCell("B2"_pos, "=(A1<>2)*5+1=1");
+        sheet.SetCell("B3"_pos, "=IF(A1>1,A1*10,-A1)");
+        sheet.SetCell("B4"_pos, "=IF(A1<1,5)");
+        sheet.SetCell("B5"_pos, "=AND(A1,A1-2)+OR(0,A1)*10");
+        ASSERT_EQUAL(value(sheet, "B1"_pos), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value(sheet, "B2"_pos), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value(sheet, "B3"_pos), CellInterface::Value(20.0));
+        ASSERT_EQUAL(value(sheet, "B4"_pos), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value(sheet, "B5"_pos), CellInterface::Value(10.0));
+
+        // канонический текст: сравнение связывает слабее арифметики
+        sheet.SetCell("C1"_pos, "=(A1 < 2) * 3 + (1 = (2 = 2)) - IF((A1), (1), (2 > 1))");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=(A1<2)*3+(1=(2=2))-IF(A1,1,2>1)");
+        sheet.SetCell("C2"_pos, "=1=2=0");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=1=2=0");
+        ASSERT_EQUAL(value(sheet, "C2"_pos), CellInterface::Value(1.0));
+
+        for (const char* text : { "=IF(1)", "=IF(1,2,3,4)", "=AND()", "=SUM(A1)", "=IF 1", "=A1=>2" }) {
+            try {
+                sheet.SetCell("D1"_pos, text);
+                ASSERT(false);
+            }
+            catch (const FormulaException&) {
+            }
+        }
+
+        // ошибки невыбранной ветви и непроверенных аргументов не возникают
+        sheet.SetCell("D1"_pos, "=IF(A1,1,1/0)");
+        sheet.SetCell("D2"_pos, "=AND(A1-2,1/0)");
+        sheet.SetCell("D3"_pos, "=OR(A1,1/0)");
+        sheet.SetCell("D4"_pos, "=IF(1/0,1,2)");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value(sheet, "D2"_pos), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value(sheet, "D3"_pos), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value(sheet, "D4"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        sheet.SetCell("A1"_pos, "0");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+
+        // формулы невыбранной ветви не вычисляются, а зависимость от них остаётся
+        sheet.SetCell("E1"_pos, "=A1+1");
+        sheet.SetCell("E2"_pos, "=A1-1");
+        sheet.SetCell("E3"_pos, "=IF(A1>0,E1,E2)");
+        ASSERT_EQUAL(value(sheet, "E3"_pos), CellInterface::Value(-1.0));
+        ASSERT(!is_cached(sheet, "E1"_pos));
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT(!is_cached(sheet, "E3"_pos));
+        ASSERT_EQUAL(value(sheet, "E3"_pos), CellInterface::Value(2.0));
+        ASSERT(is_cached(sheet, "E1"_pos));
+
+        // глубокая цепочка условных формул вычисляется без рекурсии и тоже
+        // не трогает невыбранные ветви
+        Sheet chain;
+        chain.EnableStats(true);
+        constexpr int length = 2000;
+        chain.SetCell("A1"_pos, "1");
+        chain.SetCell("B1"_pos, "=A1");
+        for (int row = 1; row < length; ++row) {
+            std::string prev = std::to_string(row);
+            chain.SetCell({ row, 1 }, "=IF(A1>0,B" + prev + "+1,C" + prev + ")");
+            chain.SetCell({ row, 2 }, "=B" + prev + "*2");
+        }
+        ASSERT_EQUAL(value(chain, { length - 1, 1 }), CellInterface::Value(double(length)));
+        ASSERT_EQUAL(chain.GetStats().evaluations, uint64_t(length));
+        ASSERT(!is_cached(chain, { length / 2, 2 }));
+
+        // то же при чтении снимка
+        SnapshotReader reader(chain.Snapshot());
+        ASSERT_EQUAL(reader.GetCell({ length - 1, 1 })->GetValue(), CellInterface::Value(double(length)));
+        chain.SetCell("C1"_pos, "=A1+5");
+        chain.SetCell("A1"_pos, "0");
+        SnapshotReader other(chain.Snapshot());
+        ASSERT_EQUAL(other.GetCell({ 3, 1 })->GetValue(), CellInterface::Value(10.0));
+        ASSERT_EQUAL(value(chain, { 3, 1 }), CellInterface::Value(10.0));
+    }
+
+    void TestLookupFunctions() {
+        auto value = [](const SheetInterface& sheet, Position pos) {
+            return sheet.GetCell(pos)->GetValue();
+        };
+        const CellInterface::Value not_found = FormulaError(FormulaError::Category::NotAvailable);
+
+        Sheet sheet;
+        for (int row = 0; row < 5; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string((row + 1) * 10));
+            sheet.SetCell({ row, 1 }, std::to_string(row + 1));
+        }
+        sheet.SetCell("D1"_pos, "apple");
+        sheet.SetCell("D2"_pos, "Banana");
+        sheet.SetCell("D3"_pos, "cherry");
+        sheet.SetCell("E1"_pos, "100");
+        sheet.SetCell("E2"_pos, "200");
+        sheet.SetCell("E3"_pos, "300");
+        sheet.SetCell("F1"_pos, "banana");
+
+        sheet.SetCell("G1"_pos, "=VLOOKUP(30,A1:B5,2,0)");
+        sheet.SetCell("G2"_pos, "=VLOOKUP(35,A1:B5,2)");
+        sheet.SetCell("G3"_pos, "=VLOOKUP(35,A1:B5,2,0)");
+        sheet.SetCell("G4"_pos, "=MATCH(40,A1:A5,0)+MATCH(45,A1:A5)*10+MATCH(45,A1:A5,-1)*100");
+        sheet.SetCell("G5"_pos, "=XLOOKUP(F1,D1:D3,E1:E3)");
+        sheet.SetCell("G6"_pos, "=XLOOKUP(7,A1:A5,B1:B5,-1)+XLOOKUP(7,A1:A5,B1:B5,0,1)");
+        sheet.SetCell("G7"_pos, "=VLOOKUP(5,A1:B5,2)");
+        ASSERT_EQUAL(value(sheet, "G1"_pos), CellInterface::Value(3.0));
+        ASSERT_EQUAL(value(sheet, "G2"_pos), CellInterface::Value(3.0));
+        ASSERT_EQUAL(value(sheet, "G3"_pos), not_found);
+        ASSERT_EQUAL(value(sheet, "G4"_pos), CellInterface::Value(4.0 + 40 + 500));
+        ASSERT_EQUAL(value(sheet, "G5"_pos), CellInterface::Value(200.0));
+        ASSERT_EQUAL(value(sheet, "G6"_pos), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value(sheet, "G7"_pos), not_found);
+        std::ostringstream error;
+        error << std::get<FormulaError>(not_found);
+        ASSERT_EQUAL(error.str(), "#N/A");
+
+        // номер столбца вне таблицы, область в несколько столбцов для MATCH
+        sheet.SetCell("H1"_pos, "=VLOOKUP(30,A1:B5,3)");
+        sheet.SetCell("H2"_pos, "=VLOOKUP(30,A1:B5,0)");
+        sheet.SetCell("H3"_pos, "=MATCH(30,A1:B5)");
+        sheet.SetCell("H4"_pos, "=XLOOKUP(30,A1:A5,B1:B4)");
+        ASSERT_EQUAL(value(sheet, "H1"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+        ASSERT_EQUAL(value(sheet, "H2"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(value(sheet, "H3"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(value(sheet, "H4"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+        // канонический текст и синтаксис областей
+        sheet.SetCell("H5"_pos, "=MATCH( 30 , B5:A1 )");
+        ASSERT_EQUAL(sheet.GetCell("H5"_pos)->GetText(), "=MATCH(30,A1:B5)");
+        for (const char* text : { "=A1:A3", "=A1:A3+1", "=IF(A1:A3,1)", "=VLOOKUP(1,2,1)", "=VLOOKUP(A1:A2,A1:B2,1)",
+                 "=MATCH(1)", "=MATCH(1,Sheet2!A1:A3)", "=XLOOKUP(1,A1:A2,3)" }) {
+            try {
+                sheet.SetCell("H6"_pos, text);
+                ASSERT(false);
+            }
+            catch (const FormulaException&) {
+            }
+        }
+
+        // ячейка в своей области и цикл через формулу поиска
+        try {
+            sheet.SetCell("A3"_pos, "=MATCH(1,A1:A5)");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        try {
+            sheet.SetCell("B2"_pos, "=G1");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(value(sheet, "A3"_pos), CellInterface::Value(std::string("30")));
+
+        // изменение ячейки столбца сбрасывает формулы поиска, индекс
+        // переиндексирует только изменённые строки
+        sheet.SetCell("A3"_pos, "35");
+        ASSERT_EQUAL(value(sheet, "G1"_pos), not_found);
+        ASSERT_EQUAL(value(sheet, "G3"_pos), CellInterface::Value(3.0));
+        sheet.SetCell("A4"_pos, "=A3-5");
+        ASSERT_EQUAL(value(sheet, "G1"_pos), CellInterface::Value(4.0));
+        sheet.SetCell("A3"_pos, "45");
+        ASSERT_EQUAL(value(sheet, "G1"_pos), not_found);
+        ASSERT_EQUAL(value(sheet, "G2"_pos), CellInterface::Value(2.0));
+        sheet.ClearCell("A3"_pos);
+        ASSERT_EQUAL(value(sheet, "G2"_pos), CellInterface::Value(2.0));
+        sheet.SetCell("A3"_pos, "30");
+        sheet.SetCell("A4"_pos, "40");
+        ASSERT_EQUAL(value(sheet, "G1"_pos), CellInterface::Value(3.0));
+        ASSERT(sheet.GetMemoryUsage().lookup_indexes > 0);
+
+        // снимок ищет просмотром столбца с тем же результатом
+        SnapshotReader reader(sheet.Snapshot());
+        for (Position pos : { "G1"_pos, "G2"_pos, "G3"_pos, "G4"_pos, "G5"_pos, "G6"_pos, "G7"_pos }) {
+            ASSERT_EQUAL(value(reader, pos), value(sheet, pos));
+        }
+
+        // области сдвигаются вместе со строками и сжимаются при удалении
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetText(), "=VLOOKUP(30,A2:B6,2,0)");
+        ASSERT_EQUAL(value(sheet, "G2"_pos), CellInterface::Value(3.0));
+        sheet.DeleteRows(2);
+        ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetText(), "=VLOOKUP(30,A2:B5,2,0)");
+        ASSERT_EQUAL(value(sheet, "G2"_pos), CellInterface::Value(3.0));
+        ASSERT_EQUAL(sheet.GetCell("G4"_pos)->GetText(), "=MATCH(40,A2:A5,0)+MATCH(45,A2:A5)*10+MATCH(45,A2:A5,-1)*100");
+        ASSERT_EQUAL(value(sheet, "G4"_pos), CellInterface::Value(3.0 + 30 + 400));
+        sheet.DeleteRows(1, 4);
+        ASSERT_EQUAL(sheet.GetCell("G3"_pos)->GetText(), "=VLOOKUP(5,#REF!,2)");
+        ASSERT_EQUAL(value(sheet, "G3"_pos), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    }
+
+    void TestFormulaCache() {
+        Sheet sheet;
+        sheet.EnableStats(true);
+        const FormulaCache& cache = sheet.GetFormulaCache();
+        auto shared = [&sheet](Position pos) {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->GetSharedFormula();
+        };
+
+        // одинаковый текст разбирается один раз, AST общее
+        sheet.SetCell("B1"_pos, "5");
+        sheet.SetCell("A1"_pos, "=B1 + 1");
+        sheet.SetCell("A2"_pos, "=B1 + 1");
+        ASSERT_EQUAL(cache.GetStats().misses, 1u);
+        ASSERT_EQUAL(cache.GetStats().hits, 1u);
+        ASSERT_EQUAL(sheet.GetStats().formulas_parsed, 1u);
+        ASSERT(shared("A1"_pos) == shared("A2"_pos));
+
+        // канонический текст находит ту же формулу
+        sheet.SetCell("A3"_pos, "=B1+1");
+        ASSERT(shared("A3"_pos) == shared("A1"_pos));
+        ASSERT_EQUAL(cache.GetStats().hits, 2u);
+        ASSERT_EQUAL(cache.GetSize(), 1u);
+
+        // восстановление прежней формулы после ошибки не разбирает её заново
+        sheet.SetCell("A4"_pos, "=(B1)*2");
+        uint64_t misses = cache.GetStats().misses;
+        try {
+            sheet.SetCell("A4"_pos, "=B1+");
+            ASSERT(false);
+        }
+        catch (const FormulaException&) {
+        }
+        try {
+            sheet.SetCell("A4"_pos, "=A4+1");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=B1*2");
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(10.0));
+        ASSERT_EQUAL(cache.GetStats().misses, misses + 2);
+        ASSERT_EQUAL(sheet.GetStats().formulas_parsed, 3u);
+
+        // сдвиг ссылок копирует общую формулу и не портит кэш
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=B2+1");
+        sheet.SetCell("C1"_pos, "=B1+1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=B1+1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+        const size_t cache_bytes = sheet.GetMemoryUsage().formula_cache;
+        ASSERT(cache_bytes > 0);
+
+        // при переполнении забываются давно не запрошенные формулы
+        sheet.SetFormulaCacheCapacity(2);
+        ASSERT_EQUAL(cache.GetSize(), 2u);
+        sheet.SetCell("C2"_pos, "=B1+1");
+        ASSERT(shared("C2"_pos) == shared("C1"_pos));
+        sheet.SetFormulaCacheCapacity(0);
+        ASSERT_EQUAL(cache.GetSize(), 0u);
+        misses = cache.GetStats().misses;
+        sheet.SetCell("C3"_pos, "=B1+1");
+        ASSERT_EQUAL(cache.GetStats().misses, misses + 1);
+        ASSERT(shared("C3"_pos) != shared("C1"_pos));
+        ASSERT(sheet.GetMemoryUsage().formula_cache < cache_bytes);
+
+        // AST кэша входят в лимит памяти формул: первой забывается формула,
+        // которую держит только кэш, а формулы ячеек остаются в кэше
+        Sheet limited;
+        const FormulaCache& limited_cache = limited.GetFormulaCache();
+        limited.SetCell("A1"_pos, "=1+2");
+        std::string sum = "=1";
+        for (int i = 2; i <= 60; ++i) {
+            sum += "+" + std::to_string(i);
+        }
+        limited.SetCell("A2"_pos, sum);
+        limited.ClearCell("A2"_pos);
+        ASSERT_EQUAL(limited_cache.GetSize(), 2u);
+        const size_t used = limited.GetCompiledFormulaBytes() + limited_cache.GetFormulaBytes();
+        limited.SetFormulaMemoryLimit(used - 1);
+        ASSERT_EQUAL(limited_cache.GetSize(), 1u);
+        ASSERT_EQUAL(limited.GetUncompiledFormulaCount(), 0u);
+        misses = limited_cache.GetStats().misses;
+        limited.SetCell("A3"_pos, "=1+2");
+        ASSERT_EQUAL(limited_cache.GetStats().misses, misses);
+
+        // AST снимка не вытесняется, и кэш при этом не очищается
+        limited.Snapshot();
+        limited.SetFormulaMemoryLimit(0);
+        ASSERT_EQUAL(limited.GetUncompiledFormulaCount(), 0u);
+        ASSERT_EQUAL(limited_cache.GetSize(), 1u);
+
+        // вытесненная формула уходит из кэша, и её AST освобождается
+        limited.SetCell("B1"_pos, "=A1*2");
+        ASSERT_EQUAL(limited.GetUncompiledFormulaCount(), 1u);
+        ASSERT_EQUAL(limited_cache.GetSize(), 1u);
+        ASSERT_EQUAL(limited.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+    }
+
+    void TestServerProtocol() {
+        std::string out;
+        ProtocolWriter writer(out);
+        writer.BeginFrame(7, static_cast<uint8_t>(ProtocolCommand::Set));
+        writer.PutString16("Итоги");
+        writer.PutPosition("B3"_pos);
+        writer.PutString32("=A1+1");
+        writer.EndFrame();
+        writer.BeginFrame(8, static_cast<uint8_t>(ProtocolStatus::Ok));
+        writer.PutValue(CellInterface::ValueView(2.5));
+        writer.PutValue(CellInterface::ValueView(std::string_view("text")));
+        writer.PutValue(CellInterface::ValueView(FormulaError(FormulaError::Category::NotAvailable)));
+        writer.PutEmptyValue();
+        writer.PutU64(0x0102030405060708);
+        writer.EndFrame();
+
+        // неполный кадр ждёт остальных байт
+        size_t size = 0;
+        ASSERT(!ParseFrame(std::string_view(out).substr(0, 3), size));
+        ASSERT(!ParseFrame(std::string_view(out).substr(0, PROTOCOL_HEADER_SIZE + 2), size));
+
+        auto set = ParseFrame(out, size);
+        ASSERT(set.has_value());
+        ASSERT_EQUAL(set->request_id, 7u);
+        ASSERT_EQUAL(set->code, static_cast<uint8_t>(ProtocolCommand::Set));
+        ProtocolReader reader(set->payload);
+        ASSERT_EQUAL(reader.GetString16(), "Итоги");
+        ASSERT_EQUAL(reader.GetPosition(), "B3"_pos);
+        ASSERT_EQUAL(reader.GetString32(), "=A1+1");
+        reader.ExpectEnd();
+
+        std::string_view rest = std::string_view(out).substr(size);
+        auto values = ParseFrame(rest, size);
+        ASSERT(values.has_value());
+        ASSERT_EQUAL(size, rest.size());
+        ASSERT_EQUAL(values->request_id, 8u);
+        ProtocolReader value_reader(values->payload);
+        ASSERT_EQUAL(value_reader.GetValue(), CellInterface::Value(2.5));
+        ASSERT_EQUAL(value_reader.GetValue(), CellInterface::Value(std::string("text")));
+        ASSERT_EQUAL(value_reader.GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::NotAvailable)));
+        ASSERT_EQUAL(value_reader.GetValue(), CellInterface::Value(std::string()));
+        ASSERT(!value_reader.AtEnd());
+        ASSERT_EQUAL(value_reader.GetU64(), 0x0102030405060708u);
+        ASSERT(value_reader.AtEnd());
+
+        // обрезанные данные и лишние байты - ошибка протокола
+        ProtocolReader truncated(set->payload.substr(0, sizeof(uint16_t) + std::string_view("Итоги").size() + 2));
+        truncated.GetString16();
+        try {
+            truncated.GetPosition();
+            ASSERT(false);
+        }
+        catch (const ProtocolException&) {
+        }
+        ProtocolReader extra(set->payload);
+        extra.GetString16();
+        try {
+            extra.ExpectEnd();
+            ASSERT(false);
+        }
+        catch (const ProtocolException&) {
+        }
+
+        // длина кадра проверяется до того, как он придёт целиком
+        std::string huge;
+        ProtocolWriter huge_writer(huge);
+        huge_writer.PutU32(PROTOCOL_MAX_FRAME_SIZE + 1);
+        try {
+            ParseFrame(huge, size);
+            ASSERT(false);
+        }
+        catch (const ProtocolException&) {
+        }
+    }
+
+#ifdef SPREADSHEET_SERVER_TEST
+    // Клиент сервера на блокирующем сокете; чтение ждёт не дольше 5 секунд
+    class TestServerClient {
+    public:
+        explicit TestServerClient(const std::string& socket_path) {
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+            fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            ASSERT(fd_ >= 0);
+            timeval timeout{ 5, 0 };
+            ::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            ASSERT(::connect(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0);
+        }
+
+        ~TestServerClient() {
+            Close();
+        }
+
+        void Close() {
+            if (fd_ >= 0) {
+                ::close(fd_);
+                fd_ = -1;
+            }
+        }
+
+        void Send(std::string_view data) {
+            while (!data.empty()) {
+                ssize_t sent = ::write(fd_, data.data(), data.size());
+                ASSERT(sent > 0);
+                data.remove_prefix(static_cast<size_t>(sent));
+            }
+        }
+
+        // Следующий кадр; payload действителен до следующего вызова
+        ProtocolFrame Receive() {
+            input_.erase(0, consumed_);
+            consumed_ = 0;
+            while (true) {
+                size_t size = 0;
+                if (auto frame = ParseFrame(input_, size)) {
+                    consumed_ = size;
+                    return *frame;
+                }
+                char buffer[4096];
+                ssize_t received = ::read(fd_, buffer, sizeof(buffer));
+                // таймаут или соединение, закрытое сервером
+                ASSERT(received > 0);
+                input_.append(buffer, static_cast<size_t>(received));
+            }
+        }
+
+    private:
+        int fd_ = -1;
+        std::string input_;
+        size_t consumed_ = 0;
+    };
+
+    void TestServerSession() {
+        namespace fs = std::filesystem;
+        const std::string socket_path
+            = (fs::temp_directory_path() / ("spreadsheet_test_" + std::to_string(::getpid()) + ".sock")).string();
+        Workbook book;
+        book.AddSheet("Лист");
+        SpreadsheetServer server(book, { socket_path, 2 });
+        std::thread server_thread([&server] { server.Run(); });
+        // сервер останавливается и при провале проверки
+        struct ServerStopper {
+            SpreadsheetServer& server;
+            std::thread& thread;
+            ~ServerStopper() {
+                if (thread.joinable()) {
+                    server.Stop();
+                    thread.join();
+                }
+            }
+        } stopper{ server, server_thread };
+
+        TestServerClient client(socket_path);
+        std::string requests;
+        ProtocolWriter writer(requests);
+        auto begin = [&writer](uint32_t request_id, ProtocolCommand command, std::string_view sheet = "Лист") {
+            writer.BeginFrame(request_id, static_cast<uint8_t>(command));
+            writer.PutString16(sheet);
+        };
+        begin(10, ProtocolCommand::Subscribe);
+        writer.PutPosition("A1"_pos);
+        writer.PutPosition("B2"_pos);
+        writer.EndFrame();
+        begin(11, ProtocolCommand::Set);
+        writer.PutPosition("A1"_pos);
+        writer.PutString32("2");
+        writer.EndFrame();
+        begin(12, ProtocolCommand::Get);
+        writer.PutPosition("A1"_pos);
+        writer.EndFrame();
+        begin(13, ProtocolCommand::Batch);
+        writer.PutU32(2);
+        writer.PutPosition("B1"_pos);
+        writer.PutString32("=A1*3");
+        writer.PutPosition("B2"_pos);
+        writer.PutString32("текст");
+        writer.EndFrame();
+        begin(14, ProtocolCommand::Get);
+        writer.PutPosition("B1"_pos);
+        writer.EndFrame();
+        begin(15, ProtocolCommand::Get, "Нет");
+        writer.PutPosition("A1"_pos);
+        writer.EndFrame();
+        // все запросы уходят сразу, не дожидаясь ответов
+        client.Send(requests);
+
+        // уведомления приходят раньше ответов на запросы, выполненные вместе
+        // с изменившими ячейки
+        struct Received {
+            uint32_t request_id;
+            uint8_t code;
+            std::string payload;
+        };
+        std::vector<Received> responses;
+        std::vector<std::string> events;
+        while (responses.size() < 6) {
+            ProtocolFrame frame = client.Receive();
+            if (frame.code == static_cast<uint8_t>(ProtocolStatus::Event)) {
+                ASSERT_EQUAL(frame.request_id, 0u);
+                events.emplace_back(frame.payload);
+            }
+            else {
+                responses.push_back({ frame.request_id, frame.code, std::string(frame.payload) });
+            }
+        }
+        for (size_t i = 0; i < responses.size(); ++i) {
+            ASSERT_EQUAL(responses[i].request_id, 10 + i);
+        }
+        const uint8_t ok = static_cast<uint8_t>(ProtocolStatus::Ok);
+        for (size_t i = 0; i < 5; ++i) {
+            ASSERT_EQUAL(responses[i].code, ok);
+        }
+
+        ProtocolReader subscribed(responses[0].payload);
+        const uint64_t subscription = subscribed.GetU64();
+        subscribed.ExpectEnd();
+        ASSERT(responses[1].payload.empty());
+        ProtocolReader a1(responses[2].payload);
+        ASSERT_EQUAL(a1.GetValue(), CellInterface::Value(std::string("2")));
+        ASSERT(responses[3].payload.empty());
+        ProtocolReader b1(responses[4].payload);
+        ASSERT_EQUAL(b1.GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(responses[5].code, static_cast<uint8_t>(ProtocolStatus::Error));
+        ProtocolReader unknown(responses[5].payload);
+        ASSERT_EQUAL(unknown.GetU8(), static_cast<uint8_t>(ProtocolErrorCode::UnknownSheet));
+
+        // Set и Batch - по уведомлению
+        ASSERT_EQUAL(events.size(), 2u);
+        ProtocolReader set_event(events[0]);
+        ASSERT_EQUAL(set_event.GetU64(), subscription);
+        ASSERT_EQUAL(set_event.GetU8(), 0);
+        ASSERT_EQUAL(set_event.GetU32(), 1u);
+        ASSERT_EQUAL(set_event.GetPosition(), "A1"_pos);
+        ASSERT_EQUAL(set_event.GetValue(), CellInterface::Value(std::string("2")));
+        set_event.ExpectEnd();
+        ProtocolReader batch_event(events[1]);
+        ASSERT_EQUAL(batch_event.GetU64(), subscription);
+        ASSERT_EQUAL(batch_event.GetU8(), 0);
+        ASSERT_EQUAL(batch_event.GetU32(), 2u);
+        ASSERT_EQUAL(batch_event.GetPosition(), "B1"_pos);
+        ASSERT_EQUAL(batch_event.GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(batch_event.GetPosition(), "B2"_pos);
+        ASSERT_EQUAL(batch_event.GetValue(), CellInterface::Value(std::string("текст")));
+        batch_event.ExpectEnd();
+
+        // подписки закрытого соединения снимаются
+        ASSERT_EQUAL(server.GetSubscriptionCount(), 1u);
+        client.Close();
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (server.GetSubscriptionCount() > 0 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        ASSERT_EQUAL(server.GetSubscriptionCount(), 0u);
+
+        server.Stop();
+        server_thread.join();
+        const Sheet& sheet = *book.GetSheet("Лист");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "текст");
+    }
+#endif
+
+    void TestConcurrentWriters() {
+        constexpr int THREADS = 8;
+        constexpr int ROWS_PER_THREAD = 32;
+        constexpr int CYCLE_PAIRS = 20;
+        constexpr int CYCLE_FIRST_ROW = 1000;
+
+        Sheet sheet;
+        ConcurrentSheetWriter writer(sheet);
+        std::atomic<int> cycles = 0;
+        std::atomic<int> unexpected = 0;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < THREADS; ++i) {
+            threads.emplace_back([&, i] {
+                const int first = i * ROWS_PER_THREAD;
+                const int next = (i + 1) % THREADS * ROWS_PER_THREAD;
+                try {
+                    for (int row = first; row < first + ROWS_PER_THREAD; ++row) {
+                        writer.SetCell({ row, 0 }, std::to_string(row));
+                        writer.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+                        // ссылка в строки соседнего потока
+                        writer.SetCell({ row, 2 }, "=B" + std::to_string(next + row - first + 1) + "+1");
+                    }
+                }
+                catch (...) {
+                    ++unexpected;
+                }
+                // соседние потоки замыкают цикл навстречу друг другу
+                const int pair_row = CYCLE_FIRST_ROW + i / 2 * CYCLE_PAIRS;
+                for (int k = 0; k < CYCLE_PAIRS; ++k) {
+                    const std::string row = std::to_string(pair_row + k + 1);
+                    try {
+                        writer.SetCell({ pair_row + k, 4 + i % 2 }, i % 2 ? "=E" + row : "=F" + row);
+                    }
+                    catch (const CircularDependencyException&) {
+                        ++cycles;
+                    }
+                    catch (...) {
+                        ++unexpected;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        ASSERT_EQUAL(unexpected.load(), 0);
+        ASSERT_EQUAL(cycles.load(), THREADS / 2 * CYCLE_PAIRS);
+        ASSERT_EQUAL(writer.GetStats().edits, static_cast<uint64_t>(THREADS * (ROWS_PER_THREAD * 3 + CYCLE_PAIRS)));
+        writer.Read([&](const Sheet& sheet) {
+            const int rows = THREADS * ROWS_PER_THREAD;
+            for (int row = 0; row < rows; ++row) {
+                const int next = (row + ROWS_PER_THREAD) % rows;
+                ASSERT_EQUAL(sheet.GetCell({ row, 1 })->GetValue(), CellInterface::Value(2.0 * row));
+                ASSERT_EQUAL(sheet.GetCell({ row, 2 })->GetValue(), CellInterface::Value(2.0 * next + 1));
+            }
+            // из каждой пары встречных формул принята ровно одна
+            for (int row = CYCLE_FIRST_ROW; row < CYCLE_FIRST_ROW + THREADS / 2 * CYCLE_PAIRS; ++row) {
+                const bool e_formula = !sheet.GetCell({ row, 4 })->GetReferencedCells().empty();
+                const bool f_formula = !sheet.GetCell({ row, 5 })->GetReferencedCells().empty();
+                ASSERT(e_formula != f_formula);
+                ASSERT_EQUAL(sheet.GetCell({ row, e_formula ? 4 : 5 })->GetValue(), CellInterface::Value(0.0));
+            }
+        });
+
+        // ошибки разбора и позиции бросаются в вызывающем потоке, лист не меняется
+        try {
+            writer.SetCell("A1"_pos, "=1+");
+            ASSERT(false);
+        }
+        catch (const FormulaException&) {
+        }
+        try {
+            writer.ClearCell(Position::NONE);
+            ASSERT(false);
+        }
+        catch (const InvalidPositionException&) {
+        }
+        ASSERT_EQUAL(writer.GetText("A1"_pos), "0");
+
+        // формула, разобранная писателем, не разбирается листом повторно
+        const uint64_t misses = sheet.GetFormulaCache().GetStats().misses;
+        writer.SetCell("H1"_pos, "=A2+A3");
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().misses, misses);
+        ASSERT_EQUAL(writer.GetValue("H1"_pos), CellInterface::Value(3.0));
+        // и без кэша формул
+        writer.Modify([](Sheet& sheet) {
+            sheet.SetFormulaCacheCapacity(0);
+        });
+        writer.SetCell("H2"_pos, "=A2*A3");
+        ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().misses, misses);
+        ASSERT_EQUAL(writer.GetValue("H2"_pos), CellInterface::Value(2.0));
+
+        writer.Modify([](Sheet& sheet) {
+            sheet.InsertRows(0);
+        });
+        writer.ClearCell("A3"_pos);
+        ASSERT_EQUAL(writer.GetValue("H2"_pos), CellInterface::Value(2.0));
+
+        Workbook book;
+        try {
+            ConcurrentSheetWriter book_writer(book.AddSheet("Sheet1"));
+            ASSERT(false);
+        }
+        catch (const std::invalid_argument&) {
+        }
+    }
+
+    void TestEditLog() {
+        namespace fs = std::filesystem;
+        using Policy = EditLog::SyncPolicy;
+        const std::string log_path = (fs::temp_directory_path() / "spreadsheet_test_edit.log").string();
+        const std::string checkpoint_path = (fs::temp_directory_path() / "spreadsheet_test_edit.ckpt").string();
+        fs::remove(log_path);
+        fs::remove(checkpoint_path);
+        auto texts = [](const Sheet& sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+
+        std::string expected;
+        {
+            Sheet sheet;
+            sheet.SetUndoMemoryLimit(1 << 20);
+            auto log = std::make_shared<EditLog>(log_path);
+            sheet.SetEditLog(log);
+            sheet.SetCell("A1"_pos, "1");
+            sheet.SetCell("A2"_pos, "=A1+1");
+            sheet.SetCell("B1"_pos, "text");
+            // отклонённое изменение в журнал не попадает
+            try {
+                sheet.SetCell("A1"_pos, "=A2");
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException&) {
+            }
+            // пакет и его отмена - по одной записи
+            sheet.BeginBatch();
+            sheet.SetCell("C1"_pos, "=A2*10");
+            sheet.ClearCell("B1"_pos);
+            sheet.EndBatch();
+            sheet.Undo();
+            sheet.InsertRows(0);
+            sheet.SetCell("D1"_pos, "'=escaped");
+            log->Commit();
+            ASSERT_EQUAL(log->GetLastLsn(), 7u);
+            ASSERT_EQUAL(log->GetDurableLsn(), 7u);
+            expected = texts(sheet);
+        }
+        {
+            Sheet restored;
+            auto info = EditLog::Recover(restored, log_path, checkpoint_path);
+            ASSERT_EQUAL(info.checkpoint_lsn, 0u);
+            ASSERT_EQUAL(info.replayed, 7u);
+            ASSERT_EQUAL(info.last_lsn, 7u);
+            ASSERT(!info.torn_tail);
+            ASSERT_EQUAL(texts(restored), expected);
+            ASSERT_EQUAL(restored.GetCell("A3"_pos)->GetValue(), CellInterface::Value(2.0));
+        }
+
+        // оборванная запись отбрасывается, новые записи идут вместо неё
+        fs::resize_file(log_path, fs::file_size(log_path) - 3);
+        {
+            Sheet restored;
+            auto info = EditLog::Recover(restored, log_path, checkpoint_path);
+            ASSERT(info.torn_tail);
+            ASSERT_EQUAL(info.last_lsn, 6u);
+            ASSERT(restored.GetCell("D1"_pos) == nullptr);
+
+            auto log = std::make_shared<EditLog>(log_path);
+            ASSERT_EQUAL(log->GetLastLsn(), 6u);
+            restored.SetEditLog(log);
+            restored.SetCell("D1"_pos, "4");
+            log->Commit();
+            // контрольная точка очищает журнал, нумерация продолжается
+            log->Checkpoint(restored, checkpoint_path);
+            restored.SetCell("E1"_pos, "=D1*2");
+            log->Commit();
+            ASSERT_EQUAL(log->GetLastLsn(), 8u);
+            expected = texts(restored);
+        }
+        {
+            Sheet restored;
+            auto info = EditLog::Recover(restored, log_path, checkpoint_path);
+            ASSERT_EQUAL(info.checkpoint_lsn, 7u);
+            ASSERT_EQUAL(info.replayed, 1u);
+            ASSERT(!info.torn_tail);
+            ASSERT_EQUAL(texts(restored), expected);
+            ASSERT_EQUAL(restored.GetCell("E1"_pos)->GetValue(), CellInterface::Value(8.0));
+        }
+
+        // запись с неверной контрольной суммой не применяется
+        {
+            std::fstream file(log_path, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekg(-1, std::ios::end);
+            char last = static_cast<char>(file.get());
+            file.seekp(-1, std::ios::end);
+            file.put(static_cast<char>(last ^ 1));
+        }
+        {
+            Sheet restored;
+            auto info = EditLog::Recover(restored, log_path, checkpoint_path);
+            ASSERT(info.torn_tail);
+            ASSERT_EQUAL(info.replayed, 0u);
+            ASSERT(restored.GetCell("E1"_pos) == nullptr);
+            ASSERT_EQUAL(restored.GetCell("D1"_pos)->GetText(), "4");
+        }
+
+        // при любой политике записи восстанавливаются после закрытия журнала
+        for (Policy policy : { Policy::Always, Policy::Group, Policy::Interval, Policy::None }) {
+            fs::remove(log_path);
+            fs::remove(checkpoint_path);
+            {
+                Sheet sheet;
+                auto log = std::make_shared<EditLog>(log_path, EditLog::Options{ policy, std::chrono::milliseconds(1) });
+                sheet.SetEditLog(log);
+                for (int row = 0; row < 20; ++row) {
+                    sheet.SetCell({ row, 0 }, std::to_string(row));
+                    log->Commit();
+                }
+                if (policy == Policy::Always || policy == Policy::Group) {
+                    ASSERT_EQUAL(log->GetDurableLsn(), 20u);
+                    ASSERT_EQUAL(log->GetStats().syncs, 20u);
+                }
+            }
+            Sheet restored;
+            ASSERT_EQUAL(EditLog::Recover(restored, log_path, checkpoint_path).replayed, 20u);
+            ASSERT_EQUAL(restored.GetCell("A20"_pos)->GetText(), "19");
+        }
+
+        // писатели из разных потоков делят fsync
+        fs::remove(log_path);
+        {
+            Sheet sheet;
+            auto log = std::make_shared<EditLog>(log_path);
+            sheet.SetEditLog(log);
+            ConcurrentSheetWriter writer(sheet);
+            std::vector<std::thread> threads;
+            for (int i = 0; i < 4; ++i) {
+                threads.emplace_back([&writer, i] {
+                    for (int row = 0; row < 50; ++row) {
+                        writer.SetCell({ row, i }, "=" + std::to_string(row) + "+1");
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            ASSERT_EQUAL(log->GetDurableLsn(), 200u);
+            ASSERT(log->GetStats().syncs <= 200u);
+        }
+        {
+            Sheet restored;
+            ASSERT_EQUAL(EditLog::Recover(restored, log_path, checkpoint_path).replayed, 200u);
+            ASSERT_EQUAL(restored.GetCell("D50"_pos)->GetValue(), CellInterface::Value(50.0));
+        }
+
+        // журнал отключается, пока писатели вызывают Commit вне блокировки
+        // листа: последний из них и закрывает журнал
+        fs::remove(log_path);
+        {
+            Sheet sheet;
+            std::weak_ptr<EditLog> weak_log;
+            {
+                auto log = std::make_shared<EditLog>(log_path);
+                weak_log = log;
+                sheet.SetEditLog(std::move(log));
+            }
+            ConcurrentSheetWriter writer(sheet);
+            std::vector<std::thread> threads;
+            for (int i = 0; i < 4; ++i) {
+                threads.emplace_back([&writer, i] {
+                    for (int row = 0; row < 50; ++row) {
+                        writer.SetCell({ row, i }, std::to_string(row));
+                    }
+                });
+            }
+            threads.emplace_back([&writer] {
+                std::this_thread::yield();
+                writer.Modify([](Sheet& sheet) {
+                    sheet.SetEditLog(nullptr);
+                });
+            });
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            ASSERT(weak_log.expired());
+            ASSERT(sheet.GetEditLog() == nullptr);
+        }
+        {
+            Sheet restored;
+            auto info = EditLog::Recover(restored, log_path, checkpoint_path);
+            ASSERT(!info.torn_tail);
+            ASSERT(info.replayed <= 200u);
+        }
+
+        // контрольная точка после удаления строк и столбцов и удаления после неё
+        fs::remove(log_path);
+        fs::remove(checkpoint_path);
+        {
+            Sheet sheet;
+            auto log = std::make_shared<EditLog>(log_path);
+            sheet.SetEditLog(log);
+            for (int row = 0; row < 5; ++row) {
+                sheet.SetCell({ row, 0 }, std::to_string(row));
+                sheet.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "+A5");
+            }
+            sheet.SetCell("C1"_pos, "=MATCH(3,A4:A5,0)");
+            sheet.DeleteRows(3, 2);
+            log->Checkpoint(sheet, checkpoint_path);
+            sheet.DeleteCols(0);
+            sheet.SetCell("C1"_pos, "=A1");
+            log->Commit();
+            expected = texts(sheet);
+        }
+        {
+            Sheet restored;
+            auto info = EditLog::Recover(restored, log_path, checkpoint_path);
+            ASSERT_EQUAL(info.replayed, 2u);
+            ASSERT_EQUAL(texts(restored), expected);
+            ASSERT_EQUAL(restored.GetCell("A1"_pos)->GetText(), "=#REF!+#REF!");
+            ASSERT_EQUAL(restored.GetCell("B1"_pos)->GetText(), "=MATCH(3,#REF!,0)");
+            ASSERT_EQUAL(restored.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        }
+
+        std::ofstream(log_path, std::ios::binary) << "definitely not an edit log";
+        try {
+            EditLog log(log_path);
+            ASSERT(false);
+        }
+        catch (const EditLogException&) {
+        }
+        fs::remove(log_path);
+        fs::remove(checkpoint_path);
+    }
+
+    void TestColumnarSnapshot() {
+        auto texts = [](const Sheet& sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+
+        Sheet sheet;
+        // тексты, похожие на числа, но не совпадающие с записью числа,
+        // хранятся как текст
+        const std::vector<std::string> column_a = { "1", "-5", "-0", "007", "+3", "123456789012345678", "1234567890123456789",
+            "0.1", "2.50", "1e300", "1e+300", "-1.5", "inf", "nan", "text", "text", "'=escaped", "", "1 " };
+        for (int row = 0; row < static_cast<int>(column_a.size()); ++row) {
+            if (!column_a[row].empty()) {
+                sheet.SetCell({ row, 0 }, column_a[row]);
+            }
+        }
+        for (int row = 0; row < 40; ++row) {
+            sheet.SetCell({ row, 2 }, std::to_string(row * 3));
+            sheet.SetCell({ row, 3 }, "=C" + std::to_string(row + 1) + "*2+IF(C1>0,A1,MATCH(C" + std::to_string(row + 1) + ",C1:C40,0))");
+        }
+        sheet.SetCell("E100"_pos, "=A1+ZZ99");
+        sheet.SetCell("XFD16384"_pos, "end");
+
+        auto snapshot = sheet.Snapshot();
+        const std::string data = EncodeColumnarSnapshot(*snapshot);
+        ColumnarSnapshot columnar(data);
+        ASSERT_EQUAL(columnar.GetColumns().size(), 5u);
+        ASSERT_EQUAL(columnar.GetColumns()[1].col, 2);
+        ASSERT_EQUAL(columnar.GetColumns()[1].cells, 40u);
+
+        auto column = columnar.DecodeColumn(2);
+        ASSERT_EQUAL(column.size(), 40u);
+        ASSERT(column[5].pos == "D6"_pos);
+        ASSERT_EQUAL(column[5].text, "=C6*2+IF(C1>0,A1,MATCH(C6,C1:C40,0))");
+
+        for (unsigned threads : { 1u, 4u }) {
+            Sheet restored;
+            columnar.Load(restored, threads);
+            ASSERT_EQUAL(texts(restored), texts(sheet));
+            ASSERT_EQUAL(restored.GetCell("D40"_pos)->GetValue(), sheet.GetCell("D40"_pos)->GetValue());
+        }
+
+        // повреждённый блок не мешает читать остальные
+        std::string corrupted = data;
+        const auto& columns = columnar.GetColumns();
+        corrupted[columns[1].offset + columns[1].size / 2] ^= 0x20;
+        ColumnarSnapshot damaged(corrupted);
+        ASSERT_EQUAL(damaged.DecodeColumn(2).size(), 40u);
+        try {
+            damaged.DecodeColumn(1);
+            ASSERT(false);
+        }
+        catch (const ColumnarSnapshotException&) {
+        }
+        try {
+            damaged.DecodeAll(2);
+            ASSERT(false);
+        }
+        catch (const ColumnarSnapshotException&) {
+        }
+
+        for (const std::string& broken : { std::string("SHEETCKP"), data.substr(0, data.size() - 1), data + "x" }) {
+            try {
+                ColumnarSnapshot{ broken };
+                ASSERT(false);
+            }
+            catch (const ColumnarSnapshotException&) {
+            }
+        }
+
+        // ячейка, отклонённая листом, отменяет загрузку целиком
+        Sheet conflicting;
+        conflicting.SetCell("ZZ99"_pos, "=E100");
+        try {
+            columnar.Load(conflicting);
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT(conflicting.GetCell("A1"_pos) == nullptr);
+        ASSERT(conflicting.GetCell("C1"_pos) == nullptr);
+        ASSERT(conflicting.GetCell("D40"_pos) == nullptr);
+        ASSERT_EQUAL(conflicting.GetPrintableSize(), (Size{ 99, 702 }));
+
+        // пустой лист
+        Sheet empty;
+        ASSERT(ColumnarSnapshot(EncodeColumnarSnapshot(*empty.Snapshot())).GetColumns().empty());
+    }
+
+    void TestDeletedReferenceText() {
+        namespace fs = std::filesystem;
+        auto texts = [](const Sheet& sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+        const CellInterface::Value ref_error(FormulaError::Category::Ref);
+
+        // #REF! разбирается обратно в удалённую ссылку и удалённую область
+        Sheet parsed;
+        parsed.SetCell("A1"_pos, "=1+#REF!*2");
+        ASSERT_EQUAL(parsed.GetCell("A1"_pos)->GetText(), "=1+#REF!*2");
+        ASSERT_EQUAL(parsed.GetCell("A1"_pos)->GetValue(), ref_error);
+        ASSERT(parsed.GetCell("A1"_pos)->GetReferencedCells().empty());
+        parsed.SetCell("A2"_pos, "=VLOOKUP(#REF!,#REF!,2)+MATCH(1,#REF!)");
+        ASSERT_EQUAL(parsed.GetCell("A2"_pos)->GetText(), "=VLOOKUP(#REF!,#REF!,2)+MATCH(1,#REF!)");
+        ASSERT_EQUAL(parsed.GetCell("A2"_pos)->GetValue(), ref_error);
+        for (const char* text : { "=#REF", "=#REF!!", "=#REF!:A1", "=A1:#REF!" }) {
+            try {
+                parsed.SetCell("A3"_pos, text);
+                ASSERT(false);
+            }
+            catch (const FormulaException&) {
+            }
+        }
+
+        Sheet sheet;
+        sheet.SetUndoMemoryLimit(1 << 20);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("B1"_pos, "=A1+A2");
+        sheet.SetCell("C1"_pos, "=VLOOKUP(1,A2:A2,1)");
+        sheet.SetCell("D1"_pos, "=B1*2");
+        sheet.DeleteRows(1);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+#REF!");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=VLOOKUP(1,#REF!,1)");
+        const std::string expected = texts(sheet);
+
+        // отклонённая циклическая формула возвращает прежний текст
+        try {
+            sheet.SetCell("B1"_pos, "=D1");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+#REF!");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ref_error);
+
+        // отмена восстанавливает формулу из текста
+        sheet.SetCell("B1"_pos, "5");
+        sheet.Undo();
+        ASSERT_EQUAL(texts(sheet), expected);
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), ref_error);
+
+        // вытесненная формула компилируется заново из текста
+        sheet.SetFormulaMemoryLimit(0);
+        ASSERT(sheet.GetUncompiledFormulaCount() > 0);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), ref_error);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), ref_error);
+        sheet.SetFormulaMemoryLimit(std::numeric_limits<size_t>::max());
+
+        // контрольная точка после удаления строк восстанавливается
+        const std::string log_path = (fs::temp_directory_path() / "spreadsheet_test_ref.log").string();
+        const std::string checkpoint_path = (fs::temp_directory_path() / "spreadsheet_test_ref.ckpt").string();
+        fs::remove(log_path);
+        fs::remove(checkpoint_path);
+        {
+            EditLog log(log_path);
+            log.Checkpoint(sheet, checkpoint_path);
+        }
+        Sheet restored;
+        EditLog::Recover(restored, log_path, checkpoint_path);
+        ASSERT_EQUAL(texts(restored), expected);
+        ASSERT_EQUAL(restored.GetCell("D1"_pos)->GetValue(), ref_error);
+        fs::remove(log_path);
+        fs::remove(checkpoint_path);
+    }
+
+    void TestRangeDependents() {
+        auto is_cached = [](const Sheet& sheet, Position pos) {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->IsCacheValid();
+        };
+        constexpr int rows = 300;
+        const CellInterface::Value not_found = FormulaError(FormulaError::Category::NotAvailable);
+
+        // скользящие окна по столбцу A: у каждой формулы своя область
+        Sheet sheet;
+        for (int row = 0; row < rows + 4; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string(row * 10));
+        }
+        for (int row = 0; row < rows; ++row) {
+            const std::string r = std::to_string(row + 1);
+            sheet.SetCell({ row, 1 }, std::to_string((row + 2) * 10));
+            sheet.SetCell({ row, 2 }, "=MATCH(B" + r + ",A" + r + ":A" + std::to_string(row + 5) + ",0)");
+        }
+        // широкая область лежит вне блоков
+        sheet.SetCell("E5"_pos, "1500");
+        sheet.SetCell("D1"_pos, "=VLOOKUP(1500,E1:CV16000,1,0)");
+        sheet.Recalculate();
+        ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(1500.0));
+
+        // сбрасываются только формулы, в окно которых попала ячейка
+        sheet.SetCell("A130"_pos, "-1");
+        for (int row = 0; row < rows; ++row) {
+            const bool in_window = row >= 125 && row <= 129;
+            ASSERT_EQUAL(is_cached(sheet, { row, 2 }), !in_window);
+        }
+        ASSERT(is_cached(sheet, "D1"_pos));
+        ASSERT_EQUAL(sheet.GetCell("C128"_pos)->GetValue(), not_found);
+        ASSERT_EQUAL(sheet.GetCell("C127"_pos)->GetValue(), CellInterface::Value(3.0));
+        sheet.SetCell("CV16000"_pos, "1");
+        ASSERT(!is_cached(sheet, "D1"_pos));
+        ASSERT(is_cached(sheet, "C1"_pos));
+
+        // цикл через область другой строки и через широкую область
+        for (auto [pos, text] : { std::pair{ "A131"_pos, "=C127" }, std::pair{ "A64"_pos, "=C61*2" },
+                 std::pair{ "CV5000"_pos, "=D1+1" } }) {
+            try {
+                sheet.SetCell(pos, text);
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException&) {
+            }
+        }
+        sheet.SetCell("A200"_pos, "=C1");
+
+        // после вставки строк области переносятся вместе с формулами
+        sheet.InsertRows(0);
+        sheet.Recalculate();
+        sheet.SetCell("A51"_pos, "1");
+        ASSERT(!is_cached(sheet, "C47"_pos));
+        ASSERT(!is_cached(sheet, "C51"_pos));
+        ASSERT(is_cached(sheet, "C46"_pos));
+        ASSERT(is_cached(sheet, "C52"_pos));
+
+        // удалённая формула больше не зависит от области
+        sheet.ClearCell("C52"_pos);
+        sheet.ClearCell("D2"_pos);
+        sheet.Recalculate();
+        sheet.SetCell("A53"_pos, "2");
+        ASSERT(is_cached(sheet, "C54"_pos));
+        ASSERT(!is_cached(sheet, "C53"_pos));
+        ASSERT(sheet.GetCell("C52"_pos) == nullptr || sheet.GetCell("C52"_pos)->GetText().empty());
+    }
+}  // namespace
+
+int main() {
+    TestRunner tr;
+    RUN_TEST(tr, TestPositionAndStringConversion);
+    RUN_TEST(tr, TestPositionToStringInvalid);
+    RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestEmpty);
+    RUN_TEST(tr, TestInvalidPosition);
+    RUN_TEST(tr, TestSetCellPlainText);
+    RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestFormulaArithmetic);
+    RUN_TEST(tr, TestFormulaReferences);
+    RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestErrorValue);
+    RUN_TEST(tr, TestErrorArithmetic);
+    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
+    RUN_TEST(tr, TestFormulaInvalidPosition);
+    RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestLazyFormulaCompilation);
+    RUN_TEST(tr, TestCacheInvalidation);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestRecalcProfiler);
+    RUN_TEST(tr, TestErrorPropagation);
+    RUN_TEST(tr, TestDeepDependencyChain);
+    RUN_TEST(tr, TestUndoRedo);
+    RUN_TEST(tr, TestSheetSnapshot);
+    RUN_TEST(tr, TestInsertDeleteRowsCols);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestConstantFolding);
+    RUN_TEST(tr, TestBatchEvaluation);
+    RUN_TEST(tr, TestAsyncRecalculation);
+    RUN_TEST(tr, TestChangeSubscriptions);
+    RUN_TEST(tr, TestReadRange);
+    RUN_TEST(tr, TestValueView);
+    RUN_TEST(tr, TestStringPool);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestFormulaMemoryLimit);
+    RUN_TEST(tr, TestConditionalFormulas);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestServerProtocol);
+#ifdef SPREADSHEET_SERVER_TEST
+    RUN_TEST(tr, TestServerSession);
+#endif
+    RUN_TEST(tr, TestConcurrentWriters);
+    RUN_TEST(tr, TestEditLog);
+    RUN_TEST(tr, TestColumnarSnapshot);
+    RUN_TEST(tr, TestDeletedReferenceText);
+    RUN_TEST(tr, TestRangeDependents);
+}
@@ -0,0 +1,91 @@
+﻿#include "profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+RecalcProfiler::RecalcProfiler(size_t max_trace_events)
+    : origin_(Clock::now())
+    , max_trace_events_(max_trace_events) {
+}
+
+void RecalcProfiler::BeginEvaluation(Position pos) {
+    stack_.push_back({ pos, Clock::now(), 0 });
+}
+
+void RecalcProfiler::EndEvaluation() {
+    auto finish = Clock::now();
+    Frame frame = stack_.back();
+    stack_.pop_back();
+
+    uint64_t inclusive = std::chrono::duration_cast<std::chrono::nanoseconds>(finish - frame.start).count();
+    CellProfile& profile = cells_[frame.pos];
+    profile.pos = frame.pos;
+    ++profile.evaluations;
+    profile.inclusive_ns += inclusive;
+    profile.self_ns += inclusive - std::min(inclusive, frame.children_ns);
+
+    if (!stack_.empty()) {
+        stack_.back().children_ns += inclusive;
+    }
+
+    if (events_.size() < max_trace_events_) {
+        uint64_t start = std::chrono::duration_cast<std::chrono::nanoseconds>(frame.start - origin_).count();
+        events_.push_back({ frame.pos, start, inclusive, static_cast<uint32_t>(stack_.size()) });
+    }
+    else {
+        ++dropped_trace_events_;
+    }
+}
+
+std::vector<RecalcProfiler::CellProfile> RecalcProfiler::GetHottestCells(size_t count) const {
+    std::vector<CellProfile> result;
+    result.reserve(cells_.size());
+    for (const auto& [pos, profile] : cells_) {
+        result.push_back(profile);
+    }
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + count, result.end(),
+        [](const CellProfile& lhs, const CellProfile& rhs) {
+            return lhs.self_ns > rhs.self_ns;
+        });
+    result.resize(count);
+    return result;
+}
+
+const std::unordered_map<Position, RecalcProfiler::CellProfile>& RecalcProfiler::GetCellProfiles() const {
+    return cells_;
+}
+
+size_t RecalcProfiler::GetDroppedTraceEvents() const {
+    return dropped_trace_events_;
+}
+
+void RecalcProfiler::PrintReport(std::ostream& output, size_t count) const {
+    output << std::left << std::setw(10) << "cell"
+        << std::right << std::setw(12) << "evals"
+        << std::setw(14) << "self_us"
+        << std::setw(14) << "incl_us" << '\n';
+    for (const auto& profile : GetHottestCells(count)) {
+        output << std::left << std::setw(10) << profile.pos.ToString()
+            << std::right << std::setw(12) << profile.evaluations
+            << std::setw(14) << profile.self_ns / 1000
+            << std::setw(14) << profile.inclusive_ns / 1000 << '\n';
+    }
+}
+
+void RecalcProfiler::ExportChromeTrace(std::ostream& output) const {
+    // complete-события ("ph": "X"), время в микросекундах
+    output << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    bool first = true;
+    for (const auto& event : events_) {
+        output << (first ? "\n" : ",\n");
+        first = false;
+        output << "{\"name\": \"" << event.pos.ToString() << "\", \"cat\": \"recalc\", \"ph\": \"X\""
+            << ", \"ts\": " << event.start_ns / 1000 << '.' << std::setw(3) << std::setfill('0') << event.start_ns % 1000
+            << ", \"dur\": " << event.duration_ns / 1000 << '.' << std::setw(3) << event.duration_ns % 1000
+            << std::setfill(' ')
+            << ", \"pid\": 1, \"tid\": 1, \"args\": {\"depth\": " << event.depth << "}}";
+    }
+    output << "\n]}\n";
+}
@@ -0,0 +1,87 @@
+﻿#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <unordered_map>
+#include <vector>
+
+// Профилировщик пересчёта: для каждой формульной ячейки считает число
+// вычислений, собственное время и время вместе с вычислением ячеек, на
+// которые она ссылается. Вложенные вычисления отслеживаются стеком, поэтому
+// собственное время = полное время - полное время вложенных вычислений.
+class RecalcProfiler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct CellProfile {
+        Position pos;
+        uint64_t evaluations = 0;
+        uint64_t self_ns = 0;
+        uint64_t inclusive_ns = 0;
+    };
+
+    // Отмечает вычисление ячейки на время своей жизни. С нулевым
+    // профилировщиком ничего не делает.
+    class Scope {
+    public:
+        Scope(RecalcProfiler* profiler, Position pos)
+            : profiler_(profiler) {
+            if (profiler_) {
+                profiler_->BeginEvaluation(pos);
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        ~Scope() {
+            if (profiler_) {
+                profiler_->EndEvaluation();
+            }
+        }
+
+    private:
+        RecalcProfiler* profiler_;
+    };
+
+    // max_trace_events ограничивает память под события трассировки,
+    // сводная статистика по ячейкам собирается всегда
+    explicit RecalcProfiler(size_t max_trace_events = 1'000'000);
+
+    void BeginEvaluation(Position pos);
+    void EndEvaluation();
+
+    // Ячейки с наибольшим собственным временем
+    std::vector<CellProfile> GetHottestCells(size_t count) const;
+    const std::unordered_map<Position, CellProfile>& GetCellProfiles() const;
+    size_t GetDroppedTraceEvents() const;
+
+    // Таблица "top N" в текстовом виде
+    void PrintReport(std::ostream& output, size_t count) const;
+    // Трассировка в формате Chrome trace event (chrome://tracing, Perfetto)
+    void ExportChromeTrace(std::ostream& output) const;
+
+private:
+    struct Frame {
+        Position pos;
+        Clock::time_point start;
+        uint64_t children_ns = 0;
+    };
+
+    struct TraceEvent {
+        Position pos;
+        uint64_t start_ns = 0;
+        uint64_t duration_ns = 0;
+        uint32_t depth = 0;
+    };
+
+    Clock::time_point origin_;
+    size_t max_trace_events_;
+    size_t dropped_trace_events_ = 0;
+    std::vector<Frame> stack_;
+    std::vector<TraceEvent> events_;
+    std::unordered_map<Position, CellProfile> cells_;
+};
@@ -0,0 +1,279 @@
+﻿#include "protocol.h"
+
+#include <array>
+#include <cstring>
+#include <limits>
+
+namespace {
+    template <typename T>
+    void PutLittleEndian(std::string& out, T value) {
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            out.push_back(static_cast<char>(static_cast<uint8_t>(value >> (8 * i))));
+        }
+    }
+
+    template <typename T>
+    T GetLittleEndian(std::string_view bytes) {
+        T value = 0;
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            value |= static_cast<T>(static_cast<uint8_t>(bytes[i])) << (8 * i);
+        }
+        return value;
+    }
+}  // namespace
+
+uint32_t Crc32(std::string_view data) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> result{};
+        for (uint32_t i = 0; i < result.size(); ++i) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+            }
+            result[i] = value;
+        }
+        return result;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (char c : data) {
+        crc = table[(crc ^ static_cast<uint8_t>(c)) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+std::optional<ProtocolFrame> ParseFrame(std::string_view data, size_t& size) {
+    if (data.size() < sizeof(uint32_t)) {
+        return std::nullopt;
+    }
+    uint32_t frame_size = GetLittleEndian<uint32_t>(data);
+    if (frame_size < PROTOCOL_HEADER_SIZE - sizeof(uint32_t)) {
+        throw ProtocolException("Frame is shorter than its header");
+    }
+    if (frame_size > PROTOCOL_MAX_FRAME_SIZE) {
+        throw ProtocolException("Frame is too large");
+    }
+    if (data.size() - sizeof(uint32_t) < frame_size) {
+        return std::nullopt;
+    }
+    size = sizeof(uint32_t) + frame_size;
+    ProtocolFrame frame;
+    frame.request_id = GetLittleEndian<uint32_t>(data.substr(4));
+    frame.code = static_cast<uint8_t>(data[8]);
+    frame.payload = data.substr(PROTOCOL_HEADER_SIZE, size - PROTOCOL_HEADER_SIZE);
+    return frame;
+}
+
+ProtocolWriter::ProtocolWriter(std::string& out)
+    : out_(out) {
+}
+
+void ProtocolWriter::BeginFrame(uint32_t request_id, uint8_t code) {
+    frame_start_ = out_.size();
+    PutU32(0);
+    PutU32(request_id);
+    PutU8(code);
+}
+
+void ProtocolWriter::EndFrame() {
+    uint32_t frame_size = static_cast<uint32_t>(out_.size() - frame_start_ - sizeof(uint32_t));
+    for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+        out_[frame_start_ + i] = static_cast<char>(static_cast<uint8_t>(frame_size >> (8 * i)));
+    }
+}
+
+void ProtocolWriter::PutU8(uint8_t value) {
+    out_.push_back(static_cast<char>(value));
+}
+
+void ProtocolWriter::PutU16(uint16_t value) {
+    PutLittleEndian(out_, value);
+}
+
+void ProtocolWriter::PutU32(uint32_t value) {
+    PutLittleEndian(out_, value);
+}
+
+void ProtocolWriter::PutU64(uint64_t value) {
+    PutLittleEndian(out_, value);
+}
+
+void ProtocolWriter::PutVarU64(uint64_t value) {
+    while (value >= 0x80) {
+        out_.push_back(static_cast<char>(static_cast<uint8_t>(value) | 0x80));
+        value >>= 7;
+    }
+    out_.push_back(static_cast<char>(value));
+}
+
+void ProtocolWriter::PutDouble(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    PutU64(bits);
+}
+
+void ProtocolWriter::PutString16(std::string_view value) {
+    if (value.size() > std::numeric_limits<uint16_t>::max()) {
+        throw ProtocolException("String is too long");
+    }
+    PutU16(static_cast<uint16_t>(value.size()));
+    out_.append(value);
+}
+
+void ProtocolWriter::PutString32(std::string_view value) {
+    if (value.size() > PROTOCOL_MAX_FRAME_SIZE) {
+        throw ProtocolException("String is too long");
+    }
+    PutU32(static_cast<uint32_t>(value.size()));
+    out_.append(value);
+}
+
+void ProtocolWriter::PutVarString(std::string_view value) {
+    PutVarU64(value.size());
+    out_.append(value);
+}
+
+void ProtocolWriter::PutPosition(Position pos) {
+    PutU16(static_cast<uint16_t>(pos.row));
+    PutU16(static_cast<uint16_t>(pos.col));
+}
+
+void ProtocolWriter::PutValue(const CellInterface::ValueView& value) {
+    if (const double* number = std::get_if<double>(&value)) {
+        PutU8(static_cast<uint8_t>(ProtocolValueKind::Number));
+        PutDouble(*number);
+    }
+    else if (const std::string_view* text = std::get_if<std::string_view>(&value)) {
+        PutU8(static_cast<uint8_t>(ProtocolValueKind::Text));
+        PutString32(*text);
+    }
+    else {
+        PutU8(static_cast<uint8_t>(ProtocolValueKind::Error));
+        PutU8(static_cast<uint8_t>(std::get<FormulaError>(value).GetCategory()));
+    }
+}
+
+void ProtocolWriter::PutValue(const RangeValues::Value& value) {
+    switch (value.kind) {
+        case RangeValues::Kind::Empty:
+            PutEmptyValue();
+            break;
+        case RangeValues::Kind::Number:
+            PutValue(CellInterface::ValueView(value.number));
+            break;
+        case RangeValues::Kind::Text:
+            PutValue(CellInterface::ValueView(value.text));
+            break;
+        case RangeValues::Kind::Error:
+            PutValue(CellInterface::ValueView(FormulaError(value.error)));
+            break;
+    }
+}
+
+void ProtocolWriter::PutEmptyValue() {
+    PutU8(static_cast<uint8_t>(ProtocolValueKind::Empty));
+}
+
+ProtocolReader::ProtocolReader(std::string_view data)
+    : data_(data) {
+}
+
+uint8_t ProtocolReader::GetU8() {
+    return static_cast<uint8_t>(Take(1)[0]);
+}
+
+uint16_t ProtocolReader::GetU16() {
+    return GetLittleEndian<uint16_t>(Take(sizeof(uint16_t)));
+}
+
+uint32_t ProtocolReader::GetU32() {
+    return GetLittleEndian<uint32_t>(Take(sizeof(uint32_t)));
+}
+
+uint64_t ProtocolReader::GetU64() {
+    return GetLittleEndian<uint64_t>(Take(sizeof(uint64_t)));
+}
+
+uint64_t ProtocolReader::GetVarU64() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = GetU8();
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw ProtocolException("Variable-length number is too long");
+}
+
+double ProtocolReader::GetDouble() {
+    uint64_t bits = GetU64();
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+std::string_view ProtocolReader::GetString16() {
+    return Take(GetU16());
+}
+
+std::string_view ProtocolReader::GetString32() {
+    return Take(GetU32());
+}
+
+std::string_view ProtocolReader::GetVarString() {
+    uint64_t size = GetVarU64();
+    if (size > data_.size()) {
+        throw ProtocolException("Frame is truncated");
+    }
+    return Take(static_cast<size_t>(size));
+}
+
+Position ProtocolReader::GetPosition() {
+    Position pos;
+    pos.row = GetU16();
+    pos.col = GetU16();
+    return pos;
+}
+
+CellInterface::Value ProtocolReader::GetValue() {
+    switch (static_cast<ProtocolValueKind>(GetU8())) {
+        case ProtocolValueKind::Empty:
+            return std::string{};
+        case ProtocolValueKind::Number:
+            return GetDouble();
+        case ProtocolValueKind::Text:
+            return std::string(GetString32());
+        case ProtocolValueKind::Error: {
+            uint8_t category = GetU8();
+            if (category > static_cast<uint8_t>(FormulaError::Category::NotAvailable)) {
+                throw ProtocolException("Unknown error category");
+            }
+            return FormulaError(static_cast<FormulaError::Category>(category));
+        }
+        default:
+            throw ProtocolException("Unknown value kind");
+    }
+}
+
+bool ProtocolReader::AtEnd() const {
+    return data_.empty();
+}
+
+std::string_view ProtocolReader::GetRest() const {
+    return data_;
+}
+
+void ProtocolReader::ExpectEnd() const {
+    if (!data_.empty()) {
+        throw ProtocolException("Unexpected data at the end of frame");
+    }
+}
+
+std::string_view ProtocolReader::Take(size_t size) {
+    if (data_.size() < size) {
+        throw ProtocolException("Frame is truncated");
+    }
+    std::string_view bytes = data_.substr(0, size);
+    data_.remove_prefix(size);
+    return bytes;
+}
@@ -0,0 +1,153 @@
+﻿#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Двоичный протокол сервера таблиц (spreadsheet_server). Числа передаются
+// в порядке little-endian. Кадр запроса:
+//   u32 size | u32 request_id | u8 command | аргументы
+// кадр ответа:
+//   u32 size | u32 request_id | u8 status | данные
+// где size - длина кадра без самого поля size. Клиент может посылать
+// запросы, не дожидаясь ответов: ответы на запросы одного соединения
+// приходят в порядке запросов и с теми же request_id.
+//
+// Строка str16 - u16 длина и байты (имена листов), str32 - u32 длина и
+// байты. Позиция pos - u16 row, u16 col. Значение value - u8
+// ProtocolValueKind и f64, str32 или u8 категория ошибки FormulaError.
+//
+// Команды и данные успешного ответа:
+//   Set          str16 sheet, pos, str32 text             -> -
+//   Get          str16 sheet, pos                         -> value
+//   ReadRange    str16 sheet, pos first, pos last         -> u16 rows, u16 cols, value построчно
+//   Batch        str16 sheet, u32 count, count x (pos, str32 text) -> -
+//   Subscribe    str16 sheet, pos first, pos last         -> u64 subscription
+//   Unsubscribe  u64 subscription                         -> -
+// Пустой text очищает ячейку. Изменения Batch составляют одну операцию
+// для подписчиков и применяются до первой ошибки.
+// Ответ с ошибкой: status Error, u8 ProtocolErrorCode, str32 сообщение.
+// Уведомление подписки приходит без запроса: request_id 0, status Event,
+// u64 subscription, u8 structure_changed, u32 count, count x (pos, value).
+// Уведомление может опередить ответ на запрос, изменивший ячейки.
+enum class ProtocolCommand : uint8_t {
+    Set = 1,
+    Get,
+    ReadRange,
+    Batch,
+    Subscribe,
+    Unsubscribe,
+};
+
+enum class ProtocolStatus : uint8_t {
+    Ok,
+    Error,
+    Event,
+};
+
+enum class ProtocolErrorCode : uint8_t {
+    BadRequest = 1,       // неизвестная команда или неверные аргументы
+    UnknownSheet,
+    InvalidPosition,
+    InvalidFormula,
+    CircularDependency,
+    UnknownSubscription,
+    Internal,
+};
+
+enum class ProtocolValueKind : uint8_t {
+    Empty,
+    Number,
+    Text,
+    Error,
+};
+
+// Исключение, выбрасываемое при разборе некорректного кадра
+class ProtocolException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+inline constexpr size_t PROTOCOL_HEADER_SIZE = 9;  // size, request_id и код
+inline constexpr uint32_t PROTOCOL_MAX_FRAME_SIZE = 64u << 20;
+
+// Кадр без поля size; payload указывает в разобранный буфер
+struct ProtocolFrame {
+    uint32_t request_id = 0;
+    uint8_t code = 0;
+    std::string_view payload;
+};
+
+// Контрольная сумма CRC-32 (IEEE 802.3) для файлов журнала и снимков
+uint32_t Crc32(std::string_view data);
+
+// Кадр в начале data или std::nullopt, если он пришёл не целиком. В size
+// записывается полная длина кадра вместе с полем size. Бросает
+// ProtocolException для кадра короче заголовка или длиннее
+// PROTOCOL_MAX_FRAME_SIZE.
+std::optional<ProtocolFrame> ParseFrame(std::string_view data, size_t& size);
+
+// Дописывает кадры в конец строки
+class ProtocolWriter {
+public:
+    explicit ProtocolWriter(std::string& out);
+
+    // длина кадра записывается в EndFrame
+    void BeginFrame(uint32_t request_id, uint8_t code);
+    void EndFrame();
+
+    void PutU8(uint8_t value);
+    void PutU16(uint16_t value);
+    void PutU32(uint32_t value);
+    void PutU64(uint64_t value);
+    // число в формате LEB128: по 7 бит в байте, начиная с младших
+    void PutVarU64(uint64_t value);
+    void PutDouble(double value);
+    void PutString16(std::string_view value);
+    void PutString32(std::string_view value);
+    // строка с длиной в формате LEB128
+    void PutVarString(std::string_view value);
+    void PutPosition(Position pos);
+    void PutValue(const CellInterface::ValueView& value);
+    void PutValue(const RangeValues::Value& value);
+    void PutEmptyValue();
+
+private:
+    std::string& out_;
+    size_t frame_start_ = 0;
+};
+
+// Читает аргументы кадра. Бросает ProtocolException, если данных не хватает.
+class ProtocolReader {
+public:
+    explicit ProtocolReader(std::string_view data);
+
+    uint8_t GetU8();
+    uint16_t GetU16();
+    uint32_t GetU32();
+    uint64_t GetU64();
+    uint64_t GetVarU64();
+    double GetDouble();
+    // строки указывают в читаемый буфер
+    std::string_view GetString16();
+    std::string_view GetString32();
+    std::string_view GetVarString();
+    Position GetPosition();
+    // пустая ячейка читается как пустая строка
+    CellInterface::Value GetValue();
+
+    bool AtEnd() const;
+    // непрочитанные данные
+    std::string_view GetRest() const;
+    // бросает ProtocolException, если остались непрочитанные данные
+    void ExpectEnd() const;
+
+private:
+    std::string_view Take(size_t size);
+
+    std::string_view data_;
+};
@@ -0,0 +1,618 @@
+﻿#include "server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+    // пока у соединения столько невыполненных запросов или неотправленных
+    // ответов, новые запросы из сокета не читаются
+    constexpr size_t MAX_PENDING_REQUEST_BYTES = 16u << 20;
+    constexpr size_t MAX_PENDING_OUTPUT_BYTES = 64u << 20;
+    constexpr size_t READ_CHUNK_SIZE = 64u << 10;
+    // ограничение на ответ ReadRange, чтобы он уложился в кадр
+    constexpr size_t MAX_RANGE_CELLS = 1u << 20;
+
+#ifdef MSG_NOSIGNAL
+    constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    constexpr int SEND_FLAGS = 0;
+#endif
+
+    [[noreturn]] void ThrowSystemError(const char* what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    void SetNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            ThrowSystemError("fcntl");
+        }
+    }
+
+    bool IsWouldBlock(int error) {
+        return error == EAGAIN || error == EWOULDBLOCK;
+    }
+
+    // Ошибка запроса, о которой сообщается клиенту
+    class RequestError : public std::runtime_error {
+    public:
+        RequestError(ProtocolErrorCode code, const std::string& message)
+            : std::runtime_error(message)
+            , code_(code) {
+        }
+
+        ProtocolErrorCode GetCode() const {
+            return code_;
+        }
+
+    private:
+        ProtocolErrorCode code_;
+    };
+
+    CellRange ReadRangeArgument(ProtocolReader& reader) {
+        CellRange range{ reader.GetPosition(), reader.GetPosition() };
+        if (!range.first.IsValid() || !range.last.IsValid()
+            || range.first.row > range.last.row || range.first.col > range.last.col) {
+            throw InvalidPositionException("Invalid range");
+        }
+        return range;
+    }
+}  // namespace
+
+class SpreadsheetServer::Connection {
+public:
+    explicit Connection(int fd)
+        : fd_(fd) {
+    }
+
+    int GetFd() const {
+        return fd_;
+    }
+
+    // Дописывает данные к неотправленным и отправляет, сколько примет
+    // сокет. Истина, если часть данных осталась ждать готовности сокета.
+    bool Send(std::string_view data) {
+        std::lock_guard lock(mutex);
+        if (closed || data.empty()) {
+            return false;
+        }
+        output.append(data);
+        return Flush() && HasOutput();
+    }
+
+    // Отправляет неотправленные данные, вызывается под mutex. Ложь при
+    // ошибке сокета.
+    bool Flush() {
+        while (output_offset < output.size()) {
+            ssize_t sent = ::send(fd_, output.data() + output_offset, output.size() - output_offset, SEND_FLAGS);
+            if (sent > 0) {
+                output_offset += static_cast<size_t>(sent);
+            }
+            else if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            else if (sent < 0 && IsWouldBlock(errno)) {
+                break;
+            }
+            else {
+                return false;
+            }
+        }
+        if (output_offset == output.size()) {
+            output.clear();
+            output_offset = 0;
+        }
+        else if (output_offset > output.size() / 2) {
+            output.erase(0, output_offset);
+            output_offset = 0;
+        }
+        return true;
+    }
+
+    bool HasOutput() const {
+        return output_offset < output.size();
+    }
+
+    // принятые байты, ещё не сложившиеся в кадр; только в потоке цикла событий
+    std::string input;
+
+    std::mutex mutex;
+    std::string requests;   // целые кадры запросов, ожидающие выполнения
+    bool scheduled = false; // в очереди или у рабочего потока
+    bool closed = false;
+    std::string output;
+    size_t output_offset = 0;
+
+    // подписки соединения, под workbook_mutex_ сервера
+    std::vector<uint64_t> subscriptions;
+
+private:
+    const int fd_;
+};
+
+SpreadsheetServer::SpreadsheetServer(Workbook& workbook, Options options)
+    : workbook_(workbook)
+    , options_(std::move(options)) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (options_.socket_path.empty() || options_.socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Invalid socket path");
+    }
+    std::memcpy(address.sun_path, options_.socket_path.c_str(), options_.socket_path.size() + 1);
+
+    try {
+        if (::pipe(wake_fds_) < 0) {
+            ThrowSystemError("pipe");
+        }
+        SetNonBlocking(wake_fds_[0]);
+        SetNonBlocking(wake_fds_[1]);
+
+        listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) {
+            ThrowSystemError("socket");
+        }
+        ::unlink(options_.socket_path.c_str());
+        if (::bind(listen_fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+            ThrowSystemError("bind");
+        }
+        if (::listen(listen_fd_, SOMAXCONN) < 0) {
+            ThrowSystemError("listen");
+        }
+        SetNonBlocking(listen_fd_);
+    }
+    catch (...) {
+        for (int fd : { listen_fd_, wake_fds_[0], wake_fds_[1] }) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        throw;
+    }
+}
+
+SpreadsheetServer::~SpreadsheetServer() {
+    ::close(listen_fd_);
+    ::unlink(options_.socket_path.c_str());
+    ::close(wake_fds_[0]);
+    ::close(wake_fds_[1]);
+}
+
+void SpreadsheetServer::Run() {
+    for (size_t i = 0; i < std::max<size_t>(options_.workers, 1); ++i) {
+        workers_.emplace_back([this] { RunWorker(); });
+    }
+
+    std::vector<pollfd> fds;
+    std::vector<std::shared_ptr<Connection>> polled;
+    while (!stopping_) {
+        fds.clear();
+        polled.clear();
+        fds.push_back({ listen_fd_, POLLIN, 0 });
+        fds.push_back({ wake_fds_[0], POLLIN, 0 });
+        for (const auto& [fd, connection] : connections_) {
+            short events = 0;
+            {
+                std::lock_guard lock(connection->mutex);
+                size_t pending_output = connection->output.size() - connection->output_offset;
+                if (connection->requests.size() < MAX_PENDING_REQUEST_BYTES && pending_output < MAX_PENDING_OUTPUT_BYTES) {
+                    events |= POLLIN;
+                }
+                if (pending_output > 0) {
+                    events |= POLLOUT;
+                }
+            }
+            fds.push_back({ fd, events, 0 });
+            polled.push_back(connection);
+        }
+
+        if (::poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ThrowSystemError("poll");
+        }
+        if (fds[1].revents & POLLIN) {
+            char buffer[256];
+            while (::read(wake_fds_[0], buffer, sizeof(buffer)) > 0) {
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            Accept();
+        }
+        for (size_t i = 0; i < polled.size(); ++i) {
+            short revents = fds[i + 2].revents;
+            if (revents == 0) {
+                continue;
+            }
+            bool alive = true;
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                alive = ReadFrom(*polled[i]);
+            }
+            if (alive && (revents & POLLOUT)) {
+                std::lock_guard lock(polled[i]->mutex);
+                alive = polled[i]->Flush();
+            }
+            if (!alive) {
+                Close(polled[i]);
+            }
+        }
+    }
+
+    // рабочие потоки доделывают очередь, в том числе отписку закрытых соединений
+    polled.clear();
+    while (!connections_.empty()) {
+        Close(connections_.begin()->second);
+    }
+    queue_cv_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+    workers_.clear();
+    std::lock_guard lock(workbook_mutex_);
+    while (!subscriptions_.empty()) {
+        Unsubscribe(subscriptions_.begin()->first);
+    }
+}
+
+void SpreadsheetServer::Stop() {
+    stopping_ = true;
+    Wake();
+}
+
+size_t SpreadsheetServer::GetSubscriptionCount() {
+    std::lock_guard lock(workbook_mutex_);
+    return subscriptions_.size();
+}
+
+void SpreadsheetServer::Accept() {
+    while (true) {
+        int fd = ::accept(listen_fd_, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN - очередь принята целиком, прочие ошибки относятся к
+            // одному соединению, и сервер продолжает работу
+            return;
+        }
+        SetNonBlocking(fd);
+        connections_.emplace(fd, std::make_shared<Connection>(fd));
+    }
+}
+
+bool SpreadsheetServer::ReadFrom(Connection& connection) {
+    std::string& input = connection.input;
+    // за один раз читается ограниченный объём, чтобы не задерживать другие соединения
+    for (size_t total = 0; total < MAX_PENDING_REQUEST_BYTES;) {
+        size_t size = input.size();
+        input.resize(size + READ_CHUNK_SIZE);
+        ssize_t received = ::read(connection.GetFd(), input.data() + size, READ_CHUNK_SIZE);
+        input.resize(size + std::max<ssize_t>(received, 0));
+        if (received > 0) {
+            total += static_cast<size_t>(received);
+            continue;
+        }
+        if (received == 0) {
+            return false;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (IsWouldBlock(errno)) {
+            break;
+        }
+        return false;
+    }
+
+    size_t complete = 0;
+    try {
+        size_t size = 0;
+        while (ParseFrame(std::string_view(input).substr(complete), size)) {
+            complete += size;
+        }
+    }
+    catch (const ProtocolException&) {
+        // после испорченного кадра границы следующих неизвестны
+        return false;
+    }
+    if (complete == 0) {
+        return true;
+    }
+
+    bool schedule = false;
+    {
+        std::lock_guard lock(connection.mutex);
+        connection.requests.append(input, 0, complete);
+        schedule = !std::exchange(connection.scheduled, true);
+    }
+    input.erase(0, complete);
+    if (schedule) {
+        Schedule(connections_.at(connection.GetFd()));
+    }
+    return true;
+}
+
+void SpreadsheetServer::Close(const std::shared_ptr<Connection>& connection) {
+    connections_.erase(connection->GetFd());
+    bool schedule = false;
+    {
+        std::lock_guard lock(connection->mutex);
+        connection->closed = true;
+        ::close(connection->GetFd());
+        // подписки соединения снимает рабочий поток под захватом книги
+        schedule = !std::exchange(connection->scheduled, true);
+    }
+    if (schedule) {
+        Schedule(connection);
+    }
+}
+
+void SpreadsheetServer::Schedule(const std::shared_ptr<Connection>& connection) {
+    {
+        std::lock_guard lock(queue_mutex_);
+        queue_.push_back(connection);
+    }
+    queue_cv_.notify_one();
+}
+
+void SpreadsheetServer::Wake() {
+    // переполненный канал и так разбудит цикл событий
+    char byte = 0;
+    [[maybe_unused]] ssize_t written = ::write(wake_fds_[1], &byte, 1);
+}
+
+void SpreadsheetServer::RunWorker() {
+    while (true) {
+        std::shared_ptr<Connection> connection;
+        {
+            std::unique_lock lock(queue_mutex_);
+            queue_cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            connection = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        Process(connection);
+    }
+}
+
+void SpreadsheetServer::Process(const std::shared_ptr<Connection>& connection) {
+    std::string requests;
+    std::string responses;
+    RangeValues range;
+    while (true) {
+        bool closed = false;
+        {
+            std::lock_guard lock(connection->mutex);
+            closed = connection->closed;
+            if (!closed && connection->requests.empty()) {
+                connection->scheduled = false;
+                return;
+            }
+            requests.swap(connection->requests);
+        }
+        if (closed) {
+            {
+                std::lock_guard lock(workbook_mutex_);
+                for (uint64_t id : connection->subscriptions) {
+                    Unsubscribe(id);
+                }
+                connection->subscriptions.clear();
+            }
+            std::lock_guard lock(connection->mutex);
+            connection->scheduled = false;
+            return;
+        }
+
+        // все пришедшие запросы выполняются за один захват книги
+        responses.clear();
+        {
+            std::lock_guard lock(workbook_mutex_);
+            std::string_view rest = requests;
+            size_t size = 0;
+            while (auto frame = ParseFrame(rest, size)) {
+                Execute(connection, *frame, responses, range);
+                rest.remove_prefix(size);
+            }
+        }
+        requests.clear();
+        if (connection->Send(responses)) {
+            Wake();
+        }
+    }
+}
+
+void SpreadsheetServer::Execute(const std::shared_ptr<Connection>& connection, const ProtocolFrame& frame,
+    std::string& out, RangeValues& range) {
+    const size_t start = out.size();
+    ProtocolWriter writer(out);
+    ProtocolReader reader(frame.payload);
+    auto begin_ok = [&writer, &frame] {
+        writer.BeginFrame(frame.request_id, static_cast<uint8_t>(ProtocolStatus::Ok));
+    };
+    auto fail = [&](ProtocolErrorCode code, std::string_view message) {
+        out.resize(start);
+        writer.BeginFrame(frame.request_id, static_cast<uint8_t>(ProtocolStatus::Error));
+        writer.PutU8(static_cast<uint8_t>(code));
+        writer.PutString32(message);
+    };
+
+    try {
+        switch (static_cast<ProtocolCommand>(frame.code)) {
+            case ProtocolCommand::Set: {
+                Sheet& sheet = GetSheet(reader.GetString16());
+                Position pos = reader.GetPosition();
+                std::string_view text = reader.GetString32();
+                reader.ExpectEnd();
+                if (text.empty()) {
+                    sheet.ClearCell(pos);
+                }
+                else {
+                    sheet.SetCell(pos, std::string(text));
+                }
+                begin_ok();
+                break;
+            }
+            case ProtocolCommand::Get: {
+                const Sheet& sheet = GetSheet(reader.GetString16());
+                Position pos = reader.GetPosition();
+                reader.ExpectEnd();
+                const CellInterface* cell = sheet.GetCell(pos);
+                begin_ok();
+                if (cell) {
+                    writer.PutValue(cell->GetValueView());
+                }
+                else {
+                    writer.PutEmptyValue();
+                }
+                break;
+            }
+            case ProtocolCommand::ReadRange: {
+                Sheet& sheet = GetSheet(reader.GetString16());
+                CellRange cells = ReadRangeArgument(reader);
+                reader.ExpectEnd();
+                if (static_cast<size_t>(cells.last.row - cells.first.row + 1)
+                    * (cells.last.col - cells.first.col + 1) > MAX_RANGE_CELLS) {
+                    throw RequestError(ProtocolErrorCode::BadRequest, "Range is too large");
+                }
+                sheet.ReadRange(cells, range);
+                begin_ok();
+                writer.PutU16(static_cast<uint16_t>(range.rows));
+                writer.PutU16(static_cast<uint16_t>(range.cols));
+                for (const auto& value : range.values) {
+                    writer.PutValue(value);
+                }
+                break;
+            }
+            case ProtocolCommand::Batch: {
+                Sheet& sheet = GetSheet(reader.GetString16());
+                // кадр разбирается целиком до первого изменения
+                std::vector<std::pair<Position, std::string_view>> changes;
+                uint32_t count = reader.GetU32();
+                for (uint32_t i = 0; i < count; ++i) {
+                    Position pos = reader.GetPosition();
+                    changes.emplace_back(pos, reader.GetString32());
+                }
+                reader.ExpectEnd();
+                sheet.BeginBatch();
+                try {
+                    for (const auto& [pos, text] : changes) {
+                        if (text.empty()) {
+                            sheet.ClearCell(pos);
+                        }
+                        else {
+                            sheet.SetCell(pos, std::string(text));
+                        }
+                    }
+                }
+                catch (...) {
+                    sheet.EndBatch();
+                    throw;
+                }
+                sheet.EndBatch();
+                begin_ok();
+                break;
+            }
+            case ProtocolCommand::Subscribe: {
+                Sheet& sheet = GetSheet(reader.GetString16());
+                CellRange region = ReadRangeArgument(reader);
+                reader.ExpectEnd();
+                const uint64_t id = next_subscription_id_++;
+                std::weak_ptr<Connection> weak = connection;
+                Sheet::SubscriptionId sheet_id = sheet.Subscribe(region,
+                    [this, id, weak, &sheet](const Sheet::Changes& changes) {
+                        auto subscriber = weak.lock();
+                        if (!subscriber) {
+                            return;
+                        }
+                        std::string event;
+                        ProtocolWriter event_writer(event);
+                        event_writer.BeginFrame(0, static_cast<uint8_t>(ProtocolStatus::Event));
+                        event_writer.PutU64(id);
+                        event_writer.PutU8(changes.structure_changed ? 1 : 0);
+                        event_writer.PutU32(static_cast<uint32_t>(changes.cells.size()));
+                        for (Position pos : changes.cells) {
+                            event_writer.PutPosition(pos);
+                            if (const CellInterface* cell = sheet.GetCell(pos)) {
+                                event_writer.PutValue(cell->GetValueView());
+                            }
+                            else {
+                                event_writer.PutEmptyValue();
+                            }
+                        }
+                        event_writer.EndFrame();
+                        if (subscriber->Send(event)) {
+                            Wake();
+                        }
+                    });
+                subscriptions_.emplace(id, Subscription{ &sheet, sheet_id });
+                connection->subscriptions.push_back(id);
+                begin_ok();
+                writer.PutU64(id);
+                break;
+            }
+            case ProtocolCommand::Unsubscribe: {
+                uint64_t id = reader.GetU64();
+                reader.ExpectEnd();
+                auto& own = connection->subscriptions;
+                auto it = std::find(own.begin(), own.end(), id);
+                if (it == own.end()) {
+                    throw RequestError(ProtocolErrorCode::UnknownSubscription, "Unknown subscription");
+                }
+                own.erase(it);
+                Unsubscribe(id);
+                begin_ok();
+                break;
+            }
+            default:
+                throw RequestError(ProtocolErrorCode::BadRequest, "Unknown command");
+        }
+    }
+    catch (const RequestError& e) {
+        fail(e.GetCode(), e.what());
+    }
+    catch (const ProtocolException& e) {
+        fail(ProtocolErrorCode::BadRequest, e.what());
+    }
+    catch (const InvalidPositionException& e) {
+        fail(ProtocolErrorCode::InvalidPosition, e.what());
+    }
+    catch (const FormulaException& e) {
+        fail(ProtocolErrorCode::InvalidFormula, e.what());
+    }
+    catch (const CircularDependencyException& e) {
+        fail(ProtocolErrorCode::CircularDependency, e.what());
+    }
+    catch (const std::exception& e) {
+        fail(ProtocolErrorCode::Internal, e.what());
+    }
+    writer.EndFrame();
+}
+
+Sheet& SpreadsheetServer::GetSheet(std::string_view name) {
+    Sheet* sheet = workbook_.GetSheet(name);
+    if (!sheet) {
+        throw RequestError(ProtocolErrorCode::UnknownSheet, "Unknown sheet " + std::string(name));
+    }
+    return *sheet;
+}
+
+void SpreadsheetServer::Unsubscribe(uint64_t id) {
+    auto it = subscriptions_.find(id);
+    if (it != subscriptions_.end()) {
+        it->second.sheet->Unsubscribe(it->second.id);
+        subscriptions_.erase(it);
+    }
+}
@@ -0,0 +1,93 @@
+﻿#pragma once
+
+#include "protocol.h"
+#include "sheet.h"
+#include "workbook.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Сервер листов книги на Unix-сокете, протокол описан в protocol.h.
+// Один поток цикла событий принимает соединения, читает и пишет сокеты и
+// разбирает кадры, а запросы выполняет пул рабочих потоков: рабочий
+// забирает все пришедшие запросы соединения и выполняет их за один захват
+// книги, поэтому вычисление формул не задерживает ввод-вывод других
+// соединений. Книга не потокобезопасна, и рабочие захватывают её по
+// очереди; запросы одного соединения выполняются по порядку. Пока сервер
+// работает, книгу можно менять только через него.
+class SpreadsheetServer {
+public:
+    struct Options {
+        std::string socket_path;
+        size_t workers = 2;
+    };
+
+    // Создаёт сокет и начинает его слушать. Бросает std::system_error,
+    // если сокет создать не удалось; файл, оставшийся от прежнего
+    // запуска, заменяется.
+    SpreadsheetServer(Workbook& workbook, Options options);
+    ~SpreadsheetServer();
+
+    SpreadsheetServer(const SpreadsheetServer&) = delete;
+    SpreadsheetServer& operator=(const SpreadsheetServer&) = delete;
+
+    // Обслуживает соединения до вызова Stop
+    void Run();
+    // Можно вызывать из любого потока и из обработчика сигнала
+    void Stop();
+
+    // Число подписок всех соединений, можно вызывать из любого потока.
+    // Подписки закрытого соединения снимаются рабочим потоком вскоре после
+    // закрытия.
+    size_t GetSubscriptionCount();
+
+private:
+    class Connection;
+
+    struct Subscription {
+        Sheet* sheet;
+        Sheet::SubscriptionId id;
+    };
+
+    void Accept();
+    // false, если соединение нужно закрыть
+    bool ReadFrom(Connection& connection);
+    void Close(const std::shared_ptr<Connection>& connection);
+    void Schedule(const std::shared_ptr<Connection>& connection);
+    void Wake();
+    void RunWorker();
+    // выполняет пришедшие запросы соединения, пока они не кончатся
+    void Process(const std::shared_ptr<Connection>& connection);
+    void Execute(const std::shared_ptr<Connection>& connection, const ProtocolFrame& frame,
+        std::string& out, RangeValues& range);
+    Sheet& GetSheet(std::string_view name);
+    void Unsubscribe(uint64_t id);
+
+    Workbook& workbook_;
+    Options options_;
+    int listen_fd_ = -1;
+    int wake_fds_[2] = { -1, -1 };
+    std::atomic<bool> stopping_ = false;
+
+    // соединения по дескрипторам, только в потоке цикла событий
+    std::unordered_map<int, std::shared_ptr<Connection>> connections_;
+
+    // соединения с невыполненными запросами
+    std::mutex queue_mutex_;
+    std::condition_variable queue_cv_;
+    std::deque<std::shared_ptr<Connection>> queue_;
+    std::vector<std::thread> workers_;
+
+    // книга и подписки захватываются вместе
+    std::mutex workbook_mutex_;
+    std::unordered_map<uint64_t, Subscription> subscriptions_;
+    uint64_t next_subscription_id_ = 1;
+};
@@ -0,0 +1,65 @@
+﻿#include "server.h"
+#include "workbook.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+    SpreadsheetServer* running_server = nullptr;
+
+    void HandleStopSignal(int) {
+        if (running_server) {
+            running_server->Stop();
+        }
+    }
+}  // namespace
+
+// Использование: spreadsheet_server --socket PATH [--sheet NAME]... [--workers N]
+// Без --sheet книга состоит из одного листа Sheet1.
+int main(int argc, char* argv[]) {
+    SpreadsheetServer::Options options;
+    std::vector<std::string> sheets;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string_view arg = argv[i];
+        if (arg == "--socket") {
+            options.socket_path = argv[i + 1];
+        }
+        else if (arg == "--sheet") {
+            sheets.emplace_back(argv[i + 1]);
+        }
+        else if (arg == "--workers") {
+            options.workers = static_cast<size_t>(std::atoi(argv[i + 1]));
+        }
+    }
+    if (options.socket_path.empty()) {
+        std::cerr << "Usage: spreadsheet_server --socket PATH [--sheet NAME]... [--workers N]" << std::endl;
+        return 1;
+    }
+    if (sheets.empty()) {
+        sheets.emplace_back("Sheet1");
+    }
+
+    try {
+        Workbook workbook;
+        for (auto& name : sheets) {
+            workbook.AddSheet(std::move(name));
+        }
+        SpreadsheetServer server(workbook, options);
+        running_server = &server;
+        std::signal(SIGINT, HandleStopSignal);
+        std::signal(SIGTERM, HandleStopSignal);
+        std::signal(SIGPIPE, SIG_IGN);
+        std::cerr << "Listening on " << options.socket_path << std::endl;
+        server.Run();
+        running_server = nullptr;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -1,195 +1,1274 @@
-﻿#include "sheet.h"
-
-#include "cell.h"
-#include "common.h"
-
-#include <algorithm>
-#include <functional>
-#include <iostream>
-#include <optional>
-
-using namespace std::literals;
-
-Sheet::~Sheet() = default;
-
-void Sheet::UpdateDependencies(Position pos, const std::vector<Position>& old_refs, const std::vector<Position>& new_refs) {
-    std::unordered_set<Position> old_refs_set(old_refs.begin(), old_refs.end());
-    std::unordered_set<Position> new_refs_set(new_refs.begin(), new_refs.end());
-
-    // удаляем зависимости, которые есть в старых ссылках, но отсутствуют в новых
-    for (const auto& ref : old_refs) {
-        if (new_refs_set.find(ref) == new_refs_set.end()) {
-            RemoveDependency(ref, pos);
-        }
-    }
-
-    // добавляем зависимости, которые есть в новых ссылках, но отсутствуют в старых
-    for (const auto& ref : new_refs) {
-        if (old_refs_set.find(ref) == old_refs_set.end()) {
-            AddDependency(ref, pos);
-        }
-    }
-}
-
-void Sheet::AddDependency(Position from, Position to) {
-    auto* cell = dynamic_cast<Cell*>(GetCell(from));
-    if (cell) {
-        cell->AddDependentCell(to);  // добавление зависимой ячейки
-    }
-}
-
-void Sheet::RemoveDependency(Position from, Position to) {
-    auto* cell = dynamic_cast<Cell*>(GetCell(from));
-    if (cell) {
-        cell->RemoveDependentCell(to);  // удаление зависимой ячейки
-    }
-}
-
-void Sheet::SetCell(Position pos, std::string text) {
-    if (!IsValidPosition(pos)) {
-        throw InvalidPositionException("Invalid position");
-    }
-    if (text[0] == '=') {
-        try {
-            auto formula_ast = ParseFormula(text.substr(1));
-            for (const auto& cell_ref : formula_ast->GetReferencedCells()) {
-                if (!IsValidPosition(cell_ref)) {
-                    throw FormulaException("Invalid cell reference in formula");
-                }
-                if (GetCell(cell_ref) == nullptr) {
-                    sheet_[cell_ref] = std::make_unique<Cell>(*this);
-                }
-            }
-        }
-        catch (const FormulaException&) {
-            throw;
-        }
-    }
-    Cell* cell = dynamic_cast<Cell*>(GetCell(pos));
-    if (!cell) {
-        sheet_[pos] = std::make_unique<Cell>(*this);
-        cell = sheet_[pos].get();
-    }
-
-    std::string old_text = cell->GetText();
-    auto old_references = cell->GetReferencedCells();
-
-    try {
-        cell->Set(std::move(text)); 
-    }
-    catch (const FormulaException& e) {
-        cell->Set(std::move(old_text));
-        throw;
-    }
-    catch (const CircularDependencyException& e) {
-        cell->Set(std::move(old_text));
-        cell->UpdateReferences(old_references); // Вернуть старые зависимости
-        throw;
-    }
-
-    // Обновление зависимостей в таблице
-    UpdateDependencies(pos, old_references, cell->GetReferencedCells());
-}
-
-
-const CellInterface* Sheet::GetCell(Position pos) const {
-    if (!IsValidPosition(pos)) {
-        throw InvalidPositionException("Invalid position");
-    }
-    auto it = sheet_.find(pos);
-    return (it != sheet_.end() && it->second) ? it->second.get() : nullptr;
-}
-CellInterface* Sheet::GetCell(Position pos) {
-    if (!IsValidPosition(pos)) {
-        throw InvalidPositionException("Invalid position");
-    }
-    auto it = sheet_.find(pos);
-    return (it != sheet_.end() && it->second) ? it->second.get() : nullptr;
-}
-
-void Sheet::ClearCell(Position pos) {
-    if (!IsValidPosition(pos)) {
-        throw InvalidPositionException("Invalid position");
-    }
-
-    auto it = sheet_.find(pos);
-    if (it != sheet_.end()) {
-        // очищаем ячейку
-        it->second->Clear();
-
-        // проверяем, есть ли ссылки на эту ячейку из других ячеек
-        bool has_references = false;
-        for (const auto& [key, cell] : sheet_) {
-            if (!cell->GetReferencedCells().empty()) {
-                const auto& refs = cell->GetReferencedCells();
-                if (std::find(refs.begin(), refs.end(), pos) != refs.end()) {
-                    has_references = true;
-                    break;
-                }
-            }
-        }
-
-        // если на ячейку нет ссылок и она пустая, удаляем её
-        if (!has_references && it->second->GetText().empty()) {
-            sheet_.erase(it);
-        }
-    }
-}
-
-Size Sheet::GetPrintableSize() const {
-    if (sheet_.empty()) {
-        return { 0, 0 };
-    }
-    int max_row = 0;
-    int max_col = 0;
-    for (const auto& [pos, cell] : sheet_) {
-        if (!cell->GetText().empty()) {
-            max_row = std::max(max_row, pos.row + 1);
-            max_col = std::max(max_col, pos.col + 1);
-        }
-    }
-    return { max_row, max_col };
-}
-
-void Sheet::PrintValues(std::ostream& output) const {
-    Size size = GetPrintableSize();
-    for (int row = 0; row < size.rows; ++row) {
-        for (int col = 0; col < size.cols; ++col) {
-            Position pos{ row, col };
-            const CellInterface* cell = GetCell(pos); // ячейка по позиции
-            if (cell) {
-                std::visit([&output](const auto& value) { output << value; }, cell->GetValue());
-            }
-
-            if (col < size.cols - 1) {
-                output << '\t';  // разделитель табуляции между столбцами
-            }
-        }
-        output << '\n';  // перевод строки после каждой строки таблицы
-    }
-}
-void Sheet::PrintTexts(std::ostream& output) const {
-    Size size = GetPrintableSize();
-    for (int row = 0; row < size.rows; ++row) {
-        for (int col = 0; col < size.cols; ++col) {
-            Position pos{ row, col };
-            const CellInterface* cell = GetCell(pos); // получаем ячейку по позиции
-            if (cell) {
-                output << cell->GetText();
-            }
-
-            if (col < size.cols - 1) {
-                output << '\t';  // разделитель табуляции между столбцами
-            }
-        }
-        output << '\n';  // перевод строки после каждой строки таблицы
-    }
-}
-
-bool Sheet::IsValidPosition(const Position& pos) const {
-    return pos.IsValid();
-}
-
-std::unique_ptr<SheetInterface> CreateSheet() {
-    return std::make_unique<Sheet>();
-}
+﻿#include "sheet.h"
+
+#include "cell.h"
+#include "common.h"
+#include "formula_batch.h"
+#include "workbook.h"
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+using namespace std::literals;
+
+class Sheet::ChangeScope {
+public:
+    explicit ChangeScope(Sheet& sheet)
+        : sheet_(sheet)
+        , uncaught_exceptions_(std::uncaught_exceptions()) {
+        ++sheet_.change_depth_;
+    }
+
+    ChangeScope(const ChangeScope&) = delete;
+    ChangeScope& operator=(const ChangeScope&) = delete;
+
+    // исключение подписчика передаётся вызвавшему изменение
+    ~ChangeScope() noexcept(false) {
+        // после неудачного изменения значения сравниваются при следующей операции
+        if (--sheet_.change_depth_ != 0) {
+            return;
+        }
+        // изменения, уже внесённые в лист, попадают в журнал и после исключения
+        sheet_.FlushEditLog();
+        if (std::uncaught_exceptions() == uncaught_exceptions_) {
+            sheet_.FlushChanges();
+        }
+    }
+
+private:
+    Sheet& sheet_;
+    int uncaught_exceptions_;
+};
+
+Sheet::~Sheet() = default;
+
+void Sheet::UpdateDependencies(Position pos, const std::vector<Position>& old_refs, const std::vector<Position>& new_refs) {
+    std::unordered_set<Position> old_refs_set(old_refs.begin(), old_refs.end());
+    std::unordered_set<Position> new_refs_set(new_refs.begin(), new_refs.end());
+
+    // удаляем зависимости, которые есть в старых ссылках, но отсутствуют в новых
+    for (const auto& ref : old_refs) {
+        if (new_refs_set.find(ref) == new_refs_set.end()) {
+            RemoveDependency(ref, pos);
+        }
+    }
+
+    // добавляем зависимости, которые есть в новых ссылках, но отсутствуют в старых
+    for (const auto& ref : new_refs) {
+        if (old_refs_set.find(ref) == old_refs_set.end()) {
+            AddDependency(ref, pos);
+        }
+    }
+}
+
+void Sheet::AddDependency(Position from, Position to) {
+    auto* cell = FindCell(from);
+    if (cell) {
+        cell->AddDependentCell(to);  // добавление зависимой ячейки
+    }
+}
+
+void Sheet::RemoveDependency(Position from, Position to) {
+    auto* cell = FindCell(from);
+    if (cell) {
+        cell->RemoveDependentCell(to);  // удаление зависимой ячейки
+    }
+}
+
+void Sheet::SetCell(Position pos, std::string text) {
+    SetCell(pos, std::move(text), nullptr);
+}
+
+void Sheet::SetCell(Position pos, std::string text, std::shared_ptr<FormulaInterface> parsed_formula) {
+    if (!IsValidPosition(pos)) {
+        throw InvalidPositionException("Invalid position");
+    }
+    ChangeScope scope(*this);
+    Cell* cell = FindCell(pos);
+    bool created = false;
+    if (!cell) {
+        cell = CreateCell(pos);
+        created = true;
+    }
+    RecordValueChange(pos, *cell);
+
+    std::string old_text = cell->GetText();
+    auto old_references = cell->GetReferencedCells();
+    auto old_external_references = cell->GetExternalReferences();
+    auto old_ranges = cell->GetReferencedRanges();
+    std::string journal_text;
+    if (journal_ || edit_log_) {
+        journal_text = text;
+    }
+
+    try {
+        cell->Set(std::move(text), std::move(parsed_formula));
+    }
+    catch (const FormulaException& e) {
+        if (created) {
+            sheet_.erase(pos);
+        }
+        else {
+            cell->Set(std::move(old_text));
+        }
+        throw;
+    }
+    catch (const CircularDependencyException& e) {
+        if (created) {
+            sheet_.erase(pos);
+        }
+        else {
+            cell->Set(std::move(old_text));
+            cell->UpdateReferences(old_references); // Вернуть старые зависимости
+        }
+        throw;
+    }
+
+    // ячейки, на которые ссылается формула, должны существовать в таблице
+    const auto new_references = cell->GetReferencedCells();
+    for (const auto& cell_ref : new_references) {
+        if (FindCell(cell_ref) == nullptr) {
+            CreateCell(cell_ref);
+        }
+    }
+
+    // Обновление зависимостей в таблице
+    UpdateDependencies(pos, old_references, new_references);
+    UpdateExternalDependencies(pos, old_external_references, cell->GetExternalReferences());
+    UpdateRangeDependencies(pos, old_ranges, cell->GetReferencedRanges());
+    cell->InvalidateCache();
+    MarkSnapshotChange(pos);
+
+    if (edit_log_) {
+        LogOperation({ EditLogOperation::Kind::Set, pos, journal_ ? journal_text : std::move(journal_text) });
+    }
+    if (journal_) {
+        journal_->Record(pos, std::move(old_text), std::move(journal_text));
+    }
+    EnforceFormulaMemoryLimit();
+}
+
+
+const CellInterface* Sheet::GetCell(Position pos) const {
+    if (!IsValidPosition(pos)) {
+        throw InvalidPositionException("Invalid position");
+    }
+    auto it = sheet_.find(pos);
+    return (it != sheet_.end() && it->second) ? it->second.get() : nullptr;
+}
+CellInterface* Sheet::GetCell(Position pos) {
+    if (!IsValidPosition(pos)) {
+        throw InvalidPositionException("Invalid position");
+    }
+    auto it = sheet_.find(pos);
+    return (it != sheet_.end() && it->second) ? it->second.get() : nullptr;
+}
+
+void Sheet::ClearCell(Position pos) {
+    if (!IsValidPosition(pos)) {
+        throw InvalidPositionException("Invalid position");
+    }
+
+    ChangeScope scope(*this);
+    auto it = sheet_.find(pos);
+    if (it != sheet_.end()) {
+        RecordValueChange(pos, *it->second);
+        // очищаем ячейку
+        auto old_references = it->second->GetReferencedCells();
+        auto old_external_references = it->second->GetExternalReferences();
+        auto old_ranges = it->second->GetReferencedRanges();
+        if (journal_ && !it->second->GetTextView().empty()) {
+            journal_->Record(pos, it->second->GetText(), {});
+        }
+        it->second->Clear();
+        UpdateDependencies(pos, old_references, {});
+        UpdateExternalDependencies(pos, old_external_references, {});
+        UpdateRangeDependencies(pos, old_ranges, {});
+        it->second->InvalidateCache();
+        MarkSnapshotChange(pos);
+        LogOperation({ EditLogOperation::Kind::Clear, pos, {} });
+
+        // если на ячейку нет ссылок из других ячеек, удаляем её
+        if (!it->second->HasDependentCells()) {
+            sheet_.erase(it);
+        }
+    }
+}
+
+Size Sheet::GetPrintableSize() const {
+    if (sheet_.empty()) {
+        return { 0, 0 };
+    }
+    int max_row = 0;
+    int max_col = 0;
+    for (const auto& [pos, cell] : sheet_) {
+        if (!cell->GetTextView().empty()) {
+            max_row = std::max(max_row, pos.row + 1);
+            max_col = std::max(max_col, pos.col + 1);
+        }
+    }
+    return { max_row, max_col };
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    Size size = GetPrintableSize();
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            Position pos{ row, col };
+            const CellInterface* cell = GetCell(pos); // ячейка по позиции
+            if (cell) {
+                std::visit([&output](const auto& value) { output << value; }, cell->GetValueView());
+            }
+
+            if (col < size.cols - 1) {
+                output << '\t';  // разделитель табуляции между столбцами
+            }
+        }
+        output << '\n';  // перевод строки после каждой строки таблицы
+    }
+}
+void Sheet::PrintTexts(std::ostream& output) const {
+    Size size = GetPrintableSize();
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            Position pos{ row, col };
+            auto it = sheet_.find(pos); // получаем ячейку по позиции
+            if (it != sheet_.end()) {
+                output << it->second->GetTextView();
+            }
+
+            if (col < size.cols - 1) {
+                output << '\t';  // разделитель табуляции между столбцами
+            }
+        }
+        output << '\n';  // перевод строки после каждой строки таблицы
+    }
+}
+
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return FindExternalSheet(name);
+}
+
+std::optional<int> Sheet::FindInColumn(CellRange column, const LookupValue& value, LookupMode mode) const {
+    int rows = column.last.row - column.first.row + 1;
+    LookupIndex& index = lookup_indexes_.try_emplace(GetLookupKey(column), rows).first->second;
+    return index.Find(value, mode, [this, &column](int row) -> std::optional<LookupValue> {
+        auto it = sheet_.find({ column.first.row + row, column.first.col });
+        if (it == sheet_.end()) {
+            return std::nullopt;
+        }
+        return ToLookupValue(it->second->GetResolvedValueView());
+    });
+}
+
+const std::string& Sheet::GetName() const {
+    return name_;
+}
+
+void Sheet::Recalculate() {
+    // профилировщику нужно время каждой ячейки, поэтому пакеты не собираются
+    if (!batch_evaluation_ || profiler_) {
+        for (const auto& [pos, cell] : sheet_) {
+            if (cell->IsFormula() && !cell->IsCacheValid()) {
+                cell->GetValue();
+            }
+        }
+        EnforceFormulaMemoryLimit();
+        return;
+    }
+
+    // невычисленные формулы по столбцам, внутри столбца по строкам
+    std::vector<std::pair<Position, Cell*>> formulas;
+    for (const auto& [pos, cell] : sheet_) {
+        if (cell->IsFormula() && !cell->IsCacheValid()) {
+            formulas.emplace_back(pos, cell.get());
+        }
+    }
+    std::sort(formulas.begin(), formulas.end(), [](const auto& lhs, const auto& rhs) {
+        return std::pair(lhs.first.col, lhs.first.row) < std::pair(rhs.first.col, rhs.first.row);
+    });
+
+    size_t begin = 0;
+    while (begin < formulas.size()) {
+        auto [pos, first] = formulas[begin];
+        // формула могла вычислиться как зависимость предыдущего пакета
+        if (first->IsCacheValid()) {
+            ++begin;
+            continue;
+        }
+        auto formula = first->GetSharedFormula();
+        const FormulaProgram* program = formula->GetProgram();
+        if (!program) {
+            first->GetValue();
+            ++begin;
+            continue;
+        }
+
+        FormulaBatch batch(pos, *program);
+        size_t end = begin + 1;
+        for (; end < formulas.size(); ++end) {
+            auto [next_pos, cell] = formulas[end];
+            if (!(next_pos == Position{ pos.row + static_cast<int>(end - begin), pos.col }) || cell->IsCacheValid()) {
+                break;
+            }
+            const FormulaProgram* next_program = cell->GetSharedFormula()->GetProgram();
+            if (!next_program || !batch.Matches(next_pos, *next_program)) {
+                break;
+            }
+        }
+
+        int count = static_cast<int>(end - begin);
+        if (count < FormulaBatch::MIN_ROWS || batch.ReferencesOwnRows(count)) {
+            for (size_t i = begin; i < end; ++i) {
+                formulas[i].second->GetValue();
+            }
+        }
+        else {
+            auto values = batch.Evaluate(*this, count);
+            for (int i = 0; i < count; ++i) {
+                formulas[begin + i].second->SetCachedValue(std::move(values[i]));
+            }
+            if (SheetStats* stats = ActiveStats()) {
+                stats->evaluations += count;
+                stats->batched_evaluations += count;
+            }
+        }
+        begin = end;
+    }
+    EnforceFormulaMemoryLimit();
+}
+
+std::vector<Position> Sheet::GetUncalculatedFormulas() const {
+    std::vector<Position> result;
+    for (const auto& [pos, cell] : sheet_) {
+        if (cell->IsFormula() && !cell->IsCacheValid()) {
+            result.push_back(pos);
+        }
+    }
+    return result;
+}
+
+void Sheet::SetInvalidationListener(InvalidationListener listener) {
+    invalidation_listener_ = std::move(listener);
+}
+
+void Sheet::SetBatchEvaluation(bool enabled) {
+    batch_evaluation_ = enabled;
+}
+
+bool Sheet::IsBatchEvaluation() const {
+    return batch_evaluation_;
+}
+
+void Sheet::SetLazyFormulaCompilation(bool enabled) {
+    lazy_formula_compilation_ = enabled;
+}
+
+bool Sheet::IsLazyFormulaCompilation() const {
+    return lazy_formula_compilation_;
+}
+
+size_t Sheet::GetUncompiledFormulaCount() const {
+    return uncompiled_formulas_;
+}
+
+void Sheet::EnableStats(bool enabled) {
+    stats_enabled_ = enabled;
+}
+
+bool Sheet::IsStatsEnabled() const {
+    return stats_enabled_;
+}
+
+const SheetStats& Sheet::GetStats() const {
+    return stats_;
+}
+
+void Sheet::ResetStats() {
+    stats_ = SheetStats{};
+}
+
+void Sheet::StartProfiling(size_t max_trace_events) {
+    profiler_ = std::make_unique<RecalcProfiler>(max_trace_events);
+}
+
+std::unique_ptr<RecalcProfiler> Sheet::StopProfiling() {
+    return std::move(profiler_);
+}
+
+bool Sheet::IsProfiling() const {
+    return profiler_ != nullptr;
+}
+
+void Sheet::SetUndoMemoryLimit(size_t bytes) {
+    if (bytes == 0) {
+        journal_.reset();
+    }
+    else if (journal_) {
+        journal_->SetMemoryLimit(bytes);
+    }
+    else {
+        journal_ = std::make_unique<UndoJournal>(bytes);
+    }
+}
+
+void Sheet::SetEditLog(std::shared_ptr<EditLog> log) {
+    edit_log_ = std::move(log);
+    pending_log_.clear();
+}
+
+std::shared_ptr<EditLog> Sheet::GetEditLog() const {
+    return edit_log_;
+}
+
+void Sheet::LogOperation(EditLogOperation operation) {
+    if (!edit_log_) {
+        return;
+    }
+    pending_log_.push_back(std::move(operation));
+    if (change_depth_ == 0) {
+        FlushEditLog();
+    }
+}
+
+void Sheet::FlushEditLog() {
+    if (edit_log_ && !pending_log_.empty()) {
+        edit_log_->Append(pending_log_);
+    }
+    pending_log_.clear();
+}
+
+const UndoJournal* Sheet::GetUndoJournal() const {
+    return journal_.get();
+}
+
+void Sheet::BeginBatch() {
+    if (journal_) {
+        journal_->BeginBatch();
+    }
+    ++change_depth_;
+}
+
+void Sheet::EndBatch() {
+    if (change_depth_ == 0) {
+        throw std::logic_error("EndBatch without BeginBatch");
+    }
+    // журнал мог быть включён уже внутри пакета
+    if (journal_ && journal_->InBatch()) {
+        journal_->EndBatch();
+    }
+    if (--change_depth_ == 0) {
+        FlushEditLog();
+        FlushChanges();
+    }
+}
+
+bool Sheet::CanUndo() const {
+    return journal_ && journal_->CanUndo();
+}
+
+bool Sheet::CanRedo() const {
+    return journal_ && journal_->CanRedo();
+}
+
+void Sheet::Undo() {
+    ChangeScope scope(*this);
+    if (journal_) {
+        journal_->Undo([this](Position pos, const std::string& text) {
+            ApplyJournalText(pos, text);
+        });
+    }
+}
+
+void Sheet::Redo() {
+    ChangeScope scope(*this);
+    if (journal_) {
+        journal_->Redo([this](Position pos, const std::string& text) {
+            ApplyJournalText(pos, text);
+        });
+    }
+}
+
+void Sheet::ApplyJournalText(Position pos, const std::string& text) {
+    if (text.empty()) {
+        ClearCell(pos);
+    }
+    else {
+        SetCell(pos, text);
+    }
+}
+
+std::shared_ptr<const SheetSnapshot> Sheet::Snapshot() {
+    if (snapshot_ && snapshot_changes_.empty()) {
+        return snapshot_;
+    }
+
+    // копируются только блоки с изменёнными ячейками, остальные общие
+    SheetSnapshot::Tiles tiles = snapshot_ ? snapshot_->GetTiles() : SheetSnapshot::Tiles{};
+    std::unordered_map<uint32_t, std::shared_ptr<SheetSnapshot::Tile>> changed_tiles;
+    auto update = [&](Position pos, const Cell* cell) {
+        uint32_t key = SheetSnapshot::GetTileKey(pos);
+        auto& tile = changed_tiles[key];
+        if (!tile) {
+            auto it = tiles.find(key);
+            tile = it != tiles.end()
+                ? std::make_shared<SheetSnapshot::Tile>(*it->second)
+                : std::make_shared<SheetSnapshot::Tile>();
+        }
+        std::shared_ptr<const SheetSnapshot::Entry> entry;
+        if (cell && !cell->GetTextView().empty()) {
+            entry = std::make_shared<const SheetSnapshot::Entry>(
+                SheetSnapshot::Entry{ cell->GetText(), cell->GetCompiledFormula() });
+        }
+        tile->Set(pos, std::move(entry));
+    };
+
+    if (!snapshot_) {
+        // первый снимок строится из всех ячеек
+        for (const auto& [pos, cell] : sheet_) {
+            update(pos, cell.get());
+        }
+    }
+    for (Position pos : snapshot_changes_) {
+        update(pos, FindCell(pos));
+    }
+    for (auto& [key, tile] : changed_tiles) {
+        if (tile->IsEmpty()) {
+            tiles.erase(key);
+        }
+        else {
+            tiles[key] = std::move(tile);
+        }
+    }
+
+    snapshot_changes_.clear();
+    // прежний снимок мог держать AST, которые теперь можно вытеснить
+    eviction_retry_bytes_ = 0;
+    snapshot_ = std::make_shared<const SheetSnapshot>(std::move(tiles));
+    return snapshot_;
+}
+
+const StringPool& Sheet::GetStringPool() const {
+    return string_pool_;
+}
+
+void Sheet::SetFormulaCacheCapacity(size_t capacity) {
+    formula_cache_.SetCapacity(capacity);
+}
+
+const FormulaCache& Sheet::GetFormulaCache() const {
+    return formula_cache_;
+}
+
+size_t SheetMemoryUsage::GetTotal() const {
+    return cells + text + formulas + dependencies + cached_values + undo_journal + lookup_indexes
+        + formula_cache;
+}
+
+SheetMemoryUsage Sheet::GetMemoryUsage() const {
+    SheetMemoryUsage usage;
+    // узел таблицы позиций хранит пару и указатель на следующий узел
+    usage.cells = sheet_.bucket_count() * sizeof(void*)
+        + sheet_.size() * (sizeof(decltype(sheet_)::value_type) + sizeof(void*));
+    for (const auto& [pos, cell] : sheet_) {
+        cell->AddMemoryUsage(usage);
+    }
+    usage.text = string_pool_.GetAllocatedBytes();
+    // узел списка хранит два указателя, узел дерева - три и цвет
+    usage.dependencies += range_dependents_.size() * (sizeof(RangeDependents) + 2 * sizeof(void*));
+    if (!ranges_by_block_.empty()) {
+        usage.dependencies += ranges_by_block_.bucket_count() * sizeof(void*);
+    }
+    for (const auto& dependents : range_dependents_) {
+        usage.dependencies += dependents.cells.capacity() * sizeof(Position);
+    }
+    for (const auto& [key, ranges] : ranges_by_block_) {
+        usage.dependencies += sizeof(void*) + sizeof(key) + sizeof(ranges) + ranges.capacity() * sizeof(RangeDependents*);
+    }
+    usage.dependencies += wide_ranges_.capacity() * sizeof(RangeDependents*);
+    for (const auto& [key, index] : lookup_indexes_) {
+        usage.lookup_indexes += 4 * sizeof(void*) + sizeof(key) + index.GetAllocatedBytes();
+    }
+    usage.formula_cache = formula_cache_.GetAllocatedBytes();
+    if (journal_) {
+        usage.undo_journal = journal_->GetMemoryUsage();
+    }
+    return usage;
+}
+
+void Sheet::SetFormulaMemoryLimit(size_t bytes) {
+    formula_memory_limit_ = bytes;
+    eviction_retry_bytes_ = 0;
+    EnforceFormulaMemoryLimit();
+}
+
+size_t Sheet::GetFormulaMemoryLimit() const {
+    return formula_memory_limit_;
+}
+
+size_t Sheet::GetCompiledFormulaBytes() const {
+    return compiled_formula_bytes_;
+}
+
+void Sheet::InsertRows(int before, int count) {
+    if (before < 0 || before >= Position::MAX_ROWS || count < 0) {
+        throw InvalidPositionException("Invalid row range");
+    }
+    // сравнение записано так, чтобы большое count не переполняло int
+    for (Position pos : GetShiftablePositions()) {
+        if (pos.row >= before && count >= Position::MAX_ROWS - pos.row) {
+            throw TableTooBigException("Too many rows");
+        }
+    }
+    // за пределы таблицы уходят только пустые строки
+    count = std::min(count, Position::MAX_ROWS - before);
+    // изменения подписчиков, сделанные при уведомлении, идут в журнал после сдвига
+    ChangeScope scope(*this);
+    ShiftCells(
+        [before, count](Position pos) {
+            if (pos.row >= before) {
+                pos.row += count;
+            }
+            return pos;
+        },
+        [before, count](FormulaInterface& formula, std::string_view sheet) {
+            return formula.HandleInsertedRows(before, count, sheet);
+        });
+    LogOperation({ EditLogOperation::Kind::InsertRows, {}, {}, before, count });
+}
+
+void Sheet::InsertCols(int before, int count) {
+    if (before < 0 || before >= Position::MAX_COLS || count < 0) {
+        throw InvalidPositionException("Invalid column range");
+    }
+    for (Position pos : GetShiftablePositions()) {
+        if (pos.col >= before && count >= Position::MAX_COLS - pos.col) {
+            throw TableTooBigException("Too many columns");
+        }
+    }
+    count = std::min(count, Position::MAX_COLS - before);
+    ChangeScope scope(*this);
+    ShiftCells(
+        [before, count](Position pos) {
+            if (pos.col >= before) {
+                pos.col += count;
+            }
+            return pos;
+        },
+        [before, count](FormulaInterface& formula, std::string_view sheet) {
+            return formula.HandleInsertedCols(before, count, sheet);
+        });
+    LogOperation({ EditLogOperation::Kind::InsertCols, {}, {}, before, count });
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    if (first < 0 || first >= Position::MAX_ROWS || count < 0) {
+        throw InvalidPositionException("Invalid row range");
+    }
+    count = std::min(count, Position::MAX_ROWS - first);
+    ChangeScope scope(*this);
+    ShiftCells(
+        [first, count](Position pos) {
+            if (pos.row >= first + count) {
+                pos.row -= count;
+            }
+            else if (pos.row >= first) {
+                pos = Position::NONE;
+            }
+            return pos;
+        },
+        [first, count](FormulaInterface& formula, std::string_view sheet) {
+            return formula.HandleDeletedRows(first, count, sheet);
+        });
+    LogOperation({ EditLogOperation::Kind::DeleteRows, {}, {}, first, count });
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    if (first < 0 || first >= Position::MAX_COLS || count < 0) {
+        throw InvalidPositionException("Invalid column range");
+    }
+    count = std::min(count, Position::MAX_COLS - first);
+    ChangeScope scope(*this);
+    ShiftCells(
+        [first, count](Position pos) {
+            if (pos.col >= first + count) {
+                pos.col -= count;
+            }
+            else if (pos.col >= first) {
+                pos = Position::NONE;
+            }
+            return pos;
+        },
+        [first, count](FormulaInterface& formula, std::string_view sheet) {
+            return formula.HandleDeletedCols(first, count, sheet);
+        });
+    LogOperation({ EditLogOperation::Kind::DeleteCols, {}, {}, first, count });
+}
+
+std::vector<Position> Sheet::GetShiftablePositions() const {
+    // на ячейки этого листа с других листов могут ссылаться и там, где
+    // самих ячеек нет
+    std::vector<Position> positions;
+    positions.reserve(sheet_.size());
+    for (const auto& [pos, cell] : sheet_) {
+        positions.push_back(pos);
+    }
+    if (external_dependents_) {
+        for (const auto& [pos, dependents] : *external_dependents_) {
+            positions.push_back(pos);
+        }
+    }
+    return positions;
+}
+
+void Sheet::ShiftCells(const std::function<Position(Position)>& remap, const ShiftHandler& handle) {
+    ChangeScope scope(*this);
+    // ячейки, которые сдвигаются или удаляются
+    std::vector<std::pair<Position, Position>> moves;
+    for (const auto& [pos, cell] : sheet_) {
+        Position moved = remap(pos);
+        if (!(moved == pos)) {
+            moves.emplace_back(pos, moved);
+        }
+    }
+    bool external_moves = false;
+    if (external_dependents_) {
+        for (const auto& [pos, dependents] : *external_dependents_) {
+            external_moves = external_moves || !(remap(pos) == pos);
+        }
+    }
+    // области сдвигаются, даже если в них нет ни одной ячейки
+    std::vector<Position> range_formulas;
+    for (const auto& [range, cells] : range_dependents_) {
+        if (!(remap(range.first) == range.first) || !(remap(range.last) == range.last)) {
+            range_formulas.insert(range_formulas.end(), cells.begin(), cells.end());
+        }
+    }
+    if (moves.empty() && !external_moves && range_formulas.empty()) {
+        return;
+    }
+
+    // Затронуты только формулы, ссылающиеся на сдвинутые ячейки или
+    // сдвинутые области, и списки зависимых у ячеек, на которые ссылаются
+    // сдвинутые формулы
+    std::unordered_set<Position> formulas(range_formulas.begin(), range_formulas.end());
+    std::unordered_set<Position> referenced;
+    for (const auto& [pos, moved] : moves) {
+        const Cell* cell = FindCell(pos);
+        const auto& dependents = cell->GetDependentCells();
+        formulas.insert(dependents.begin(), dependents.end());
+        for (Position ref : cell->GetReferencedCells()) {
+            referenced.insert(ref);
+        }
+        referenced.insert(pos);
+    }
+
+    // ссылки переписываются, пока ячейки на старых местах
+    std::vector<Position> rewritten;
+    std::vector<Position> recalculate;
+    auto local_handle = [&handle](FormulaInterface& formula) {
+        return handle(formula, {});
+    };
+    for (Position pos : formulas) {
+        Position moved = remap(pos);
+        Cell* cell = FindCell(pos);
+        if (!cell || !moved.IsValid()) {
+            continue;
+        }
+        auto result = cell->HandleStructureChange(local_handle);
+        if (result != FormulaInterface::HandlingResult::NothingChanged) {
+            rewritten.push_back(moved);
+        }
+        if (result == FormulaInterface::HandlingResult::ReferencesChanged) {
+            recalculate.push_back(moved);
+        }
+    }
+    for (Position pos : referenced) {
+        if (Cell* cell = FindCell(pos)) {
+            cell->RemapDependentCells(remap);
+        }
+    }
+
+    // Формулы других листов переписываются по рёбрам книги. Удаляемые ячейки
+    // этого листа, ссылающиеся на него по имени, тоже переписываются, чтобы
+    // их ссылки совпали с рёбрами после сдвига.
+    std::vector<std::pair<ExternalDependent, FormulaInterface::HandlingResult>> external_rewritten;
+    if (external_moves) {
+        auto external_handle = [this, &handle](FormulaInterface& formula) {
+            return handle(formula, name_);
+        };
+        std::unordered_map<Sheet*, std::unordered_set<Position>> dependents;
+        for (const auto& [pos, cell_dependents] : *external_dependents_) {
+            if (!(remap(pos) == pos)) {
+                for (const auto& [sheet, dependent] : cell_dependents) {
+                    dependents[sheet].insert(dependent);
+                }
+            }
+        }
+        for (const auto& [sheet, positions] : dependents) {
+            for (Position pos : positions) {
+                Cell* cell = sheet->FindCell(pos);
+                auto result = cell ? cell->HandleStructureChange(external_handle)
+                    : FormulaInterface::HandlingResult::NothingChanged;
+                if (result != FormulaInterface::HandlingResult::NothingChanged) {
+                    external_rewritten.push_back({ { sheet, pos }, result });
+                }
+            }
+        }
+        ExternalDependents shifted;
+        for (auto& [pos, cell_dependents] : *external_dependents_) {
+            Position moved = remap(pos);
+            if (moved.IsValid()) {
+                shifted[moved] = std::move(cell_dependents);
+            }
+        }
+        *external_dependents_ = std::move(shifted);
+    }
+    // рёбра сдвинутых формул со ссылками на другие листы
+    for (const auto& [pos, moved] : moves) {
+        for (const ExternalReference& ref : FindCell(pos)->GetExternalReferences()) {
+            RemoveExternalDependency(ref, pos);
+            if (moved.IsValid()) {
+                AddExternalDependency(ref, moved);
+            }
+        }
+    }
+
+    // узлы переносятся без перевыделения; сначала извлекаются все, чтобы
+    // новые позиции не столкнулись со старыми
+    std::vector<decltype(sheet_)::node_type> nodes;
+    nodes.reserve(moves.size());
+    for (const auto& [pos, moved] : moves) {
+        auto node = sheet_.extract(pos);
+        if (moved.IsValid()) {
+            node.mapped()->Relocate(moved);
+            node.key() = moved;
+            nodes.push_back(std::move(node));
+        }
+    }
+    for (auto& node : nodes) {
+        sheet_.insert(std::move(node));
+    }
+
+    // пустые ячейки, на которые ссылались только удалённые формулы, не нужны
+    for (Position pos : referenced) {
+        Position moved = remap(pos);
+        if (!moved.IsValid()) {
+            continue;
+        }
+        auto it = sheet_.find(moved);
+        if (it != sheet_.end() && it->second->GetTextView().empty() && !it->second->HasDependentCells()) {
+            sheet_.erase(it);
+        }
+    }
+
+    // индексы поиска хранят номера строк, проще построить их заново
+    lookup_indexes_.clear();
+    if (!range_dependents_.empty()) {
+        RebuildRangeDependencies();
+    }
+
+    for (Position pos : recalculate) {
+        if (Cell* cell = FindCell(pos)) {
+            cell->InvalidateCache();
+        }
+    }
+
+    for (const auto& [pos, moved] : moves) {
+        MarkSnapshotChange(pos);
+        if (moved.IsValid()) {
+            MarkSnapshotChange(moved);
+        }
+    }
+    for (Position pos : rewritten) {
+        MarkSnapshotChange(pos);
+    }
+    // позиции в журнале отмены больше не соответствуют таблице
+    if (journal_) {
+        journal_->Clear();
+    }
+
+    for (auto [dependent, result] : external_rewritten) {
+        Sheet* sheet = dependent.sheet;
+        if (sheet == this) {
+            dependent.pos = remap(dependent.pos);
+        }
+        Cell* cell = dependent.pos.IsValid() ? sheet->FindCell(dependent.pos) : nullptr;
+        if (!cell) {
+            continue;
+        }
+        if (result == FormulaInterface::HandlingResult::ReferencesChanged) {
+            // прежнее значение уже сброшено, поэтому ячейка сообщается как изменённая
+            sheet->RecordValueChange(dependent.pos, *cell);
+            cell->InvalidateCache();
+        }
+        sheet->MarkSnapshotChange(dependent.pos);
+        if (sheet->journal_) {
+            sheet->journal_->Clear();
+        }
+    }
+
+    // позиции изменённых ячеек этого листа устарели, подписчики перечитывают области
+    if (!subscriptions_.empty()) {
+        pending_changes_.clear();
+        structure_changed_ = true;
+    }
+}
+
+void Sheet::ReadRange(CellRange range, RangeValues& out) {
+    if (!range.first.IsValid() || !range.last.IsValid()
+        || range.last.row < range.first.row || range.last.col < range.first.col) {
+        throw InvalidPositionException("Invalid range");
+    }
+    out.rows = range.last.row - range.first.row + 1;
+    out.cols = range.last.col - range.first.col + 1;
+    const size_t area = static_cast<size_t>(out.rows) * out.cols;
+    // assign не выделяет память, если размер не превышает прежней ёмкости
+    out.values.assign(area, RangeValues::Value{});
+
+    ForEachCellInRange(range, [&range, &out](Position pos, const Cell& cell) {
+        cell.ReadValue(out.values[static_cast<size_t>(pos.row - range.first.row) * out.cols + pos.col - range.first.col]);
+    });
+}
+
+Sheet::SubscriptionId Sheet::Subscribe(CellRange region, ChangeCallback callback) {
+    if (!region.first.IsValid() || !region.last.IsValid()
+        || region.last.row < region.first.row || region.last.col < region.first.col) {
+        throw InvalidPositionException("Invalid subscription region");
+    }
+    SubscriptionId id = next_subscription_id_++;
+    subscriptions_.push_back({ id, region, std::move(callback) });
+    return id;
+}
+
+void Sheet::Unsubscribe(SubscriptionId id) {
+    subscriptions_.erase(std::remove_if(subscriptions_.begin(), subscriptions_.end(),
+        [id](const Subscription& subscription) { return subscription.id == id; }), subscriptions_.end());
+    if (subscriptions_.empty()) {
+        pending_changes_.clear();
+        structure_changed_ = false;
+    }
+}
+
+void Sheet::RecordSubscribedChange(Position pos, const Cell& cell) {
+    // запоминается значение до первого изменения за операцию
+    if (!pending_changes_.count(pos)) {
+        pending_changes_.emplace(pos, cell.GetCachedValue());
+    }
+}
+
+void Sheet::FlushAllChanges() {
+    FlushOwnChanges();
+    // формулы других листов книги, сброшенные этой операцией
+    if (workbook_) {
+        for (const auto& [name, sheet] : workbook_->sheets_) {
+            if (sheet.get() != this && sheet->change_depth_ == 0) {
+                sheet->FlushOwnChanges();
+            }
+        }
+    }
+}
+
+void Sheet::FlushOwnChanges() {
+    if (pending_changes_.empty() && !structure_changed_) {
+        return;
+    }
+    auto pending = std::move(pending_changes_);
+    pending_changes_.clear();
+    bool structure_changed = std::exchange(structure_changed_, false);
+
+    auto is_subscribed = [this](Position pos) {
+        return std::any_of(subscriptions_.begin(), subscriptions_.end(), [pos](const Subscription& subscription) {
+            return subscription.region.Contains(pos);
+        });
+    };
+    // новые значения вычисляются только в подписанных областях
+    std::vector<Position> changed;
+    for (const auto& [pos, old_value] : pending) {
+        if (!is_subscribed(pos)) {
+            continue;
+        }
+        const Cell* cell = FindCell(pos);
+        CellInterface::Value value = cell ? cell->GetValue() : CellInterface::Value{};
+        if (!old_value || !(*old_value == value)) {
+            changed.push_back(pos);
+        }
+    }
+    std::sort(changed.begin(), changed.end());
+
+    // обработчик может отписаться или изменить лист
+    std::vector<std::pair<SubscriptionId, CellRange>> recipients;
+    for (const auto& subscription : subscriptions_) {
+        recipients.emplace_back(subscription.id, subscription.region);
+    }
+    for (const auto& [id, region] : recipients) {
+        Changes changes;
+        changes.structure_changed = structure_changed;
+        for (Position pos : changed) {
+            if (region.Contains(pos)) {
+                changes.cells.push_back(pos);
+            }
+        }
+        if (changes.cells.empty() && !structure_changed) {
+            continue;
+        }
+        auto it = std::find_if(subscriptions_.begin(), subscriptions_.end(), [id = id](const Subscription& subscription) {
+            return subscription.id == id;
+        });
+        if (it != subscriptions_.end()) {
+            // копия: обработчик может удалить свою подписку
+            ChangeCallback callback = it->callback;
+            callback(changes);
+        }
+    }
+}
+
+void Sheet::EnforceFormulaMemoryLimit() {
+    // AST, общее для ячейки и кэша разобранных формул, учитывается у обоих
+    auto used = [this] {
+        return compiled_formula_bytes_ + formula_cache_.GetFormulaBytes();
+    };
+    if (used() <= formula_memory_limit_ || used() <= eviction_retry_bytes_) {
+        return;
+    }
+    if (SheetStats* stats = ActiveStats()) {
+        ++stats->eviction_passes;
+    }
+    const size_t target = formula_memory_limit_ / 4 * 3;
+    // первыми забываются формулы, которые держит только кэш
+    formula_cache_.ReleaseUnshared(used() - target);
+    // затем вытесняются формулы, к AST которых дольше всего не обращались
+    auto it = compiled_formulas_.end();
+    while (it != compiled_formulas_.begin() && used() > target) {
+        // вытесненная ячейка сама уходит из очереди
+        auto cell = std::prev(it);
+        if (!(*cell)->EvictFormula()) {
+            it = cell;
+        }
+    }
+    eviction_retry_bytes_ = used() > target ? used() + formula_memory_limit_ / 4 : 0;
+}
+
+void Sheet::MarkSnapshotChange(Position pos) {
+    if (snapshot_) {
+        snapshot_changes_.insert(pos);
+    }
+}
+
+bool Sheet::IsValidPosition(const Position& pos) const {
+    return pos.IsValid();
+}
+
+Cell* Sheet::FindCell(Position pos) {
+    auto it = sheet_.find(pos);
+    return it != sheet_.end() ? it->second.get() : nullptr;
+}
+
+Sheet* Sheet::FindExternalSheet(std::string_view name) const {
+    return workbook_ ? workbook_->GetSheet(name) : nullptr;
+}
+
+Cell* Sheet::FindExternalCell(const ExternalReference& ref) const {
+    Sheet* sheet = FindExternalSheet(ref.sheet);
+    return sheet && ref.pos.IsValid() ? sheet->FindCell(ref.pos) : nullptr;
+}
+
+bool Sheet::HasExternalDependents() const {
+    return external_dependents_ && !external_dependents_->empty();
+}
+
+const std::vector<ExternalDependent>* Sheet::FindExternalDependents(Position pos) const {
+    if (!HasExternalDependents()) {
+        return nullptr;
+    }
+    auto it = external_dependents_->find(pos);
+    return it != external_dependents_->end() ? &it->second : nullptr;
+}
+
+void Sheet::AddExternalDependency(const ExternalReference& ref, Position pos) {
+    if (workbook_) {
+        workbook_->GetExternalDependents(ref.sheet)[ref.pos].push_back({ this, pos });
+    }
+}
+
+void Sheet::RemoveExternalDependency(const ExternalReference& ref, Position pos) {
+    if (!workbook_) {
+        return;
+    }
+    ExternalDependents& dependents = workbook_->GetExternalDependents(ref.sheet);
+    auto it = dependents.find(ref.pos);
+    if (it == dependents.end()) {
+        return;
+    }
+    auto& cells = it->second;
+    auto cell = std::find_if(cells.begin(), cells.end(), [this, pos](const ExternalDependent& dependent) {
+        return dependent.sheet == this && dependent.pos == pos;
+    });
+    if (cell != cells.end()) {
+        cells.erase(cell);
+    }
+    if (cells.empty()) {
+        dependents.erase(it);
+    }
+}
+
+void Sheet::UpdateExternalDependencies(Position pos, const std::vector<ExternalReference>& old_refs,
+    const std::vector<ExternalReference>& new_refs) {
+    // оба списка отсортированы
+    for (const auto& ref : old_refs) {
+        if (!std::binary_search(new_refs.begin(), new_refs.end(), ref)) {
+            RemoveExternalDependency(ref, pos);
+        }
+    }
+    for (const auto& ref : new_refs) {
+        if (!std::binary_search(old_refs.begin(), old_refs.end(), ref)) {
+            AddExternalDependency(ref, pos);
+        }
+    }
+}
+
+void Sheet::InvalidateExternalDependents() {
+    if (!HasExternalDependents()) {
+        return;
+    }
+    for (const auto& [pos, dependents] : *external_dependents_) {
+        for (const auto& [sheet, dependent] : dependents) {
+            if (Cell* cell = sheet->FindCell(dependent)) {
+                cell->InvalidateCache();
+            }
+        }
+    }
+}
+
+uint64_t Sheet::GetLookupKey(CellRange column) {
+    // номера строк и столбцов меньше 2^16
+    return (static_cast<uint64_t>(column.first.col) << 32) | (static_cast<uint64_t>(column.first.row) << 16)
+        | static_cast<uint64_t>(column.last.row);
+}
+
+void Sheet::MarkLookupChange(Position pos) {
+    // индексы столбца ячейки, начинающиеся не ниже её строки
+    auto it = lookup_indexes_.lower_bound(GetLookupKey({ { 0, pos.col }, { 0, pos.col } }));
+    auto end = lookup_indexes_.lower_bound(GetLookupKey({ { pos.row + 1, pos.col }, { 0, pos.col } }));
+    for (; it != end; ++it) {
+        int first_row = static_cast<int>((it->first >> 16) & 0xFFFF);
+        int last_row = static_cast<int>(it->first & 0xFFFF);
+        if (pos.row <= last_row) {
+            it->second.MarkChanged(pos.row - first_row);
+        }
+    }
+}
+
+void Sheet::UpdateRangeDependencies(Position pos, const std::vector<CellRange>& old_ranges,
+    const std::vector<CellRange>& new_ranges) {
+    auto find = [this](const CellRange& range) -> RangeDependents* {
+        const std::vector<RangeDependents*>* ranges = FindRangeList(range);
+        if (!ranges) {
+            return nullptr;
+        }
+        auto it = std::find_if(ranges->begin(), ranges->end(),
+            [&range](const RangeDependents* dependents) { return dependents->range == range; });
+        return it != ranges->end() ? *it : nullptr;
+    };
+    // обходит ключи блоков, которые задевает небольшая область
+    auto for_each_block = [](const CellRange& range, auto visit) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            for (int row = range.first.row / RANGE_BLOCK_ROWS; row <= range.last.row / RANGE_BLOCK_ROWS; ++row) {
+                visit(GetRangeBlockKey({ row * RANGE_BLOCK_ROWS, col }));
+            }
+        }
+    };
+    for (const CellRange& range : old_ranges) {
+        RangeDependents* dependents = find(range);
+        if (!dependents) {
+            continue;
+        }
+        auto& cells = dependents->cells;
+        cells.erase(std::remove(cells.begin(), cells.end(), pos), cells.end());
+        if (!cells.empty()) {
+            continue;
+        }
+        // индекс первого столбца области больше не нужен
+        lookup_indexes_.erase(GetLookupKey({ range.first, { range.last.row, range.first.col } }));
+        if (IsWideRange(range)) {
+            wide_ranges_.erase(std::find(wide_ranges_.begin(), wide_ranges_.end(), dependents));
+        }
+        else {
+            for_each_block(range, [this, dependents](uint32_t key) {
+                auto block = ranges_by_block_.find(key);
+                auto& ranges = block->second;
+                ranges.erase(std::find(ranges.begin(), ranges.end(), dependents));
+                if (ranges.empty()) {
+                    ranges_by_block_.erase(block);
+                }
+            });
+        }
+        range_dependents_.remove_if([dependents](const RangeDependents& item) { return &item == dependents; });
+    }
+    for (const CellRange& range : new_ranges) {
+        RangeDependents* dependents = find(range);
+        if (!dependents) {
+            dependents = &range_dependents_.emplace_back(RangeDependents{ range, {} });
+            if (IsWideRange(range)) {
+                wide_ranges_.push_back(dependents);
+            }
+            else {
+                for_each_block(range, [this, dependents](uint32_t key) {
+                    ranges_by_block_[key].push_back(dependents);
+                });
+            }
+        }
+        dependents->cells.push_back(pos);
+    }
+}
+
+void Sheet::RebuildRangeDependencies() {
+    range_dependents_.clear();
+    ranges_by_block_.clear();
+    wide_ranges_.clear();
+    for (const auto& [pos, cell] : sheet_) {
+        UpdateRangeDependencies(pos, {}, cell->GetReferencedRanges());
+    }
+}
+
+bool Sheet::IsWideRange(const CellRange& range) {
+    if (!range.first.IsValid() || !range.last.IsValid()) {
+        return true;
+    }
+    const int64_t blocks = range.last.row / RANGE_BLOCK_ROWS - range.first.row / RANGE_BLOCK_ROWS + 1;
+    return blocks * (range.last.col - range.first.col + 1) > MAX_RANGE_BLOCKS;
+}
+
+const std::vector<Sheet::RangeDependents*>* Sheet::FindRangeList(const CellRange& range) const {
+    if (IsWideRange(range)) {
+        return &wide_ranges_;
+    }
+    auto it = ranges_by_block_.find(GetRangeBlockKey(range.first));
+    return it != ranges_by_block_.end() ? &it->second : nullptr;
+}
+
+bool Sheet::HasRangeDependents(Position pos) const {
+    bool found = false;
+    ForEachRangeDependents(pos, [&found](const std::vector<Position>&) {
+        found = true;
+    });
+    return found;
+}
+
+Cell* Sheet::CreateCell(Position pos) {
+    auto& cell = sheet_[pos];
+    cell = std::make_unique<Cell>(*this, pos);
+    if (SheetStats* stats = ActiveStats()) {
+        ++stats->cells_allocated;
+        stats->bytes_allocated += sizeof(Cell);
+    }
+    return cell.get();
+}
+
+std::unique_ptr<SheetInterface> CreateSheet() {
+    return std::make_unique<Sheet>();
+}
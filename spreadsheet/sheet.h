@@ -1,32 +1,423 @@
-﻿#pragma once
-
-#include "cell.h"
-#include "common.h"
-
-#include <functional>
-
-class Sheet : public SheetInterface {
-public:
-    ~Sheet();
-
-    void SetCell(Position pos, std::string text) override;
-
-    const CellInterface* GetCell(Position pos) const override;
-    CellInterface* GetCell(Position pos) override;
-
-    void ClearCell(Position pos) override;
-
-    Size GetPrintableSize() const override;
-
-    void PrintValues(std::ostream& output) const override;
-    void PrintTexts(std::ostream& output) const override;
-    void UpdateDependencies(Position pos, const std::vector<Position>& old_refs, const std::vector<Position>& new_refs);
-
-    void AddDependency(Position from, Position to);
-    void RemoveDependency(Position from, Position to);
-
-private:
-    std::unordered_map<Position, std::unique_ptr<Cell>> sheet_;
-
-    bool IsValidPosition(const Position& pos) const;
+﻿#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "edit_log.h"
+#include "formula_cache.h"
+#include "journal.h"
+#include "lookup_index.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "string_pool.h"
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <list>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class Sheet;
+class Workbook;
+
+// Ячейка другого листа, зависящая от ячейки этого листа
+struct ExternalDependent {
+    Sheet* sheet;
+    Position pos;
+};
+// Межлистовые рёбра графа зависимостей: позиция ячейки листа -> ячейки
+// других листов, которые на неё ссылаются
+using ExternalDependents = std::unordered_map<Position, std::vector<ExternalDependent>>;
+
+// Счётчики работы движка. Собираются только после Sheet::EnableStats(true),
+// в выключенном состоянии каждая точка подсчёта стоит одной проверки указателя.
+struct SheetStats {
+    uint64_t formulas_parsed = 0;          // успешно разобранных формул
+    uint64_t parse_time_ns = 0;            // суммарное время разбора, включая неудачные
+    uint64_t evaluations = 0;              // вычислений формул (промахи кэша)
+    uint64_t batched_evaluations = 0;      // из них формул, вычисленных пакетно
+    uint64_t cache_hits = 0;               // значений формул, взятых из кэша
+    uint64_t invalidations = 0;            // изменений ячеек, запустивших сброс кэшей
+    uint64_t invalidated_cells = 0;        // сброшенных кэшей зависимых ячеек
+    uint64_t max_invalidation_fanout = 0;  // наибольшее число сброшенных кэшей за одно изменение
+    uint64_t cycle_check_nodes = 0;        // ячеек, посещённых при проверке циклов
+    uint64_t cells_allocated = 0;          // созданных объектов Cell
+    uint64_t bytes_allocated = 0;          // приблизительный объём памяти под ячейки и их содержимое
+    uint64_t formulas_evicted = 0;         // формул, AST которых вытеснено по лимиту памяти
+    uint64_t eviction_passes = 0;          // обходов очереди вытеснения по лимиту памяти
+};
+
+// Приблизительный объём памяти листа в байтах по составляющим
+struct SheetMemoryUsage {
+    size_t cells = 0;          // объекты ячеек и таблица позиций
+    size_t text = 0;           // пул текстов ячеек
+    size_t formulas = 0;       // AST, программы и тексты формул
+    size_t dependencies = 0;   // списки ссылок и зависимых ячеек
+    size_t cached_values = 0;  // значения формул
+    size_t undo_journal = 0;   // журнал отмены
+    size_t lookup_indexes = 0; // индексы столбцов для функций поиска
+    size_t formula_cache = 0;  // кэш разобранных формул
+
+    size_t GetTotal() const;
+};
+
+class Sheet : public SheetInterface {
+public:
+    ~Sheet();
+
+    void SetCell(Position pos, std::string text) override;
+    // То же с формулой, уже разобранной из text без знака "=" (например в
+    // другом потоке): лист не разбирает её заново и запоминает в кэше
+    // формул. При nullptr или тексте без формулы работает как SetCell.
+    void SetCell(Position pos, std::string text, std::shared_ptr<FormulaInterface> parsed_formula);
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    // Значения области range в out за один проход. Невычисленные формулы
+    // вычисляются. Бросает InvalidPositionException для некорректной области.
+    void ReadRange(CellRange range, RangeValues& out);
+
+    const SheetInterface* FindSheet(std::string_view name) const override;
+    // Поиск по индексу столбца: индекс строится при первом поиске в области
+    // и обновляется только по строкам, изменившимся с прошлого поиска.
+    // Вставка и удаление строк и столбцов сбрасывают все индексы.
+    std::optional<int> FindInColumn(CellRange column, const LookupValue& value, LookupMode mode) const override;
+    // имя листа в книге, пустое у отдельной таблицы
+    const std::string& GetName() const;
+    // Вычисляет все формулы листа, значения остаются в кэше. Формулы одной
+    // формы, заполненные вниз по столбцу, вычисляются пакетами (FormulaBatch),
+    // если пакетное вычисление включено (по умолчанию) и профилировщик выключен.
+    void Recalculate();
+    void SetBatchEvaluation(bool enabled);
+    bool IsBatchEvaluation() const;
+    // формулы, значение которых не вычислено или сброшено
+    std::vector<Position> GetUncalculatedFormulas() const;
+
+    // Наблюдатель сброса кэшей: вызывается для изменённой ячейки и для каждой
+    // ячейки, кэш которой сброшен из-за изменения. Пустая функция отключает
+    // наблюдение.
+    using InvalidationListener = std::function<void(Position)>;
+    void SetInvalidationListener(InvalidationListener listener);
+
+    void UpdateDependencies(Position pos, const std::vector<Position>& old_refs, const std::vector<Position>& new_refs);
+
+    void AddDependency(Position from, Position to);
+    void RemoveDependency(Position from, Position to);
+
+    // Режим ленивой компиляции формул: при установке формулы выполняется только
+    // быстрое сканирование ссылок, а AST строится при первом обращении к
+    // значению ячейки. До компиляции GetText возвращает текст формулы в том
+    // виде, в каком он был задан, а снимок хранит формулу без AST. Действует
+    // на формулы, заданные после включения.
+    void SetLazyFormulaCompilation(bool enabled);
+    bool IsLazyFormulaCompilation() const;
+
+    // Количество формул без AST: ещё не компилировавшихся в ленивом режиме
+    // и вытесненных по лимиту памяти
+    size_t GetUncompiledFormulaCount() const;
+
+    // Статистика работы движка
+    void EnableStats(bool enabled);
+    bool IsStatsEnabled() const;
+    const SheetStats& GetStats() const;
+    void ResetStats();
+
+    // Профилирование пересчёта: StartProfiling начинает запись с чистого
+    // листа, StopProfiling завершает её и отдаёт собранный профиль.
+    void StartProfiling(size_t max_trace_events = 1'000'000);
+    std::unique_ptr<RecalcProfiler> StopProfiling();
+    bool IsProfiling() const;
+
+    // Отмена и повтор изменений. Журнал включается ненулевым лимитом памяти в
+    // байтах, при превышении лимита забываются самые старые операции.
+    void SetUndoMemoryLimit(size_t bytes);
+    const UndoJournal* GetUndoJournal() const;
+    // Изменения между BeginBatch и EndBatch составляют одну операцию для
+    // журнала отмены и для подписчиков. EndBatch без BeginBatch бросает
+    // std::logic_error.
+    void BeginBatch();
+    void EndBatch();
+    bool CanUndo() const;
+    bool CanRedo() const;
+    void Undo();
+    void Redo();
+
+    // Журнал изменений для восстановления после сбоя. Каждая успешная
+    // операция листа дописывается в журнал одной записью, Commit журнала
+    // вызывает тот, кто меняет лист. Лист владеет журналом совместно с
+    // вызывающими Commit, поэтому журнал можно заменить или отключить
+    // (nullptr), пока другие потоки его синхронизируют.
+    void SetEditLog(std::shared_ptr<EditLog> log);
+    std::shared_ptr<EditLog> GetEditLog() const;
+
+    // Неизменяемый снимок текущего содержимого для чтения из других потоков.
+    // Первый вызов копирует все ячейки, каждый следующий - только блоки с
+    // ячейками, изменёнными после предыдущего снимка. Без изменений
+    // возвращается тот же снимок.
+    std::shared_ptr<const SheetSnapshot> Snapshot();
+
+    // Пул текстов ячеек: одинаковые тексты хранятся один раз
+    const StringPool& GetStringPool() const;
+
+    // Кэш разобранных формул: формула с уже встречавшимся текстом не
+    // разбирается заново и разделяет AST с другими ячейками. Нулевая
+    // ёмкость отключает кэш.
+    void SetFormulaCacheCapacity(size_t capacity);
+    const FormulaCache& GetFormulaCache() const;
+
+    // Объём памяти листа по составляющим, считается обходом всех ячеек
+    SheetMemoryUsage GetMemoryUsage() const;
+
+    // Лимит памяти под скомпилированные формулы в байтах. При превышении
+    // после изменения ячейки или пересчёта у давно не вычислявшихся формул
+    // освобождаются AST и программа, а значение и текст ячейки остаются;
+    // формула компилируется заново при следующем вычислении. Вытесняется
+    // до 3/4 лимита, чтобы следующий обход случился не сразу. Формулы,
+    // разделяемые со снимком (в том числе с последним снимком, который лист
+    // хранит для следующего) или с другими ячейками, не вытесняются. AST в
+    // кэше разобранных формул входят в лимит: первыми забываются формулы,
+    // которые держит только кэш, а запись вытесненной формулы удаляется
+    // из кэша вместе с её AST. Если из-за разделяемых формул вытеснить до
+    // 3/4 лимита не удалось, следующая попытка откладывается, пока объём
+    // формул не вырастет ещё на четверть лимита или не будет построен новый
+    // снимок. По умолчанию лимита нет.
+    void SetFormulaMemoryLimit(size_t bytes);
+    size_t GetFormulaMemoryLimit() const;
+    // объём скомпилированных формул ячеек (без кэша) по оценке на момент компиляции
+    size_t GetCompiledFormulaBytes() const;
+
+    // Вставка и удаление строк и столбцов. Ячейки сдвигаются вместе с
+    // зависимостями, ссылки в формулах переписываются без повторного разбора,
+    // ссылки на удалённые ячейки превращаются в ошибку #REF!. Если после
+    // вставки ячейки вышли бы за пределы таблицы, бросается
+    // TableTooBigException и таблица не меняется. Журнал отмены очищается.
+    void InsertRows(int before, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    // Подписка на изменения значений. После каждой операции (изменения или
+    // очистки ячейки, отмены, повтора, пакета BeginBatch/EndBatch) подписчик
+    // получает ячейки своей области, значение которых стало другим. Ячейки,
+    // пересчитанные в прежнее значение, не сообщаются. Об изменениях
+    // сообщается только для значений, которые были известны до операции:
+    // у изменённой ячейки и у формул, значения которых вычислялись. Формулы
+    // области, зависящие от изменённых ячеек, вычисляются при уведомлении.
+    // Для недопустимой или перевёрнутой области Subscribe бросает
+    // InvalidPositionException.
+    struct Changes {
+        std::vector<Position> cells;     // по возрастанию позиций
+        bool structure_changed = false;  // строки или столбцы вставлены или удалены, область нужно перечитать
+    };
+    using ChangeCallback = std::function<void(const Changes&)>;
+    using SubscriptionId = uint64_t;
+
+    SubscriptionId Subscribe(CellRange region, ChangeCallback callback);
+    void Unsubscribe(SubscriptionId id);
+
+private:
+    friend class Cell;
+    friend class Workbook;
+
+    // Изменения внутри области действия объекта сообщаются подписчикам одним
+    // уведомлением, когда закрывается самая внешняя область
+    class ChangeScope;
+
+    struct Subscription {
+        SubscriptionId id;
+        CellRange region;
+        ChangeCallback callback;
+    };
+
+    using ShiftHandler = std::function<FormulaInterface::HandlingResult(FormulaInterface&, std::string_view sheet)>;
+
+    // книга, которой принадлежит лист, и зависимые с других листов; у
+    // отдельной таблицы их нет
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+    ExternalDependents* external_dependents_ = nullptr;
+
+    SheetStats stats_;
+    bool stats_enabled_ = false;
+    std::unique_ptr<RecalcProfiler> profiler_;
+    std::unique_ptr<UndoJournal> journal_;
+    std::shared_ptr<EditLog> edit_log_;
+    std::vector<EditLogOperation> pending_log_;  // изменения незакончившейся операции
+    InvalidationListener invalidation_listener_;
+
+    // подписки и значения ячеек до текущей операции, пока есть подписчики
+    std::vector<Subscription> subscriptions_;
+    SubscriptionId next_subscription_id_ = 1;
+    std::unordered_map<Position, std::optional<CellInterface::Value>> pending_changes_;
+    bool structure_changed_ = false;
+    int change_depth_ = 0;
+
+    // последний снимок и ячейки, изменённые после него; до первого снимка
+    // изменения не отслеживаются
+    std::shared_ptr<const SheetSnapshot> snapshot_;
+    std::unordered_set<Position> snapshot_changes_;
+
+    // Добавляет изменение в журнал; внутри операции - когда она закончится
+    void LogOperation(EditLogOperation operation);
+    void FlushEditLog();
+
+    // счётчики, если статистика включена, иначе nullptr
+    SheetStats* ActiveStats() {
+        return stats_enabled_ ? &stats_ : nullptr;
+    }
+
+    void NotifyInvalidated(Position pos) {
+        if (!lookup_indexes_.empty()) {
+            MarkLookupChange(pos);
+        }
+        if (invalidation_listener_) {
+            invalidation_listener_(pos);
+        }
+    }
+
+    // запоминает значение ячейки до изменения, если на лист есть подписки
+    void RecordValueChange(Position pos, const Cell& cell) {
+        if (!subscriptions_.empty()) {
+            RecordSubscribedChange(pos, cell);
+        }
+    }
+    void RecordSubscribedChange(Position pos, const Cell& cell);
+    // рассылает изменения этого листа и других листов книги
+    void FlushChanges() {
+        if (workbook_ || !pending_changes_.empty() || structure_changed_) {
+            FlushAllChanges();
+        }
+    }
+    void FlushAllChanges();
+    void FlushOwnChanges();
+
+    bool lazy_formula_compilation_ = false;
+    bool batch_evaluation_ = true;
+    size_t uncompiled_formulas_ = 0;
+    size_t compiled_formula_bytes_ = 0;
+    size_t formula_memory_limit_ = std::numeric_limits<size_t>::max();
+    // Ячейки со скомпилированными формулами, недавно обращавшиеся к AST в
+    // начале: вытеснение идёт с конца и не обходит весь лист.
+    std::list<const Cell*> compiled_formulas_;
+    // Если вытеснить до 3/4 лимита не удалось (AST держат снимки или другие
+    // ячейки), следующий обход откладывается, пока объём формул не превысит
+    // это значение; сбрасывается новым снимком и сменой лимита.
+    size_t eviction_retry_bytes_ = 0;
+
+    FormulaCache formula_cache_;
+    // объявлен раньше ячеек, чтобы пережить их ссылки на тексты
+    StringPool string_pool_;
+    std::unordered_map<Position, std::unique_ptr<Cell>> sheet_;
+
+    // Формулы, которые ищут по областям (функции поиска), по областям. Ячейки
+    // области не хранят зависимых, поэтому изменение ячейки ищет области,
+    // в которые она попала, среди областей своего блока.
+    struct RangeDependents {
+        CellRange range;
+        std::vector<Position> cells;
+    };
+    std::list<RangeDependents> range_dependents_;
+    // Области по блокам из RANGE_BLOCK_ROWS строк одного столбца, которые
+    // они задевают. Области больше MAX_RANGE_BLOCKS блоков и области #REF!
+    // лежат отдельно и проверяются для каждой ячейки.
+    static constexpr int RANGE_BLOCK_ROWS = 64;
+    static constexpr int MAX_RANGE_BLOCKS = 4096;
+    std::unordered_map<uint32_t, std::vector<RangeDependents*>> ranges_by_block_;
+    std::vector<RangeDependents*> wide_ranges_;
+    // Индексы столбцов по упакованной области, см. GetLookupKey: индексы
+    // одного столбца идут подряд в порядке первой строки
+    mutable std::map<uint64_t, LookupIndex> lookup_indexes_;
+
+    static uint32_t GetRangeBlockKey(Position pos) {
+        return static_cast<uint32_t>(pos.col) * (Position::MAX_ROWS / RANGE_BLOCK_ROWS) + pos.row / RANGE_BLOCK_ROWS;
+    }
+    static bool IsWideRange(const CellRange& range);
+    // области, среди которых ищется range: список её первого блока или широкие
+    const std::vector<RangeDependents*>* FindRangeList(const CellRange& range) const;
+
+    // вызывает visit для зависимых от каждой области, содержащей pos
+    template <typename Visit>
+    void ForEachRangeDependents(Position pos, Visit visit) const {
+        auto visit_ranges = [pos, &visit](const std::vector<RangeDependents*>& ranges) {
+            for (const RangeDependents* dependents : ranges) {
+                if (dependents->range.Contains(pos)) {
+                    visit(dependents->cells);
+                }
+            }
+        };
+        auto it = ranges_by_block_.find(GetRangeBlockKey(pos));
+        if (it != ranges_by_block_.end()) {
+            visit_ranges(it->second);
+        }
+        visit_ranges(wide_ranges_);
+    }
+
+    static uint64_t GetLookupKey(CellRange column);
+    void MarkLookupChange(Position pos);
+    void UpdateRangeDependencies(Position pos, const std::vector<CellRange>& old_ranges,
+        const std::vector<CellRange>& new_ranges);
+    // заново собирает зависимых от областей после сдвига ячеек
+    void RebuildRangeDependencies();
+    bool HasRangeDependents(Position pos) const;
+
+    // Обходит существующие ячейки области: маленькую область - поиском по
+    // позициям, большую - обходом всех ячеек листа, смотря что короче
+    template <typename Visit>
+    void ForEachCellInRange(CellRange range, Visit visit) const {
+        const size_t area = static_cast<size_t>(range.last.row - range.first.row + 1)
+            * (range.last.col - range.first.col + 1);
+        if (area <= sheet_.size()) {
+            for (int row = range.first.row; row <= range.last.row; ++row) {
+                for (int col = range.first.col; col <= range.last.col; ++col) {
+                    auto it = sheet_.find({ row, col });
+                    if (it != sheet_.end()) {
+                        visit(it->first, *it->second);
+                    }
+                }
+            }
+        }
+        else {
+            for (const auto& [pos, cell] : sheet_) {
+                if (range.Contains(pos)) {
+                    visit(pos, *cell);
+                }
+            }
+        }
+    }
+
+    bool IsValidPosition(const Position& pos) const;
+    // ячейка по заведомо корректной позиции, без проверок
+    Cell* FindCell(Position pos);
+    Cell* CreateCell(Position pos);
+    void ApplyJournalText(Position pos, const std::string& text);
+    void MarkSnapshotChange(Position pos);
+    void EnforceFormulaMemoryLimit();
+    // переносит ячейки по remap (Position::NONE - удаление) и сдвигает ссылки
+    // формул, которые на них ссылаются, через handle, в том числе на других листах
+    void ShiftCells(const std::function<Position(Position)>& remap, const ShiftHandler& handle);
+    // позиции, которые сдвигаются вставкой строк и столбцов
+    std::vector<Position> GetShiftablePositions() const;
+
+    Sheet* FindExternalSheet(std::string_view name) const;
+    Cell* FindExternalCell(const ExternalReference& ref) const;
+    bool HasExternalDependents() const;
+    const std::vector<ExternalDependent>* FindExternalDependents(Position pos) const;
+    void AddExternalDependency(const ExternalReference& ref, Position pos);
+    void RemoveExternalDependency(const ExternalReference& ref, Position pos);
+    void UpdateExternalDependencies(Position pos, const std::vector<ExternalReference>& old_refs,
+        const std::vector<ExternalReference>& new_refs);
+    // сбрасывает кэши всех формул других листов, ссылающихся на этот лист
+    void InvalidateExternalDependents();
 };
\ No newline at end of file
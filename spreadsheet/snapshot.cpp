@@ -0,0 +1,289 @@
+﻿#include "snapshot.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+const SheetSnapshot::Entry* SheetSnapshot::Tile::Find(Position pos) const {
+    return cells_[GetIndex(pos)].get();
+}
+
+void SheetSnapshot::Tile::Set(Position pos, std::shared_ptr<const Entry> entry) {
+    auto& cell = cells_[GetIndex(pos)];
+    count_ += (entry != nullptr) - (cell != nullptr);
+    cell = std::move(entry);
+}
+
+bool SheetSnapshot::Tile::IsEmpty() const {
+    return count_ == 0;
+}
+
+size_t SheetSnapshot::Tile::GetIndex(Position pos) {
+    return static_cast<size_t>(pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+}
+
+SheetSnapshot::SheetSnapshot(Tiles tiles)
+    : tiles_(std::move(tiles)) {
+}
+
+uint32_t SheetSnapshot::GetTileKey(Position pos) {
+    return static_cast<uint32_t>(pos.row / TILE_SIZE) * TILES_PER_ROW + pos.col / TILE_SIZE;
+}
+
+const SheetSnapshot::Entry* SheetSnapshot::FindEntry(Position pos) const {
+    auto it = tiles_.find(GetTileKey(pos));
+    return it != tiles_.end() ? it->second->Find(pos) : nullptr;
+}
+
+Size SheetSnapshot::GetPrintableSize() const {
+    Size size;
+    for (const auto& [key, tile] : tiles_) {
+        Position origin{ static_cast<int>(key / TILES_PER_ROW) * TILE_SIZE, static_cast<int>(key % TILES_PER_ROW) * TILE_SIZE };
+        for (int row = 0; row < TILE_SIZE; ++row) {
+            for (int col = 0; col < TILE_SIZE; ++col) {
+                Position pos{ origin.row + row, origin.col + col };
+                if (tile->Find(pos)) {
+                    size.rows = std::max(size.rows, pos.row + 1);
+                    size.cols = std::max(size.cols, pos.col + 1);
+                }
+            }
+        }
+    }
+    return size;
+}
+
+const SheetSnapshot::Tiles& SheetSnapshot::GetTiles() const {
+    return tiles_;
+}
+
+size_t SheetSnapshot::CountSharedTiles(const SheetSnapshot& other) const {
+    size_t shared = 0;
+    for (const auto& [key, tile] : tiles_) {
+        auto it = other.tiles_.find(key);
+        if (it != other.tiles_.end() && it->second == tile) {
+            ++shared;
+        }
+    }
+    return shared;
+}
+
+class SnapshotReader::CellView : public CellInterface {
+public:
+    CellView(const SnapshotReader& reader, const SheetSnapshot::Entry& entry)
+        : reader_(reader)
+        , entry_(entry) {
+    }
+
+    Value GetValue() const override {
+        return ToValue(GetValueView());
+    }
+
+    ValueView GetValueView() const override {
+        if (!GetFormula()) {
+            std::string_view text = entry_.text;
+            if (!text.empty() && text.front() == ESCAPE_SIGN) {
+                text.remove_prefix(1);
+            }
+            return text;
+        }
+        if (!value_) {
+            if (reader_.probing_) {
+                if (!reader_.missing_precedent_) {
+                    reader_.missing_precedent_ = this;
+                }
+                return 0.0;
+            }
+            reader_.Evaluate(*this);
+        }
+        if (std::holds_alternative<double>(*value_)) {
+            return std::get<double>(*value_);
+        }
+        return std::get<FormulaError>(*value_);
+    }
+
+    std::string GetText() const override {
+        return entry_.text;
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        const FormulaInterface* formula = GetFormula();
+        return formula ? formula->GetReferencedCells() : std::vector<Position>{};
+    }
+
+    // формула ячейки или nullptr у текста
+    const FormulaInterface* GetFormula() const {
+        if (entry_.formula) {
+            return entry_.formula.get();
+        }
+        if (!formula_ && entry_.text.size() > 1 && entry_.text.front() == FORMULA_SIGN) {
+            formula_ = ParseFormula(entry_.text.substr(1));
+        }
+        return formula_.get();
+    }
+
+private:
+    friend class SnapshotReader;
+
+    const SnapshotReader& reader_;
+    const SheetSnapshot::Entry& entry_;
+    mutable std::optional<FormulaInterface::Value> value_;
+    mutable std::unique_ptr<FormulaInterface> formula_;  // разобранная читателем
+};
+
+SnapshotReader::SnapshotReader(std::shared_ptr<const SheetSnapshot> snapshot)
+    : snapshot_(std::move(snapshot)) {
+}
+
+SnapshotReader::~SnapshotReader() = default;
+
+void SnapshotReader::SetCell(Position pos, std::string text) {
+    throw std::logic_error("Sheet snapshot is read-only");
+}
+
+const CellInterface* SnapshotReader::GetCell(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    return FindView(pos);
+}
+
+CellInterface* SnapshotReader::GetCell(Position pos) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    return FindView(pos);
+}
+
+void SnapshotReader::ClearCell(Position pos) {
+    throw std::logic_error("Sheet snapshot is read-only");
+}
+
+Size SnapshotReader::GetPrintableSize() const {
+    return snapshot_->GetPrintableSize();
+}
+
+void SnapshotReader::PrintValues(std::ostream& output) const {
+    Size size = GetPrintableSize();
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            if (const CellView* cell = FindView({ row, col })) {
+                std::visit([&output](const auto& value) { output << value; }, cell->GetValueView());
+            }
+            if (col < size.cols - 1) {
+                output << '\t';
+            }
+        }
+        output << '\n';
+    }
+}
+
+void SnapshotReader::PrintTexts(std::ostream& output) const {
+    Size size = GetPrintableSize();
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            if (const SheetSnapshot::Entry* entry = snapshot_->FindEntry({ row, col })) {
+                output << entry->text;
+            }
+            if (col < size.cols - 1) {
+                output << '\t';
+            }
+        }
+        output << '\n';
+    }
+}
+
+const SheetSnapshot& SnapshotReader::GetSnapshot() const {
+    return *snapshot_;
+}
+
+SnapshotReader::CellView* SnapshotReader::FindView(Position pos) const {
+    auto it = views_.find(pos);
+    if (it != views_.end()) {
+        return it->second.get();
+    }
+    const SheetSnapshot::Entry* entry = snapshot_->FindEntry(pos);
+    if (!entry) {
+        return nullptr;
+    }
+    return views_.emplace(pos, std::make_unique<CellView>(*this, *entry)).first->second.get();
+}
+
+void SnapshotReader::Evaluate(const CellView& root) const {
+    // каждая формула вычисляется после всех формул, на которые она ссылается,
+    // поэтому при вычислении их значения уже запомнены и рекурсии не возникает;
+    // граф снимка ацикличен, так как его не было в таблице.
+    // Условной формуле нужны не все ссылки: она вычисляется пробно, и в стек
+    // попадает только формула, без которой проба не удалась. Формулы
+    // областей, по которым ищет формула, вычисляются раньше неё.
+    struct Frame {
+        const CellView* cell;
+        std::vector<Position> references;
+        size_t next_ref;
+        bool ranges_pushed;
+    };
+    std::vector<Frame> stack;
+    std::vector<CellRange> expanded_ranges;
+    auto push = [&stack](const CellView* cell) {
+        const FormulaInterface& formula = *cell->GetFormula();
+        stack.push_back({ cell, formula.IsConditional() ? std::vector<Position>{} : formula.GetReferencedCells(), 0, false });
+    };
+    push(&root);
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        // формула могла попасть в стек дважды
+        if (frame.cell != &root && frame.cell->value_) {
+            stack.pop_back();
+            continue;
+        }
+        if (frame.cell->GetFormula()->IsConditional()) {
+            if (const CellView* missing = TryEvaluate(*frame.cell)) {
+                push(missing);
+            }
+            else {
+                stack.pop_back();
+            }
+            continue;
+        }
+        if (!frame.ranges_pushed) {
+            frame.ranges_pushed = true;
+            for (const CellRange& range : frame.cell->GetFormula()->GetReferencedRanges()) {
+                if (std::find(expanded_ranges.begin(), expanded_ranges.end(), range) != expanded_ranges.end()) {
+                    continue;
+                }
+                expanded_ranges.push_back(range);
+                for (int row = range.first.row; row <= range.last.row; ++row) {
+                    for (int col = range.first.col; col <= range.last.col; ++col) {
+                        const CellView* cell = FindView({ row, col });
+                        if (cell && cell->GetFormula() && !cell->value_) {
+                            push(cell);
+                        }
+                    }
+                }
+            }
+            continue;
+        }
+        if (frame.next_ref < frame.references.size()) {
+            Position pos = frame.references[frame.next_ref++];
+            const CellView* ref = pos.IsValid() ? FindView(pos) : nullptr;
+            if (ref && ref->GetFormula() && !ref->value_) {
+                push(ref);
+            }
+            continue;
+        }
+        const CellView* cell = frame.cell;
+        stack.pop_back();
+        cell->value_ = cell->GetFormula()->Evaluate(*this);
+    }
+}
+
+const SnapshotReader::CellView* SnapshotReader::TryEvaluate(const CellView& cell) const {
+    probing_ = true;
+    missing_precedent_ = nullptr;
+    FormulaInterface::Value value = cell.GetFormula()->Evaluate(*this);
+    probing_ = false;
+    if (missing_precedent_) {
+        return missing_precedent_;
+    }
+    cell.value_ = std::move(value);
+    return nullptr;
+}
@@ -0,0 +1,105 @@
+﻿#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <array>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Неизменяемый снимок таблицы, создаётся методом Sheet::Snapshot(). Ячейки
+// хранятся блоками TILE_SIZE x TILE_SIZE, и снимки разделяют между собой
+// неизменившиеся блоки и скомпилированные формулы, поэтому новый снимок
+// стоит столько, сколько блоков изменилось после предыдущего. После создания
+// снимок не меняется, и его можно читать из любых потоков без блокировок.
+class SheetSnapshot {
+public:
+    // содержимое непустой ячейки
+    struct Entry {
+        std::string text;
+        // AST только у скомпилированных формул, отложенную или вытесненную
+        // формулу читатель снимка разбирает по тексту сам
+        std::shared_ptr<const FormulaInterface> formula;
+    };
+
+    static constexpr int TILE_SIZE = 16;
+    static constexpr int TILES_PER_ROW = Position::MAX_COLS / TILE_SIZE;
+
+    // Блок ячеек. При изменении блок копируется целиком, а записи ячеек
+    // остаются общими, поэтому копия стоит TILE_SIZE * TILE_SIZE указателей.
+    class Tile {
+    public:
+        const Entry* Find(Position pos) const;
+        void Set(Position pos, std::shared_ptr<const Entry> entry);
+        bool IsEmpty() const;
+
+    private:
+        static size_t GetIndex(Position pos);
+
+        std::array<std::shared_ptr<const Entry>, TILE_SIZE * TILE_SIZE> cells_;
+        int count_ = 0; // непустых ячеек
+    };
+    using Tiles = std::unordered_map<uint32_t, std::shared_ptr<const Tile>>;
+
+    explicit SheetSnapshot(Tiles tiles);
+
+    static uint32_t GetTileKey(Position pos);
+
+    // содержимое ячейки или nullptr, если ячейка пуста
+    const Entry* FindEntry(Position pos) const;
+    Size GetPrintableSize() const;
+
+    const Tiles& GetTiles() const;
+    // число блоков, общих с другим снимком
+    size_t CountSharedTiles(const SheetSnapshot& other) const;
+
+private:
+    Tiles tiles_;
+};
+
+// Таблица только для чтения поверх снимка. Значения формул вычисляются при
+// первом обращении и запоминаются в самом читателе, поэтому читатель
+// принадлежит одному потоку: каждый поток создаёт свой читатель, а снимок
+// остаётся общим. Изменяющие методы бросают std::logic_error. Снимок
+// содержит один лист, поэтому ссылки на другие листы книги дают #REF!.
+class SnapshotReader : public SheetInterface {
+public:
+    explicit SnapshotReader(std::shared_ptr<const SheetSnapshot> snapshot);
+    ~SnapshotReader();
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    const SheetSnapshot& GetSnapshot() const;
+
+private:
+    class CellView;
+
+    CellView* FindView(Position pos) const;
+    // вычисляет формулу и все невычисленные формулы, от которых зависит её
+    // значение, в порядке обхода в глубину без рекурсии
+    void Evaluate(const CellView& root) const;
+    // вычисляет условную формулу, если все нужные ей формулы уже вычислены,
+    // иначе возвращает первую невычисленную
+    const CellView* TryEvaluate(const CellView& cell) const;
+
+    std::shared_ptr<const SheetSnapshot> snapshot_;
+    mutable std::unordered_map<Position, std::unique_ptr<CellView>> views_;
+    // при пробном вычислении невычисленные формулы дают 0
+    mutable bool probing_ = false;
+    mutable const CellView* missing_precedent_ = nullptr;
+};
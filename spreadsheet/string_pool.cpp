@@ -0,0 +1,73 @@
+﻿#include "string_pool.h"
+
+#include <cassert>
+#include <utility>
+
+StringPool::Handle::Handle(const Entry* entry)
+    : entry_(entry) {
+    if (entry_) {
+        ++entry_->refs;
+    }
+}
+
+StringPool::Handle::Handle(const Handle& other)
+    : Handle(other.entry_) {
+}
+
+StringPool::Handle::Handle(Handle&& other) noexcept
+    : entry_(std::exchange(other.entry_, nullptr)) {
+}
+
+StringPool::Handle& StringPool::Handle::operator=(Handle other) noexcept {
+    std::swap(entry_, other.entry_);
+    return *this;
+}
+
+StringPool::Handle::~Handle() {
+    if (entry_ && --entry_->refs == 0) {
+        entry_->pool->Release(entry_);
+    }
+}
+
+std::string_view StringPool::Handle::GetText() const {
+    return entry_ ? std::string_view(entry_->text) : std::string_view{};
+}
+
+StringPool::~StringPool() {
+    assert(entries_.empty());
+}
+
+StringPool::Handle StringPool::Intern(std::string text) {
+    if (text.empty()) {
+        return Handle{};
+    }
+    // текст принадлежит вызывающему, поэтому поиск не копирует его
+    Entry entry{ std::move(text), this };
+    auto it = entries_.find(entry);
+    if (it == entries_.end()) {
+        entry.text.shrink_to_fit();
+        allocated_bytes_ += GetEntryBytes(entry);
+        it = entries_.insert(std::move(entry)).first;
+    }
+    return Handle(&*it);
+}
+
+size_t StringPool::GetSize() const {
+    return entries_.size();
+}
+
+size_t StringPool::GetAllocatedBytes() const {
+    return allocated_bytes_ + entries_.bucket_count() * sizeof(void*);
+}
+
+size_t StringPool::GetEntryBytes(const Entry& entry) {
+    // узел таблицы: запись, хеш и указатель на следующий узел
+    constexpr size_t node_bytes = sizeof(Entry) + 2 * sizeof(void*);
+    size_t text_bytes = entry.text.capacity() > std::string().capacity() ? entry.text.capacity() + 1 : 0;
+    return node_bytes + text_bytes;
+}
+
+void StringPool::Release(const Entry* entry) {
+    allocated_bytes_ -= GetEntryBytes(*entry);
+    entries_.erase(entries_.find(*entry));
+}
@@ -0,0 +1,83 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+// Пул текстов ячеек листа. Одинаковые тексты хранятся один раз, ячейки
+// держат ссылки на общую запись. Запись удаляется вместе с последней
+// ссылкой, поэтому очистка ячеек возвращает память пула. Одинаковые тексты
+// получают одну запись, и их можно сравнивать по ссылке без сравнения строк.
+// Пул не потокобезопасен: ссылки создаются и удаляются только при изменении
+// листа.
+class StringPool {
+    struct Entry;
+
+public:
+    // Ссылка на запись пула с подсчётом ссылок, пустая ссылка означает
+    // пустой текст
+    class Handle {
+    public:
+        Handle() = default;
+        Handle(const Handle& other);
+        Handle(Handle&& other) noexcept;
+        Handle& operator=(Handle other) noexcept;
+        ~Handle();
+
+        std::string_view GetText() const;
+
+        bool operator==(const Handle& rhs) const {
+            return entry_ == rhs.entry_;
+        }
+        bool operator!=(const Handle& rhs) const {
+            return entry_ != rhs.entry_;
+        }
+
+    private:
+        friend class StringPool;
+
+        explicit Handle(const Entry* entry);
+
+        const Entry* entry_ = nullptr;
+    };
+
+    StringPool() = default;
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+    // ссылки должны быть удалены раньше пула
+    ~StringPool();
+
+    Handle Intern(std::string text);
+
+    // число разных текстов в пуле
+    size_t GetSize() const;
+    // приблизительный объём памяти под записи пула
+    size_t GetAllocatedBytes() const;
+
+private:
+    // запись хранится прямо в узле таблицы, число ссылок меняется у
+    // элемента множества и не участвует в хешировании и сравнении
+    struct Entry {
+        std::string text;
+        StringPool* pool = nullptr;
+        mutable size_t refs = 0;
+
+        bool operator==(const Entry& rhs) const {
+            return text == rhs.text;
+        }
+    };
+
+    struct EntryHasher {
+        size_t operator()(const Entry& entry) const {
+            return std::hash<std::string>{}(entry.text);
+        }
+    };
+
+    static size_t GetEntryBytes(const Entry& entry);
+    void Release(const Entry* entry);
+
+    std::unordered_set<Entry, EntryHasher> entries_;
+    size_t allocated_bytes_ = 0;
+};
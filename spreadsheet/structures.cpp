@@ -1,83 +1,205 @@
-﻿#include "common.h"
-
-#include <cctype>
-#include <sstream>
-#include <regex>
-#include <cctype>
-
-const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
-
-const Position Position::NONE = { -1, -1 };
-
-bool Position::operator==(const Position rhs) const {
-    return (row == rhs.row) && (col == rhs.col);
-}
-
-bool Position::operator<(const Position rhs) const {
-    return (row < rhs.row) && (col < rhs.col);
-}
-
-// Проверяет валидность позиции,
-// то есть что ячейка(row, col) не выходит за ограничения ниже и что значения полей row и col неотрицательны.
-// Position::NONE невалидна.
-bool Position::IsValid() const {
-    return ((row >= 0 && row < MAX_ROWS) && (col >= 0 && col < MAX_COLS));
-}
-
-// Возвращает строку — позицию в формате пользовательского индекса.
-// если позиция невалидна, метод должен вернуть пустую строку.
-std::string Position::ToString() const { 
-    if (!IsValid()) {
-        return std::string();
-    }
-    const int user_row = row + 1;
-    std::string user_col;
-
-    int column_index = col;
-    while (column_index >= 0) {
-        user_col.insert(user_col.begin(), 'A' + (column_index % 26));
-        column_index = column_index / 26 - 1;
-    }
-    return user_col + std::to_string(user_row);
-}
-
-// Возвращает позицию, соответствующую индексу, заданному в str
-Position Position::FromString(std::string_view str) {
-    std::regex pos_regex("^([A-Z]+)([0-9]+)$");
-    std::smatch match;
-
-    std::string str_copy(str);
-
-    // если индекс задан в неверном формате — “abc”, “111”, “12jfd”, 
-    // тогда функция должна вернуть дефолтную позицию Position::NONE
-    if (std::regex_match(str_copy, match, pos_regex)) {
-        std::string row_str = match[1].str();
-        std::string col_str = match[2].str();
-        int col = 0;
-        for (char ch : row_str) {
-            if (!std::isupper(ch)) {
-                return Position::NONE;
-            }
-            col = col * 26 + (ch - 'A' + 1);
-            if (col > MAX_COLS) {
-                return Position::NONE;
-            }
-        }
-        const int row = std::stoull(col_str) - 1;
-        // если индедекс выходит за предельные значения
-        if (row >= 0 && row < MAX_ROWS && col >= 1 && col <= MAX_COLS) {
-            Position pos;
-            pos.row = row;
-            pos.col = col - 1;
-            return pos;
-        }
-    }
-
-    return Position::NONE;
-}
-
-bool Size::operator==(Size rhs) const {
-    return cols == rhs.cols && rows == rhs.rows;
-}
\ No newline at end of file
+﻿#include "common.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <sstream>
+#include <cctype>
+#include <tuple>
+
+const int LETTERS = 26;
+const int MAX_POSITION_LENGTH = 17;
+const int MAX_POS_LETTER_COUNT = 3;
+
+const Position Position::NONE = { -1, -1 };
+
+bool Position::operator==(const Position rhs) const {
+    return (row == rhs.row) && (col == rhs.col);
+}
+
+bool Position::operator<(const Position rhs) const {
+    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
+}
+
+// Проверяет валидность позиции,
+// то есть что ячейка(row, col) не выходит за ограничения ниже и что значения полей row и col неотрицательны.
+// Position::NONE невалидна.
+bool Position::IsValid() const {
+    return ((row >= 0 && row < MAX_ROWS) && (col >= 0 && col < MAX_COLS));
+}
+
+// Возвращает строку — позицию в формате пользовательского индекса.
+// если позиция невалидна, метод должен вернуть пустую строку.
+std::string Position::ToString() const { 
+    if (!IsValid()) {
+        return std::string();
+    }
+    const int user_row = row + 1;
+    std::string user_col;
+
+    int column_index = col;
+    while (column_index >= 0) {
+        user_col.insert(user_col.begin(), 'A' + (column_index % 26));
+        column_index = column_index / 26 - 1;
+    }
+    return user_col + std::to_string(user_row);
+}
+
+// Возвращает позицию, соответствующую индексу, заданному в str
+Position Position::FromString(std::string_view str) {
+    // если индекс задан в неверном формате — “abc”, “111”, “12jfd”, 
+    // тогда функция должна вернуть дефолтную позицию Position::NONE
+    size_t i = 0;
+    int col = 0;
+    while (i < str.size() && str[i] >= 'A' && str[i] <= 'Z') {
+        col = col * LETTERS + (str[i] - 'A' + 1);
+        if (col > MAX_COLS) {
+            return Position::NONE;
+        }
+        ++i;
+    }
+    if (i == 0 || i == str.size()) {
+        return Position::NONE;
+    }
+
+    int row = 0;
+    for (; i < str.size(); ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return Position::NONE;
+        }
+        row = row * 10 + (str[i] - '0');
+        // если индекс выходит за предельные значения
+        if (row > MAX_ROWS) {
+            return Position::NONE;
+        }
+    }
+    if (row < 1) {
+        return Position::NONE;
+    }
+
+    Position pos;
+    pos.row = row - 1;
+    pos.col = col - 1;
+    return pos;
+}
+
+bool ExternalReference::operator==(const ExternalReference& rhs) const {
+    return sheet == rhs.sheet && pos == rhs.pos;
+}
+
+bool ExternalReference::operator<(const ExternalReference& rhs) const {
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
+}
+
+bool Size::operator==(Size rhs) const {
+    return cols == rhs.cols && rows == rhs.rows;
+}
+
+bool CellRange::Contains(Position pos) const {
+    return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col;
+}
+
+bool CellRange::operator==(const CellRange& rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+CellInterface::Value ToValue(const CellInterface::ValueView& view) {
+    if (const auto* text = std::get_if<std::string_view>(&view)) {
+        return std::string(*text);
+    }
+    if (const auto* number = std::get_if<double>(&view)) {
+        return *number;
+    }
+    return std::get<FormulaError>(view);
+}
+
+std::optional<double> ParseNumber(std::string_view text) {
+    // strtod нужна строка с нулём в конце, короткий текст копируется
+    // в буфер на стеке
+    char buffer[64];
+    std::string long_text;
+    const char* begin = buffer;
+    if (text.size() < sizeof(buffer)) {
+        buffer[text.copy(buffer, text.size())] = '\0';
+    }
+    else {
+        long_text = text;
+        begin = long_text.c_str();
+    }
+    char* end;
+    double number = strtod(begin, &end);
+    if (*end != '\0') {
+        return std::nullopt;
+    }
+    return number;
+}
+
+std::optional<LookupValue> ToLookupValue(const CellInterface::ValueView& view) {
+    if (const auto* number = std::get_if<double>(&view)) {
+        return *number;
+    }
+    if (const auto* text = std::get_if<std::string_view>(&view)) {
+        if (text->empty()) {
+            return std::nullopt;
+        }
+        if (std::optional<double> number = ParseNumber(*text)) {
+            return *number;
+        }
+        return *text;
+    }
+    return std::nullopt;
+}
+
+int CompareLookupValues(const LookupValue& lhs, const LookupValue& rhs) {
+    if (lhs.index() != rhs.index()) {
+        return std::holds_alternative<double>(lhs) ? -1 : 1;
+    }
+    if (const auto* number = std::get_if<double>(&lhs)) {
+        double other = std::get<double>(rhs);
+        return *number < other ? -1 : (other < *number ? 1 : 0);
+    }
+    std::string_view left = std::get<std::string_view>(lhs);
+    std::string_view right = std::get<std::string_view>(rhs);
+    size_t size = std::min(left.size(), right.size());
+    for (size_t i = 0; i < size; ++i) {
+        int a = std::tolower(static_cast<unsigned char>(left[i]));
+        int b = std::tolower(static_cast<unsigned char>(right[i]));
+        if (a != b) {
+            return a < b ? -1 : 1;
+        }
+    }
+    return left.size() < right.size() ? -1 : (right.size() < left.size() ? 1 : 0);
+}
+
+std::optional<int> SheetInterface::FindInColumn(CellRange column, const LookupValue& value, LookupMode mode) const {
+    std::optional<int> found;
+    std::optional<LookupValue> found_value;
+    for (int row = 0; row <= column.last.row - column.first.row; ++row) {
+        const CellInterface* cell = GetCell({ column.first.row + row, column.first.col });
+        std::optional<LookupValue> key = cell ? ToLookupValue(cell->GetValueView()) : std::nullopt;
+        if (!key || key->index() != value.index()) {
+            continue;
+        }
+        int order = CompareLookupValues(*key, value);
+        switch (mode) {
+            case LookupMode::Exact:
+                if (order == 0) {
+                    return row;
+                }
+                break;
+            case LookupMode::LessOrEqual:
+                if (order <= 0 && (!found || CompareLookupValues(*key, *found_value) >= 0)) {
+                    found = row;
+                    found_value = key;
+                }
+                break;
+            case LookupMode::GreaterOrEqual:
+                if (order >= 0 && (!found || CompareLookupValues(*key, *found_value) < 0)) {
+                    found = row;
+                    found_value = key;
+                }
+                break;
+        }
+    }
+    return found;
+}
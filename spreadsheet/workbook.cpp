@@ -0,0 +1,166 @@
+﻿#include "workbook.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+    void RecalculateSheets(const std::vector<Sheet*>& sheets, size_t threads) {
+        threads = std::min(threads, sheets.size());
+        if (threads <= 1) {
+            for (Sheet* sheet : sheets) {
+                sheet->Recalculate();
+            }
+            return;
+        }
+        // листы раздаются потокам по одному, пока не кончатся
+        std::atomic<size_t> next = 0;
+        std::vector<std::exception_ptr> errors(threads);
+        std::vector<std::thread> workers;
+        workers.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([&, i] {
+                try {
+                    for (size_t index = next++; index < sheets.size(); index = next++) {
+                        sheets[index]->Recalculate();
+                    }
+                }
+                catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        for (const auto& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+}  // namespace
+
+Workbook::Workbook() = default;
+
+Workbook::~Workbook() = default;
+
+Sheet& Workbook::AddSheet(std::string name) {
+    if (name.empty()) {
+        throw std::invalid_argument("Sheet name is empty");
+    }
+    if (sheets_.count(name)) {
+        throw std::invalid_argument("Sheet " + name + " already exists");
+    }
+    auto sheet = std::make_unique<Sheet>();
+    sheet->workbook_ = this;
+    sheet->name_ = name;
+    sheet->external_dependents_ = &GetExternalDependents(name);
+    Sheet& result = *sheets_.emplace(std::move(name), std::move(sheet)).first->second;
+    // формулы, ссылавшиеся на ещё не добавленный лист, хранят ошибку #REF!
+    result.InvalidateExternalDependents();
+    return result;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    auto it = sheets_.find(name);
+    return it != sheets_.end() ? it->second.get() : nullptr;
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    auto it = sheets_.find(name);
+    return it != sheets_.end() ? it->second.get() : nullptr;
+}
+
+void Workbook::RemoveSheet(std::string_view name) {
+    auto it = sheets_.find(name);
+    if (it == sheets_.end()) {
+        return;
+    }
+    std::unique_ptr<Sheet> sheet = std::move(it->second);
+    sheets_.erase(it);
+    // рёбра удаляемого листа к другим листам больше не нужны
+    for (const auto& [pos, cell] : sheet->sheet_) {
+        for (const ExternalReference& ref : cell->GetExternalReferences()) {
+            sheet->RemoveExternalDependency(ref, pos);
+        }
+    }
+    // рёбра к самому листу остаются: ссылки заработают, если лист вернётся
+    sheet->InvalidateExternalDependents();
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    std::vector<std::string> names;
+    names.reserve(sheets_.size());
+    for (const auto& [name, sheet] : sheets_) {
+        names.push_back(name);
+    }
+    return names;
+}
+
+void Workbook::Recalculate(size_t threads) {
+    // граф листов строится по межлистовым рёбрам: лист можно считать, когда
+    // посчитаны все листы, на которые он ссылается
+    std::unordered_map<Sheet*, std::unordered_set<Sheet*>> precedents;
+    std::unordered_map<Sheet*, std::vector<Sheet*>> dependents;
+    for (const auto& [name, cells] : external_dependents_) {
+        Sheet* target = GetSheet(name);
+        if (!target) {
+            continue;
+        }
+        for (const auto& [pos, cell_dependents] : cells) {
+            for (const auto& [sheet, dependent] : cell_dependents) {
+                if (sheet != target && precedents[sheet].insert(target).second) {
+                    dependents[target].push_back(sheet);
+                }
+            }
+        }
+    }
+
+    // при чтении значений из кэша другие листы не меняются, но счётчики
+    // статистики и профилировщик не рассчитаны на несколько потоков
+    bool parallel = true;
+    std::vector<Sheet*> level;
+    for (const auto& [name, sheet] : sheets_) {
+        parallel = parallel && !sheet->IsStatsEnabled() && !sheet->IsProfiling();
+        if (precedents[sheet.get()].empty()) {
+            level.push_back(sheet.get());
+        }
+    }
+
+    std::unordered_set<Sheet*> done;
+    while (!level.empty()) {
+        RecalculateSheets(level, parallel ? threads : 1);
+        std::vector<Sheet*> next_level;
+        for (Sheet* sheet : level) {
+            done.insert(sheet);
+            for (Sheet* dependent : dependents[sheet]) {
+                auto& sheet_precedents = precedents[dependent];
+                sheet_precedents.erase(sheet);
+                if (sheet_precedents.empty()) {
+                    next_level.push_back(dependent);
+                }
+            }
+        }
+        level = std::move(next_level);
+    }
+
+    // остались листы, связанные циклом ссылок между листами
+    for (const auto& [name, sheet] : sheets_) {
+        if (!done.count(sheet.get())) {
+            sheet->Recalculate();
+        }
+    }
+}
+
+ExternalDependents& Workbook::GetExternalDependents(std::string_view name) {
+    auto it = external_dependents_.find(name);
+    if (it == external_dependents_.end()) {
+        it = external_dependents_.emplace(std::string(name), ExternalDependents{}).first;
+    }
+    return it->second;
+}
@@ -0,0 +1,51 @@
+﻿#pragma once
+
+#include "sheet.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Книга из нескольких листов. Формулы ссылаются на ячейки других листов в
+// виде Sheet2!A1 или 'Итоги за май'!B3. Граф зависимостей каждого листа
+// хранится в самом листе, а межлистовые рёбра - в книге, поэтому изменение
+// ячейки затрагивает только те листы, которые от неё зависят. Ссылки на лист,
+// которого нет в книге, дают ошибку #REF! и начинают работать, как только
+// лист с таким именем будет добавлен.
+class Workbook {
+public:
+    Workbook();
+    ~Workbook();
+
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+
+    // Бросает std::invalid_argument, если имя пустое или уже занято
+    Sheet& AddSheet(std::string name);
+    // nullptr, если листа с таким именем нет
+    Sheet* GetSheet(std::string_view name);
+    const Sheet* GetSheet(std::string_view name) const;
+    // Ссылки на удалённый лист становятся ошибкой #REF!
+    void RemoveSheet(std::string_view name);
+    // имена листов в алфавитном порядке
+    std::vector<std::string> GetSheetNames() const;
+
+    // Вычисляет все формулы книги. Лист считается после листов, на которые
+    // он ссылается, а листы, не зависящие друг от друга, - параллельно в
+    // threads потоках. Листы, ссылающиеся друг на друга по кругу, и книга со
+    // статистикой или профилированием хотя бы одного листа считаются в одном
+    // потоке.
+    void Recalculate(size_t threads = 1);
+
+private:
+    friend class Sheet;
+
+    // рёбра к листу с именем name, создаются и для ещё не добавленных листов
+    ExternalDependents& GetExternalDependents(std::string_view name);
+
+    std::map<std::string, std::unique_ptr<Sheet>, std::less<>> sheets_;
+    std::map<std::string, ExternalDependents, std::less<>> external_dependents_;
+};